@@ -3,15 +3,47 @@
 #include <boost/test/unit_test.hpp>
 
 #include "../include/roommate_split.h"
+#include "../include/batch_io.h"
+#include "../include/parse_pool.h"
+#include "../include/settlement.h"
+#include "../include/ledger.h"
+#include "../include/http_server.h"
+#include "../include/shm_server.h"
+#include "../include/trace.h"
+#include "../include/request_scheduler.h"
+#include "../include/prefork_pool.h"
+#include "../include/shard_coordinator.h"
+#include "../include/cart_session.h"
+#include "../include/json_patch.h"
+#include "../include/output_projection.h"
+#include "../include/compressed_stream.h"
+#include "../include/table_export.h"
+#include "../include/alloc_tracker_new.h"
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <map>
 #include <iostream>
+#include <random>
+#include <sstream>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 /** The tolerance must be 0.02 to account for error in the relative distance calculation.
  *  This limits the tested accuracy to $0.02 for customer totals.
  */
 #define ACCEPTABLE_TEST_TOLERANCE 0.02
 
+
 void run_test(std::string test_name);
+void run_test(std::string test_name, const Parse_options &options);
 
 BOOST_AUTO_TEST_CASE(all_items_one_roommate)
 {
@@ -38,11 +70,846 @@ BOOST_AUTO_TEST_CASE(small_distributed)
     run_test("small_distributed");
 }
 
+BOOST_AUTO_TEST_CASE(exact_decimal_parsing)
+{
+    Parse_options options;
+    options.exact_decimal = true;
+    options.decimal_scale = 2;
+    run_test("small_distributed", options);
+    run_test("larger_distributed", options);
+}
+
+BOOST_AUTO_TEST_CASE(exact_decimal_units)
+{
+    long long units = 0;
+    BOOST_TEST(parse_decimal_units("16.71", 5, 2, &units));
+    BOOST_TEST(units == 1671);
+    BOOST_TEST(parse_decimal_units("-3", 2, 2, &units));
+    BOOST_TEST(units == -300);
+    BOOST_TEST(parse_decimal_units("8.100", 5, 2, &units));
+    BOOST_TEST(units == 810);
+    BOOST_TEST(parse_decimal_units("125e-2", 6, 2, &units));
+    BOOST_TEST(units == 125);
+    BOOST_TEST(parse_decimal_units("0.0", 3, 2, &units));
+    BOOST_TEST(units == 0);
+    BOOST_TEST(parse_decimal_units("6.566", 5, 2, &units) == false);
+    BOOST_TEST(parse_decimal_units("1e-3", 4, 2, &units) == false);
+    BOOST_TEST(parse_decimal_units("99999999999999999999", 20, 2, &units) == false);
+
+    //Shares are whole cents and add up to the cart total exactly, the
+    //cents left over go to the largest remainders
+    const char *input =
+        "{\"roommates\":["
+        "{\"id\":0,\"name\":\"a\",\"items\":[],\"total\":0.0,\"tax_share\":0.0},"
+        "{\"id\":1,\"name\":\"b\",\"items\":[],\"total\":0.0,\"tax_share\":0.0},"
+        "{\"id\":2,\"name\":\"c\",\"items\":[],\"total\":0.0,\"tax_share\":0.0}],"
+        "\"cart\":{\"total\":10.11,\"tax\":0.1,\"line_items\":["
+        "{\"id\":0,\"item_name\":\"pizza\",\"cost\":10.00,\"share_cost\":0.0,"
+        "\"splitting\":[0,1,2]},"
+        "{\"id\":1,\"item_name\":\"soda\",\"cost\":0.01,\"share_cost\":0.0,"
+        "\"splitting\":[1,2],\"weights\":[1,2]}]}}";
+    Parse_options options;
+    options.exact_decimal = true;
+    std::map<int, Roommate> roommates = {};
+    Cart cart = Cart();
+    BOOST_REQUIRE(parse_json_buffer(&cart, &roommates, input, strlen(input), options));
+    BOOST_TEST(cart.get_total_units().units == 1011);
+    BOOST_TEST(cart.get_total_units().scale == 2);
+    BOOST_TEST(try_validate_input(&cart, &roommates).ok());
+    BOOST_TEST(try_calculate_shares(&cart, &roommates).ok());
+    //Pre-tax 334, 333 and 334, then 10 cents of tax as 4, 3 and 3
+    long long expected[3][2] = {{338, 4}, {336, 3}, {337, 3}};
+    long long sum = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        const Roommate &rm = roommates.at(i);
+        BOOST_TEST(rm.get_total_units().units == expected[i][0]);
+        BOOST_TEST(rm.get_tax_share_units().units == expected[i][1]);
+        BOOST_TEST(rm.get_total() == expected[i][0] / 100.0);
+        sum += rm.get_total_units().units;
+    }
+    BOOST_TEST(sum == cart.get_total_units().units);
+
+    long long parts[3];
+    long long weights[3] = {1, 1, 1};
+    BOOST_TEST(apportion_units(100, weights, 3, parts));
+    BOOST_TEST(parts[0] == 34);
+    BOOST_TEST(parts[1] == 33);
+    BOOST_TEST(parts[2] == 33);
+    weights[0] = weights[1] = weights[2] = 0;
+    BOOST_TEST(apportion_units(1, weights, 3, parts) == false);
+}
+
+BOOST_AUTO_TEST_CASE(fragment_serializer_matches_writer)
+{
+    std::map<int, Roommate> roommates = {};
+    Cart cart = Cart();
+    BOOST_TEST(parse_json_data(&cart, &roommates,
+                               std::string(TEST_FILE_PREFIX) +
+                               "larger_distributed" +
+                               std::string(TEST_FILE_POSTFIX)));
+    calculate_shares(&cart, &roommates);
+    roommates.find(0)->second.set_name("Quote\" back\\ tab\t ctl\x01 utf8 \xc3\xa9");
+
+    rapidjson::StringBuffer expected;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(expected);
+    writer.StartObject();
+    writer.String("roommates");
+    writer.StartArray();
+    for (auto &rm : roommates) rm.second.json_serialize(writer);
+    writer.EndArray();
+    writer.String("cart");
+    cart.json_serialize(writer);
+    writer.EndObject();
+
+    rapidjson::StringBuffer actual;
+    serialize_json(cart, roommates, actual);
+    BOOST_TEST(std::string(actual.GetString()) ==
+               std::string(expected.GetString()));
+}
+
+BOOST_AUTO_TEST_CASE(id_set_matches_std_set)
+{
+    std::mt19937 rng(7);
+    //Small ranges end up in bitset mode, large ones in the sorted array mode
+    for (int range : {6, 200, 100000})
+    {
+        Id_set ids;
+        std::set<int> expected;
+        std::uniform_int_distribution<int> pick(0, range);
+        for (int i = 0; i < 2000; i++)
+        {
+            int id = pick(rng);
+            if (i % 3 == 2) BOOST_TEST(ids.erase(id) == expected.erase(id));
+            else BOOST_TEST(ids.insert(id) == expected.insert(id).second);
+        }
+        BOOST_TEST(ids.size() == expected.size());
+        BOOST_TEST(std::set<int>(ids) == expected);
+
+        Id_set other = {1, 2, 3, 5, 8, 13, 21, 34, 55, 89, 144};
+        std::set<int> other_expected(other.begin(), other.end());
+        std::set<int> both, either, only;
+        for (int id : expected)
+        {
+            if (other_expected.count(id)) both.insert(id);
+            else only.insert(id);
+        }
+        either = expected;
+        either.insert(other_expected.begin(), other_expected.end());
+        BOOST_TEST(std::set<int>(ids & other) == both);
+        BOOST_TEST(std::set<int>(ids | other) == either);
+        BOOST_TEST(std::set<int>(ids - other) == only);
+        BOOST_TEST((ids | other).size() == either.size());
+
+        uint64_t mask = 0, expected_mask = 0;
+        bool fits = expected.empty() || *expected.rbegin() < 64;
+        for (int id : expected)
+        {
+            if (id < 64) expected_mask |= 1ULL << id;
+        }
+        BOOST_TEST(ids.get_mask(&mask) == fits);
+        if (fits) BOOST_TEST(mask == expected_mask);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(status_path_reports_errors)
+{
+    std::map<int, Roommate> roommates = {};
+    roommates.insert(std::pair<int, Roommate>(0, Roommate(0, "David")));
+    Cart cart = Cart();
+    BOOST_TEST((try_validate_input(&cart, &roommates).code ==
+                Split_error::no_line_items));
+
+    Line_item bad_cost(4, "refund", -1.0, 0.0, {0});
+    cart.add_line_item(bad_cost);
+    cart.set_total(1.0);
+    Split_status status = try_validate_input(&cart, &roommates);
+    BOOST_TEST((status.code == Split_error::negative_item_cost));
+    BOOST_TEST(status.item_id == 4);
+    BOOST_TEST(status.message() == "Item cost is negative id:4");
+    BOOST_CHECK_THROW(validate_input(&cart, &roommates), std::invalid_argument);
+
+    Cart unknown_rm = Cart();
+    Line_item shared(2, "milk", 3.0, 0.0, {0, 9});
+    unknown_rm.add_line_item(shared);
+    unknown_rm.set_total(3.0);
+    BOOST_TEST(try_validate_input(&unknown_rm, &roommates).ok());
+    status = try_calculate_shares(&unknown_rm, &roommates);
+    BOOST_TEST((status.code == Split_error::unknown_roommate));
+    BOOST_TEST(status.item_id == 2);
+}
+
+//Valid JSON of the wrong shape, each of which used to hit a rapidjson assert
+static const char *const MALFORMED_INPUTS[] = {
+    "{\"cart\":1,\"roommates\":[]}",
+    "{\"roommates\":[{\"name\":7,\"items\":[],\"total\":0,\"tax_share\":0}],"
+    "\"cart\":{\"total\":1,\"tax\":0,\"line_items\":[]}}",
+    "{\"roommates\":[],\"cart\":{\"total\":1,\"tax\":0,\"line_items\":[{\"id\":1}]}}",
+    "{\"roommates\":[],\"cart\":{\"total\":\"1\",\"tax\":0,\"line_items\":[]}}",
+    "[]",
+    "{\"roommates\":{},\"cart\":{\"total\":1,\"tax\":0,\"line_items\":[]}}",
+    "{\"roommates\":[1],\"cart\":{\"total\":1,\"tax\":0,\"line_items\":[]}}",
+    "{\"roommates\":[],\"cart\":{\"total\":1,\"tax\":0,\"line_items\":[{\"id\":1,"
+    "\"item_name\":\"x\",\"cost\":1,\"share_cost\":0,\"splitting\":[0.5]}]}}"};
+
+BOOST_AUTO_TEST_CASE(malformed_input_is_refused)
+{
+    Parse_options exact;
+    exact.exact_decimal = true;
+    for (const char *input : MALFORMED_INPUTS)
+    {
+        Cart cart = Cart();
+        std::map<int, Roommate> roommates = {};
+        BOOST_TEST(parse_json_buffer(&cart, &roommates, input, strlen(input),
+                                     Parse_options()) == false);
+        rapidjson::StringBuffer sb;
+        BOOST_TEST(split_json_buffer(input, strlen(input), Parse_options(), sb) == false);
+        sb.Clear();
+        BOOST_TEST(split_json_pooled(input, strlen(input), Parse_options(), sb) == false);
+        BOOST_TEST(std::string(sb.GetString()).find("Invalid input JSON") !=
+                   std::string::npos);
+        //Exact mode reads every number as text, so some of these parse and
+        //then fail validation instead
+        sb.Clear();
+        BOOST_TEST(split_json_pooled(input, strlen(input), exact, sb) == false);
+        sb.Clear();
+        BOOST_TEST(split_json_buffer(input, strlen(input), exact, sb) == false);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(batch_backends_match_single_split)
+{
+    std::filesystem::path out_dir = std::filesystem::temp_directory_path() /
+                                    "roommate_split_batch_test";
+    for (bool thread_pool : {false, true})
+    {
+        std::filesystem::remove_all(out_dir);
+        std::filesystem::create_directories(out_dir);
+        std::vector<Batch_job> jobs = list_batch_jobs("Tests/Input",
+                                                      out_dir.string());
+        BOOST_TEST(jobs.size() == 5u);
+
+        Batch_options options;
+        options.workers = 2;
+        options.queue_depth = 2;
+        options.force_thread_pool = thread_pool;
+        Batch_stats stats = run_batch(jobs, options);
+        BOOST_TEST(stats.succeeded == jobs.size());
+        BOOST_TEST(stats.io_errors == 0u);
+
+        for (auto &job : jobs)
+        {
+            std::map<int, Roommate> roommates = {};
+            Cart cart = Cart();
+            parse_json_data(&cart, &roommates, job.input_path);
+            calculate_shares(&cart, &roommates);
+            rapidjson::StringBuffer expected;
+            serialize_json(cart, roommates, expected);
+
+            std::ifstream output(job.output_path);
+            std::stringstream actual;
+            actual << output.rdbuf();
+            BOOST_TEST(actual.str() == std::string(expected.GetString()));
+        }
+    }
+    std::filesystem::remove_all(out_dir);
+}
+
+BOOST_AUTO_TEST_CASE(parse_context_reuses_memory)
+{
+    std::string input;
+    BOOST_TEST(read_whole_file(std::string(TEST_FILE_PREFIX) +
+                               "larger_distributed" +
+                               std::string(TEST_FILE_POSTFIX), &input) == 0);
+
+    for (bool exact : {false, true})
+    {
+        Parse_options options;
+        options.exact_decimal = exact;
+        Parse_context_pool::Lease context = Parse_context_pool::acquire();
+
+        //The first requests size the buffers and create the map nodes
+        for (int i = 0; i < 3; i++)
+            BOOST_TEST(context->parse(input.data(), input.size(), options));
+        size_t spills = context->get_spill_count();
+
+        bool all_parsed = true;
+        size_t allocations;
+        {
+            Alloc_tracker tracker;
+            for (int i = 0; i < 100; i++)
+                all_parsed &= context->parse(input.data(), input.size(), options);
+            allocations = tracker.get_total().count;
+        }
+
+        BOOST_TEST(all_parsed);
+        BOOST_TEST(allocations == 0u);
+        BOOST_TEST(context->get_spill_count() == spills);
+
+        std::map<int, Roommate> roommates = {};
+        Cart cart = Cart();
+        parse_json_buffer(&cart, &roommates, input.data(), input.size(), options);
+        rapidjson::StringBuffer expected;
+        serialize_json(cart, roommates, expected);
+        rapidjson::StringBuffer actual;
+        serialize_json(context->get_cart(), context->get_roommates(), actual);
+        BOOST_TEST(std::string(actual.GetString()) ==
+                   std::string(expected.GetString()));
+    }
+    BOOST_TEST(Parse_context_pool::idle_count() == 1u);
+
+    //So is a whole request, from parse to the serialized result, once the
+    //context and the output buffer have seen one like it
+    for (bool exact : {false, true})
+    {
+        Parse_options options;
+        options.exact_decimal = exact;
+        rapidjson::StringBuffer sb;
+        for (int i = 0; i < 3; i++)
+        {
+            sb.Clear();
+            BOOST_TEST(split_json_pooled(input.data(), input.size(), options, sb));
+        }
+
+        bool all_split = true;
+        size_t allocations;
+        {
+            Alloc_tracker tracker;
+            for (int i = 0; i < 100; i++)
+            {
+                sb.Clear();
+                all_split &= split_json_pooled(input.data(), input.size(), options, sb);
+            }
+            allocations = tracker.get_total().count;
+        }
+        BOOST_TEST(all_split);
+        BOOST_TEST(allocations == 0u);
+    }
+
+    //Cleared id sets keep their storage for the next members
+    Id_set ids;
+    for (int id = 0; id < 1000; id += 7) ids.insert(id);
+    ids.clear();
+    BOOST_TEST(ids.empty());
+    size_t refill_allocations;
+    {
+        Alloc_tracker tracker;
+        for (int id = 0; id < 1000; id += 7) ids.insert(id);
+        refill_allocations = tracker.get_total().count;
+    }
+    BOOST_TEST(refill_allocations == 0u);
+    BOOST_TEST(ids.size() == 143u);
+}
+
+BOOST_AUTO_TEST_CASE(construction_api_builds_without_copies)
+{
+    Cart cart(12.0, 1.0, {});
+    std::map<int, Roommate> roommates;
+    roommates.emplace(0, Roommate(0, "Alice"));
+    roommates.emplace(1, Roommate(1, "Bob"));
+
+    Line_item &bread = cart.emplace_line_item(0, "Bread", 5.0, 0.0, Id_set());
+    bread.add_splitting(roommates.at(0));
+    bread.add_splitting(roommates.at(1));
+    Line_item milk(1, "Milk", 6.0, 0.0, Id_set());
+    milk.add_splitting(1);
+    cart.add_line_item(std::move(milk));
+    //An existing id keeps its item
+    cart.emplace_line_item(0, "Ignored", 99.0, 0.0, Id_set());
+
+    const Cart &const_cart = cart;
+    BOOST_TEST(const_cart.get_line_items().size() == 2u);
+    BOOST_TEST(const_cart.get_line_items().at(0).get_name() == "Bread");
+    BOOST_TEST(const_cart.get_line_items().at(1).get_splitting().count(1) == 1u);
+
+    Split_status status = try_validate_input(&cart, &roommates);
+    BOOST_TEST(status.ok());
+    status = try_calculate_shares(&cart, &roommates);
+    BOOST_TEST(status.ok());
+    const Roommate &bob = roommates.at(1);
+    BOOST_TEST(bob.get_name() == "Bob");
+    BOOST_TEST(bob.get_items().size() == 2u);
+    BOOST_TEST(bob.get_total() + roommates.at(0).get_total() ==
+               cart.get_total(), boost::test_tools::tolerance(1e-9));
+}
+
+BOOST_AUTO_TEST_CASE(weighted_items_split_by_units)
+{
+    //Alice takes 2 of the 3 yogurts, rent is split 70/30
+    const char input[] =
+        "{\"roommates\":["
+        "{\"name\":\"Alice\",\"total\":0,\"tax_share\":0,\"items\":[]},"
+        "{\"name\":\"Bob\",\"total\":0,\"tax_share\":0,\"items\":[]}],"
+        "\"cart\":{\"total\":106.5,\"tax\":1.5,\"line_items\":["
+        "{\"id\":0,\"item_name\":\"yogurt\",\"cost\":5.0,\"share_cost\":0,"
+        "\"splitting\":[1,0],\"quantity\":3,\"weights\":[1,2]},"
+        "{\"id\":1,\"item_name\":\"rent\",\"cost\":100.0,\"share_cost\":0,"
+        "\"splitting\":[0,1],\"weights\":[70,30]}]}}";
+
+    for (bool exact : {false, true})
+    {
+        Parse_options options;
+        options.exact_decimal = exact;
+        std::map<int, Roommate> roommates = {};
+        Cart cart = Cart();
+        BOOST_TEST(parse_json_buffer(&cart, &roommates, input, strlen(input),
+                                     options));
+        const Line_item &yogurt = cart.get_line_items().at(0);
+        BOOST_TEST(yogurt.get_quantity() == 3);
+        BOOST_TEST(yogurt.get_weight(0) == 2);
+        BOOST_TEST(yogurt.get_weight(1) == 1);
+
+        BOOST_TEST(try_validate_input(&cart, &roommates).ok());
+        BOOST_TEST(try_calculate_shares(&cart, &roommates).ok());
+        double alice_pre_tax = 5.0 * 2 / 3 + 70.0;
+        double bob_pre_tax = 5.0 / 3 + 30.0;
+        if (exact)
+        {
+            //Whole cents, the odd ones to the largest remainders
+            BOOST_TEST(roommates.at(0).get_total_units().units == 7438);
+            BOOST_TEST(roommates.at(1).get_total_units().units == 3212);
+        }
+        else
+        {
+            BOOST_TEST(roommates.at(0).get_total() ==
+                       alice_pre_tax * (1 + 1.5 / 105.0),
+                       boost::test_tools::tolerance(1e-9));
+            BOOST_TEST(roommates.at(1).get_total() ==
+                       bob_pre_tax * (1 + 1.5 / 105.0),
+                       boost::test_tools::tolerance(1e-9));
+        }
+
+        //Both serializers keep the new fields and round trip them
+        rapidjson::StringBuffer fragments;
+        serialize_json(cart, roommates, fragments);
+        rapidjson::StringBuffer expected;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(expected);
+        cart.json_serialize(writer);
+        std::string output = fragments.GetString();
+        BOOST_TEST(output.find(expected.GetString()) != std::string::npos);
+        BOOST_TEST(output.find("\"quantity\":3,\"weights\":[2,1]") !=
+                   std::string::npos);
+    }
+
+    Line_item uneven(2, "eggs", 4.0, 0.0, {});
+    uneven.set_quantity(4);
+    uneven.add_splitting(0, 1);
+    uneven.add_splitting(1, 2);
+    Cart cart(4.0, 0.0, {});
+    cart.add_line_item(uneven);
+    std::map<int, Roommate> roommates = {};
+    roommates.emplace(0, Roommate(0, "Alice"));
+    roommates.emplace(1, Roommate(1, "Bob"));
+    Split_status status = try_validate_input(&cart, &roommates);
+    BOOST_TEST((status.code == Split_error::invalid_weight));
+    BOOST_TEST(status.item_id == 2);
+}
+
+//Balance left on every roommate once the transfers are paid
+static std::map<int, long long> settle_residue(
+    const std::vector<std::pair<int, long long>> &balances,
+    const std::vector<Transfer> &transfers)
+{
+    std::map<int, long long> residue(balances.begin(), balances.end());
+    for (auto &transfer : transfers)
+    {
+        BOOST_TEST(transfer.cents > 0);
+        residue[transfer.from] += transfer.cents;
+        residue[transfer.to] -= transfer.cents;
+    }
+    return residue;
+}
+
+BOOST_AUTO_TEST_CASE(settlement_clears_balances)
+{
+    //Greedy needs 5 transfers here, {7, -7} and the rest settle with 4
+    std::vector<std::pair<int, long long>> balances =
+        {{0, -900}, {1, 700}, {2, -200}, {3, 500}, {4, 600}, {5, -700}};
+    Settlement_options options;
+    options.exact = false;
+    std::vector<Transfer> greedy = settle_balances(balances, options);
+    options.exact = true;
+    std::vector<Transfer> exact = settle_balances(balances, options);
+    BOOST_TEST(greedy.size() == 5u);
+    BOOST_TEST(exact.size() == 4u);
+    for (auto &residue : settle_residue(balances, greedy))
+        BOOST_TEST(residue.second == 0);
+    for (auto &residue : settle_residue(balances, exact))
+        BOOST_TEST(residue.second == 0);
+
+    std::mt19937 rng(11);
+    std::uniform_int_distribution<long long> pick(-50000, 50000);
+    std::vector<std::pair<int, long long>> large;
+    long long sum = 0;
+    for (int i = 0; i < 5000; i++)
+    {
+        large.emplace_back(i, pick(rng));
+        sum += large.back().second;
+    }
+    large.emplace_back(5000, -sum);
+    std::vector<Transfer> transfers = settle_balances(large, options);
+    BOOST_TEST(transfers.size() < large.size());
+    for (auto &residue : settle_residue(large, transfers))
+        BOOST_TEST(residue.second == 0);
+
+    //One roommate paid the whole larger_distributed cart
+    std::map<int, Roommate> roommates = {};
+    Cart cart = Cart();
+    BOOST_TEST(parse_json_data(&cart, &roommates,
+                               std::string(TEST_FILE_PREFIX) +
+                               "larger_distributed" +
+                               std::string(TEST_FILE_POSTFIX)));
+    calculate_shares(&cart, &roommates);
+    std::vector<Transfer> owed;
+    BOOST_TEST(settle_shares({{0, cart.get_total()}}, roommates, options,
+                             &owed));
+    BOOST_TEST(owed.size() == roommates.size() - 1);
+    for (auto &transfer : owed) BOOST_TEST(transfer.to == 0);
+    BOOST_TEST(settle_shares({{0, cart.get_total() / 2}}, roommates, options,
+                             &owed) == false);
+}
+
+BOOST_AUTO_TEST_CASE(ledger_survives_reopen_and_damage)
+{
+    std::filesystem::path dir = std::filesystem::temp_directory_path() /
+                                ("roommate_ledger_" + std::to_string(getpid()));
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::string path = (dir / "ledger").string();
+
+    std::map<int, Roommate> roommates = {};
+    Cart cart = Cart();
+    BOOST_TEST(parse_json_data(&cart, &roommates,
+                               std::string(TEST_FILE_PREFIX) +
+                               "larger_distributed" +
+                               std::string(TEST_FILE_POSTFIX)));
+    calculate_shares(&cart, &roommates);
+    const Roommate &first = roommates.begin()->second;
+    long long first_cents = std::llround(first.get_total() * 100.0);
+
+    //Enough distinct names to grow the index past its initial capacity
+    std::map<int, Roommate> many = {};
+    for (int i = 0; i < 3000; i++)
+    {
+        many.emplace(i, Roommate(i, "guest " + std::to_string(i)));
+        many.at(i).add_to_total(i / 100.0);
+    }
+
+    Ledger_balance balance;
+    {
+        Ledger ledger;
+        BOOST_TEST(ledger.open(path) == 0);
+        for (int i = 0; i < 3; i++) BOOST_TEST(ledger.append(roommates) == 0);
+        BOOST_TEST(ledger.append(many) == 0);
+        BOOST_TEST(ledger.get_balance(first.get_name(), &balance));
+        BOOST_TEST(balance.total_cents == 3 * first_cents);
+        BOOST_TEST(balance.receipts == 3u);
+        Ledger second;
+        BOOST_TEST(second.open(path) != 0);
+    }
+
+    //Reopen replays nothing, a torn tail is cut off
+    {
+        std::ofstream log(path + ".log", std::ios::app | std::ios::binary);
+        log << "RML1 partial";
+    }
+    size_t log_size = 0;
+    {
+        Ledger ledger;
+        BOOST_TEST(ledger.open(path) == 0);
+        BOOST_TEST(ledger.get_record_count() == 4u);
+        BOOST_TEST(ledger.get_balance("guest 2999", &balance));
+        BOOST_TEST(balance.total_cents == 2999);
+        BOOST_TEST(ledger.append(roommates) == 0);
+        log_size = std::filesystem::file_size(path + ".log");
+    }
+
+    //A lost index is rebuilt from the log
+    std::filesystem::remove(path + ".idx");
+    {
+        Ledger ledger;
+        BOOST_TEST(ledger.open(path) == 0);
+        BOOST_TEST(std::filesystem::file_size(path + ".log") == log_size);
+        BOOST_TEST(ledger.get_record_count() == 5u);
+        BOOST_TEST(ledger.get_name_count() >= 3000u);
+        BOOST_TEST(ledger.get_balance(first.get_name(), &balance));
+        BOOST_TEST(balance.total_cents == 4 * first_cents);
+        BOOST_TEST(ledger.get_balance("nobody", &balance) == false);
+    }
+    std::filesystem::remove_all(dir);
+}
+
+BOOST_AUTO_TEST_CASE(http_server_answers_pipelined_requests_in_order)
+{
+    Http_server_options options;
+    options.port = 0;
+    options.workers = 3;
+    Http_server server(options);
+    BOOST_TEST(server.start() == 0);
+
+    std::string valid;
+    BOOST_TEST(read_whole_file(std::string(TEST_FILE_PREFIX) +
+                               "larger_distributed" +
+                               std::string(TEST_FILE_POSTFIX), &valid) == 0);
+    std::string invalid = "{\"cart\":";
+    //Compressed far below max_body, but inflating past 16 times it
+    std::string spaces(MAX_INFLATE_RATIO * options.max_body + 1, ' '), bomb;
+    BOOST_TEST(compress_buffer(spaces.data(), spaces.size(), Compression::gzip, &bomb) == 0);
+    BOOST_TEST(bomb.size() < options.max_body);
+    rapidjson::StringBuffer expected_valid, expected_invalid;
+    split_json_buffer(valid.data(), valid.size(), Parse_options(), expected_valid);
+    split_json_buffer(invalid.data(), invalid.size(), Parse_options(),
+                      expected_invalid);
+
+    auto post = [](const std::string &body, const char *headers,
+                   const std::string &target = "/split") {
+        return "POST " + target + " HTTP/1.1\r\nContent-Length: " +
+               std::to_string(body.size()) + "\r\n" + headers + "\r\n" + body;
+    };
+    Output_projection totals;
+    BOOST_REQUIRE(Output_projection::parse("totals", &totals));
+    rapidjson::StringBuffer expected_totals;
+    Split_status totals_status;
+    split_json_pooled(valid.data(), valid.size(), Parse_options(), expected_totals,
+                      &totals_status, &totals);
+    //Everything goes out in one write, the last request closes the connection
+    //Valid JSON of the wrong shape gets a 400 and the server carries on
+    std::string malformed = MALFORMED_INPUTS[0];
+    rapidjson::StringBuffer expected_malformed;
+    serialize_error_json("Invalid input JSON", expected_malformed);
+    std::string requests = post(valid, "") + post(invalid, "") +
+                           "GET /other HTTP/1.1\r\n\r\n" + post(bomb, "") +
+                           post(malformed, "") +
+                           post(valid, "", "/split?view=tot%61ls") +
+                           post(valid, "", "/split?view=tot%zz") +
+                           post(valid, "", "/split?view=tot%2") +
+                           post(valid, "", "/split?view=bogus") +
+                           post(valid, "Connection: close\r\n");
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server.get_port());
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    BOOST_TEST(connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0);
+    BOOST_TEST(send(fd, requests.data(), requests.size(), 0) ==
+               static_cast<ssize_t>(requests.size()));
+
+    std::string received;
+    char chunk[4096];
+    for (ssize_t n; (n = recv(fd, chunk, sizeof(chunk), 0)) > 0;)
+        received.append(chunk, n);
+    close(fd);
+    server.stop();
+
+    std::vector<std::pair<std::string, std::string>> responses;
+    size_t pos = 0;
+    while (pos < received.size())
+    {
+        size_t header_end = received.find("\r\n\r\n", pos);
+        BOOST_REQUIRE(header_end != std::string::npos);
+        std::string head = received.substr(pos, header_end - pos);
+        size_t length_at = head.find("Content-Length: ");
+        BOOST_REQUIRE(length_at != std::string::npos);
+        size_t length = std::stoul(head.substr(length_at + 16));
+        responses.emplace_back(head.substr(9, 3),
+                               received.substr(header_end + 4, length));
+        pos = header_end + 4 + length;
+    }
+
+    BOOST_REQUIRE(responses.size() == 10u);
+    BOOST_TEST(responses[0].first == "200");
+    BOOST_TEST(responses[0].second == std::string(expected_valid.GetString()));
+    BOOST_TEST(responses[1].first == "400");
+    BOOST_TEST(responses[1].second == std::string(expected_invalid.GetString()));
+    BOOST_TEST(responses[2].first == "404");
+    BOOST_TEST(responses[3].first == "413");
+    BOOST_TEST(responses[4].first == "400");
+    BOOST_TEST(responses[4].second == std::string(expected_malformed.GetString()));
+    //Views are percent decoded, a badly encoded or unknown one is a 400
+    BOOST_TEST(responses[5].first == "200");
+    BOOST_TEST(responses[5].second == std::string(expected_totals.GetString()));
+    BOOST_TEST(responses[6].first == "400");
+    BOOST_TEST(responses[7].first == "400");
+    BOOST_TEST(responses[8].first == "400");
+    BOOST_TEST(responses[9].first == "200");
+    BOOST_TEST(responses[9].second == std::string(expected_valid.GetString()));
+}
+
+BOOST_AUTO_TEST_CASE(shared_ring_round_trips)
+{
+    Shm_server_options options;
+    options.name = "/roommate_split_test_" + std::to_string(getpid());
+    options.slots = 4;
+    options.workers = 2;
+    Shm_split_server server(options);
+    BOOST_TEST(server.start() == 0);
+    rs_client *client = rs_client_open(options.name.c_str());
+    BOOST_REQUIRE(client != nullptr);
+
+    std::string json;
+    BOOST_TEST(read_whole_file(std::string(TEST_FILE_PREFIX) +
+                               "larger_distributed" +
+                               std::string(TEST_FILE_POSTFIX), &json) == 0);
+    rapidjson::StringBuffer expected;
+    split_json_buffer(json.data(), json.size(), Parse_options(), expected);
+
+    std::string response(64 * 1024, '\0');
+    size_t length = 0;
+    int32_t status = -1;
+    BOOST_TEST(rs_client_split(client, RS_FORMAT_JSON, json.data(), json.size(),
+                               &response[0], response.size(), &length,
+                               &status) == 0);
+    BOOST_TEST(status == 0);
+    BOOST_TEST(response.substr(0, length) == std::string(expected.GetString()));
+
+    std::string broken = "{\"cart\":";
+    BOOST_TEST(rs_client_split(client, RS_FORMAT_JSON, broken.data(),
+                               broken.size(), &response[0], response.size(),
+                               &length, &status) == 0);
+    BOOST_TEST(status == RS_STATUS_INVALID_INPUT);
+    //Input of the wrong shape is refused too, the workers live on
+    for (const char *malformed : MALFORMED_INPUTS)
+    {
+        BOOST_TEST(rs_client_split(client, RS_FORMAT_JSON, malformed, strlen(malformed),
+                                   &response[0], response.size(), &length,
+                                   &status) == 0);
+        BOOST_TEST(status == RS_STATUS_INVALID_INPUT);
+    }
+
+    //The packed cart from the same input gives the same shares
+    std::map<int, Roommate> roommates = {};
+    Cart cart = Cart();
+    BOOST_TEST(parse_json_buffer(&cart, &roommates, json.data(), json.size(),
+                                 Parse_options()));
+    std::string packed;
+    rs_packed_cart packed_cart = {static_cast<uint32_t>(roommates.size()),
+                                  static_cast<uint32_t>(cart.get_line_items().size()),
+                                  cart.get_total(), cart.get_tax()};
+    packed.append(reinterpret_cast<const char *>(&packed_cart),
+                  sizeof(packed_cart));
+    for (auto &item : cart.get_line_items())
+    {
+        const Id_set &splitting = item.second.get_splitting();
+        rs_packed_item packed_item = {item.first,
+                                      static_cast<uint32_t>(splitting.size()),
+                                      item.second.get_cost()};
+        packed.append(reinterpret_cast<const char *>(&packed_item),
+                      sizeof(packed_item));
+        std::string ids(RS_PACKED_ITEM_SIZE(splitting.size()) -
+                        sizeof(packed_item), '\0');
+        int k = 0;
+        for (int rm_id : splitting)
+            memcpy(&ids[4 * k++], &rm_id, sizeof(rm_id));
+        packed.append(ids);
+    }
+    calculate_shares(&cart, &roommates);
+
+    std::vector<rs_packed_share> shares(roommates.size());
+    BOOST_TEST(rs_client_split(client, RS_FORMAT_PACKED, packed.data(),
+                               packed.size(), shares.data(),
+                               shares.size() * sizeof(rs_packed_share),
+                               &length, &status) == 0);
+    BOOST_TEST(status == 0);
+    BOOST_TEST(length == shares.size() * sizeof(rs_packed_share));
+    for (auto &rm : roommates)
+    {
+        BOOST_TEST(shares[rm.first].total == rm.second.get_total());
+        BOOST_TEST(shares[rm.first].tax_share == rm.second.get_tax_share());
+    }
+
+    server.stop();
+    BOOST_TEST(rs_client_split(client, RS_FORMAT_JSON, json.data(), json.size(),
+                               &response[0], response.size(), &length,
+                               &status) == ESHUTDOWN);
+    rs_client_close(client);
+
+    //A server process that exits without stopping leaves its request
+    //unserved, the caller notices and gives up instead of waiting forever
+    Shm_server_options orphan_options = options;
+    orphan_options.name += "_orphan";
+    pid_t pid = fork();
+    BOOST_REQUIRE(pid >= 0);
+    if (pid == 0)
+    {
+        Shm_split_server orphan(orphan_options);
+        _exit(orphan.start() == 0 ? 0 : 1);
+    }
+    int wait_status = 0;
+    BOOST_REQUIRE(waitpid(pid, &wait_status, 0) == pid);
+    BOOST_REQUIRE(WIFEXITED(wait_status));
+    BOOST_REQUIRE(WEXITSTATUS(wait_status) == 0);
+    client = rs_client_open(orphan_options.name.c_str());
+    BOOST_REQUIRE(client != nullptr);
+    BOOST_TEST(rs_client_split(client, RS_FORMAT_JSON, json.data(), json.size(),
+                               &response[0], response.size(), &length,
+                               &status) == ESHUTDOWN);
+    rs_client_close(client);
+    shm_unlink(orphan_options.name.c_str());
+}
+
+BOOST_AUTO_TEST_CASE(fixed_kernels_match_generic_split)
+{
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<double> price(0.01, 40.0);
+    for (int count = 1; count <= 10; count++)
+    {
+        for (int trial = 0; trial < 20; trial++)
+        {
+            std::map<int, Roommate> roommates = {};
+            for (int i = 0; i < count; i++)
+                roommates.emplace(i, Roommate(i, "rm"));
+            Cart cart = Cart();
+            double total = 0.0;
+            for (int id = 0; id < 25; id++)
+            {
+                Line_item &item = cart.emplace_line_item(id, "item", price(rng),
+                                                         0.0, Id_set());
+                for (int i = 0; i < count; i++)
+                    if (rng() % 3 == 0) item.add_splitting(i);
+                if (item.get_splitting().size() == 0)
+                    item.add_splitting(rng() % count);
+                total += item.get_cost();
+            }
+            cart.set_tax(total * 0.0725);
+            cart.set_total(total + cart.get_tax());
+
+            std::map<int, Roommate> generic_roommates = roommates;
+            Cart generic_cart = cart;
+            Split_status fixed = try_calculate_shares(&cart, &roommates);
+            Split_status generic = try_calculate_shares_generic(&generic_cart,
+                                                                &generic_roommates);
+            BOOST_TEST((fixed.code == generic.code));
+            for (int i = 0; i < count; i++)
+            {
+                const Roommate &a = roommates.at(i);
+                const Roommate &b = generic_roommates.at(i);
+                BOOST_TEST(a.get_total() == b.get_total());
+                BOOST_TEST(a.get_tax_share() == b.get_tax_share());
+                BOOST_TEST((a.get_items() == b.get_items()));
+            }
+        }
+    }
+
+    //Unknown roommates fall back to the generic path and its error
+    std::map<int, Roommate> roommates = {};
+    roommates.emplace(0, Roommate(0, "Alice"));
+    Cart cart(2.0, 0.0, {});
+    cart.emplace_line_item(0, "milk", 2.0, 0.0, Id_set{0, 3});
+    Split_status status = try_calculate_shares(&cart, &roommates);
+    BOOST_TEST((status.code == Split_error::unknown_roommate));
+}
+
 /**
  * Reads input json from <test_name>_input.json, performs share calculation,
  * and compares result to <test_name>_output.json
  */
 void run_test(std::string test_name)
+{
+    run_test(test_name, Parse_options());
+}
+
+void run_test(std::string test_name, const Parse_options &options)
 {
     std::map<int, Roommate> roommates = {};
     Cart cart = Cart();
@@ -50,10 +917,10 @@ void run_test(std::string test_name)
     std::map<int, Roommate> exp_roommates = {};
     Cart exp_cart = Cart();
 
-    parse_json_data(&cart, &roommates,
-                    (std::string(TEST_FILE_PREFIX) +
-                     test_name +
-                     std::string(TEST_FILE_POSTFIX)));
+    BOOST_TEST(parse_json_data(&cart, &roommates,
+                               (std::string(TEST_FILE_PREFIX) +
+                                test_name +
+                                std::string(TEST_FILE_POSTFIX)), options));
 
     try{ validate_input(&cart, &roommates); }
     catch (std::invalid_argument& e)
@@ -96,3 +963,954 @@ void run_test(std::string test_name)
     }
 
 }
+
+BOOST_AUTO_TEST_CASE(trace_records_split_stages)
+{
+    std::string input;
+    BOOST_TEST(read_whole_file(std::string(TEST_FILE_PREFIX) + "larger_distributed" +
+                               std::string(TEST_FILE_POSTFIX), &input) == 0);
+    std::string path = (std::filesystem::temp_directory_path() /
+                        ("roommate_trace_" + std::to_string(getpid()) +
+                         ".json")).string();
+
+    //Nothing is recorded while tracing is off
+    rapidjson::StringBuffer sb;
+    split_json_pooled(input.data(), input.size(), Parse_options(), sb);
+
+    trace_start();
+    for (int cart_id = 0; cart_id < 3; cart_id++)
+    {
+        Trace_cart_scope cart(cart_id);
+        sb.Clear();
+        BOOST_TEST(split_json_pooled(input.data(), input.size(),
+                                     Parse_options(), sb));
+    }
+    BOOST_TEST(trace_stop(path) == 0);
+    BOOST_TEST(trace_enabled() == false);
+
+    std::string json;
+    BOOST_TEST(read_whole_file(path, &json) == 0);
+    std::filesystem::remove(path);
+    rapidjson::Document trace;
+    trace.Parse(json.data(), json.size());
+    BOOST_TEST(trace.HasParseError() == false);
+
+    std::map<std::string, int> counts;
+    for (auto &event : trace["traceEvents"].GetArray())
+    {
+        BOOST_TEST(event["ph"].GetString() == std::string("X"));
+        BOOST_TEST(event["dur"].GetDouble() >= 0.0);
+        BOOST_TEST(event["args"]["cart"].GetInt() < 3);
+        BOOST_TEST(event["args"]["items"].GetInt() > 0);
+        counts[event["name"].GetString()]++;
+    }
+    for (const char *stage : {"parse", "validate", "calculate", "serialize"})
+        BOOST_TEST(counts[stage] == 3);
+}
+
+BOOST_AUTO_TEST_CASE(scheduler_orders_and_sheds_requests)
+{
+    double units = 0.0;
+    Scheduler_options fifo_options;
+    fifo_options.shortest_first = false;
+    Request_scheduler<int> fifo(fifo_options);
+    Request_scheduler<int> sjf;
+    for (int i = 0; i < 3; i++)
+    {
+        BOOST_TEST(fifo.push(int(i), 1000.0 - i * 100.0, 0));
+        BOOST_TEST(sjf.push(int(i), 1000.0 - i * 100.0, 0));
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        BOOST_TEST(fifo.pop(&units) == i);
+        BOOST_TEST(sjf.pop(&units) == 2 - i);
+        BOOST_TEST(units == 1000.0 - (2 - i) * 100.0);
+    }
+    BOOST_TEST(sjf.empty());
+
+    //Learned rate of 10 ns per unit, so 1000 units cost 10 us
+    for (int i = 0; i < 200; i++) sjf.record(1000.0, 10000.0);
+    BOOST_TEST(std::abs(sjf.get_ns_per_unit() - 10.0) < 0.01);
+
+    //A large request overtaken while young runs first once it has aged
+    Scheduler_options aging_options;
+    aging_options.aging = 0.5;
+    Request_scheduler<int> aging(aging_options);
+    for (int i = 0; i < 200; i++) aging.record(1000.0, 10000.0);
+    BOOST_TEST(aging.push(1, 1000.0, 0));
+    BOOST_TEST(aging.push(2, 10.0, 1000));
+    BOOST_TEST(aging.push(3, 10.0, 100000));
+    BOOST_TEST(aging.pop(&units) == 2);
+    BOOST_TEST(aging.pop(&units) == 1);
+    BOOST_TEST(aging.pop(&units) == 3);
+
+    //12 us budget on two workers: 30 us of queued work is over it only for
+    //a request that sorts behind all of it
+    Scheduler_options budget_options;
+    budget_options.latency_budget_ms = 0.012;
+    Request_scheduler<int> budget(budget_options, 2);
+    for (int i = 0; i < 200; i++) budget.record(1000.0, 10000.0);
+    for (int i = 0; i < 3; i++) BOOST_TEST(budget.push(int(i), 1000.0, 0));
+    BOOST_TEST(std::abs(budget.get_backlog_ns() - 15000.0) < 100.0);
+    BOOST_TEST(budget.push(10, 10.0, 0));
+    BOOST_TEST(budget.push(11, 5000.0, 0) == false);
+    BOOST_TEST(budget.get_shed_count() == 1u);
+    BOOST_TEST(budget.size() == 4u);
+}
+
+//Crashes a prefork worker on the body "crash"
+static void crash_on_request(const char *data, size_t length)
+{
+    if (std::string_view(data, length) == "crash") raise(SIGSEGV);
+}
+
+BOOST_AUTO_TEST_CASE(prefork_workers_survive_crashing_input)
+{
+    std::string valid;
+    BOOST_TEST(read_whole_file(std::string(TEST_FILE_PREFIX) + "larger_distributed" +
+                               std::string(TEST_FILE_POSTFIX), &valid) == 0);
+    rapidjson::StringBuffer expected;
+    split_json_buffer(valid.data(), valid.size(), Parse_options(), expected);
+    std::string crashing = "crash";
+    //A few KB of gzip that inflate past the workers' 1 MB limit
+    std::string spaces(2 << 20, ' '), bomb;
+    BOOST_TEST(compress_buffer(spaces.data(), spaces.size(), Compression::gzip, &bomb) == 0);
+    //Nesting deep enough to overflow the stack of a recursive parser
+    std::string nested(500000, '[');
+    rapidjson::StringBuffer refused;
+    BOOST_TEST(split_json_buffer(nested.data(), nested.size(), Parse_options(),
+                                 refused) == false);
+    Parse_context context;
+    BOOST_TEST(context.parse(nested.data(), nested.size(), Parse_options()) == false);
+
+    prefork_request_hook = crash_on_request;
+    Prefork_pool pool;
+    Parse_options limited;
+    limited.max_decompressed = 1 << 20;
+    BOOST_REQUIRE(pool.start(2, limited) == 0);
+    std::string response;
+    Prefork_result result;
+    BOOST_TEST(pool.split(0, valid.data(), valid.size(), &response, &result) == 0);
+    BOOST_TEST(result.ok);
+    BOOST_TEST(response == std::string(expected.GetString()));
+
+    pid_t crashed_pid = pool.get_worker_pid(0);
+    BOOST_TEST(pool.split(0, crashing.data(), crashing.size(), &response,
+                          &result) == 0);
+    BOOST_TEST(result.crashed);
+    BOOST_TEST(result.pid == crashed_pid);
+    BOOST_TEST(WIFSIGNALED(result.wait_status));
+    BOOST_TEST(pool.get_worker_pid(0) != crashed_pid);
+    BOOST_TEST(pool.split(0, valid.data(), valid.size(), &response, &result) == 0);
+    BOOST_TEST(result.ok);
+    //Deep nesting and input of the wrong shape are refused as invalid, the
+    //worker lives on
+    BOOST_TEST(pool.split(0, nested.data(), nested.size(), &response, &result) == 0);
+    BOOST_TEST(result.ok == false);
+    BOOST_TEST(result.crashed == false);
+    pid_t worker_pid = pool.get_worker_pid(0);
+    for (const char *input : MALFORMED_INPUTS)
+    {
+        BOOST_TEST(pool.split(0, input, strlen(input), &response, &result) == 0);
+        BOOST_TEST(result.ok == false);
+        BOOST_TEST(result.crashed == false);
+    }
+    BOOST_TEST(pool.get_worker_pid(0) == worker_pid);
+    BOOST_TEST((result.error == Split_error::none));
+    BOOST_TEST(pool.split(0, bomb.data(), bomb.size(), &response, &result) == 0);
+    BOOST_TEST(result.ok == false);
+    BOOST_TEST((result.error == Split_error::input_too_large));
+
+    //A worker that died between requests is replaced without failing one
+    kill(pool.get_worker_pid(1), SIGKILL);
+    usleep(10000);
+    BOOST_TEST(pool.split(1, valid.data(), valid.size(), &response, &result) == 0);
+    BOOST_TEST(result.ok);
+    BOOST_TEST(result.crashed == false);
+    BOOST_TEST(pool.get_restart_count() == 2u);
+    pool.stop();
+
+    //Through the server the crashing request gets a 500 and the next one
+    //on the same connection is still served
+    Http_server_options options;
+    options.port = 0;
+    options.processes = 1;
+    Http_server server(options);
+    BOOST_REQUIRE(server.start() == 0);
+    std::string requests =
+        "POST /split HTTP/1.1\r\nContent-Length: " +
+        std::to_string(crashing.size()) + "\r\n\r\n" + crashing +
+        "POST /split HTTP/1.1\r\nConnection: close\r\nContent-Length: " +
+        std::to_string(valid.size()) + "\r\n\r\n" + valid;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(server.get_port());
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    BOOST_TEST(connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0);
+    size_t sent = 0;
+    while (sent < requests.size())
+    {
+        ssize_t n = send(fd, requests.data() + sent, requests.size() - sent, 0);
+        BOOST_REQUIRE(n > 0);
+        sent += n;
+    }
+    std::string received;
+    char chunk[4096];
+    for (ssize_t n; (n = recv(fd, chunk, sizeof(chunk), 0)) > 0;)
+        received.append(chunk, n);
+    close(fd);
+    server.stop();
+    prefork_request_hook = nullptr;
+
+    BOOST_TEST(received.compare(0, 12, "HTTP/1.1 500") == 0);
+    size_t second = received.find("HTTP/1.1 ", 12);
+    BOOST_REQUIRE(second != std::string::npos);
+    BOOST_TEST(received.compare(second, 12, "HTTP/1.1 200") == 0);
+    BOOST_TEST(server.get_crash_count() == 1u);
+}
+
+BOOST_AUTO_TEST_CASE(sharded_batch_survives_lost_worker)
+{
+    //Removing a node only moves the keys it owned
+    Hash_ring ring(32);
+    ring.add("a");
+    ring.add("b");
+    ring.add("c");
+    std::vector<bool> down = {false, true, false};
+    for (int i = 0; i < 200; i++)
+    {
+        std::string key = "receipt-" + std::to_string(i);
+        int owner = ring.lookup(key);
+        if (owner != 1) BOOST_TEST(ring.lookup(key, down) == owner);
+        else BOOST_TEST(ring.lookup(key, down) != 1);
+    }
+
+    Http_server_options server_options;
+    server_options.port = 0;
+    Http_server first(server_options), second(server_options);
+    BOOST_REQUIRE(first.start() == 0);
+    BOOST_REQUIRE(second.start() == 0);
+    //A port nobody listens on stands in for a dead worker
+    int probe = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    BOOST_REQUIRE(bind(probe, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0);
+    socklen_t addr_length = sizeof(addr);
+    getsockname(probe, reinterpret_cast<sockaddr *>(&addr), &addr_length);
+    close(probe);
+
+    Shard_options options;
+    options.workers = {"127.0.0.1:" + std::to_string(first.get_port()),
+                       "127.0.0.1:" + std::to_string(ntohs(addr.sin_port)),
+                       "127.0.0.1:" + std::to_string(second.get_port())};
+    options.attempts = 1;
+    options.pipeline = 4;
+    options.checkpoint_dir = (std::filesystem::temp_directory_path() /
+                              "shard_checkpoint_test").string();
+    std::filesystem::remove_all(options.checkpoint_dir);
+
+    //Leading "./" gives every copy of a receipt its own path
+    std::vector<std::string> inputs;
+    std::string prefix;
+    for (int copy = 0; copy < 8; copy++, prefix += "./")
+    {
+        for (const char *name : {"regular_distributed", "larger_distributed",
+                                 "small_distributed"})
+            inputs.push_back(prefix + TEST_FILE_PREFIX + name + TEST_FILE_POSTFIX);
+    }
+    inputs.push_back("missing_receipt.json");
+
+    std::stringstream out;
+    Shard_stats stats;
+    BOOST_TEST(run_sharded_batch(inputs, options, out, &stats) == 0);
+    BOOST_TEST(stats.succeeded == inputs.size() - 1);
+    BOOST_TEST(stats.io_errors == 1u);
+    BOOST_TEST(stats.lost_workers == 1u);
+
+    std::string line;
+    size_t lines = 0;
+    while (std::getline(out, line))
+    {
+        rapidjson::Document document;
+        BOOST_TEST(document.Parse(line.c_str()).HasParseError() == false);
+        BOOST_TEST(document.HasMember("input"));
+        lines++;
+    }
+    BOOST_TEST(lines == inputs.size());
+
+    //Resuming finds every receipt in the checkpoints
+    std::stringstream resumed;
+    BOOST_TEST(run_sharded_batch(inputs, options, resumed, &stats) == 0);
+    BOOST_TEST(stats.skipped == inputs.size());
+    BOOST_TEST(resumed.str().empty());
+
+    first.stop();
+    second.stop();
+    std::filesystem::remove_all(options.checkpoint_dir);
+}
+
+BOOST_AUTO_TEST_CASE(cart_sessions_match_fresh_split)
+{
+    std::string input;
+    BOOST_TEST(read_whole_file(std::string(TEST_FILE_PREFIX) + "regular_distributed" +
+                               std::string(TEST_FILE_POSTFIX), &input) == 0);
+    Cart cart = Cart();
+    std::map<int, Roommate> roommates = {};
+    BOOST_REQUIRE(parse_json_buffer(&cart, &roommates, input.data(), input.size(),
+                                    Parse_options()));
+    Cart_session session{Cart(cart), std::map<int, Roommate>(roommates)};
+
+    //Splits the session's current cart from scratch
+    auto fresh_split = [&](std::map<int, Roommate> *results) {
+        Cart copy = session.get_cart();
+        *results = roommates;
+        Split_status status = try_validate_input(&copy, results);
+        if (status.ok()) status = try_calculate_shares(&copy, results);
+        return status;
+    };
+    auto edit = [&](const std::string &edits) {
+        std::string json = "{\"edits\":[" + edits + "]}";
+        return apply_session_edits(json.data(), json.size(), Parse_options(),
+                                   &session);
+    };
+    auto matches_fresh = [&]() {
+        std::map<int, Roommate> results;
+        Split_status expected = fresh_split(&results);
+        Split_status status = session.update();
+        BOOST_TEST(static_cast<int>(status.code) == static_cast<int>(expected.code));
+        BOOST_TEST(status.item_id == expected.item_id);
+        if (status.ok() == false) return;
+        for (auto &rm : results)
+        {
+            const Roommate &got = session.get_results().at(rm.first);
+            BOOST_TEST(got.get_items() == rm.second.get_items());
+            BOOST_TEST(got.get_total() == rm.second.get_total(),
+                       boost::test_tools::tolerance(1e-9));
+            BOOST_TEST(got.get_tax_share() == rm.second.get_tax_share(),
+                       boost::test_tools::tolerance(1e-9));
+        }
+    };
+
+    matches_fresh();
+    size_t rebuilds = session.get_rebuild_count();
+    BOOST_TEST(edit("{\"op\":\"set_item\",\"item\":{\"id\":1,\"item_name\":\"milk\","
+                    "\"cost\":3.25,\"share_cost\":0,\"splitting\":[1,3,5]}}"));
+    matches_fresh();
+    //Item edits adjust the sums instead of rebuilding them
+    BOOST_TEST(session.get_rebuild_count() == rebuilds);
+
+    //The cart does not add up until the total follows the new item
+    BOOST_TEST(edit("{\"op\":\"set_item\",\"item\":{\"id\":10,\"item_name\":\"eggs\","
+                    "\"cost\":2.0,\"share_cost\":0,\"splitting\":[2]}}"));
+    matches_fresh();
+    BOOST_TEST(edit("{\"op\":\"set_cart\",\"total\":54.66,\"tax\":4.56}"));
+    matches_fresh();
+    BOOST_TEST(edit("{\"op\":\"set_item\",\"item\":{\"id\":3,\"item_name\":\"febreeze\","
+                    "\"cost\":-3.98,\"share_cost\":0,\"splitting\":[5]}}"));
+    matches_fresh();
+    BOOST_TEST(edit("{\"op\":\"remove_item\",\"id\":3},"
+                    "{\"op\":\"set_cart\",\"total\":50.68,\"tax\":4.56}"));
+    matches_fresh();
+
+    //A new roommate rebuilds the sums, the results then match exactly
+    BOOST_TEST(edit("{\"op\":\"set_item\",\"item\":{\"id\":4,\"item_name\":\"peppers\","
+                    "\"cost\":0.77,\"share_cost\":0,\"splitting\":[6]}}"));
+    matches_fresh();
+    BOOST_TEST(edit("{\"op\":\"set_roommate\",\"id\":6,\"roommate\":{\"name\":\"Ross\","
+                    "\"total\":0,\"tax_share\":0,\"items\":[]}}"));
+    roommates.emplace(6, Roommate(6, "Ross"));
+    matches_fresh();
+    std::map<int, Roommate> results;
+    BOOST_TEST(fresh_split(&results).ok());
+    rapidjson::StringBuffer expected, got;
+    serialize_json(session.get_cart(), results, expected);
+    serialize_json(session.get_cart(), session.get_results(), got);
+    BOOST_TEST(std::string(got.GetString()) == std::string(expected.GetString()));
+
+    //A malformed edit changes nothing
+    std::string before = got.GetString();
+    BOOST_TEST(edit("{\"op\":\"remove_item\",\"id\":0},{\"op\":\"drop\"}") == false);
+    BOOST_TEST(session.update().ok());
+    got.Clear();
+    serialize_json(session.get_cart(), session.get_results(), got);
+    BOOST_TEST(std::string(got.GetString()) == before);
+
+    //With exact amounts the adjusted sums are whole units, so they match a
+    //fresh split exactly without rebuilding
+    Parse_options exact;
+    exact.exact_decimal = true;
+    Cart exact_cart = Cart();
+    std::map<int, Roommate> exact_roommates = {};
+    BOOST_REQUIRE(parse_json_buffer(&exact_cart, &exact_roommates, input.data(),
+                                    input.size(), exact));
+    Cart_session exact_session{Cart(exact_cart), std::map<int, Roommate>(exact_roommates)};
+    BOOST_TEST(exact_session.update().ok());
+    size_t exact_rebuilds = exact_session.get_rebuild_count();
+    std::string exact_edit = "{\"edits\":[{\"op\":\"set_item\",\"item\":{\"id\":1,"
+                             "\"item_name\":\"milk\",\"cost\":3.25,\"share_cost\":0,"
+                             "\"splitting\":[1,3,5]}}]}";
+    BOOST_TEST(apply_session_edits(exact_edit.data(), exact_edit.size(), exact,
+                                   &exact_session));
+    BOOST_TEST(exact_session.update().ok());
+    BOOST_TEST(exact_session.get_rebuild_count() == exact_rebuilds);
+    Cart exact_copy = exact_session.get_cart();
+    std::map<int, Roommate> exact_results = exact_roommates;
+    BOOST_TEST(try_calculate_shares(&exact_copy, &exact_results).ok());
+    for (auto &rm : exact_results)
+    {
+        const Roommate &got = exact_session.get_results().at(rm.first);
+        BOOST_TEST(got.get_total_units().units == rm.second.get_total_units().units);
+        BOOST_TEST(got.get_tax_share_units().units ==
+                   rm.second.get_tax_share_units().units);
+    }
+
+    //The least recently used session goes first when the budget is full
+    size_t size = session.get_memory();
+    Session_store store(size * 5 / 2);
+    Session_store::Entry_ptr first = store.add(Cart_session(Cart(cart),
+                                               std::map<int, Roommate>(roommates)));
+    Session_store::Entry_ptr second = store.add(Cart_session(Cart(cart),
+                                                std::map<int, Roommate>(roommates)));
+    BOOST_REQUIRE(first != nullptr);
+    BOOST_REQUIRE(second != nullptr);
+    BOOST_TEST(first->id.size() == 32u);
+    BOOST_TEST(first->id.find_first_not_of("0123456789abcdef") == std::string::npos);
+    BOOST_TEST(first->id != second->id);
+    BOOST_TEST(store.find(first->id) == first);
+    BOOST_TEST(store.add(Cart_session(Cart(cart),
+                                      std::map<int, Roommate>(roommates))) != nullptr);
+    BOOST_TEST(store.find(second->id) == nullptr);
+    BOOST_TEST(store.find(first->id) == first);
+    BOOST_TEST(store.size() == 2u);
+    BOOST_TEST(store.get_eviction_count() == 1u);
+    BOOST_TEST(store.get_memory() <= size * 5 / 2);
+    Session_store tiny(size / 2);
+    BOOST_TEST(tiny.add(Cart_session(Cart(cart), std::map<int, Roommate>(roommates))) ==
+               nullptr);
+
+    //Over HTTP, pipelined requests after a session edit see the edit.
+    //Sessions stay in-process even with worker processes
+    Http_server_options options;
+    options.port = 0;
+    options.workers = 2;
+    options.processes = 2;
+    Http_server server(options);
+    BOOST_REQUIRE(server.start() == 0);
+    auto exchange = [&](const std::string &requests) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(server.get_port());
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        BOOST_TEST(connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0);
+        BOOST_TEST(send(fd, requests.data(), requests.size(), 0) ==
+                   static_cast<ssize_t>(requests.size()));
+        std::string received;
+        char chunk[4096];
+        for (ssize_t n; (n = recv(fd, chunk, sizeof(chunk), 0)) > 0;)
+            received.append(chunk, n);
+        close(fd);
+        return received;
+    };
+    auto post = [](const std::string &target, const std::string &body,
+                   const char *headers) {
+        return "POST " + target + " HTTP/1.1\r\nContent-Length: " +
+               std::to_string(body.size()) + "\r\n" + headers + "\r\n" + body;
+    };
+
+    //Create bodies of the wrong shape are refused, not fatal
+    std::string refused;
+    for (const char *malformed : MALFORMED_INPUTS)
+        refused += post("/sessions", malformed, "");
+    refused = exchange(refused + post("/sessions", input, "Connection: close\r\n"));
+    size_t refused_count = 0;
+    for (size_t pos = 0; (pos = refused.find("HTTP/1.1 400", pos)) != std::string::npos;
+         pos += 12)
+        refused_count++;
+    BOOST_TEST(refused_count == std::size(MALFORMED_INPUTS));
+    BOOST_TEST(refused.find("HTTP/1.1 201") != std::string::npos);
+
+    std::string created = exchange(post("/sessions", input, "Connection: close\r\n"));
+    BOOST_TEST(created.compare(0, 12, "HTTP/1.1 201") == 0);
+    size_t id_at = created.find("{\"session\":\"");
+    BOOST_REQUIRE(id_at != std::string::npos);
+    std::string id = created.substr(id_at + 12, 32);
+    std::string target = "/sessions/" + id;
+
+    std::string edited_input = input;
+    size_t milk = edited_input.find("\"splitting\":[0,2]");
+    edited_input.replace(milk, 17, "\"splitting\":[1,3,5]");
+    rapidjson::StringBuffer expected_split;
+    BOOST_TEST(split_json_buffer(edited_input.data(), edited_input.size(),
+                                 Parse_options(), expected_split));
+
+    std::string received = exchange(
+        post(target, "{\"edits\":[{\"op\":\"set_item\",\"item\":{\"id\":1,"
+                     "\"item_name\":\"milk\",\"cost\":3.25,\"share_cost\":0.0,"
+                     "\"splitting\":[1,3,5]}}]}", "") +
+        "GET " + target + " HTTP/1.1\r\n\r\n" +
+        "DELETE " + target + " HTTP/1.1\r\n\r\n" +
+        "GET " + target + " HTTP/1.1\r\nConnection: close\r\n\r\n");
+    server.stop();
+
+    std::vector<std::string> statuses;
+    for (size_t pos = 0; (pos = received.find("HTTP/1.1 ", pos)) != std::string::npos;
+         pos += 9)
+        statuses.push_back(received.substr(pos + 9, 3));
+    BOOST_REQUIRE(statuses.size() == 4u);
+    BOOST_TEST(statuses[0] == "200");
+    BOOST_TEST(statuses[1] == "200");
+    BOOST_TEST(statuses[2] == "204");
+    BOOST_TEST(statuses[3] == "404");
+    BOOST_TEST(received.find(expected_split.GetString()) != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(cart_patches_match_fresh_split)
+{
+    std::string input;
+    BOOST_TEST(read_whole_file(std::string(TEST_FILE_PREFIX) + "regular_distributed" +
+                               std::string(TEST_FILE_POSTFIX), &input) == 0);
+    Cart cart = Cart();
+    std::map<int, Roommate> roommates = {};
+    BOOST_REQUIRE(parse_json_buffer(&cart, &roommates, input.data(), input.size(),
+                                    Parse_options()));
+    Cart_session session{Cart(cart), std::map<int, Roommate>(roommates)};
+    BOOST_REQUIRE(session.update(true).ok());
+    session.clear_changes();
+
+    //The client's copy of the split document, kept current by the replies
+    rapidjson::StringBuffer sb;
+    serialize_json(session.get_cart(), session.get_results(), sb);
+    rapidjson::Document client;
+    client.Parse(sb.GetString(), sb.GetSize());
+    auto patch = [&](const std::string &operations) {
+        return session.apply_patch(operations.data(), operations.size(),
+                                   Parse_options());
+    };
+    auto roommates_text = [](const rapidjson::Value &value) {
+        rapidjson::StringBuffer text;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(text);
+        value.Accept(writer);
+        return std::string(text.GetString());
+    };
+    //Applies the reply to the client copy and checks it against a split
+    //of the patched input from scratch
+    auto matches_fresh = [&](size_t *reply_size) {
+        BOOST_REQUIRE(session.update(true).ok());
+        rapidjson::StringBuffer reply;
+        BOOST_REQUIRE(session.serialize_changes(reply));
+        session.clear_changes();
+        if (reply_size != nullptr) *reply_size = reply.GetSize();
+        rapidjson::Document operations;
+        operations.Parse(reply.GetString(), reply.GetSize());
+        Json_patcher patcher(&client);
+        for (auto &operation : operations.GetArray())
+            BOOST_REQUIRE(patcher.apply(operation));
+
+        Cart copy = session.get_cart();
+        std::map<int, Roommate> results = roommates;
+        BOOST_REQUIRE(try_validate_input(&copy, &results).ok());
+        BOOST_REQUIRE(try_calculate_shares(&copy, &results).ok());
+        rapidjson::StringBuffer expected;
+        serialize_json(copy, results, expected);
+        rapidjson::Document fresh;
+        fresh.Parse(expected.GetString(), expected.GetSize());
+        BOOST_TEST(roommates_text(client["roommates"]) ==
+                   roommates_text(fresh["roommates"]));
+    };
+
+    //Milk moves from David and Erica to Donald, Derek and Chandler, and the
+    //last item moves to the front without changing
+    size_t reply_size = 0;
+    BOOST_TEST(patch("[{\"op\":\"test\",\"path\":\"/cart/line_items/1/item_name\","
+                     "\"value\":\"milk\"},{\"op\":\"replace\",\"path\":"
+                     "\"/cart/line_items/1/splitting\",\"value\":[1,3,5]},"
+                     "{\"op\":\"move\",\"from\":\"/cart/line_items/9\","
+                     "\"path\":\"/cart/line_items/0\"}]") == 0);
+    BOOST_TEST(session.get_cart().get_line_items().size() == 10u);
+    matches_fresh(&reply_size);
+    BOOST_TEST(reply_size < 1024u);
+
+    //Items are added, removed and renumbered by id
+    BOOST_TEST(patch("[{\"op\":\"add\",\"path\":\"/cart/line_items/-\",\"value\":"
+                     "{\"id\":10,\"item_name\":\"eggs\",\"cost\":3.98,\"share_cost\":0,"
+                     "\"splitting\":[2]}},{\"op\":\"remove\",\"path\":"
+                     "\"/cart/line_items/4\"},{\"op\":\"replace\",\"path\":"
+                     "\"/cart/line_items/5/id\",\"value\":12},{\"op\":\"replace\","
+                     "\"path\":\"/cart/total\",\"value\":52.66}]") == 0);
+    BOOST_TEST(session.get_cart().get_line_items().count(3) == 0u);
+    BOOST_TEST(session.get_cart().get_line_items().count(12) == 1u);
+    matches_fresh(nullptr);
+
+    //Failed patches leave the session as it was
+    size_t items = session.get_cart().get_line_items().size();
+    BOOST_TEST(patch("[{\"op\":\"remove\",\"path\":\"/cart/line_items/0\"},"
+                     "{\"op\":\"test\",\"path\":\"/cart/tax\",\"value\":1}]") ==
+               ECANCELED);
+    BOOST_TEST(patch("[{\"op\":\"add\",\"path\":\"/cart/line_items/0\",\"value\":"
+                     "{\"id\":0,\"item_name\":\"twice\",\"cost\":0,\"share_cost\":0,"
+                     "\"splitting\":[0]}}]") == ECANCELED);
+    BOOST_TEST(patch("[{\"op\":\"replace\",\"path\":\"/cart/line_items/0/cost\","
+                     "\"value\":\"free\"}]") == ECANCELED);
+    BOOST_TEST(patch("{\"op\":\"remove\"}") == EINVAL);
+    BOOST_TEST(patch("[{\"op\":\"drop\",\"path\":\"/cart\"}]") == EINVAL);
+    BOOST_TEST(session.get_cart().get_line_items().size() == items);
+    matches_fresh(&reply_size);
+    BOOST_TEST(reply_size == 2u);
+
+    //New roommates are read by position, the reply replaces them all
+    BOOST_TEST(patch("[{\"op\":\"add\",\"path\":\"/roommates/-\",\"value\":"
+                     "{\"name\":\"Ross\",\"total\":0,\"tax_share\":0,\"items\":[]}},"
+                     "{\"op\":\"add\",\"path\":\"/cart/line_items/0/splitting/-\","
+                     "\"value\":6}]") == 0);
+    roommates.emplace(6, Roommate(6, "Ross"));
+    matches_fresh(nullptr);
+
+    //A one item change to a large cart is a small request and reply
+    std::string large = "{\"roommates\":[";
+    for (int i = 0; i < 4; i++)
+    {
+        large += std::string(i ? "," : "") + "{\"name\":\"r" + std::to_string(i) +
+                 "\",\"total\":0,\"tax_share\":0,\"items\":[]}";
+    }
+    large += "],\"cart\":{\"total\":10100.0,\"tax\":100.0,\"line_items\":[";
+    for (int i = 0; i < 10000; i++)
+    {
+        large += std::string(i ? "," : "") + "{\"id\":" + std::to_string(i) +
+                 ",\"item_name\":\"item\",\"cost\":1.0,\"share_cost\":0,"
+                 "\"splitting\":[" + std::to_string(i % 4) + "]}";
+    }
+    large += "]}}";
+    Cart large_cart = Cart();
+    std::map<int, Roommate> large_roommates = {};
+    BOOST_REQUIRE(parse_json_buffer(&large_cart, &large_roommates, large.data(),
+                                    large.size(), Parse_options()));
+    Cart_session large_session{std::move(large_cart), std::move(large_roommates)};
+    BOOST_REQUIRE(large_session.update(true).ok());
+    large_session.clear_changes();
+    std::string request = "[{\"op\":\"replace\",\"path\":"
+                          "\"/cart/line_items/5000/splitting\",\"value\":[1]}]";
+    BOOST_TEST(large_session.apply_patch(request.data(), request.size(),
+                                         Parse_options()) == 0);
+    BOOST_REQUIRE(large_session.update().ok());
+    rapidjson::StringBuffer reply;
+    BOOST_REQUIRE(large_session.serialize_changes(reply));
+    BOOST_TEST(request.size() + reply.GetSize() < 1024u);
+    BOOST_TEST(std::string(reply.GetString()).find(
+        "{\"op\":\"add\",\"path\":\"/roommates/1/items/1250\",\"value\":5000}") !=
+        std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(projections_write_requested_fields)
+{
+    std::string input;
+    BOOST_TEST(read_whole_file(std::string(TEST_FILE_PREFIX) + "regular_distributed" +
+                               std::string(TEST_FILE_POSTFIX), &input) == 0);
+    Cart cart = Cart();
+    std::map<int, Roommate> roommates = {};
+    BOOST_REQUIRE(parse_json_buffer(&cart, &roommates, input.data(), input.size(),
+                                    Parse_options()));
+    BOOST_REQUIRE(try_calculate_shares(&cart, &roommates).ok());
+    rapidjson::StringBuffer full_text;
+    serialize_json(cart, roommates, full_text);
+    rapidjson::Document full;
+    full.Parse(full_text.GetString(), full_text.GetSize());
+
+    auto project = [&](const std::string &spec, rapidjson::Document *document) {
+        Output_projection projection;
+        BOOST_REQUIRE(Output_projection::parse(spec, &projection));
+        rapidjson::StringBuffer sb;
+        projection.serialize(cart, roommates, sb);
+        document->Parse(sb.GetString(), sb.GetSize());
+        BOOST_REQUIRE(document->HasParseError() == false);
+        return std::string(sb.GetString(), sb.GetSize());
+    };
+
+    rapidjson::Document projected;
+    BOOST_TEST(project("full", &projected) == full_text.GetString());
+
+    project("totals", &projected);
+    BOOST_TEST(projected.HasMember("cart") == false);
+    BOOST_REQUIRE(projected["roommates"].Size() == 6u);
+    for (rapidjson::SizeType i = 0; i < 6; i++)
+    {
+        const rapidjson::Value &rm = projected["roommates"][i];
+        BOOST_TEST(rm.HasMember("items") == false);
+        BOOST_TEST((rm["total"] == full["roommates"][i]["total"]));
+        BOOST_TEST((rm["tax_share"] == full["roommates"][i]["tax_share"]));
+    }
+
+    project("no_cart", &projected);
+    BOOST_TEST(projected.HasMember("cart") == false);
+    BOOST_TEST((projected["roommates"] == full["roommates"]));
+    project("roommate:2", &projected);
+    BOOST_REQUIRE(projected["roommates"].Size() == 1u);
+    BOOST_TEST((projected["roommates"][0] == full["roommates"][2]));
+    project("roommate:17", &projected);
+    BOOST_TEST(projected["roommates"].Size() == 0u);
+
+    //Pointers resolve against the full document, null where it has nothing
+    const char *pointers[] = {"/roommates/1/total", "/roommates/4/items/1",
+                              "/cart/total", "/cart/line_items/3/item_name",
+                              "/cart/line_items/7", "/roommates/9", "/cart/nothing",
+                              "/roommates/4/items", "/roommates/4/items/99",
+                              "/roommates/1/total/0", "/cart/line_items/3/splitting",
+                              "/cart/line_items/3/splitting/0",
+                              "/cart/line_items/3/quantity",
+                              "/cart/line_items/3/weights", "/roommates/2/name/x"};
+    std::string spec;
+    for (const char *pointer : pointers) spec += (spec.empty() ? "" : ",") +
+                                                 std::string(pointer);
+    project(spec, &projected);
+    BOOST_TEST(projected.MemberCount() == std::size(pointers));
+    for (const char *pointer : pointers)
+    {
+        const rapidjson::Value *expected = rapidjson::Pointer(pointer).Get(full);
+        if (expected == nullptr) BOOST_TEST(projected[pointer].IsNull());
+        else BOOST_TEST((projected[pointer] == *expected));
+    }
+
+    //Item ids that are not positions, weights and a quantity
+    std::string sparse = "{\"roommates\":["
+        "{\"id\":0,\"name\":\"a\",\"items\":[],\"total\":0.0,\"tax_share\":0.0},"
+        "{\"id\":1,\"name\":\"b\",\"items\":[],\"total\":0.0,\"tax_share\":0.0}],"
+        "\"cart\":{\"total\":10.0,\"tax\":0.0,\"line_items\":["
+        "{\"id\":10,\"item_name\":\"x\",\"cost\":4.0,\"share_cost\":0.0,"
+        "\"splitting\":[0]},"
+        "{\"id\":20,\"item_name\":\"y\",\"cost\":6.0,\"share_cost\":0.0,"
+        "\"splitting\":[0,1],\"quantity\":3,\"weights\":[1,2]}]}}";
+    cart = Cart();
+    roommates.clear();
+    BOOST_REQUIRE(parse_json_buffer(&cart, &roommates, sparse.data(), sparse.size(),
+                                    Parse_options()));
+    BOOST_REQUIRE(try_calculate_shares(&cart, &roommates).ok());
+    full_text.Clear();
+    serialize_json(cart, roommates, full_text);
+    full.Parse(full_text.GetString(), full_text.GetSize());
+    const char *item_pointers[] = {"/cart/line_items/1", "/cart/line_items/1/id",
+                                   "/cart/line_items/1/weights",
+                                   "/cart/line_items/1/weights/1",
+                                   "/cart/line_items/1/quantity",
+                                   "/cart/line_items/0/weights",
+                                   "/cart/line_items/2"};
+    spec.clear();
+    for (const char *pointer : item_pointers) spec += (spec.empty() ? "" : ",") +
+                                                      std::string(pointer);
+    project(spec, &projected);
+    for (const char *pointer : item_pointers)
+    {
+        const rapidjson::Value *expected = rapidjson::Pointer(pointer).Get(full);
+        if (expected == nullptr) BOOST_TEST(projected[pointer].IsNull());
+        else BOOST_TEST((projected[pointer] == *expected));
+    }
+    BOOST_TEST(projected["/cart/line_items/1/id"].GetInt() == 20);
+    BOOST_TEST(projected["/cart/line_items/1/weights"].Size() == 2u);
+    BOOST_TEST(projected["/cart/line_items/1/quantity"].GetInt() == 3);
+
+    Output_projection projection;
+    for (const char *bad : {"", "roommate:", "roommate:2x", "cart/total",
+                            "/cart,,/cart/tax", "/cart/~2"})
+        BOOST_TEST(Output_projection::parse(bad, &projection) == false);
+}
+
+BOOST_AUTO_TEST_CASE(compressed_files_split_like_plain_ones)
+{
+    std::filesystem::path dir = std::filesystem::temp_directory_path() /
+                                "roommate_split_compressed_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir / "in");
+    std::string plain;
+    BOOST_TEST(read_whole_file(std::string(TEST_FILE_PREFIX) + "larger_distributed" +
+                               std::string(TEST_FILE_POSTFIX), &plain) == 0);
+    //Leading whitespace makes the stream refill its buffers several times
+    plain.insert(0, 3 * Decompressing_read_stream::BUFFER_SIZE / 2, ' ');
+
+    std::string packed;
+    BOOST_TEST(compress_buffer(plain.data(), plain.size(), Compression::gzip, &packed) == 0);
+    BOOST_TEST((detect_compression(packed.data(), packed.size()) == Compression::gzip));
+    BOOST_TEST((detect_compression(plain.data(), plain.size()) == Compression::none));
+    BOOST_TEST(packed.size() < plain.size() / 10);
+    std::string input_path = (dir / "in" / "large_input.json.gz").string();
+    {
+        std::ofstream file(input_path, std::ios::binary);
+        file << packed;
+    }
+
+    Cart cart = Cart();
+    std::map<int, Roommate> roommates = {};
+    BOOST_REQUIRE(parse_json_data(&cart, &roommates, input_path));
+    calculate_shares(&cart, &roommates);
+    rapidjson::StringBuffer expected;
+    serialize_json(cart, roommates, expected);
+
+    auto inflate_file = [](const std::string &path) {
+        FILE *fp = fopen(path.c_str(), "rb");
+        BOOST_REQUIRE(fp != nullptr);
+        Decompressing_read_stream is(fp);
+        std::string text;
+        while (is.Peek() != '\0') text += is.Take();
+        BOOST_TEST(is.get_error() == 0);
+        BOOST_TEST(is.Tell() == text.size());
+        fclose(fp);
+        return text;
+    };
+    std::string output_path = (dir / "out_output.json.gz").string();
+    write_json(cart, roommates, output_path);
+    BOOST_TEST(inflate_file(output_path) == std::string(expected.GetString()));
+
+    //Batch outputs keep the compression of their input
+    std::vector<Batch_job> jobs = list_batch_jobs((dir / "in").string(), dir.string());
+    BOOST_REQUIRE(jobs.size() == 1u);
+    BOOST_TEST(jobs[0].output_path == (dir / "large_output.json.gz").string());
+    BOOST_TEST(run_batch(jobs, Batch_options()).succeeded == 1u);
+    BOOST_TEST(inflate_file(jobs[0].output_path) == std::string(expected.GetString()));
+
+    //Appended gzip members read as one stream, a cut one is an error
+    std::string head, tail;
+    compress_buffer(plain.data(), plain.size() / 2, Compression::gzip, &head);
+    compress_buffer(plain.data() + plain.size() / 2, plain.size() - plain.size() / 2,
+                    Compression::gzip, &tail);
+    Parse_context context;
+    std::string joined = head + tail;
+    BOOST_TEST(context.parse(joined.data(), joined.size(), Parse_options()));
+    BOOST_TEST(context.get_cart().get_line_items().size() == cart.get_line_items().size());
+    Decompressing_read_stream cut(packed.data(), packed.size() / 2);
+    while (cut.Peek() != '\0') cut.Take();
+    BOOST_TEST(cut.get_error() == EINVAL);
+    BOOST_TEST(context.parse(packed.data(), packed.size() / 2, Parse_options()) == false);
+    BOOST_TEST(context.get_input_error() == EINVAL);
+
+    //Decompressing past the limit is an error of its own
+    Decompressing_read_stream limited(packed.data(), packed.size(), plain.size() - 1);
+    while (limited.Peek() != '\0') limited.Take();
+    BOOST_TEST(limited.get_error() == EFBIG);
+    Parse_options options;
+    options.max_decompressed = plain.size();
+    BOOST_TEST(context.parse(packed.data(), packed.size(), options));
+    options.max_decompressed = plain.size() - 1;
+    BOOST_TEST(context.parse(packed.data(), packed.size(), options) == false);
+    BOOST_TEST(context.get_input_error() == EFBIG);
+    rapidjson::StringBuffer refused;
+    Split_status status;
+    BOOST_TEST(split_json_pooled(packed.data(), packed.size(), options, refused,
+                                 &status) == false);
+    BOOST_TEST((status.code == Split_error::input_too_large));
+    std::filesystem::remove_all(dir);
+}
+
+BOOST_AUTO_TEST_CASE(table_export_flattens_batch_results)
+{
+    std::filesystem::path dir = std::filesystem::temp_directory_path() /
+                                "roommate_split_table_test";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    Table_export tables;
+    BOOST_REQUIRE(tables.open(dir.string(), Table_format::csv) == 0);
+    Batch_options options;
+    options.workers = 2;
+    options.tables = &tables;
+    std::vector<Batch_job> jobs = list_batch_jobs("Tests/Input", dir.string());
+    Batch_stats stats = run_batch(jobs, options);
+    BOOST_TEST(tables.close() == 0);
+
+    //One row per roommate and per line item of every successful split
+    std::map<std::string, std::string> expected_rows;
+    size_t roommate_rows = 1, item_rows = 1;
+    for (auto &job : jobs)
+    {
+        Cart cart = Cart();
+        std::map<int, Roommate> roommates = {};
+        if (parse_json_data(&cart, &roommates, job.input_path) == false ||
+            try_validate_input(&cart, &roommates).ok() == false ||
+            try_calculate_shares(&cart, &roommates).ok() == false)
+            continue;
+        roommate_rows += roommates.size();
+        item_rows += cart.get_line_items().size();
+        const Roommate &rm = roommates.begin()->second;
+        std::ostringstream row;
+        row << job.name << "," << rm.get_id() << ",";
+        expected_rows[row.str()] = rm.get_name();
+    }
+    BOOST_TEST(stats.succeeded == 5u);
+
+    auto read_lines = [](const std::filesystem::path &path) {
+        std::ifstream file(path);
+        std::vector<std::string> lines;
+        for (std::string line; std::getline(file, line);) lines.push_back(line);
+        return lines;
+    };
+    std::vector<std::string> lines = read_lines(dir / "roommates.csv");
+    BOOST_TEST(lines.size() == roommate_rows);
+    BOOST_TEST(lines[0] == "cart,roommate_id,name,total,tax_share");
+    size_t found = 0;
+    for (auto &line : lines)
+        for (auto &expected : expected_rows)
+            if (line.compare(0, expected.first.size(), expected.first) == 0)
+            {
+                BOOST_TEST(line.find(expected.second) == expected.first.size());
+                found++;
+            }
+    BOOST_TEST(found == expected_rows.size());
+    lines = read_lines(dir / "line_items.csv");
+    BOOST_TEST(lines.size() == item_rows);
+    BOOST_TEST(lines[0] == "cart,item_id,item_name,cost,share_cost,share_count");
+
+    //Separators and quotes inside text fields survive
+    Cart cart = Cart();
+    cart.add_line_item(Line_item(3, "eggs, \"large\"", 4.5, 1.5, {0, 1, 2}));
+    std::map<int, Roommate> roommates;
+    roommates.emplace(0, Roommate(0, "tab\there"));
+    Table_rows csv(Table_format::csv), tsv(Table_format::tsv);
+    csv.add("a,b", cart, roommates);
+    tsv.add("a,b", cart, roommates);
+    BOOST_REQUIRE(tables.open(dir.string(), Table_format::tsv) == 0);
+    tables.append(tsv);
+    BOOST_TEST(tsv.size() == 0u);
+    BOOST_REQUIRE(tables.open(dir.string(), Table_format::csv) == 0);
+    tables.append(csv);
+    BOOST_TEST(tables.close() == 0);
+    BOOST_TEST(read_lines(dir / "line_items.csv")[1] ==
+               "\"a,b\",3,\"eggs, \"\"large\"\"\",4.5,1.5,3");
+    BOOST_TEST(read_lines(dir / "roommates.tsv")[1] == "a,b\t0\ttab\\there\t0.0\t0.0");
+    std::filesystem::remove_all(dir);
+}
+
+BOOST_AUTO_TEST_CASE(alloc_tracker_counts_stages_and_requests)
+{
+    std::string path = (std::filesystem::temp_directory_path() /
+                        "roommate_split_alloc_output.json").string();
+    Alloc_tracker tracker;
+    for (int request = 0; request < 2; request++)
+    {
+        Cart cart = Cart();
+        std::map<int, Roommate> roommates = {};
+        BOOST_REQUIRE(parse_json_data(&cart, &roommates, std::string(TEST_FILE_PREFIX) +
+                                      "larger_distributed" + std::string(TEST_FILE_POSTFIX)));
+        calculate_shares(&cart, &roommates);
+        write_json(cart, roommates, path);
+        tracker.end_request();
+    }
+    BOOST_TEST(tracker.get_request().count == 0u);
+    std::filesystem::remove(path);
+
+    //Both requests did the same work, parse read through rapidjson chunks
+    const Alloc_stats &last = tracker.get_last_request();
+    Alloc_stats parse = tracker.get_stage("parse");
+    BOOST_TEST(last.count > 0u);
+    BOOST_TEST(tracker.get_total().count >= 2 * last.count);
+    BOOST_TEST(parse.count > 0u);
+    BOOST_TEST(parse.rapidjson_count > 0u);
+    BOOST_TEST(parse.peak > 0u);
+    BOOST_TEST(parse.bytes >= parse.rapidjson_bytes);
+    BOOST_TEST(tracker.get_stage("serialize").count > 0u);
+    BOOST_TEST(tracker.get_stage("serialize").rapidjson_count == 0u);
+    BOOST_TEST(tracker.get_stage("unknown").count == 0u);
+    BOOST_TEST(last.peak <= tracker.get_total().peak);
+
+    size_t stage_count = 0;
+    for (size_t i = 0; i < tracker.get_stage_count(); i++)
+        stage_count += tracker.get_stage(i).stats.count;
+    BOOST_TEST(stage_count == tracker.get_total().count);
+}
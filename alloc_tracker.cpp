@@ -0,0 +1,173 @@
+#include "include/alloc_tracker.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <stdexcept>
+
+#include <malloc.h>
+
+std::atomic<int> alloc_trackers_running(0);
+
+static thread_local Alloc_tracker *local_tracker = nullptr;
+
+//Returned by enter_stage when the thread has no tracker, as Trace_span expects
+static const int NO_STAGE = -2;
+
+void alloc_record(void *ptr, Alloc_source source)
+{
+    Alloc_tracker *tracker = local_tracker;
+    if (tracker == nullptr || ptr == nullptr) return;
+    tracker->record(malloc_usable_size(ptr), source);
+}
+
+void alloc_release(void *ptr)
+{
+    Alloc_tracker *tracker = local_tracker;
+    if (tracker == nullptr || ptr == nullptr) return;
+    tracker->release(malloc_usable_size(ptr));
+}
+
+static void add_allocation(Alloc_stats *stats, size_t bytes, Alloc_source source,
+                           long long live_above)
+{
+    stats->count++;
+    stats->bytes += bytes;
+    if (source == Alloc_source::rapidjson)
+    {
+        stats->rapidjson_count++;
+        stats->rapidjson_bytes += bytes;
+    }
+    if (live_above > 0 && static_cast<size_t>(live_above) > stats->peak)
+        stats->peak = static_cast<size_t>(live_above);
+}
+
+//Alloc_tracker Implementation
+Alloc_tracker::Alloc_tracker()
+{
+    if (local_tracker != nullptr)
+        throw std::logic_error("Alloc_tracker already running on this thread");
+    local_tracker = this;
+    alloc_trackers_running.fetch_add(1, std::memory_order_relaxed);
+}
+
+Alloc_tracker::~Alloc_tracker()
+{
+    local_tracker = nullptr;
+    alloc_trackers_running.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void Alloc_tracker::end_request()
+{
+    last_request = request;
+    request = Alloc_stats();
+    request_live = live;
+}
+
+Alloc_stats Alloc_tracker::get_stage(const char *name) const
+{
+    for (size_t i = 0; i < stage_count; i++)
+        if (strcmp(stages[i].name, name) == 0) return stages[i].stats;
+    return Alloc_stats();
+}
+
+void Alloc_tracker::record(size_t bytes, Alloc_source source)
+{
+    live += static_cast<long long>(bytes);
+    add_allocation(&total, bytes, source, live);
+    add_allocation(&request, bytes, source, live - request_live);
+    int index = current_stage >= 0 ? current_stage : find_stage("none");
+    Alloc_stage &stage = stages[index];
+    add_allocation(&stage.stats, bytes, source, live - stage.entry_live);
+}
+
+void Alloc_tracker::release(size_t bytes)
+{
+    live -= static_cast<long long>(bytes);
+    total.frees++;
+    request.frees++;
+    stages[current_stage >= 0 ? current_stage : find_stage("none")].stats.frees++;
+}
+
+//Slot of the named stage, names are span literals so pointers usually match
+int Alloc_tracker::find_stage(const char *name)
+{
+    for (size_t i = 0; i < stage_count; i++)
+        if (stages[i].name == name || strcmp(stages[i].name, name) == 0)
+            return static_cast<int>(i);
+    if (stage_count == MAX_STAGES)
+    {
+        stages[MAX_STAGES - 1].name = "other";
+        return MAX_STAGES - 1;
+    }
+    stages[stage_count].name = name;
+    stages[stage_count].entry_live = live;
+    return static_cast<int>(stage_count++);
+}
+
+int Alloc_tracker::enter_stage(const char *name)
+{
+    Alloc_tracker *tracker = local_tracker;
+    if (tracker == nullptr) return NO_STAGE;
+    int previous = tracker->current_stage;
+    tracker->current_stage = tracker->find_stage(name);
+    tracker->stages[tracker->current_stage].entry_live = tracker->live;
+    return previous;
+}
+
+void Alloc_tracker::leave_stage(int previous)
+{
+    Alloc_tracker *tracker = local_tracker;
+    if (tracker == nullptr || previous == NO_STAGE) return;
+    tracker->current_stage = previous;
+}
+
+void Alloc_tracker::report(std::ostream &out, size_t ops) const
+{
+    if (ops == 0) ops = 1;
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision(1);
+    out << std::fixed;
+    auto row = [&](const char *name, const Alloc_stats &stats) {
+        out << "  " << std::left << std::setw(12) << name << std::right
+            << std::setw(10) << static_cast<double>(stats.count) / ops << " allocs "
+            << std::setw(12) << static_cast<double>(stats.bytes) / ops << " B ("
+            << static_cast<double>(stats.rapidjson_count) / ops << " allocs, "
+            << static_cast<double>(stats.rapidjson_bytes) / ops << " B rapidjson), peak "
+            << stats.peak << " B" << std::endl;
+    };
+    for (size_t i = 0; i < stage_count; i++) row(stages[i].name, stages[i].stats);
+    row("total", total);
+    out.flags(flags);
+    out.precision(precision);
+}
+
+//Tracking_allocator Implementation
+void *Tracking_allocator::Malloc(size_t size)
+{
+    if (size == 0) return nullptr;
+    void *ptr = std::malloc(size);
+    if (alloc_tracking()) alloc_record(ptr, Alloc_source::rapidjson);
+    return ptr;
+}
+
+void *Tracking_allocator::Realloc(void *original, size_t original_size, size_t new_size)
+{
+    (void)original_size;
+    if (new_size == 0)
+    {
+        Free(original);
+        return nullptr;
+    }
+    bool tracking = alloc_tracking();
+    if (tracking) alloc_release(original);
+    void *ptr = std::realloc(original, new_size);
+    if (tracking) alloc_record(ptr != nullptr ? ptr : original, Alloc_source::rapidjson);
+    return ptr;
+}
+
+void Tracking_allocator::Free(void *ptr)
+{
+    if (alloc_tracking()) alloc_release(ptr);
+    std::free(ptr);
+}
@@ -0,0 +1,727 @@
+#include "include/batch_io.h"
+#include "include/compressed_stream.h"
+#include "include/parse_pool.h"
+#include "include/trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define ROOMMATE_HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+//Blocking whole-file read, data keeps its capacity between calls
+int read_whole_file(const std::string &path, std::string *data)
+{
+    Trace_span span("read_file");
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+
+    data->resize(st.st_size);
+    size_t done = 0;
+    while (done < data->size())
+    {
+        ssize_t n = read(fd, &(*data)[done], data->size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0)
+        {
+            int err = errno;
+            close(fd);
+            return err;
+        }
+        if (n == 0) break;
+        done += n;
+    }
+    data->resize(done);
+    close(fd);
+    return 0;
+}
+
+//Blocking whole-file write
+int write_whole_file(const std::string &path, const std::string &data)
+{
+    Trace_span span("write_file");
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return errno;
+
+    size_t done = 0;
+    while (done < data.size())
+    {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0)
+        {
+            int err = errno;
+            close(fd);
+            return err;
+        }
+        done += n;
+    }
+    return (close(fd) == 0) ? 0 : errno;
+}
+
+/**
+ * Fallback backend, regular files cannot be polled so blocking reads and
+ * writes run on a pool of I/O threads instead.
+ */
+class Thread_pool_file_io : public Batch_file_io
+{
+    public:
+        explicit Thread_pool_file_io(unsigned thread_count)
+        {
+            for (unsigned i = 0; i < thread_count; i++)
+                threads.emplace_back(&Thread_pool_file_io::run, this);
+        }
+
+        ~Thread_pool_file_io()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            has_requests.notify_all();
+            for (auto &thread : threads) thread.join();
+        }
+
+        const char *name() const {return "thread_pool";}
+
+        void submit_read(size_t tag, const std::string &path)
+        {
+            push(Request{tag, false, path, std::string()});
+        }
+
+        void submit_write(size_t tag, const std::string &path,
+                          std::string &&data)
+        {
+            push(Request{tag, true, path, std::move(data)});
+        }
+
+        int wait(std::vector<Io_completion> &out)
+        {
+            std::unique_lock<std::mutex> lock(done_mutex);
+            has_completions.wait(lock, [this]{return completions.empty() == false;});
+            for (auto &completion : completions) out.push_back(std::move(completion));
+            completions.clear();
+            return 0;
+        }
+
+    private:
+        struct Request
+        {
+            size_t tag;
+            bool write;
+            std::string path;
+            std::string data;
+        };
+
+        void push(Request &&request)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                requests.push_back(std::move(request));
+            }
+            has_requests.notify_one();
+        }
+
+        void run()
+        {
+            for (;;)
+            {
+                Request request;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    has_requests.wait(lock, [this]{
+                        return stopping || requests.empty() == false;});
+                    if (requests.empty()) return;
+                    request = std::move(requests.front());
+                    requests.pop_front();
+                }
+
+                Io_completion completion;
+                completion.tag = request.tag;
+                completion.write = request.write;
+                Trace_cart_scope cart(request.tag);
+                if (request.write)
+                    completion.error = write_whole_file(request.path, request.data);
+                else
+                    completion.error = read_whole_file(request.path, &completion.data);
+
+                {
+                    std::lock_guard<std::mutex> lock(done_mutex);
+                    completions.push_back(std::move(completion));
+                }
+                has_completions.notify_one();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable has_requests;
+        std::deque<Request> requests;
+        bool stopping = false;
+
+        std::mutex done_mutex;
+        std::condition_variable has_completions;
+        std::vector<Io_completion> completions;
+
+        std::vector<std::thread> threads;
+};
+
+#ifdef ROOMMATE_HAVE_IO_URING
+static int uring_setup(unsigned entries, io_uring_params *params)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                    min_complete, flags, nullptr, 0));
+}
+
+/**
+ * io_uring backend driven through the raw syscalls. Every file goes through
+ * open, statx (reads only), read or write, so each request keeps exactly one
+ * operation in flight and no call blocks the driving thread. Reads and the
+ * follow-up operations of completed ones are only queued, and go to the
+ * kernel with the next wait, one io_uring_enter per batch. Writes come from
+ * worker threads while the driving thread may be blocked, so they submit.
+ */
+class Uring_file_io : public Batch_file_io
+{
+    public:
+        //Returns null when io_uring or one of the needed opcodes is missing
+        static std::unique_ptr<Uring_file_io> create(unsigned entries)
+        {
+            std::unique_ptr<Uring_file_io> io(new Uring_file_io());
+            if (io->setup(entries) == false) return nullptr;
+            return io;
+        }
+
+        ~Uring_file_io()
+        {
+            if (sqes != nullptr) munmap(sqes, sqes_size);
+            if (cq_ptr != nullptr && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+            if (sq_ptr != nullptr) munmap(sq_ptr, sq_size);
+            if (ring_fd >= 0) close(ring_fd);
+        }
+
+        const char *name() const {return "io_uring";}
+
+        void submit_read(size_t tag, const std::string &path)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            start(tag, false, path, std::string());
+        }
+
+        void submit_write(size_t tag, const std::string &path,
+                          std::string &&data)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            start(tag, true, path, std::move(data));
+            while (uring_enter(ring_fd, unsubmitted(), 0, 0) < 0 && errno == EINTR) {}
+        }
+
+        //An io_uring_enter failure other than an interruption or a full
+        //completion queue leaves the ring unusable and is returned
+        int wait(std::vector<Io_completion> &out)
+        {
+            size_t before = out.size();
+            reap(out);
+            if (out.size() > before)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (unsubmitted() > 0)
+                    while (uring_enter(ring_fd, unsubmitted(), 0, 0) < 0 &&
+                           errno == EINTR) {}
+                return 0;
+            }
+            //Operations queued by the last reap go out here with the new
+            //reads, they are submitted by the same call that waits
+            for (;;)
+            {
+                unsigned to_submit;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    to_submit = unsubmitted();
+                }
+                int ret = uring_enter(ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS);
+                if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                    return errno;
+                reap(out);
+                if (out.size() > before) return 0;
+            }
+        }
+
+    private:
+        enum Stage {opening, sizing, transferring};
+
+        struct Request
+        {
+            size_t tag;
+            bool write;
+            Stage stage;
+            int fd;
+            size_t offset;
+            std::string path;
+            std::string data;
+            struct statx stx;
+        };
+
+        Uring_file_io() {}
+
+        bool setup(unsigned entries)
+        {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            ring_fd = uring_setup(entries, &params);
+            if (ring_fd < 0) return false;
+
+            sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP)
+                sq_size = cq_size = std::max(sq_size, cq_size);
+
+            sq_ptr = map_ring(sq_size, IORING_OFF_SQ_RING);
+            if (sq_ptr == nullptr) return false;
+            if (params.features & IORING_FEAT_SINGLE_MMAP) cq_ptr = sq_ptr;
+            else cq_ptr = map_ring(cq_size, IORING_OFF_CQ_RING);
+            if (cq_ptr == nullptr) return false;
+            sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            sqes = static_cast<io_uring_sqe *>(map_ring(sqes_size, IORING_OFF_SQES));
+            if (sqes == nullptr) return false;
+
+            char *sq = static_cast<char *>(sq_ptr);
+            sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+            sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+            sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+            char *cq = static_cast<char *>(cq_ptr);
+            cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+            cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+            cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+            return supports_file_ops();
+        }
+
+        void *map_ring(size_t size, off_t offset)
+        {
+            void *ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+            return (ptr == MAP_FAILED) ? nullptr : ptr;
+        }
+
+        bool supports_file_ops()
+        {
+            const unsigned probe_ops = 256;
+            std::vector<char> buffer(sizeof(io_uring_probe) +
+                                     probe_ops * sizeof(io_uring_probe_op), 0);
+            io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(buffer.data());
+            if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE,
+                        probe, probe_ops) < 0)
+                return false;
+
+            for (int op : {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+                           IORING_OP_WRITE})
+            {
+                if (op > probe->last_op) return false;
+                if ((probe->ops[op].flags & IO_URING_OP_SUPPORTED) == 0)
+                    return false;
+            }
+            return true;
+        }
+
+        //Allocates a request slot and queues its open, caller holds mutex
+        void start(size_t tag, bool write, const std::string &path,
+                   std::string &&data)
+        {
+            size_t slot;
+            if (free_slots.empty())
+            {
+                slot = requests.size();
+                requests.emplace_back(new Request());
+            }
+            else
+            {
+                slot = free_slots.back();
+                free_slots.pop_back();
+            }
+
+            Request &request = *requests[slot];
+            request.tag = tag;
+            request.write = write;
+            request.stage = opening;
+            request.fd = -1;
+            request.offset = 0;
+            request.path = path;
+            request.data = std::move(data);
+
+            io_uring_sqe sqe;
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_OPENAT;
+            sqe.fd = AT_FDCWD;
+            sqe.addr = reinterpret_cast<uint64_t>(request.path.c_str());
+            if (write)
+            {
+                sqe.len = 0644;
+                sqe.open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+            }
+            else
+            {
+                sqe.open_flags = O_RDONLY | O_CLOEXEC;
+            }
+            sqe.user_data = slot;
+            push(sqe);
+        }
+
+        //Queues the next read or write for the unfinished part of the file
+        void transfer(size_t slot)
+        {
+            Request &request = *requests[slot];
+            io_uring_sqe sqe;
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = request.write ? IORING_OP_WRITE : IORING_OP_READ;
+            sqe.fd = request.fd;
+            sqe.addr = reinterpret_cast<uint64_t>(&request.data[request.offset]);
+            sqe.len = static_cast<unsigned>(request.data.size() - request.offset);
+            sqe.off = request.offset;
+            sqe.user_data = slot;
+            push(sqe);
+        }
+
+        //Queues an operation without submitting it, caller holds mutex
+        void push(const io_uring_sqe &sqe)
+        {
+            unsigned tail = *sq_tail;
+            unsigned index = tail & sq_mask;
+            sqes[index] = sqe;
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        }
+
+        //Queued operations the kernel has not taken yet, caller holds mutex
+        unsigned unsubmitted() const
+        {
+            return *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        }
+
+        void finish(size_t slot, int error, std::vector<Io_completion> &out)
+        {
+            Request &request = *requests[slot];
+            if (request.fd >= 0) close(request.fd);
+
+            Io_completion completion;
+            completion.tag = request.tag;
+            completion.write = request.write;
+            completion.error = error;
+            if (request.write == false && error == 0)
+            {
+                request.data.resize(request.offset);
+                completion.data = std::move(request.data);
+            }
+            out.push_back(std::move(completion));
+
+            request.data = std::string();
+            free_slots.push_back(slot);
+        }
+
+        //Advances the request that owns a completed operation
+        void advance(size_t slot, int res, std::vector<Io_completion> &out)
+        {
+            Request &request = *requests[slot];
+            if (res == -EINTR || res == -EAGAIN)
+            {
+                if (request.stage == transferring) transfer(slot);
+                else finish(slot, -res, out);
+                return;
+            }
+            if (res < 0)
+            {
+                finish(slot, -res, out);
+                return;
+            }
+
+            if (request.stage == opening)
+            {
+                request.fd = res;
+                if (request.write)
+                {
+                    request.stage = transferring;
+                    if (request.data.empty()) finish(slot, 0, out);
+                    else transfer(slot);
+                    return;
+                }
+
+                request.stage = sizing;
+                io_uring_sqe sqe;
+                memset(&sqe, 0, sizeof(sqe));
+                sqe.opcode = IORING_OP_STATX;
+                sqe.fd = request.fd;
+                sqe.addr = reinterpret_cast<uint64_t>("");
+                sqe.len = STATX_SIZE;
+                sqe.off = reinterpret_cast<uint64_t>(&request.stx);
+                sqe.statx_flags = AT_EMPTY_PATH;
+                sqe.user_data = slot;
+                push(sqe);
+                return;
+            }
+
+            if (request.stage == sizing)
+            {
+                request.data.resize(request.stx.stx_size);
+                request.stage = transferring;
+                if (request.data.empty()) finish(slot, 0, out);
+                else transfer(slot);
+                return;
+            }
+
+            if (request.write && res == 0)
+            {
+                finish(slot, EIO, out);
+                return;
+            }
+            request.offset += res;
+            if (request.offset == request.data.size() ||
+                (request.write == false && res == 0))
+                finish(slot, 0, out);
+            else
+                transfer(slot);
+        }
+
+        void reap(std::vector<Io_completion> &out)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; head++)
+            {
+                const io_uring_cqe &cqe = cqes[head & cq_mask];
+                size_t slot = static_cast<size_t>(cqe.user_data);
+                int res = cqe.res;
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                advance(slot, res, out);
+            }
+        }
+
+        int ring_fd = -1;
+        void *sq_ptr = nullptr;
+        void *cq_ptr = nullptr;
+        size_t sq_size = 0;
+        size_t cq_size = 0;
+        io_uring_sqe *sqes = nullptr;
+        size_t sqes_size = 0;
+        unsigned *sq_head = nullptr;
+        unsigned *sq_tail = nullptr;
+        unsigned sq_mask = 0;
+        unsigned *sq_array = nullptr;
+        unsigned *cq_head = nullptr;
+        unsigned *cq_tail = nullptr;
+        unsigned cq_mask = 0;
+        io_uring_cqe *cqes = nullptr;
+
+        //Guards the submission ring and the request table
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Request>> requests;
+        std::vector<size_t> free_slots;
+};
+#endif
+
+std::unique_ptr<Batch_file_io> make_batch_file_io(const Batch_options &options)
+{
+    unsigned depth = std::max(1u, options.queue_depth);
+#ifdef ROOMMATE_HAVE_IO_URING
+    if (options.force_thread_pool == false)
+    {
+        std::unique_ptr<Uring_file_io> uring = Uring_file_io::create(depth);
+        if (uring) return uring;
+    }
+#endif
+    return std::unique_ptr<Batch_file_io>(
+        new Thread_pool_file_io(std::min(depth, 64u)));
+}
+
+std::vector<Batch_job> list_batch_jobs(const std::string &input_dir,
+                                       const std::string &output_dir)
+{
+    const std::string input_postfix = TEST_FILE_POSTFIX;
+    std::vector<Batch_job> jobs;
+
+    for (auto &entry : std::filesystem::directory_iterator(input_dir))
+    {
+        if (entry.is_regular_file() == false) continue;
+        std::string file_name = entry.path().filename().string();
+        //Compressed inputs keep their compression in the output name
+        std::string suffix;
+        if (compression_for_path(file_name) != Compression::none)
+        {
+            if (compression_supported(compression_for_path(file_name)) == false)
+                continue;
+            suffix = std::filesystem::path(file_name).extension().string();
+            file_name.resize(file_name.size() - suffix.size());
+        }
+        if (std::filesystem::path(file_name).extension() != ".json") continue;
+
+        std::string base = std::filesystem::path(file_name).stem().string();
+        if (file_name.size() > input_postfix.size() &&
+            file_name.compare(file_name.size() - input_postfix.size(),
+                              input_postfix.size(), input_postfix) == 0)
+            base = file_name.substr(0, file_name.size() - input_postfix.size());
+
+        Batch_job job;
+        job.input_path = entry.path().string();
+        job.output_path = (std::filesystem::path(output_dir) /
+                           (base + EXP_FILE_POSTFIX + suffix)).string();
+        job.name = base;
+        jobs.push_back(job);
+    }
+
+    std::sort(jobs.begin(), jobs.end(), [](const Batch_job &a, const Batch_job &b){
+        return a.input_path < b.input_path;});
+    return jobs;
+}
+
+/**
+ * Reads inputs through the async backend, splits completed buffers on a pool
+ * of worker threads and hands the results back to the backend to write.
+ * The calling thread only submits reads and reaps completions.
+ */
+Batch_stats run_batch(const std::vector<Batch_job> &jobs,
+                      const Batch_options &options)
+{
+    Batch_stats stats;
+    std::unique_ptr<Batch_file_io> io = make_batch_file_io(options);
+    stats.backend = io->name();
+    if (jobs.empty()) return stats;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_ready;
+    std::deque<Io_completion> queue;
+    bool closing = false;
+    std::atomic<size_t> succeeded(0);
+    std::atomic<size_t> failed(0);
+
+    unsigned worker_count = options.workers;
+    if (worker_count == 0) worker_count = std::thread::hardware_concurrency();
+    if (worker_count == 0) worker_count = 1;
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < worker_count; i++)
+    {
+        workers.emplace_back([&]{
+            //Table rows are batched per worker and appended in large chunks
+            std::unique_ptr<Table_rows> rows;
+            if (options.tables != nullptr)
+                rows.reset(new Table_rows(options.tables->get_format()));
+            for (;;)
+            {
+                Io_completion input;
+                {
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    queue_ready.wait(lock, [&]{return closing || queue.empty() == false;});
+                    if (queue.empty())
+                    {
+                        if (rows) options.tables->append(*rows);
+                        return;
+                    }
+                    input = std::move(queue.front());
+                    queue.pop_front();
+                }
+
+                Trace_cart_scope cart(input.tag);
+                rapidjson::StringBuffer sb;
+                Split_status status;
+                if (split_json_pooled(input.data.data(), input.data.size(),
+                                      options.parse, sb, &status,
+                                      &options.projection, rows.get(),
+                                      jobs[input.tag].name))
+                    succeeded++;
+                else
+                    failed++;
+                if (rows && rows->size() >= Table_rows::FLUSH_SIZE)
+                    options.tables->append(*rows);
+                //Batch writes are whole files, so the result is compressed in memory
+                std::string output;
+                Compression compression = compression_for_path(jobs[input.tag].output_path);
+                compress_buffer(sb.GetString(), sb.GetSize(), compression, &output);
+                io->submit_write(input.tag, jobs[input.tag].output_path,
+                                 std::move(output));
+            }
+        });
+    }
+
+    size_t depth = std::max(1u, options.queue_depth);
+    size_t next_job = 0;
+    size_t active = 0;
+    size_t finished = 0;
+    std::vector<Io_completion> completions;
+    while (finished < jobs.size())
+    {
+        for (; active < depth && next_job < jobs.size(); next_job++, active++)
+            io->submit_read(next_job, jobs[next_job].input_path);
+
+        completions.clear();
+        int io_err;
+        {
+            //With io_uring this is the only place file I/O shows up
+            Trace_span span("io_wait");
+            io_err = io->wait(completions);
+        }
+        for (auto &completion : completions)
+        {
+            if (completion.write || completion.error != 0)
+            {
+                if (completion.error != 0) stats.io_errors++;
+                active--;
+                finished++;
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                queue.push_back(std::move(completion));
+            }
+            queue_ready.notify_one();
+        }
+        //No more completions will come, every job still pending is lost
+        if (io_err != 0)
+        {
+            stats.io_errors += jobs.size() - finished;
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            queue.clear();
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        closing = true;
+    }
+    queue_ready.notify_all();
+    for (auto &worker : workers) worker.join();
+
+    stats.succeeded = succeeded;
+    stats.failed = failed;
+    return stats;
+}
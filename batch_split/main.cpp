@@ -0,0 +1,116 @@
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "../include/batch_io.h"
+#include "../include/trace.h"
+
+static void usage()
+{
+    std::cout << "usage: split_batch <input_dir> <output_dir> [options]"
+              << std::endl;
+    std::cout << "  --workers N     split worker threads (default: all cores)"
+              << std::endl;
+    std::cout << "  --depth N       receipts in flight (default: 64)" << std::endl;
+    std::cout << "  --thread-pool   use the thread pool I/O backend" << std::endl;
+    std::cout << "  --exact         exact decimal parsing of money fields"
+              << std::endl;
+    std::cout << "  --trace FILE    write a Chrome trace-event timeline to FILE"
+              << std::endl;
+    std::cout << "  --view SPEC     write only part of each result: totals, no_cart,"
+              << std::endl;
+    std::cout << "                  roommate:<id> or comma separated JSON Pointers"
+              << std::endl;
+    std::cout << "  --tables DIR    also export roommates.csv and line_items.csv to DIR"
+              << std::endl;
+    std::cout << "  --tsv           export tab separated .tsv tables instead" << std::endl;
+}
+
+/**
+ * Splits every receipt JSON in <input_dir> and writes the results, or error
+ * documents, as <name>_output.json files in <output_dir>. With --tables the
+ * successful results are also flattened into two tables keyed by <name>.
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    Batch_options options;
+    std::string trace_path;
+    std::string tables_dir;
+    Table_format table_format = Table_format::csv;
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+            options.workers = std::stoi(argv[++i]);
+        else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc)
+            options.queue_depth = std::stoi(argv[++i]);
+        else if (strcmp(argv[i], "--thread-pool") == 0)
+            options.force_thread_pool = true;
+        else if (strcmp(argv[i], "--exact") == 0)
+            options.parse.exact_decimal = true;
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            trace_path = argv[++i];
+        else if (strcmp(argv[i], "--tables") == 0 && i + 1 < argc)
+            tables_dir = argv[++i];
+        else if (strcmp(argv[i], "--tsv") == 0)
+            table_format = Table_format::tsv;
+        else if (strcmp(argv[i], "--view") == 0 && i + 1 < argc &&
+                 Output_projection::parse(argv[i + 1], &options.projection))
+            i++;
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    Table_export tables;
+    if (tables_dir.empty() == false)
+    {
+        int err = tables.open(tables_dir, table_format);
+        if (err != 0)
+        {
+            std::cerr << "split_batch: " << tables_dir << ": " << strerror(err)
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+        options.tables = &tables;
+    }
+
+    std::vector<Batch_job> jobs = list_batch_jobs(argv[1], argv[2]);
+    if (trace_path.empty() == false) trace_start();
+    auto start = std::chrono::steady_clock::now();
+    Batch_stats stats = run_batch(jobs, options);
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    if (trace_path.empty() == false)
+    {
+        int err = trace_stop(trace_path);
+        if (err != 0)
+            std::cerr << "split_batch: " << trace_path << ": " << strerror(err)
+                      << std::endl;
+    }
+
+    if (tables.is_open())
+    {
+        int err = tables.close();
+        if (err != 0)
+        {
+            std::cerr << "split_batch: " << tables_dir << ": " << strerror(err)
+                      << std::endl;
+            stats.io_errors++;
+        }
+    }
+
+    std::cout << "backend: " << stats.backend << std::endl;
+    std::cout << "receipts: " << jobs.size() << " in " << seconds << " s ("
+              << jobs.size() / seconds << "/s)" << std::endl;
+    std::cout << "succeeded: " << stats.succeeded << " failed: " << stats.failed
+              << " io errors: " << stats.io_errors << std::endl;
+    return (stats.failed == 0 && stats.io_errors == 0) ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,355 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../include/batch_io.h"
+#include "../include/http_server.h"
+
+typedef std::chrono::steady_clock load_clock;
+
+//Per connection results
+struct Load_result
+{
+    std::vector<double> latencies_us;
+    size_t errors = 0;
+    //503 answers of a server shedding load
+    size_t shed = 0;
+    bool failed = false;
+};
+
+static int connect_loopback(const std::string &host, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+        connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_all(int fd, const std::string &data)
+{
+    size_t done = 0;
+    while (done < data.size())
+    {
+        ssize_t n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+/**
+ * Reads one response from buffer/fd, returns its status code or -1 if the
+ * connection broke. Consumed bytes are removed from buffer.
+ */
+static int read_response(int fd, std::string &buffer)
+{
+    char chunk[16 * 1024];
+    for (;;)
+    {
+        size_t header_end = buffer.find("\r\n\r\n");
+        if (header_end != std::string::npos)
+        {
+            size_t length_at = buffer.find("Content-Length: ");
+            if (length_at == std::string::npos || length_at > header_end)
+                return -1;
+            size_t body_length = std::stoul(buffer.substr(length_at + 16, 20));
+            size_t total = header_end + 4 + body_length;
+            if (buffer.size() >= total)
+            {
+                int status = std::stoi(buffer.substr(9, 3));
+                buffer.erase(0, total);
+                return status;
+            }
+        }
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        buffer.append(chunk, n);
+    }
+}
+
+//Sends <requests> copies of request keeping up to <pipeline> in flight,
+//or fewer if stop is set
+static void run_connection(const std::string &host, int port,
+                           const std::string &request, size_t requests,
+                           unsigned pipeline, const std::atomic<bool> *stop,
+                           Load_result *result)
+{
+    int fd = connect_loopback(host, port);
+    if (fd < 0)
+    {
+        result->failed = true;
+        return;
+    }
+
+    std::deque<load_clock::time_point> in_flight;
+    std::string buffer;
+    size_t sent = 0, received = 0;
+    result->latencies_us.reserve(std::min<size_t>(requests, 1 << 20));
+    for (;;)
+    {
+        bool stopping = stop && stop->load(std::memory_order_relaxed);
+        if (received == sent && (sent == requests || stopping)) break;
+        while (sent < requests && stopping == false &&
+               in_flight.size() < pipeline)
+        {
+            in_flight.push_back(load_clock::now());
+            if (send_all(fd, request) == false)
+            {
+                result->failed = true;
+                close(fd);
+                return;
+            }
+            sent++;
+        }
+
+        int status = read_response(fd, buffer);
+        if (status < 0)
+        {
+            result->failed = true;
+            break;
+        }
+        if (status == 503) result->shed++;
+        else if (status != 200) result->errors++;
+        result->latencies_us.push_back(std::chrono::duration<double, std::micro>(
+            load_clock::now() - in_flight.front()).count());
+        in_flight.pop_front();
+        received++;
+    }
+    close(fd);
+}
+
+//Input JSON with item_count items each split among four roommates
+static std::string make_large_cart(int item_count)
+{
+    std::ostringstream json;
+    json << "{\"roommates\":[";
+    for (int i = 0; i < 4; i++)
+    {
+        if (i > 0) json << ",";
+        json << "{\"name\":\"rm" << i
+             << "\",\"total\":0,\"tax_share\":0,\"items\":[]}";
+    }
+    json << "],\"cart\":{\"total\":" << item_count * 4
+         << ",\"tax\":0,\"line_items\":[";
+    for (int id = 0; id < item_count; id++)
+    {
+        if (id > 0) json << ",";
+        json << "{\"id\":" << id << ",\"item_name\":\"item\",\"cost\":4,"
+             << "\"share_cost\":0,\"splitting\":[0,1,2,3]}";
+    }
+    json << "]}}";
+    return json.str();
+}
+
+static std::string make_request(const std::string &host, const std::string &body)
+{
+    return "POST /split HTTP/1.1\r\nHost: " + host +
+           "\r\nContent-Type: application/json\r\nContent-Length: " +
+           std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+static double percentile(const std::vector<double> &sorted, double fraction)
+{
+    if (sorted.empty()) return 0.0;
+    size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+static void print_latencies(const char *label, std::vector<double> &latencies)
+{
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << label << "latency us: p50 " << percentile(latencies, 0.50)
+              << " p99 " << percentile(latencies, 0.99)
+              << " p999 " << percentile(latencies, 0.999) << std::endl;
+}
+
+static void usage()
+{
+    std::cout << "usage: http_load [options]" << std::endl;
+    std::cout << "  --host A         server address (default: 127.0.0.1)"
+              << std::endl;
+    std::cout << "  --port N         server port, without it an in-process"
+              << " server is started" << std::endl;
+    std::cout << "  --input FILE     request body (default: "
+              << "Tests/Input/larger_distributed_input.json)" << std::endl;
+    std::cout << "  --connections N  concurrent connections (default: 8)"
+              << std::endl;
+    std::cout << "  --requests N     total requests (default: 100000)"
+              << std::endl;
+    std::cout << "  --pipeline N     requests in flight per connection "
+              << "(default: 1)" << std::endl;
+    std::cout << "  --workers N      in-process server workers (default: all cores)"
+              << std::endl;
+    std::cout << "  --processes N    in-process server splits in N worker processes"
+              << std::endl;
+    std::cout << "  --fifo           in-process server serves in arrival order"
+              << std::endl;
+    std::cout << "  --aging X        in-process server priority gained per ns"
+              << " waited" << std::endl;
+    std::cout << "  --latency-budget MS  in-process server sheds requests that"
+              << " would wait longer" << std::endl;
+    std::cout << "  --large-items N  mix in carts of N items, their latency is"
+              << " reported apart" << std::endl;
+    std::cout << "  --large-connections N  connections sending large carts until"
+              << " the others finish (default: 1)" << std::endl;
+}
+
+/**
+ * Loopback load generator for POST /split. Reports latency percentiles
+ * measured from sending a request to reading its full response.
+ *
+ * With --large-items some connections keep sending large carts in the
+ * background, which replays the mix that hurts tail latency of small
+ * carts. Run it with and without --fifo to compare the two schedules.
+ */
+int main(int argc, char **argv)
+{
+    std::string host = "127.0.0.1";
+    int port = 0;
+    std::string input_path = "Tests/Input/larger_distributed_input.json";
+    unsigned connections = 8;
+    size_t requests = 100000;
+    unsigned pipeline = 1;
+    int large_items = 0;
+    unsigned large_connections = 1;
+    Http_server_options server_options;
+    server_options.port = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--host") == 0 && i + 1 < argc) host = argv[++i];
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+            port = std::stoi(argv[++i]);
+        else if (strcmp(argv[i], "--input") == 0 && i + 1 < argc)
+            input_path = argv[++i];
+        else if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc)
+            connections = std::max(1, std::stoi(argv[++i]));
+        else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc)
+            requests = std::stoul(argv[++i]);
+        else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc)
+            pipeline = std::max(1, std::stoi(argv[++i]));
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+            server_options.workers = std::stoi(argv[++i]);
+        else if (strcmp(argv[i], "--processes") == 0 && i + 1 < argc)
+            server_options.processes = std::stoi(argv[++i]);
+        else if (strcmp(argv[i], "--fifo") == 0)
+            server_options.schedule.shortest_first = false;
+        else if (strcmp(argv[i], "--aging") == 0 && i + 1 < argc)
+            server_options.schedule.aging = std::stod(argv[++i]);
+        else if (strcmp(argv[i], "--latency-budget") == 0 && i + 1 < argc)
+            server_options.schedule.latency_budget_ms = std::stod(argv[++i]);
+        else if (strcmp(argv[i], "--large-items") == 0 && i + 1 < argc)
+            large_items = std::max(0, std::stoi(argv[++i]));
+        else if (strcmp(argv[i], "--large-connections") == 0 && i + 1 < argc)
+            large_connections = std::max(1, std::stoi(argv[++i]));
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::string body;
+    if (read_whole_file(input_path, &body) != 0)
+    {
+        std::cerr << "http_load: cannot read " << input_path << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string request = make_request(host, body);
+    std::string large_request;
+    if (large_items > 0) large_request = make_request(host, make_large_cart(large_items));
+    else large_connections = 0;
+
+    std::unique_ptr<Http_server> server;
+    if (port == 0)
+    {
+        server.reset(new Http_server(server_options));
+        if (server->start() != 0)
+        {
+            std::cerr << "http_load: cannot start server" << std::endl;
+            return EXIT_FAILURE;
+        }
+        port = server->get_port();
+    }
+
+    std::vector<Load_result> results(connections);
+    std::vector<Load_result> large_results(large_connections);
+    std::atomic<bool> small_done(false);
+    std::vector<std::thread> threads, large_threads;
+    load_clock::time_point start = load_clock::now();
+    for (unsigned i = 0; i < connections; i++)
+    {
+        size_t share = requests / connections + (i < requests % connections);
+        threads.emplace_back(run_connection, host, port, request, share,
+                             pipeline, nullptr, &results[i]);
+    }
+    for (unsigned i = 0; i < large_connections; i++)
+    {
+        large_threads.emplace_back(run_connection, host, port, large_request,
+                                   SIZE_MAX, pipeline, &small_done,
+                                   &large_results[i]);
+    }
+    for (auto &thread : threads) thread.join();
+    double seconds = std::chrono::duration<double>(load_clock::now() - start)
+                     .count();
+    small_done = true;
+    for (auto &thread : large_threads) thread.join();
+
+    std::vector<double> latencies, large_latencies;
+    size_t errors = 0, shed = 0;
+    bool failed = false;
+    for (auto &result : results)
+    {
+        latencies.insert(latencies.end(), result.latencies_us.begin(),
+                         result.latencies_us.end());
+        errors += result.errors;
+        shed += result.shed;
+        failed |= result.failed;
+    }
+    for (auto &result : large_results)
+    {
+        large_latencies.insert(large_latencies.end(), result.latencies_us.begin(),
+                               result.latencies_us.end());
+        errors += result.errors;
+        shed += result.shed;
+        failed |= result.failed;
+    }
+
+    std::cout << "requests: " << latencies.size() << " in " << seconds << " s ("
+              << latencies.size() / seconds << " req/s)" << std::endl;
+    print_latencies(large_connections ? "small cart " : "", latencies);
+    if (large_connections)
+    {
+        std::cout << "large carts: " << large_latencies.size() << std::endl;
+        print_latencies("large cart ", large_latencies);
+    }
+    std::cout << "non-200 responses: " << errors << ", shed (503): " << shed
+              << (failed ? ", some connections failed" : "") << std::endl;
+    return (failed || errors != 0) ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,1020 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+#include "../include/roommate_split.h"
+#include "../include/settlement.h"
+#include "../include/ledger.h"
+#include "../include/batch_io.h"
+#include "../include/parse_pool.h"
+#include "../include/shm_server.h"
+#include "../include/trace.h"
+#include "../include/cart_session.h"
+#include "../include/output_projection.h"
+#include "../include/alloc_tracker_new.h"
+#include "../include/rapidjson/document.h"
+#include "../include/rapidjson/prettywriter.h"
+
+typedef std::chrono::steady_clock bench_clock;
+
+
+static double elapsed_ns(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::nano>(bench_clock::now() - start)
+           .count();
+}
+
+//Cart with <item_count> items where the last one has a negative cost
+static void make_invalid_cart(Cart *cart, std::map<int, Roommate> *roommates,
+                              int item_count)
+{
+    for (int i = 0; i < 4; i++)
+        roommates->insert(std::pair<int, Roommate>(i, Roommate(i, "rm")));
+    for (int i = 0; i < item_count; i++)
+    {
+        Line_item item(i, "item", (i == item_count - 1) ? -1.0 : 1.0, 0.0,
+                       {i % 4});
+        cart->add_line_item(item);
+    }
+    cart->set_total(item_count);
+}
+
+/**
+ * Measures how many malformed carts per second are rejected through the
+ * throwing validate_input wrapper versus the try_validate_input status path.
+ */
+static int bench_errors(int iterations)
+{
+    std::map<int, Roommate> roommates = {};
+    Cart cart = Cart();
+    make_invalid_cart(&cart, &roommates, 4);
+    size_t rejected = 0;
+
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        try { validate_input(&cart, &roommates); }
+        catch (std::invalid_argument &e) { rejected++; }
+    }
+    double throw_ns = elapsed_ns(start);
+
+    start = bench_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        Split_status status = try_validate_input(&cart, &roommates);
+        if (status.ok() == false) rejected++;
+    }
+    double status_ns = elapsed_ns(start);
+
+    std::cout << "invalid input, " << iterations << " carts" << std::endl;
+    std::cout << "  exceptions:  " << throw_ns / iterations << " ns/cart, "
+              << iterations / (throw_ns / 1e9) << " carts/s" << std::endl;
+    std::cout << "  status path: " << status_ns / iterations << " ns/cart, "
+              << iterations / (status_ns / 1e9) << " carts/s" << std::endl;
+    return rejected == static_cast<size_t>(iterations) * 2 ? 0 : 1;
+}
+
+/**
+ * Input JSON for <item_count> items of <units> units each, shared by four
+ * roommates who take 1, 2, ... units. Exploded carts repeat the item once
+ * per unit with a single roommate, weighted carts carry quantity and weights.
+ */
+static std::string make_unit_cart_json(int item_count, int units, bool weighted)
+{
+    std::ostringstream json;
+    json << "{\"roommates\":[";
+    for (int i = 0; i < 4; i++)
+    {
+        if (i > 0) json << ",";
+        json << "{\"name\":\"rm" << i
+             << "\",\"total\":0,\"tax_share\":0,\"items\":[]}";
+    }
+    json << "],\"cart\":{\"total\":" << item_count * units
+         << ",\"tax\":0,\"line_items\":[";
+
+    int id = 0;
+    for (int i = 0; i < item_count; i++)
+    {
+        int taker = i % 4;
+        int other = (i + 1) % 4;
+        if (weighted)
+        {
+            if (id > 0) json << ",";
+            json << "{\"id\":" << id++ << ",\"item_name\":\"item\",\"cost\":"
+                 << units << ",\"share_cost\":0,\"splitting\":[" << taker
+                 << "," << other << "],\"quantity\":" << units
+                 << ",\"weights\":[" << units - 1 << ",1]}";
+            continue;
+        }
+        for (int unit = 0; unit < units; unit++)
+        {
+            if (id > 0) json << ",";
+            json << "{\"id\":" << id++
+                 << ",\"item_name\":\"item\",\"cost\":1,\"share_cost\":0,"
+                 << "\"splitting\":[" << (unit == 0 ? other : taker) << "]}";
+        }
+    }
+    json << "]}}";
+    return json.str();
+}
+
+/**
+ * Parse, validate, split and serialize of the same purchases expressed as
+ * one line item per unit versus one weighted line item per product.
+ */
+static int bench_weighted(int iterations)
+{
+    const int item_count = 50;
+    const int units = 6;
+    int failed = 0;
+
+    for (bool weighted : {false, true})
+    {
+        std::string input = make_unit_cart_json(item_count, units, weighted);
+        rapidjson::StringBuffer sb;
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 0; i < iterations; i++)
+        {
+            sb.Clear();
+            if (split_json_buffer(input.data(), input.size(), Parse_options(),
+                                  sb) == false)
+                failed++;
+        }
+        double ns = elapsed_ns(start);
+        std::cout << (weighted ? "  weighted: " : "  exploded: ")
+                  << input.size() << " bytes, " << ns / iterations
+                  << " ns/cart" << std::endl;
+    }
+    return failed == 0 ? 0 : 1;
+}
+
+//Random balances in cents for <count> roommates, summing to zero
+static std::vector<std::pair<int, long long>> make_balances(int count)
+{
+    std::mt19937_64 rng(count);
+    std::uniform_int_distribution<long long> pick(-100000, 100000);
+    std::vector<std::pair<int, long long>> balances;
+    long long sum = 0;
+    for (int i = 0; i < count - 1; i++)
+    {
+        balances.emplace_back(i, pick(rng));
+        sum += balances.back().second;
+    }
+    balances.emplace_back(count - 1, -sum);
+    return balances;
+}
+
+/**
+ * Greedy settlement time and transfer count for groups of 10 to 1M
+ * roommates, plus the exact subset search on the sizes it accepts.
+ * Each size runs iterations / R times so every row does similar work.
+ */
+static int bench_settle(int iterations)
+{
+    for (int count = 10; count <= 1000000; count *= 10)
+    {
+        std::vector<std::pair<int, long long>> balances = make_balances(count);
+        int runs = std::max(1, iterations / count);
+        Settlement_options options;
+        options.exact = false;
+        size_t transfers = 0;
+
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 0; i < runs; i++)
+            transfers = settle_balances(balances, options).size();
+        double ns = elapsed_ns(start) / runs;
+        std::cout << "  greedy R=" << count << ": " << ns / 1e3 << " us, "
+                  << transfers << " transfers" << std::endl;
+    }
+
+    for (int count : {8, 12, 16})
+    {
+        std::vector<std::pair<int, long long>> balances = make_balances(count);
+        //Pairs that cancel out are where the exact search beats greedy
+        for (int i = 0; i + 1 < count / 2; i += 2)
+            balances[i + 1].second = -balances[i].second;
+        long long sum = 0;
+        for (int i = 0; i < count - 1; i++) sum += balances[i].second;
+        balances[count - 1].second = -sum;
+
+        Settlement_options options;
+        size_t greedy = 0, exact = 0;
+        options.exact = false;
+        greedy = settle_balances(balances, options).size();
+        options.exact = true;
+        bench_clock::time_point start = bench_clock::now();
+        exact = settle_balances(balances, options).size();
+        double ns = elapsed_ns(start);
+        std::cout << "  exact R=" << count << ": " << ns / 1e3 << " us, "
+                  << exact << " transfers (greedy " << greedy << ")"
+                  << std::endl;
+    }
+    return 0;
+}
+
+/**
+ * Appends <iterations> four-roommate splits to a ledger in the working
+ * directory, then times balance queries, a reopen that replays nothing and
+ * a full index rebuild from the log.
+ */
+static int bench_ledger(int iterations)
+{
+    const char *path = "split_bench_ledger";
+    std::remove("split_bench_ledger.log");
+    std::remove("split_bench_ledger.idx");
+
+    std::map<int, Roommate> roommates = {};
+    for (int i = 0; i < 4; i++)
+    {
+        roommates.emplace(i, Roommate(i, "rm" + std::to_string(i)));
+        roommates.at(i).add_to_total(12.34 * (i + 1));
+    }
+
+    int failed = 0;
+    Ledger ledger;
+    if (ledger.open(path) != 0) return 1;
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < iterations; i++) failed += ledger.append(roommates) != 0;
+    double append_ns = elapsed_ns(start);
+
+    Ledger_balance balance;
+    start = bench_clock::now();
+    for (int i = 0; i < iterations; i++)
+        failed += ledger.get_balance(roommates.at(i % 4).get_name(),
+                                     &balance) == false;
+    double query_ns = elapsed_ns(start);
+    ledger.close();
+
+    start = bench_clock::now();
+    failed += ledger.open(path) != 0;
+    double reopen_ns = elapsed_ns(start);
+    start = bench_clock::now();
+    failed += ledger.rebuild_index() != 0;
+    double rebuild_ns = elapsed_ns(start);
+    ledger.close();
+
+    std::cout << "ledger, " << iterations << " records" << std::endl;
+    std::cout << "  append:  " << append_ns / iterations << " ns/record"
+              << std::endl;
+    std::cout << "  balance: " << query_ns / iterations << " ns/query"
+              << std::endl;
+    std::cout << "  reopen:  " << reopen_ns / 1e3 << " us" << std::endl;
+    std::cout << "  rebuild: " << rebuild_ns / 1e6 << " ms" << std::endl;
+    std::remove("split_bench_ledger.log");
+    std::remove("split_bench_ledger.idx");
+    return failed == 0 ? 0 : 1;
+}
+
+//Packed form of a cart with four roommates, see rs_packed_cart
+static std::string make_packed_cart(int item_count)
+{
+    std::string packed;
+    rs_packed_cart cart = {4, static_cast<uint32_t>(item_count),
+                           static_cast<double>(item_count), 0.0};
+    packed.append(reinterpret_cast<const char *>(&cart), sizeof(cart));
+    for (int i = 0; i < item_count; i++)
+    {
+        rs_packed_item item = {i, 2, 1.0};
+        int32_t ids[2] = {i % 4, (i + 1) % 4};
+        packed.append(reinterpret_cast<const char *>(&item), sizeof(item));
+        packed.append(reinterpret_cast<const char *>(ids), sizeof(ids));
+    }
+    return packed;
+}
+
+static bool read_exact(int fd, char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = read(fd, data, length);
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool write_exact(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+//Length-prefixed JSON over a unix socket, answered by split_json_pooled
+static void serve_socket(int fd)
+{
+    std::string request;
+    rapidjson::StringBuffer sb;
+    uint32_t length;
+    while (read_exact(fd, reinterpret_cast<char *>(&length), sizeof(length)))
+    {
+        request.resize(length);
+        if (read_exact(fd, &request[0], length) == false) break;
+        sb.Clear();
+        split_json_pooled(request.data(), request.size(), Parse_options(), sb);
+        length = sb.GetSize();
+        if (write_exact(fd, reinterpret_cast<const char *>(&length),
+                        sizeof(length)) == false ||
+            write_exact(fd, sb.GetString(), length) == false)
+            break;
+    }
+}
+
+/**
+ * Round-trip latency of one split through a unix socket with JSON, the
+ * shared-memory ring with JSON and the ring with a packed binary cart.
+ */
+static int bench_shm(int iterations)
+{
+    std::string json;
+    if (read_whole_file("Tests/Input/larger_distributed_input.json", &json) != 0)
+    {
+        std::cerr << "run from the repository root" << std::endl;
+        return 1;
+    }
+    std::string packed = make_packed_cart(30);
+    std::string response(64 * 1024, '\0');
+    int failed = 0;
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return 1;
+    std::thread socket_server(serve_socket, fds[1]);
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < iterations; i++)
+    {
+        uint32_t length = json.size();
+        failed += write_exact(fds[0], reinterpret_cast<const char *>(&length),
+                              sizeof(length)) == false;
+        failed += write_exact(fds[0], json.data(), json.size()) == false;
+        failed += read_exact(fds[0], reinterpret_cast<char *>(&length),
+                             sizeof(length)) == false;
+        failed += read_exact(fds[0], &response[0], length) == false;
+    }
+    double socket_ns = elapsed_ns(start);
+    close(fds[0]);
+    socket_server.join();
+    close(fds[1]);
+
+    Shm_server_options options;
+    options.name = "/roommate_split_bench";
+    Shm_split_server server(options);
+    if (server.start() != 0) return 1;
+    rs_client *client = rs_client_open(options.name.c_str());
+    if (client == nullptr) return 1;
+
+    double shm_ns[2];
+    for (int format = 0; format < 2; format++)
+    {
+        const std::string &request = (format == 0) ? json : packed;
+        uint32_t request_format = (format == 0) ? RS_FORMAT_JSON : RS_FORMAT_PACKED;
+        start = bench_clock::now();
+        for (int i = 0; i < iterations; i++)
+        {
+            size_t length = 0;
+            int32_t status = 0;
+            failed += rs_client_split(client, request_format, request.data(),
+                                      request.size(), &response[0],
+                                      response.size(), &length, &status) != 0;
+            failed += status != 0;
+        }
+        shm_ns[format] = elapsed_ns(start);
+    }
+    rs_client_close(client);
+    server.stop();
+
+    std::cout << "round trip, " << iterations << " splits" << std::endl;
+    std::cout << "  unix socket, json: " << socket_ns / iterations << " ns"
+              << std::endl;
+    std::cout << "  shared ring, json: " << shm_ns[0] / iterations << " ns"
+              << std::endl;
+    std::cout << "  shared ring, packed (30 items): " << shm_ns[1] / iterations
+              << " ns" << std::endl;
+    return failed == 0 ? 0 : 1;
+}
+
+/**
+ * Share calculation through the dispatcher, which picks a fixed size kernel
+ * for up to 8 roommates, versus the generic map walk, for 2 to 10 roommates
+ * and 40 items each shared by about half of them. Costs divide evenly so
+ * the total check passes for every group size.
+ */
+static int bench_kernels(int iterations)
+{
+    std::mt19937 rng(5);
+    for (int count = 2; count <= 10; count += 2)
+    {
+        std::map<int, Roommate> roommates = {};
+        for (int i = 0; i < count; i++) roommates.emplace(i, Roommate(i, "rm"));
+        Cart cart = Cart();
+        for (int id = 0; id < 40; id++)
+        {
+            Line_item &item = cart.emplace_line_item(id, "item", 2520.0, 0.0,
+                                                     Id_set());
+            for (int i = 0; i < count; i++)
+                if (rng() % 2 == 0 || i == id % count) item.add_splitting(i);
+        }
+        cart.set_total(40 * 2520.0);
+
+        double ns[2];
+        for (int generic = 0; generic < 2; generic++)
+        {
+            int runs = iterations / 100;
+            bench_clock::time_point start = bench_clock::now();
+            for (int i = 0; i < runs; i++)
+            {
+                for (auto &rm : roommates) rm.second.reset();
+                Split_status status = generic ?
+                    try_calculate_shares_generic(&cart, &roommates) :
+                    try_calculate_shares(&cart, &roommates);
+                if (status.ok() == false) return 1;
+            }
+            ns[generic] = elapsed_ns(start) / runs;
+        }
+        std::cout << "  " << count << " roommates: dispatch " << ns[0]
+                  << " ns, generic " << ns[1] << " ns" << std::endl;
+    }
+    return 0;
+}
+
+/**
+ * Tracing overhead: splits iterations / 10 carts from memory with tracing
+ * off, then on, and writes the trace. Without file I/O in the loop this is
+ * the worst case for the relative cost of the spans.
+ */
+static int bench_trace(int iterations)
+{
+    std::string json;
+    if (read_whole_file("Tests/Input/larger_distributed_input.json", &json) != 0)
+    {
+        std::cerr << "run split_bench from the repository root" << std::endl;
+        return 1;
+    }
+
+    int carts = std::max(1, iterations / 10);
+    const char *trace_path = "split_bench_trace.json";
+    double ns[2];
+    rapidjson::StringBuffer sb;
+    for (int traced = 0; traced < 2; traced++)
+    {
+        if (traced) trace_start();
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 0; i < carts; i++)
+        {
+            Trace_cart_scope cart(i);
+            sb.Clear();
+            if (split_json_pooled(json.data(), json.size(), Parse_options(),
+                                  sb) == false)
+                return 1;
+        }
+        ns[traced] = elapsed_ns(start);
+    }
+    bench_clock::time_point start = bench_clock::now();
+    int err = trace_stop(trace_path);
+    double write_ns = elapsed_ns(start);
+    if (err != 0)
+    {
+        std::cerr << trace_path << ": " << strerror(err) << std::endl;
+        return 1;
+    }
+
+    std::cout << carts << " carts" << std::endl;
+    std::cout << "  untraced: " << ns[0] / carts << " ns/cart" << std::endl;
+    std::cout << "  traced: " << ns[1] / carts << " ns/cart ("
+              << (ns[1] / ns[0] - 1.0) * 100.0 << "% overhead)" << std::endl;
+    std::cout << "  writing " << trace_path << ": " << write_ns / 1e6 << " ms"
+              << std::endl;
+    return 0;
+}
+
+/**
+ * Cost of one edit to carts of 10 to 10000 items: the client sending the
+ * whole cart again to /split, versus an edit document applied to a
+ * Cart_session holding the parsed cart, and the same edit as a JSON Patch
+ * answered with a patch of the results. Each edit moves one item to
+ * another roommate, so the cart stays valid.
+ */
+static int bench_sessions(int iterations)
+{
+    for (int count = 10; count <= 10000; count *= 10)
+    {
+        std::string json = make_unit_cart_json(count, 1, false);
+        int runs = std::max(10, iterations / count);
+        rapidjson::StringBuffer sb;
+        bench_clock::time_point start = bench_clock::now();
+        for (int i = 0; i < runs; i++)
+        {
+            sb.Clear();
+            if (split_json_buffer(json.data(), json.size(), Parse_options(),
+                                  sb) == false)
+                return 1;
+        }
+        double resend_ns = elapsed_ns(start) / runs;
+
+        Cart cart = Cart();
+        std::map<int, Roommate> roommates = {};
+        if (parse_json_buffer(&cart, &roommates, json.data(), json.size(),
+                              Parse_options()) == false)
+            return 1;
+        Cart_session session(std::move(cart), std::move(roommates));
+        std::vector<std::string> edits;
+        for (int i = 0; i < 64; i++)
+        {
+            edits.push_back("{\"edits\":[{\"op\":\"set_item\",\"item\":{\"id\":" +
+                            std::to_string(i * 7 % count) + ",\"item_name\":"
+                            "\"item\",\"cost\":1,\"share_cost\":0,"
+                            "\"splitting\":[" + std::to_string(i % 4) + "]}}]}");
+        }
+        runs = std::max(1000, iterations / 10);
+        start = bench_clock::now();
+        for (int i = 0; i < runs; i++)
+        {
+            const std::string &edit = edits[i % edits.size()];
+            if (apply_session_edits(edit.data(), edit.size(), Parse_options(),
+                                    &session) == false ||
+                session.update().ok() == false)
+                return 1;
+        }
+        double edit_ns = elapsed_ns(start) / runs;
+
+        //Two rounds over the same items, each moving them on from the last
+        std::vector<std::string> patches;
+        for (int i = 0; i < 128; i++)
+        {
+            patches.push_back("[{\"op\":\"replace\",\"path\":\"/cart/line_items/" +
+                              std::to_string(i % 64 * 7 % count) + "/splitting\","
+                              "\"value\":[" + std::to_string((i + i / 64 + 1) % 4) +
+                              "]}]");
+        }
+        if (session.update(true).ok() == false) return 1;
+        session.clear_changes();
+        size_t patch_bytes = 0;
+        size_t reply_bytes = 0;
+        start = bench_clock::now();
+        for (int i = 0; i < runs; i++)
+        {
+            const std::string &patch = patches[i % patches.size()];
+            sb.Clear();
+            if (session.apply_patch(patch.data(), patch.size(), Parse_options()) != 0 ||
+                session.update().ok() == false || session.serialize_changes(sb) == false)
+                return 1;
+            session.clear_changes();
+            patch_bytes += patch.size();
+            reply_bytes += sb.GetSize();
+        }
+        double patch_ns = elapsed_ns(start) / runs;
+
+        std::cout << "  " << count << " items: resend " << resend_ns
+                  << " ns, session edit " << edit_ns << " ns, patch " << patch_ns
+                  << " ns (" << patch_bytes / runs << " B in, " << reply_bytes / runs
+                  << " B out, " << session.get_memory() / 1024 << " KiB held)"
+                  << std::endl;
+    }
+    return 0;
+}
+
+/**
+ * Bytes and serialization time of a split result under each projection,
+ * for carts of 10 to 10000 items.
+ */
+static int bench_views(int iterations)
+{
+    const char *specs[] = {"full", "no_cart", "totals", "roommate:1",
+                           "/roommates/1/total"};
+    for (int count = 10; count <= 10000; count *= 10)
+    {
+        std::string json = make_unit_cart_json(count, 1, false);
+        Cart cart = Cart();
+        std::map<int, Roommate> roommates = {};
+        if (parse_json_buffer(&cart, &roommates, json.data(), json.size(),
+                              Parse_options()) == false ||
+            try_calculate_shares(&cart, &roommates).ok() == false)
+            return 1;
+
+        std::cout << "  " << count << " items:";
+        int runs = std::max(100, iterations / count);
+        for (const char *spec : specs)
+        {
+            Output_projection projection;
+            Output_projection::parse(spec, &projection);
+            rapidjson::StringBuffer sb;
+            bench_clock::time_point start = bench_clock::now();
+            for (int i = 0; i < runs; i++)
+            {
+                sb.Clear();
+                projection.serialize(cart, roommates, sb);
+            }
+            std::cout << " " << spec << " " << sb.GetSize() << " B "
+                      << elapsed_ns(start) / runs << " ns;";
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
+
+/**
+ * Allocations per stage of parse_json_data, calculate_shares and write_json
+ * on the larger fixture and on synthetic carts of 100 and 10000 items,
+ * with the peak of the heaviest request.
+ */
+static int bench_allocs(int iterations)
+{
+    std::string dir = std::filesystem::temp_directory_path().string();
+    std::vector<std::pair<std::string, std::string>> inputs;
+    inputs.emplace_back("larger_distributed", std::string(TEST_FILE_PREFIX) +
+                        "larger_distributed" + std::string(TEST_FILE_POSTFIX));
+    for (int count : {100, 10000})
+    {
+        std::string path = dir + "/split_bench_" + std::to_string(count) + "_input.json";
+        std::ofstream file(path);
+        file << make_unit_cart_json(count, 1, false);
+        inputs.emplace_back(std::to_string(count) + " items", path);
+    }
+
+    std::string output_path = dir + "/split_bench_output.json";
+    for (auto &input : inputs)
+    {
+        Cart probe = Cart();
+        std::map<int, Roommate> probe_roommates = {};
+        if (parse_json_data(&probe, &probe_roommates, input.second) == false) return 1;
+        int runs = std::max<int>(10, iterations / 100 /
+                                 std::max<size_t>(1, probe.get_line_items().size()));
+
+        Alloc_tracker tracker;
+        size_t request_peak = 0;
+        for (int i = 0; i < runs; i++)
+        {
+            Cart cart = Cart();
+            std::map<int, Roommate> roommates = {};
+            if (parse_json_data(&cart, &roommates, input.second) == false) return 1;
+            calculate_shares(&cart, &roommates);
+            write_json(cart, roommates, output_path);
+            tracker.end_request();
+            request_peak = std::max(request_peak, tracker.get_last_request().peak);
+        }
+        std::cout << input.first << ", per request over " << runs << " requests, peak "
+                  << request_peak << " B" << std::endl;
+        tracker.report(std::cout, runs);
+    }
+    for (size_t i = 1; i < inputs.size(); i++) std::remove(inputs[i].second.c_str());
+    std::remove(output_path.c_str());
+    return 0;
+}
+
+//Median and median absolute deviation of repeated measurements of a metric
+struct Gate_metric
+{
+    std::string unit;
+    double median = 0.0;
+    double mad = 0.0;
+    std::vector<double> samples;
+};
+
+static double median_of(std::vector<double> values)
+{
+    if (values.empty()) return 0.0;
+    std::sort(values.begin(), values.end());
+    size_t mid = values.size() / 2;
+    return values.size() % 2 ? values[mid] : (values[mid - 1] + values[mid]) / 2;
+}
+
+static void summarize(Gate_metric *metric)
+{
+    metric->median = median_of(metric->samples);
+    std::vector<double> deviations;
+    for (double sample : metric->samples)
+        deviations.push_back(std::fabs(sample - metric->median));
+    metric->mad = median_of(deviations);
+}
+
+/**
+ * One repetition over a cart: parses, validates, splits and serializes it
+ * runs times through a pooled Parse_context, the way split_batch and the
+ * server do, and adds the per-op stage times, allocations and carts/s.
+ */
+static bool gate_cart(const std::string &name, const std::string &json, int runs,
+                      std::map<std::string, Gate_metric> *metrics)
+{
+    const char *stages[] = {"parse", "validate", "calculate", "serialize"};
+    double stage_ns[4] = {0, 0, 0, 0};
+    Parse_context_pool::Lease context = Parse_context_pool::acquire();
+    rapidjson::StringBuffer sb;
+    //Warms the pooled buffers, the recycled nodes, the kernels' scratch and
+    //the output buffer, so the runs measure steady state
+    for (int i = 0; i < 2; i++)
+    {
+        if (context->parse(json.data(), json.size(), Parse_options()) == false ||
+            try_calculate_shares(&context->get_cart(),
+                                 &context->get_roommates()).ok() == false)
+            return false;
+        sb.Clear();
+        serialize_json(context->get_cart(), context->get_roommates(), sb);
+    }
+
+    Alloc_tracker tracker;
+    bench_clock::time_point start = bench_clock::now();
+    for (int i = 0; i < runs; i++)
+    {
+        bench_clock::time_point t0 = bench_clock::now();
+        if (context->parse(json.data(), json.size(), Parse_options()) == false)
+            return false;
+        bench_clock::time_point t1 = bench_clock::now();
+        if (try_validate_input(&context->get_cart(), &context->get_roommates()).ok() == false)
+            return false;
+        bench_clock::time_point t2 = bench_clock::now();
+        if (try_calculate_shares(&context->get_cart(), &context->get_roommates()).ok() == false)
+            return false;
+        bench_clock::time_point t3 = bench_clock::now();
+        sb.Clear();
+        serialize_json(context->get_cart(), context->get_roommates(), sb);
+        bench_clock::time_point t4 = bench_clock::now();
+        stage_ns[0] += std::chrono::duration<double, std::nano>(t1 - t0).count();
+        stage_ns[1] += std::chrono::duration<double, std::nano>(t2 - t1).count();
+        stage_ns[2] += std::chrono::duration<double, std::nano>(t3 - t2).count();
+        stage_ns[3] += std::chrono::duration<double, std::nano>(t4 - t3).count();
+    }
+    double total_ns = elapsed_ns(start);
+    size_t allocations = tracker.get_total().count;
+
+    for (int i = 0; i < 4; i++)
+    {
+        Gate_metric &metric = (*metrics)[name + "/" + stages[i]];
+        metric.unit = "ns/op";
+        metric.samples.push_back(stage_ns[i] / runs);
+    }
+    Gate_metric &alloc = (*metrics)[name + "/allocations"];
+    alloc.unit = "allocs/op";
+    alloc.samples.push_back(static_cast<double>(allocations) / runs);
+    Gate_metric &throughput = (*metrics)[name + "/throughput"];
+    throughput.unit = "carts/s";
+    throughput.samples.push_back(runs * 1e9 / total_ns);
+    return true;
+}
+
+static int write_gate_results(const std::string &path, int repeat,
+                              const std::map<std::string, Gate_metric> &metrics)
+{
+    rapidjson::StringBuffer sb;
+    rapidjson::PrettyWriter<rapidjson::StringBuffer> writer(sb);
+    writer.StartObject();
+    writer.Key("repeat");
+    writer.Int(repeat);
+    writer.Key("metrics");
+    writer.StartObject();
+    for (auto &entry : metrics)
+    {
+        writer.Key(entry.first.c_str());
+        writer.StartObject();
+        writer.Key("unit");
+        writer.String(entry.second.unit.c_str());
+        writer.Key("median");
+        writer.Double(entry.second.median);
+        writer.Key("mad");
+        writer.Double(entry.second.mad);
+        writer.EndObject();
+    }
+    writer.EndObject();
+    writer.EndObject();
+
+    std::ofstream file(path);
+    file << sb.GetString() << std::endl;
+    return file.good() ? 0 : 1;
+}
+
+static bool read_gate_results(const std::string &path,
+                              std::map<std::string, Gate_metric> *metrics)
+{
+    std::string text;
+    if (read_whole_file(path, &text) != 0) return false;
+    rapidjson::Document document;
+    document.Parse(text.data(), text.size());
+    if (document.HasParseError() || document.IsObject() == false ||
+        document.HasMember("metrics") == false || document["metrics"].IsObject() == false)
+        return false;
+    for (auto &member : document["metrics"].GetObject())
+    {
+        const rapidjson::Value &value = member.value;
+        if (value.IsObject() == false || value.HasMember("median") == false ||
+            value["median"].IsNumber() == false || value.HasMember("mad") == false ||
+            value["mad"].IsNumber() == false || value.HasMember("unit") == false ||
+            value["unit"].IsString() == false)
+            return false;
+        Gate_metric &metric = (*metrics)[member.name.GetString()];
+        metric.unit = value["unit"].GetString();
+        metric.median = value["median"].GetDouble();
+        metric.mad = value["mad"].GetDouble();
+    }
+    return true;
+}
+
+/**
+ * A timed metric regressed when its median moved the wrong way by more
+ * than threshold (a fraction of the baseline median) and by more than three
+ * scaled MADs of either run, so noisy metrics need a larger move.
+ */
+static bool regressed(const Gate_metric &base, const Gate_metric &current,
+                      double threshold)
+{
+    //Scales a MAD to the standard deviation of normally distributed noise
+    const double MAD_SCALE = 1.4826;
+    double change = current.median - base.median;
+    //Allocations are counted, not timed, half a new one per op is a change
+    if (base.unit == "allocs/op") return change >= 0.5;
+    if (base.unit == "carts/s") change = -change;
+    double noise = 3 * MAD_SCALE * std::max(base.mad, current.mad);
+    return change > threshold * base.median && change > noise;
+}
+
+static void gate_usage()
+{
+    std::cout << "usage: split_bench gate [options]" << std::endl;
+    std::cout << "  --repeat N       repetitions per metric (default: 7)" << std::endl;
+    std::cout << "  --iterations N   item-weighted work per repetition (default: 200000)"
+              << std::endl;
+    std::cout << "  --save FILE      write the results as JSON" << std::endl;
+    std::cout << "  --baseline FILE  compare against results saved earlier" << std::endl;
+    std::cout << "  --threshold PCT  allowed slowdown of a median (default: 10)"
+              << std::endl;
+}
+
+/**
+ * Per-stage ns/op, allocations/op and carts/s on the Tests/Input fixtures
+ * and synthetic 100 and 10000 item carts, each the median of --repeat runs.
+ * With --baseline it exits 1 if any metric regressed, so it can gate a
+ * change: save a baseline on the old tree, then compare the new one to it.
+ */
+static int bench_gate(int argc, char **argv)
+{
+    int repeat = 7;
+    int iterations = 200000;
+    double threshold = 0.10;
+    std::string save_path;
+    std::string baseline_path;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+            repeat = std::max(1, std::stoi(argv[++i]));
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+            iterations = std::max(1, std::stoi(argv[++i]));
+        else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc)
+            save_path = argv[++i];
+        else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+            baseline_path = argv[++i];
+        else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+            threshold = std::stod(argv[++i]) / 100;
+        else
+        {
+            gate_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::map<std::string, Gate_metric> baseline;
+    if (baseline_path.empty() == false && read_gate_results(baseline_path, &baseline) == false)
+    {
+        std::cerr << "split_bench: " << baseline_path << ": not a saved gate result"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    //(metric prefix, input JSON, line items)
+    std::vector<std::tuple<std::string, std::string, size_t>> carts;
+    const std::string postfix = TEST_FILE_POSTFIX;
+    std::vector<std::filesystem::path> fixtures;
+    for (auto &entry : std::filesystem::directory_iterator(TEST_FILE_PREFIX))
+        fixtures.push_back(entry.path());
+    std::sort(fixtures.begin(), fixtures.end());
+    for (auto &path : fixtures)
+    {
+        std::string file_name = path.filename().string();
+        if (file_name.size() <= postfix.size() ||
+            file_name.compare(file_name.size() - postfix.size(), postfix.size(), postfix) != 0)
+            continue;
+        std::string json;
+        if (read_whole_file(path.string(), &json) != 0) return 1;
+        Cart cart = Cart();
+        std::map<int, Roommate> roommates = {};
+        if (parse_json_buffer(&cart, &roommates, json.data(), json.size(),
+                              Parse_options()) == false)
+            return 1;
+        carts.emplace_back("fixture/" + file_name.substr(0, file_name.size() - postfix.size()),
+                           json, std::max<size_t>(1, cart.get_line_items().size()));
+    }
+    for (int count : {100, 10000})
+        carts.emplace_back("synthetic/" + std::to_string(count) + "_items",
+                           make_unit_cart_json(count, 1, false), count);
+
+    //Repetitions interleave the carts, so slow drift hits all of them alike
+    std::map<std::string, Gate_metric> metrics;
+    for (int r = 0; r < repeat; r++)
+        for (auto &cart : carts)
+        {
+            int runs = std::max<int>(10, iterations / std::get<2>(cart));
+            if (gate_cart(std::get<0>(cart), std::get<1>(cart), runs, &metrics) == false)
+            {
+                std::cerr << "split_bench: " << std::get<0>(cart) << " did not split"
+                          << std::endl;
+                return 1;
+            }
+        }
+
+    size_t regressions = 0;
+    for (auto &entry : metrics)
+    {
+        Gate_metric &metric = entry.second;
+        summarize(&metric);
+        printf("  %-44s %12.1f %-9s +- %.1f", entry.first.c_str(), metric.median,
+               metric.unit.c_str(), metric.mad);
+        auto base = baseline.find(entry.first);
+        if (base != baseline.end())
+        {
+            bool worse = regressed(base->second, metric, threshold);
+            if (worse) regressions++;
+            double change = base->second.median == 0.0 ? 0.0 :
+                            (metric.median / base->second.median - 1) * 100;
+            printf("  %+6.1f%%%s", change, worse ? "  REGRESSION" : "");
+        }
+        printf("\n");
+    }
+
+    if (save_path.empty() == false && write_gate_results(save_path, repeat, metrics) != 0)
+    {
+        std::cerr << "split_bench: could not write " << save_path << std::endl;
+        return 1;
+    }
+    if (baseline_path.empty() == false)
+        std::cout << regressions << " of " << metrics.size()
+                  << " metrics regressed beyond " << threshold * 100 << "%" << std::endl;
+    return regressions == 0 ? 0 : 1;
+}
+
+static void usage()
+{
+    std::cout << "usage: split_bench <mode> [iterations]" << std::endl;
+    std::cout << "  errors   invalid input rejection, exceptions vs status codes"
+              << std::endl;
+    std::cout << "  weighted per-unit items vs quantity and weights" << std::endl;
+    std::cout << "  settle   settlement transfers for 10 to 1M roommates"
+              << std::endl;
+    std::cout << "  ledger   ledger appends, balance queries and index rebuild"
+              << std::endl;
+    std::cout << "  shm      shared-memory ring vs unix socket round trips"
+              << std::endl;
+    std::cout << "  kernels  fixed size split kernels vs the generic path"
+              << std::endl;
+    std::cout << "  trace    split throughput with and without tracing"
+              << std::endl;
+    std::cout << "  sessions cart edits through a session vs resending the cart"
+              << std::endl;
+    std::cout << "  views    result size and serialization time per projection"
+              << std::endl;
+    std::cout << "  allocs   heap and rapidjson allocations per split stage" << std::endl;
+    std::cout << "  gate     stage timings saved as JSON and compared to a baseline,"
+              << std::endl;
+    std::cout << "           run split_bench gate --help for its options" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+    if (strcmp(argv[1], "gate") == 0) return bench_gate(argc, argv);
+    int iterations = (argc > 2) ? std::stoi(argv[2]) : 1000000;
+
+    if (strcmp(argv[1], "errors") == 0) return bench_errors(iterations);
+    if (strcmp(argv[1], "weighted") == 0) return bench_weighted(iterations);
+    if (strcmp(argv[1], "settle") == 0) return bench_settle(iterations);
+    if (strcmp(argv[1], "ledger") == 0) return bench_ledger(iterations);
+    if (strcmp(argv[1], "shm") == 0) return bench_shm(iterations);
+    if (strcmp(argv[1], "kernels") == 0) return bench_kernels(iterations);
+    if (strcmp(argv[1], "trace") == 0) return bench_trace(iterations);
+    if (strcmp(argv[1], "sessions") == 0) return bench_sessions(iterations);
+    if (strcmp(argv[1], "views") == 0) return bench_views(iterations);
+    if (strcmp(argv[1], "allocs") == 0) return bench_allocs(iterations);
+
+    usage();
+    return EXIT_FAILURE;
+}
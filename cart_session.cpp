@@ -0,0 +1,1029 @@
+#include "include/cart_session.h"
+#include "include/trace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include <sys/random.h>
+
+#include "include/json_patch.h"
+#include "include/rapidjson/document.h"
+#include "include/rapidjson/pointer.h"
+
+//Estimated size of a std::map node besides its value: three links and a color
+static const size_t MAP_NODE_BYTES = 32;
+
+static size_t string_bytes(const std::string &text)
+{
+    //Short strings live inside the object
+    return text.capacity() > 15 ? text.capacity() + 1 : 0;
+}
+
+static size_t id_set_bytes(const Id_set &ids)
+{
+    return ids.size() > Id_set::INLINE_CAPACITY ? ids.size() * sizeof(int) : 0;
+}
+
+//An item in the cart, plus its id in the results of every roommate
+//splitting it
+static size_t line_item_bytes(const Line_item &item)
+{
+    size_t splitting = item.get_splitting().size();
+    size_t bytes = MAP_NODE_BYTES + sizeof(std::pair<const int, Line_item>) +
+                   string_bytes(item.get_name()) +
+                   id_set_bytes(item.get_splitting()) + splitting * sizeof(int);
+    if (item.is_weighted()) bytes += splitting * sizeof(std::pair<int, int>);
+    return bytes;
+}
+
+//A roommate as given and in the results, plus its pre-tax sums
+static size_t roommate_bytes(const Roommate &rm)
+{
+    size_t copy = MAP_NODE_BYTES + sizeof(std::pair<const int, Roommate>) +
+                  string_bytes(rm.get_name()) + id_set_bytes(rm.get_items());
+    return 2 * copy + 2 * MAP_NODE_BYTES + sizeof(std::pair<const int, double>) +
+           sizeof(std::pair<const int, long long>);
+}
+
+//Shares of an item's cost in integer units, in splitting order, as
+//try_calculate_shares apportions them. False when they can not be made
+static bool item_share_units(const Line_item &item, std::vector<long long> *parts)
+{
+    static thread_local std::vector<long long> weights;
+    weights.clear();
+    for (int rm_id : item.get_splitting()) weights.push_back(item.get_weight(rm_id));
+    parts->resize(weights.size());
+    return apportion_units(item.get_cost_units().units, weights.data(),
+                           weights.size(), parts->data());
+}
+
+//Copies total and tax, as exact amounts when they are
+static void copy_cart_totals(const Cart &from, Cart *to)
+{
+    if (from.get_total_units().is_exact()) to->set_total(from.get_total_units());
+    else to->set_total(from.get_total());
+    if (from.get_tax_units().is_exact()) to->set_tax(from.get_tax_units());
+    else to->set_tax(from.get_tax());
+}
+
+//Cart_session Implementation
+Cart_session::Cart_session(Cart &&cart, std::map<int, Roommate> &&roommates) :
+    cart(std::move(cart)), roommates(std::move(roommates))
+{
+    rebuild();
+}
+
+void Cart_session::set_line_item(Line_item &&item)
+{
+    document.reset();
+    put_line_item(std::move(item));
+}
+
+bool Cart_session::remove_line_item(int id)
+{
+    document.reset();
+    return erase_line_item(id);
+}
+
+void Cart_session::set_cart_totals(double total, double tax)
+{
+    document.reset();
+    cart.set_total(total);
+    cart.set_tax(tax);
+    check_money_scale();
+}
+
+void Cart_session::set_cart_totals(Money_units total, Money_units tax)
+{
+    document.reset();
+    cart.set_total(total);
+    cart.set_tax(tax);
+    check_money_scale();
+}
+
+void Cart_session::check_money_scale()
+{
+    if (cart.get_total_units().scale != money_scale ||
+        cart.get_tax_units().scale != money_scale)
+        stale = true;
+}
+
+void Cart_session::set_roommate(Roommate &&roommate)
+{
+    document.reset();
+    int id = roommate.get_id();
+    auto old = roommates.find(id);
+    if (old != roommates.end())
+    {
+        memory -= roommate_bytes(old->second);
+        roommates.erase(old);
+    }
+    memory += roommate_bytes(roommate);
+    roommates.emplace(id, std::move(roommate));
+    stale = true;
+    roommates_changed = true;
+}
+
+bool Cart_session::remove_roommate(int id)
+{
+    auto old = roommates.find(id);
+    if (old == roommates.end()) return false;
+    document.reset();
+    memory -= roommate_bytes(old->second);
+    roommates.erase(old);
+    stale = true;
+    roommates_changed = true;
+    return true;
+}
+
+void Cart_session::put_line_item(Line_item &&item)
+{
+    int id = item.get_id();
+    auto &items = cart.get_line_items();
+    auto old = items.find(id);
+    if (old != items.end())
+    {
+        if (stale == false) remove_contribution(old->second);
+        memory -= line_item_bytes(old->second);
+        cart.remove_line_item(old->second);
+    }
+    memory += line_item_bytes(item);
+    cart.add_line_item(std::move(item));
+    if (stale == false) add_contribution(items.find(id)->second);
+    edits++;
+}
+
+bool Cart_session::erase_line_item(int id)
+{
+    auto &items = cart.get_line_items();
+    auto old = items.find(id);
+    if (old == items.end()) return false;
+    if (stale == false) remove_contribution(old->second);
+    memory -= line_item_bytes(old->second);
+    cart.remove_line_item(old->second);
+    edits++;
+    return true;
+}
+
+void Cart_session::put_roommates(std::map<int, Roommate> &&replacement)
+{
+    for (auto &rm : roommates) memory -= roommate_bytes(rm.second);
+    roommates = std::move(replacement);
+    for (auto &rm : roommates) memory += roommate_bytes(rm.second);
+    stale = true;
+    roommates_changed = true;
+}
+
+size_t Cart_session::get_memory() const
+{
+    size_t bytes = memory + reported_totals.size() *
+        (MAP_NODE_BYTES + sizeof(std::pair<const int, std::pair<double, double>>));
+    if (document != nullptr)
+        bytes += sizeof(rapidjson::Document) + document->GetAllocator().Capacity();
+    return bytes;
+}
+
+Split_status Cart_session::update(bool exact)
+{
+    Trace_span span("calculate");
+    span.set_items(cart.get_line_items().size());
+    if (stale || edits >= REBUILD_EDITS || (exact && edits > 0)) rebuild();
+    Split_status status = finish();
+    //A failed check on adjusted sums may be rounding, only fresh ones decide
+    bool rounding = status.code == Split_error::cost_mismatch ||
+                    status.code == Split_error::total_mismatch;
+    if (rounding == false || edits == 0) return status;
+    rebuild();
+    return finish();
+}
+
+/**
+ * Recomputes the sums from the current input, adding shares in the order
+ * try_calculate_shares_generic does, so the results match it bit for bit.
+ */
+void Cart_session::rebuild()
+{
+    tracking = false;
+    results.clear();
+    pre_tax.clear();
+    pre_tax_units.clear();
+    money_scale = exact_money_scale(cart, roommates);
+    memory = sizeof(Cart_session);
+    for (auto &rm : roommates)
+    {
+        results.emplace(rm.first, rm.second);
+        pre_tax.emplace(rm.first, rm.second.get_total());
+        if (money_scale >= 0)
+            pre_tax_units.emplace(rm.first, rm.second.get_total_units().units);
+        memory += roommate_bytes(rm.second);
+    }
+
+    cost_sum = 0.0;
+    share_sum = 0.0;
+    cost_units_sum = 0;
+    share_units_sum = 0;
+    invalid_items.clear();
+    unknown_items.clear();
+    for (auto &item : cart.get_line_items())
+    {
+        add_contribution(item.second);
+        memory += line_item_bytes(item.second);
+    }
+    stale = false;
+    edits = 0;
+    rebuild_count++;
+    tracking = true;
+}
+
+void Cart_session::add_contribution(const Line_item &item)
+{
+    cost_sum += item.get_cost();
+    cost_units_sum += item.get_cost_units().units;
+    if (money_scale >= 0 && item.get_cost_units().scale != money_scale) stale = true;
+    Split_status status = try_validate_line_item(item);
+    if (status.ok() == false)
+    {
+        invalid_items.emplace(item.get_id(), status);
+        return;
+    }
+    for (int rm_id : item.get_splitting())
+    {
+        if (results.count(rm_id) == 0)
+        {
+            unknown_items.insert(item.get_id());
+            return;
+        }
+    }
+
+    long long weight_sum = 0;
+    if (item.is_weighted())
+    {
+        for (int rm_id : item.get_splitting()) weight_sum += item.get_weight(rm_id);
+    }
+    static thread_local std::vector<long long> parts;
+    bool exact = money_scale >= 0 && item_share_units(item, &parts);
+    const long long *part = parts.data();
+    double even_share = item.get_cost() / item.get_splitting().size();
+    for (int rm_id : item.get_splitting())
+    {
+        double share = item.is_weighted() ?
+            item.get_cost() * item.get_weight(rm_id) / weight_sum : even_share;
+        Roommate &rm = results.find(rm_id)->second;
+        if (tracking && rm.get_items().count(item.get_id()) == 0)
+            track_item(rm_id, item.get_id(), 1);
+        rm.add_line_item(item.get_id());
+        pre_tax[rm_id] += share;
+        share_sum += share;
+        if (exact)
+        {
+            pre_tax_units[rm_id] += *part;
+            share_units_sum += *part++;
+        }
+    }
+}
+
+void Cart_session::remove_contribution(const Line_item &item)
+{
+    cost_sum -= item.get_cost();
+    cost_units_sum -= item.get_cost_units().units;
+    if (invalid_items.erase(item.get_id()) || unknown_items.erase(item.get_id()))
+        return;
+
+    long long weight_sum = 0;
+    if (item.is_weighted())
+    {
+        for (int rm_id : item.get_splitting()) weight_sum += item.get_weight(rm_id);
+    }
+    static thread_local std::vector<long long> parts;
+    bool exact = money_scale >= 0 && item_share_units(item, &parts);
+    const long long *part = parts.data();
+    double even_share = item.get_cost() / item.get_splitting().size();
+    for (int rm_id : item.get_splitting())
+    {
+        double share = item.is_weighted() ?
+            item.get_cost() * item.get_weight(rm_id) / weight_sum : even_share;
+        //Items the roommate was given in the input stay in its results
+        if (roommates.find(rm_id)->second.get_items().count(item.get_id()) == 0)
+        {
+            results.find(rm_id)->second.remove_line_item(item.get_id());
+            if (tracking) track_item(rm_id, item.get_id(), -1);
+        }
+        pre_tax[rm_id] -= share;
+        share_sum -= share;
+        if (exact)
+        {
+            pre_tax_units[rm_id] -= *part;
+            share_units_sum -= *part++;
+        }
+    }
+}
+
+//The checks of try_validate_input and try_calculate_shares in their order,
+//then the tax shares
+Split_status Cart_session::finish()
+{
+    if (money_scale >= 0) return finish_exact();
+    const double epsilon = std::numeric_limits<double>::epsilon();
+    if (cart.get_line_items().empty())
+        return Split_status{Split_error::no_line_items};
+    if (cart.get_total() <= 0.0)
+        return Split_status{Split_error::non_positive_total};
+    if (cart.get_tax() < 0)
+        return Split_status{Split_error::negative_tax};
+    if (invalid_items.empty() == false) return invalid_items.begin()->second;
+    if (approximately_equal(cost_sum + cart.get_tax(), cart.get_total(),
+                            epsilon) == false)
+        return Split_status{Split_error::cost_mismatch};
+    if (unknown_items.empty() == false)
+        return Split_status{Split_error::unknown_roommate, *unknown_items.begin()};
+
+    double total_check = share_sum;
+    double pre_tax_total = cart.get_total() - cart.get_tax();
+    for (auto &rm_pair : results)
+    {
+        double base = pre_tax.find(rm_pair.first)->second;
+        double tax_share = (base / pre_tax_total) * cart.get_tax();
+        rm_pair.second.set_tax_share(tax_share);
+        rm_pair.second.set_total(base + tax_share);
+        total_check += tax_share;
+    }
+    if (approximately_equal(total_check, cart.get_total(), epsilon) == false)
+        return Split_status{Split_error::total_mismatch};
+    return Split_status();
+}
+
+//finish() over the integer sums, apportioning the tax as
+//try_calculate_shares does for exact amounts
+Split_status Cart_session::finish_exact()
+{
+    if (cart.get_line_items().empty())
+        return Split_status{Split_error::no_line_items};
+    if (cart.get_total() <= 0.0)
+        return Split_status{Split_error::non_positive_total};
+    if (cart.get_tax() < 0)
+        return Split_status{Split_error::negative_tax};
+    if (invalid_items.empty() == false) return invalid_items.begin()->second;
+    if (cost_units_sum + cart.get_tax_units().units != cart.get_total_units().units)
+        return Split_status{Split_error::cost_mismatch};
+    if (unknown_items.empty() == false)
+        return Split_status{Split_error::unknown_roommate, *unknown_items.begin()};
+
+    static thread_local std::vector<long long> weights;
+    static thread_local std::vector<long long> parts;
+    weights.clear();
+    for (auto &rm_pair : results) weights.push_back(pre_tax_units.find(rm_pair.first)->second);
+    parts.resize(weights.size());
+    if (apportion_units(cart.get_tax_units().units, weights.data(), weights.size(),
+                        parts.data()) == false)
+        return Split_status{Split_error::total_mismatch};
+
+    long long total_check = share_units_sum;
+    const long long *weight = weights.data();
+    const long long *part = parts.data();
+    for (auto &rm_pair : results)
+    {
+        rm_pair.second.set_tax_share(Money_units{*part, money_scale});
+        rm_pair.second.set_total(Money_units{*weight++ + *part, money_scale});
+        total_check += *part++;
+    }
+    if (total_check != cart.get_total_units().units)
+        return Split_status{Split_error::total_mismatch};
+    return Split_status();
+}
+
+enum class Edit_op {set_item, remove_item, set_cart, set_roommate, remove_roommate};
+
+//One parsed edit, applied once the whole document has been read
+struct Session_edit
+{
+    Session_edit(Edit_op op, int id) : op(op), id(id), roommate(id, "") {}
+
+    Edit_op op;
+    int id;
+    Line_item item;
+    Roommate roommate;
+    Cart cart;
+};
+
+static bool read_edit_int(const rapidjson::Value &val,
+                          const Parse_options &options, int *out)
+{
+    if (options.exact_decimal == false)
+    {
+        if (val.IsInt() == false) return false;
+        *out = val.GetInt();
+        return true;
+    }
+    long long value = 0;
+    if (val.IsString() == false ||
+        parse_decimal_units(val.GetString(), val.GetStringLength(), 0,
+                            &value) == false ||
+        value < std::numeric_limits<int>::min() ||
+        value > std::numeric_limits<int>::max())
+        return false;
+    *out = static_cast<int>(value);
+    return true;
+}
+
+//Every edit is read, and the json_read_* functions check its shape, before
+//any is applied, so a malformed one is refused rather than half applied
+static bool read_session_edit(const rapidjson::Value &json,
+                              const Parse_options &options,
+                              std::vector<Session_edit> *edits)
+{
+    if (json.IsObject() == false || json.HasMember("op") == false ||
+        json["op"].IsString() == false)
+        return false;
+    std::string op = json["op"].GetString();
+    int id = 0;
+
+    if (op == "set_item")
+    {
+        if (json.HasMember("item") == false) return false;
+        edits->emplace_back(Edit_op::set_item, 0);
+        return json_read_line_item(json["item"], options, &edits->back().item);
+    }
+    if (op == "set_cart")
+    {
+        edits->emplace_back(Edit_op::set_cart, 0);
+        return json_read_cart_totals(json, options, &edits->back().cart);
+    }
+
+    if (json.HasMember("id") == false ||
+        read_edit_int(json["id"], options, &id) == false)
+        return false;
+    if (op == "remove_item")
+        edits->emplace_back(Edit_op::remove_item, id);
+    else if (op == "remove_roommate")
+        edits->emplace_back(Edit_op::remove_roommate, id);
+    else if (op == "set_roommate")
+    {
+        if (json.HasMember("roommate") == false) return false;
+        edits->emplace_back(Edit_op::set_roommate, id);
+        return json_read_roommate(json["roommate"], options, &edits->back().roommate);
+    }
+    else
+        return false;
+    return true;
+}
+
+bool apply_session_edits(const char *data, size_t length,
+                         const Parse_options &options, Cart_session *session)
+{
+    std::vector<Session_edit> edits;
+    {
+        Trace_span span("parse");
+        rapidjson::Document document;
+        if (options.exact_decimal)
+            document.Parse<INPUT_DECIMAL_PARSE_FLAGS>(data, length);
+        else
+            document.Parse<INPUT_PARSE_FLAGS>(data, length);
+        if (document.HasParseError() || document.IsObject() == false ||
+            document.HasMember("edits") == false ||
+            document["edits"].IsArray() == false)
+            return false;
+        for (auto &json : document["edits"].GetArray())
+        {
+            if (read_session_edit(json, options, &edits) == false) return false;
+        }
+        span.set_items(edits.size());
+    }
+
+    for (auto &edit : edits)
+    {
+        switch (edit.op)
+        {
+            case Edit_op::set_item:
+                session->set_line_item(std::move(edit.item));
+                break;
+            case Edit_op::remove_item:
+                session->remove_line_item(edit.id);
+                break;
+            case Edit_op::set_cart:
+                if (edit.cart.get_total_units().is_exact())
+                    session->set_cart_totals(edit.cart.get_total_units(),
+                                             edit.cart.get_tax_units());
+                else
+                    session->set_cart_totals(edit.cart.get_total(), edit.cart.get_tax());
+                break;
+            case Edit_op::set_roommate:
+                session->set_roommate(std::move(edit.roommate));
+                break;
+            case Edit_op::remove_roommate:
+                session->remove_roommate(edit.id);
+                break;
+        }
+    }
+    return true;
+}
+
+void Cart_session::track_item(int rm_id, int item_id, int change)
+{
+    auto key = std::make_pair(rm_id, item_id);
+    int &net = item_changes[key];
+    net += change;
+    if (net == 0) item_changes.erase(key);
+}
+
+void Cart_session::clear_changes()
+{
+    item_changes.clear();
+    roommates_changed = false;
+    reported_totals.clear();
+    for (auto &rm_pair : results)
+    {
+        reported_totals.emplace(rm_pair.first,
+                                std::make_pair(rm_pair.second.get_total(),
+                                               rm_pair.second.get_tax_share()));
+    }
+    reported = true;
+}
+
+//Opens one operation object, the caller adds its value and closes it
+static void write_patch_op(rapidjson::Writer<rapidjson::StringBuffer> &writer,
+                           const char *op, const std::string &path)
+{
+    writer.StartObject();
+    writer.Key("op");
+    writer.String(op);
+    writer.Key("path");
+    writer.String(path.c_str(), path.size());
+}
+
+bool Cart_session::serialize_changes(rapidjson::StringBuffer &sb) const
+{
+    if (reported == false) return false;
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+    writer.StartArray();
+    if (roommates_changed || reported_totals.size() != results.size())
+    {
+        write_patch_op(writer, "replace", "/roommates");
+        writer.Key("value");
+        writer.StartArray();
+        for (auto &rm_pair : results) rm_pair.second.json_serialize(writer);
+        writer.EndArray();
+        writer.EndObject();
+        writer.EndArray();
+        return true;
+    }
+
+    auto change = item_changes.begin();
+    size_t index = 0;
+    std::vector<int> added;
+    std::vector<int> removed;
+    for (auto &rm_pair : results)
+    {
+        const Roommate &rm = rm_pair.second;
+        std::string prefix = "/roommates/" + std::to_string(index++);
+        added.clear();
+        removed.clear();
+        for (; change != item_changes.end() && change->first.first == rm_pair.first;
+             change++)
+        {
+            if (change->second > 0) added.push_back(change->first.second);
+            else removed.push_back(change->first.second);
+        }
+
+        //Removals run from the highest id down and additions up, so each
+        //index counts the smaller ids the array holds at that point
+        for (auto id = removed.rbegin(); id != removed.rend(); id++)
+        {
+            size_t at = rm.get_items().rank(*id) -
+                (std::lower_bound(added.begin(), added.end(), *id) - added.begin()) +
+                (removed.rend() - id - 1);
+            write_patch_op(writer, "remove", prefix + "/items/" + std::to_string(at));
+            writer.EndObject();
+        }
+        for (int id : added)
+        {
+            write_patch_op(writer, "add", prefix + "/items/" +
+                           std::to_string(rm.get_items().rank(id)));
+            writer.Key("value");
+            writer.Int(id);
+            writer.EndObject();
+        }
+
+        const std::pair<double, double> &old = reported_totals.find(rm_pair.first)->second;
+        if (rm.get_total() != old.first)
+        {
+            write_patch_op(writer, "replace", prefix + "/total");
+            writer.Key("value");
+            writer.Double(rm.get_total());
+            writer.EndObject();
+        }
+        if (rm.get_tax_share() != old.second)
+        {
+            write_patch_op(writer, "replace", prefix + "/tax_share");
+            writer.Key("value");
+            writer.Double(rm.get_tax_share());
+            writer.EndObject();
+        }
+    }
+    writer.EndArray();
+    return true;
+}
+
+void Cart_session::materialize(const Parse_options &options)
+{
+    rapidjson::StringBuffer sb;
+    serialize_json(cart, roommates, sb);
+    document.reset(new rapidjson::Document());
+    if (options.exact_decimal)
+        document->Parse<rapidjson::kParseNumbersAsStringsFlag>(sb.GetString(),
+                                                               sb.GetSize());
+    else
+        document->Parse(sb.GetString(), sb.GetSize());
+    document_capacity = document->GetAllocator().Capacity();
+}
+
+//The part of the input a patch pointer addresses
+enum class Patch_target {input, roommates, totals, line_item, other};
+
+static bool token_is(const rapidjson::Pointer::Token &token, const char *name)
+{
+    return token.length == strlen(name) && memcmp(token.name, name, token.length) == 0;
+}
+
+//*index is set for line items, to kPointerInvalidIndex for "-"
+static Patch_target classify_pointer(const rapidjson::Pointer &pointer,
+                                     rapidjson::SizeType *index)
+{
+    size_t count = pointer.GetTokenCount();
+    const rapidjson::Pointer::Token *tokens = pointer.GetTokens();
+    if (count == 0) return Patch_target::input;
+    if (token_is(tokens[0], "roommates")) return Patch_target::roommates;
+    if (token_is(tokens[0], "cart") == false) return Patch_target::other;
+    if (count == 1) return Patch_target::input;
+    if (token_is(tokens[1], "total") || token_is(tokens[1], "tax"))
+        return Patch_target::totals;
+    if (token_is(tokens[1], "line_items") == false) return Patch_target::other;
+    if (count == 2) return Patch_target::input;
+    *index = tokens[2].index;
+    return Patch_target::line_item;
+}
+
+//Checks the shape of an operation, Json_patcher decides whether it applies
+static bool is_patch_op(const rapidjson::Value &json)
+{
+    if (json.IsObject() == false || json.HasMember("op") == false ||
+        json["op"].IsString() == false || json.HasMember("path") == false ||
+        json["path"].IsString() == false)
+        return false;
+    std::string op = json["op"].GetString();
+    if (op == "add" || op == "replace" || op == "test")
+        return json.HasMember("value");
+    if (op == "move" || op == "copy")
+        return json.HasMember("from") && json["from"].IsString();
+    return op == "remove";
+}
+
+static rapidjson::Value *find_line_items(rapidjson::Document &document)
+{
+    if (document.IsObject() == false) return nullptr;
+    auto cart = document.FindMember("cart");
+    if (cart == document.MemberEnd() || cart->value.IsObject() == false)
+        return nullptr;
+    auto items = cart->value.FindMember("line_items");
+    if (items == cart->value.MemberEnd() || items->value.IsArray() == false)
+        return nullptr;
+    return &items->value;
+}
+
+//Reads the patched input as read_json_data would, checking its shape. A
+//line item id given twice is refused, the session holds one item per id
+static bool read_patched_input(const rapidjson::Document &document,
+                               const Parse_options &options, bool with_cart,
+                               Cart *cart, std::map<int, Roommate> *roommates)
+{
+    if (document.IsObject() == false || document.HasMember("roommates") == false ||
+        document["roommates"].IsArray() == false)
+        return false;
+    for (auto &json_rm : document["roommates"].GetArray())
+    {
+        Roommate rm(roommates->size(), "");
+        if (json_read_roommate(json_rm, options, &rm) == false)
+            return false;
+        roommates->emplace(rm.get_id(), std::move(rm));
+    }
+    if (with_cart == false) return true;
+
+    if (document.HasMember("cart") == false) return false;
+    const rapidjson::Value &json_cart = document["cart"];
+    if (json_cart.IsObject() == false || json_cart.HasMember("line_items") == false ||
+        json_cart["line_items"].IsArray() == false ||
+        json_read_cart_totals(json_cart, options, cart) == false)
+        return false;
+    for (auto &json_li : json_cart["line_items"].GetArray())
+    {
+        Line_item item;
+        if (json_read_line_item(json_li, options, &item) == false)
+            return false;
+        cart->add_line_item(std::move(item));
+    }
+    return cart->get_line_items().size() == json_cart["line_items"].Size();
+}
+
+//Id of the line item at index, false if there is none
+static bool patched_item_id(rapidjson::Document &document, rapidjson::SizeType index,
+                            const Parse_options &options, int *id)
+{
+    rapidjson::Value *items = find_line_items(document);
+    if (items == nullptr || index >= items->Size()) return false;
+    const rapidjson::Value &item = (*items)[index];
+    return item.IsObject() && item.HasMember("id") &&
+           read_edit_int(item["id"], options, id);
+}
+
+static bool read_patched_item(rapidjson::Document &document, rapidjson::SizeType index,
+                              const Parse_options &options, Line_item *item)
+{
+    rapidjson::Value *items = find_line_items(document);
+    if (items == nullptr) return false;
+    if (index == rapidjson::kPointerInvalidIndex) index = items->Size() - 1;
+    if (index >= items->Size()) return false;
+    const rapidjson::Value &json_li = (*items)[index];
+    return json_read_line_item(json_li, options, item);
+}
+
+/**
+ * Operations are applied to the input document one by one. A line item an
+ * operation replaces or removes is noted as gone, and one it adds or edits
+ * is read back right after it, so each operation must leave the items it
+ * touches valid. Roommates, totals and whole cart changes are read back
+ * once the patch is through.
+ */
+int Cart_session::apply_patch(const char *data, size_t length,
+                              const Parse_options &options)
+{
+    Trace_span span("parse");
+    rapidjson::Document patch;
+    if (options.exact_decimal)
+        patch.Parse<INPUT_DECIMAL_PARSE_FLAGS>(data, length);
+    else
+        patch.Parse<INPUT_PARSE_FLAGS>(data, length);
+    if (patch.HasParseError() || patch.IsArray() == false) return EINVAL;
+    for (auto &json : patch.GetArray())
+    {
+        if (is_patch_op(json) == false) return EINVAL;
+    }
+    span.set_items(patch.Size());
+    if (document == nullptr) materialize(options);
+
+    //Line items the patch changed by id, empty when it removed them
+    std::map<int, std::optional<Line_item>> changed;
+    bool input_changed = false;
+    bool roommates_patched = false;
+    bool totals_changed = false;
+    Json_patcher patcher(document.get());
+    for (auto &json : patch.GetArray())
+    {
+        std::string op = json["op"].GetString();
+        rapidjson::Pointer path(json["path"].GetString(),
+                                json["path"].GetStringLength());
+        rapidjson::Pointer from;
+        if (op == "move")
+            from = rapidjson::Pointer(json["from"].GetString(),
+                                      json["from"].GetStringLength());
+        rapidjson::SizeType path_index = rapidjson::kPointerInvalidIndex;
+        rapidjson::SizeType from_index = rapidjson::kPointerInvalidIndex;
+        Patch_target target = classify_pointer(path, &path_index);
+        Patch_target source = op == "move" ?
+            classify_pointer(from, &from_index) : Patch_target::other;
+        bool path_element = path.GetTokenCount() == 3;
+        bool from_element = from.GetTokenCount() == 3;
+        bool adds = op == "add" || op == "copy" || op == "move";
+
+        int id = 0;
+        if (source == Patch_target::line_item &&
+            patched_item_id(*document, from_index, options, &id))
+            changed[id].reset();
+        //A move takes from away before adding to path
+        rapidjson::SizeType before = path_index;
+        if (source == Patch_target::line_item && from_element &&
+            path_index != rapidjson::kPointerInvalidIndex && path_index >= from_index)
+            before++;
+        if (target == Patch_target::line_item && op != "test" &&
+            (path_element && adds) == false &&
+            patched_item_id(*document, before, options, &id))
+            changed[id].reset();
+
+        if (patcher.apply(json) == false)
+        {
+            patcher.rollback();
+            return ECANCELED;
+        }
+
+        input_changed = input_changed || target == Patch_target::input ||
+                        source == Patch_target::input;
+        roommates_patched = roommates_patched || target == Patch_target::roommates ||
+                            source == Patch_target::roommates;
+        totals_changed = totals_changed || target == Patch_target::totals ||
+                         source == Patch_target::totals;
+        if (input_changed || op == "test") continue;
+
+        Line_item item;
+        if (source == Patch_target::line_item && from_element == false)
+        {
+            if (read_patched_item(*document, from_index, options, &item) == false)
+            {
+                patcher.rollback();
+                return ECANCELED;
+            }
+            changed[item.get_id()] = std::move(item);
+        }
+        if (target == Patch_target::line_item && (path_element && op == "remove") == false)
+        {
+            item = Line_item();
+            if (read_patched_item(*document, path_index, options, &item) == false)
+            {
+                patcher.rollback();
+                return ECANCELED;
+            }
+            changed[item.get_id()] = std::move(item);
+        }
+    }
+
+    //Everything is read and checked before the session changes
+    Cart patched_cart;
+    std::map<int, Roommate> patched_roommates;
+    bool ok = true;
+    if (input_changed || roommates_patched)
+        ok = read_patched_input(*document, options, input_changed, &patched_cart,
+                                &patched_roommates);
+    if (ok && input_changed == false && totals_changed)
+        ok = document->HasMember("cart") &&
+             json_read_cart_totals((*document)["cart"], options, &patched_cart);
+    if (ok && input_changed == false)
+    {
+        //Item ids stay unique, as the cart holds one item per id
+        size_t items = cart.get_line_items().size();
+        for (auto &change : changed)
+        {
+            bool held = cart.get_line_items().count(change.first) != 0;
+            if (change.second && held == false) items++;
+            if (!change.second && held) items--;
+        }
+        ok = find_line_items(*document)->Size() == items;
+    }
+    if (ok == false)
+    {
+        patcher.rollback();
+        return ECANCELED;
+    }
+    patcher.commit();
+
+    if (input_changed)
+    {
+        cart = std::move(patched_cart);
+        put_roommates(std::move(patched_roommates));
+    }
+    else
+    {
+        if (roommates_patched) put_roommates(std::move(patched_roommates));
+        if (totals_changed)
+        {
+            copy_cart_totals(patched_cart, &cart);
+            check_money_scale();
+        }
+        for (auto &change : changed)
+        {
+            if (change.second) put_line_item(std::move(*change.second));
+            else erase_line_item(change.first);
+        }
+    }
+    if (document->GetAllocator().Capacity() > 2 * document_capacity) document.reset();
+    return 0;
+}
+
+//128 bits from the kernel's random source as 32 hex digits, so an id
+//can not be guessed from ids seen before. errno value on failure
+static int random_session_id(std::string *id)
+{
+    unsigned char bytes[16];
+    size_t done = 0;
+    while (done < sizeof(bytes))
+    {
+        ssize_t n = getrandom(bytes + done, sizeof(bytes) - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) break;
+        done += n;
+    }
+    if (done < sizeof(bytes))
+    {
+        //Kernels without getrandom
+        FILE *fp = fopen("/dev/urandom", "rb");
+        if (fp == nullptr) return errno;
+        done = fread(bytes, 1, sizeof(bytes), fp);
+        fclose(fp);
+        if (done < sizeof(bytes)) return EIO;
+    }
+
+    static const char digits[] = "0123456789abcdef";
+    id->resize(2 * sizeof(bytes));
+    for (size_t i = 0; i < sizeof(bytes); i++)
+    {
+        (*id)[2 * i] = digits[bytes[i] >> 4];
+        (*id)[2 * i + 1] = digits[bytes[i] & 0xf];
+    }
+    return 0;
+}
+
+//Session_store Implementation
+Session_store::Session_store(size_t memory_budget) : memory_budget(memory_budget) {}
+
+Session_store::Entry_ptr Session_store::add(Cart_session &&session)
+{
+    size_t charged = session.get_memory();
+    if (charged > memory_budget) return nullptr;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::string id;
+    do
+    {
+        if (random_session_id(&id) != 0) return nullptr;
+    } while (sessions.count(id));
+
+    Entry_ptr entry = std::make_shared<Entry>(id, std::move(session));
+    recent.push_front(id);
+    sessions.emplace(id, Slot{entry, recent.begin(), charged});
+    memory += charged;
+    evict();
+    return entry;
+}
+
+Session_store::Entry_ptr Session_store::find(const std::string &id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto slot = sessions.find(id);
+    if (slot == sessions.end()) return nullptr;
+    recent.splice(recent.begin(), recent, slot->second.recent);
+    return slot->second.entry;
+}
+
+bool Session_store::charge(const Entry_ptr &entry)
+{
+    size_t charged = entry->session.get_memory();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto slot = sessions.find(entry->id);
+    if (slot == sessions.end() || slot->second.entry != entry) return false;
+    if (charged > memory_budget)
+    {
+        erase(slot);
+        eviction_count++;
+        return false;
+    }
+    memory = memory - slot->second.charged + charged;
+    slot->second.charged = charged;
+    recent.splice(recent.begin(), recent, slot->second.recent);
+    evict();
+    return true;
+}
+
+bool Session_store::remove(const std::string &id)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto slot = sessions.find(id);
+    if (slot == sessions.end()) return false;
+    erase(slot);
+    return true;
+}
+
+size_t Session_store::size() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return sessions.size();
+}
+
+size_t Session_store::get_memory() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return memory;
+}
+
+size_t Session_store::get_eviction_count() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return eviction_count;
+}
+
+//The most recent session always fits on its own, so it is never evicted here
+void Session_store::evict()
+{
+    while (memory > memory_budget && recent.size() > 1)
+    {
+        erase(sessions.find(recent.back()));
+        eviction_count++;
+    }
+}
+
+void Session_store::erase(std::unordered_map<std::string, Slot>::iterator slot)
+{
+    memory -= slot->second.charged;
+    recent.erase(slot->second.recent);
+    sessions.erase(slot);
+}
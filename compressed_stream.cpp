@@ -0,0 +1,390 @@
+#include "include/compressed_stream.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <zlib.h>
+
+#ifdef ROOMMATE_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+static const unsigned char GZIP_MAGIC[] = {0x1f, 0x8b};
+static const unsigned char ZSTD_MAGIC[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+static bool ends_with(const std::string &path, const char *suffix)
+{
+    size_t length = strlen(suffix);
+    return path.size() > length && path.compare(path.size() - length, length, suffix) == 0;
+}
+
+static bool starts_with(const char *data, size_t length,
+                        const unsigned char *magic, size_t magic_length)
+{
+    return length >= magic_length && memcmp(data, magic, magic_length) == 0;
+}
+
+Compression compression_for_path(const std::string &path)
+{
+    if (ends_with(path, ".gz")) return Compression::gzip;
+    if (ends_with(path, ".zst")) return Compression::zstd;
+    return Compression::none;
+}
+
+Compression detect_compression(const char *data, size_t length)
+{
+    if (starts_with(data, length, GZIP_MAGIC, sizeof(GZIP_MAGIC)))
+        return Compression::gzip;
+    if (starts_with(data, length, ZSTD_MAGIC, sizeof(ZSTD_MAGIC)))
+        return Compression::zstd;
+    return Compression::none;
+}
+
+bool compression_supported(Compression compression)
+{
+#ifdef ROOMMATE_HAVE_ZSTD
+    return true;
+#else
+    return compression != Compression::zstd;
+#endif
+}
+
+//Decompressing_read_stream Implementation
+struct Decompressing_read_stream::Codec
+{
+    z_stream zs;
+    bool zs_open = false;
+#ifdef ROOMMATE_HAVE_ZSTD
+    ZSTD_DCtx *dctx = nullptr;
+    //Last ZSTD_decompressStream result, 0 only at the end of a frame
+    size_t zstd_pending = 0;
+#endif
+
+    ~Codec()
+    {
+        if (zs_open) inflateEnd(&zs);
+#ifdef ROOMMATE_HAVE_ZSTD
+        ZSTD_freeDCtx(dctx);
+#endif
+    }
+};
+
+Decompressing_read_stream::Decompressing_read_stream(FILE *fp, size_t max_output)
+    : fp(fp), codec(new Codec()), in_buffer(BUFFER_SIZE), max_output(max_output)
+{
+    start();
+}
+
+Decompressing_read_stream::Decompressing_read_stream(const char *data, size_t length,
+                                                     size_t max_output)
+    : codec(new Codec()), in_next(data), in_end(data + length), source_done(true),
+      max_output(max_output)
+{
+    start();
+}
+
+Decompressing_read_stream::~Decompressing_read_stream() {}
+
+void Decompressing_read_stream::start()
+{
+    current = end = out_start = &eof_char;
+    if (in_next == in_end) read_input();
+    compression = detect_compression(in_next, in_end - in_next);
+    if (compression_supported(compression) == false)
+    {
+        finish(EINVAL);
+        return;
+    }
+
+    if (compression == Compression::gzip)
+    {
+        memset(&codec->zs, 0, sizeof(codec->zs));
+        //15 window bits, +32 to read the gzip header
+        if (inflateInit2(&codec->zs, 15 + 32) != Z_OK)
+        {
+            finish(ENOMEM);
+            return;
+        }
+        codec->zs_open = true;
+    }
+#ifdef ROOMMATE_HAVE_ZSTD
+    if (compression == Compression::zstd)
+    {
+        codec->dctx = ZSTD_createDCtx();
+        if (codec->dctx == nullptr)
+        {
+            finish(ENOMEM);
+            return;
+        }
+    }
+#endif
+    if (compression != Compression::none) out_buffer.resize(BUFFER_SIZE);
+    fill();
+}
+
+bool Decompressing_read_stream::read_input()
+{
+    if (source_done) return false;
+    size_t length = fread(in_buffer.data(), 1, in_buffer.size(), fp);
+    if (length < in_buffer.size())
+    {
+        source_done = true;
+        if (ferror(fp)) error = EIO;
+    }
+    in_next = in_buffer.data();
+    in_end = in_next + length;
+    return length > 0;
+}
+
+void Decompressing_read_stream::finish(int err)
+{
+    consumed += end - out_start;
+    current = end = out_start = &eof_char;
+    at_end = true;
+    if (error == 0) error = err;
+}
+
+void Decompressing_read_stream::fill()
+{
+    consumed += end - out_start;
+    out_start = end;
+    if (error != 0)
+    {
+        finish(error);
+        return;
+    }
+
+    if (compression == Compression::none)
+    {
+        //Plain input is handed over where it lies
+        if (in_next == in_end && read_input() == false)
+        {
+            finish(error);
+            return;
+        }
+        current = out_start = in_next;
+        end = in_end;
+        in_next = in_end;
+        return;
+    }
+
+    char *out = out_buffer.data();
+    size_t produced = 0;
+    while (produced == 0)
+    {
+        if (in_next == in_end && read_input() == false)
+        {
+            //The source ended, fine only between gzip members or zstd frames
+            bool truncated = codec->zs_open && codec->zs.total_in > 0;
+#ifdef ROOMMATE_HAVE_ZSTD
+            truncated = truncated || codec->zstd_pending != 0;
+#endif
+            finish(error != 0 ? error : (truncated ? EINVAL : 0));
+            return;
+        }
+
+        if (compression == Compression::gzip)
+        {
+            z_stream &zs = codec->zs;
+            zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in_next));
+            zs.avail_in = static_cast<uInt>(in_end - in_next);
+            zs.next_out = reinterpret_cast<Bytef *>(out);
+            zs.avail_out = static_cast<uInt>(out_buffer.size());
+            int ret = inflate(&zs, Z_NO_FLUSH);
+            in_next = in_end - zs.avail_in;
+            produced = out_buffer.size() - zs.avail_out;
+            if (ret == Z_STREAM_END)
+            {
+                //Another member may follow, total_in 0 marks a clean boundary
+                inflateReset(&zs);
+            }
+            else if (ret != Z_OK && ret != Z_BUF_ERROR)
+            {
+                finish(EINVAL);
+                return;
+            }
+        }
+#ifdef ROOMMATE_HAVE_ZSTD
+        else
+        {
+            ZSTD_inBuffer in = {in_next, static_cast<size_t>(in_end - in_next), 0};
+            ZSTD_outBuffer zout = {out, out_buffer.size(), 0};
+            size_t ret = ZSTD_decompressStream(codec->dctx, &zout, &in);
+            if (ZSTD_isError(ret))
+            {
+                finish(EINVAL);
+                return;
+            }
+            codec->zstd_pending = ret;
+            in_next += in.pos;
+            produced = zout.pos;
+        }
+#endif
+    }
+    if (max_output != 0 && consumed + produced > max_output)
+    {
+        finish(EFBIG);
+        return;
+    }
+    current = out_start = out;
+    end = out + produced;
+}
+
+//Compressing_write_stream Implementation
+struct Compressing_write_stream::Codec
+{
+    z_stream zs;
+    bool zs_open = false;
+#ifdef ROOMMATE_HAVE_ZSTD
+    ZSTD_CCtx *cctx = nullptr;
+#endif
+
+    ~Codec()
+    {
+        if (zs_open) deflateEnd(&zs);
+#ifdef ROOMMATE_HAVE_ZSTD
+        ZSTD_freeCCtx(cctx);
+#endif
+    }
+};
+
+Compressing_write_stream::Compressing_write_stream(FILE *fp, Compression compression,
+                                                   int level)
+    : fp(fp), compression(compression), codec(new Codec()), in_buffer(BUFFER_SIZE)
+{
+    current = in_buffer.data();
+    if (compression_supported(compression) == false)
+    {
+        error = EINVAL;
+        return;
+    }
+    if (compression != Compression::none) out_buffer.resize(BUFFER_SIZE);
+
+    if (compression == Compression::gzip)
+    {
+        memset(&codec->zs, 0, sizeof(codec->zs));
+        //15 window bits, +16 to write a gzip header and trailer
+        if (deflateInit2(&codec->zs, level == 0 ? Z_DEFAULT_COMPRESSION : level,
+                         Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            error = ENOMEM;
+        else
+            codec->zs_open = true;
+    }
+#ifdef ROOMMATE_HAVE_ZSTD
+    if (compression == Compression::zstd)
+    {
+        codec->cctx = ZSTD_createCCtx();
+        if (codec->cctx == nullptr)
+            error = ENOMEM;
+        else if (level != 0)
+            ZSTD_CCtx_setParameter(codec->cctx, ZSTD_c_compressionLevel, level);
+    }
+#endif
+}
+
+Compressing_write_stream::~Compressing_write_stream() {}
+
+void Compressing_write_stream::write_out(const char *data, size_t length)
+{
+    if (error == 0 && length > 0 && fwrite(data, 1, length, fp) != length)
+        error = EIO;
+}
+
+void Compressing_write_stream::drain(bool last)
+{
+    const char *data = in_buffer.data();
+    size_t length = current - data;
+    current = in_buffer.data();
+    drained += length;
+    if (error != 0 || finished) return;
+
+    if (compression == Compression::none)
+    {
+        write_out(data, length);
+        return;
+    }
+
+    if (compression == Compression::gzip)
+    {
+        z_stream &zs = codec->zs;
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        zs.avail_in = static_cast<uInt>(length);
+        int ret;
+        do
+        {
+            zs.next_out = reinterpret_cast<Bytef *>(out_buffer.data());
+            zs.avail_out = static_cast<uInt>(out_buffer.size());
+            ret = deflate(&zs, last ? Z_FINISH : Z_NO_FLUSH);
+            write_out(out_buffer.data(), out_buffer.size() - zs.avail_out);
+        } while (error == 0 && (zs.avail_out == 0 || (last && ret != Z_STREAM_END)) &&
+                 ret != Z_STREAM_ERROR);
+        if (ret == Z_STREAM_ERROR && error == 0) error = EINVAL;
+    }
+#ifdef ROOMMATE_HAVE_ZSTD
+    else
+    {
+        ZSTD_inBuffer in = {data, length, 0};
+        size_t remaining;
+        do
+        {
+            ZSTD_outBuffer out = {out_buffer.data(), out_buffer.size(), 0};
+            remaining = ZSTD_compressStream2(codec->cctx, &out, &in,
+                                             last ? ZSTD_e_end : ZSTD_e_continue);
+            if (ZSTD_isError(remaining))
+            {
+                error = EINVAL;
+                return;
+            }
+            write_out(out_buffer.data(), out.pos);
+        } while (error == 0 && (last ? remaining != 0 : in.pos < in.size));
+    }
+#endif
+}
+
+int Compressing_write_stream::finish()
+{
+    if (finished == false)
+    {
+        drain(true);
+        finished = true;
+    }
+    return error;
+}
+
+int compress_buffer(const char *data, size_t length, Compression compression,
+                    std::string *out)
+{
+    out->clear();
+    if (compression == Compression::none)
+    {
+        out->assign(data, length);
+        return 0;
+    }
+    if (compression_supported(compression) == false) return EINVAL;
+
+    if (compression == Compression::gzip)
+    {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK)
+            return ENOMEM;
+        out->resize(deflateBound(&zs, length));
+        zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        zs.avail_in = static_cast<uInt>(length);
+        zs.next_out = reinterpret_cast<Bytef *>(&(*out)[0]);
+        zs.avail_out = static_cast<uInt>(out->size());
+        int ret = deflate(&zs, Z_FINISH);
+        out->resize(zs.total_out);
+        deflateEnd(&zs);
+        return ret == Z_STREAM_END ? 0 : EINVAL;
+    }
+#ifdef ROOMMATE_HAVE_ZSTD
+    out->resize(ZSTD_compressBound(length));
+    size_t written = ZSTD_compress(&(*out)[0], out->size(), data, length,
+                                   ZSTD_CLEVEL_DEFAULT);
+    if (ZSTD_isError(written)) return EINVAL;
+    out->resize(written);
+#endif
+    return 0;
+}
@@ -0,0 +1,1053 @@
+#include "include/http_server.h"
+#include "include/batch_io.h"
+#include "include/parse_pool.h"
+#include "include/trace.h"
+
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string_view>
+#include <unordered_map>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//Epoll keys of the two non-connection descriptors
+static const unsigned long long LISTEN_KEY = 0;
+static const unsigned long long WAKE_KEY = 1;
+//Request line plus headers beyond this get 431 and the connection closed
+static const size_t MAX_HEADER_BYTES = 16 * 1024;
+static const size_t READ_CHUNK = 16 * 1024;
+static const int MAX_EVENTS = 64;
+
+//Builds a full response, body is the JSON document
+static std::string make_response(int status, const char *reason,
+                                 const char *body, size_t body_length,
+                                 bool keep_alive, const char *extra_headers = "",
+                                 const char *content_type = "application/json")
+{
+    std::string response;
+    response.reserve(128 + body_length);
+    response.append("HTTP/1.1 ");
+    response.append(std::to_string(status));
+    response.append(" ");
+    response.append(reason);
+    response.append("\r\nContent-Type: ");
+    response.append(content_type);
+    response.append("\r\nContent-Length: ");
+    response.append(std::to_string(body_length));
+    response.append("\r\n");
+    response.append(extra_headers);
+    if (keep_alive == false) response.append("Connection: close\r\n");
+    response.append("\r\n");
+    response.append(body, body_length);
+    return response;
+}
+
+static std::string make_error_response(int status, const char *reason,
+                                       bool keep_alive,
+                                       const char *extra_headers = "")
+{
+    rapidjson::StringBuffer sb;
+    serialize_error_json(reason, sb);
+    return make_response(status, reason, sb.GetString(), sb.GetSize(),
+                         keep_alive, extra_headers);
+}
+
+static bool equals_ignore_case(std::string_view a, std::string_view b)
+{
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        char x = a[i], y = b[i];
+        if (x >= 'A' && x <= 'Z') x += 'a' - 'A';
+        if (y >= 'A' && y <= 'Z') y += 'a' - 'A';
+        if (x != y) return false;
+    }
+    return true;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+//The percent decoded value of name in a query string. Returns 0, ENOENT if
+//it is absent or EINVAL if it is badly encoded, value is then left empty
+static int query_value(std::string_view query, std::string_view name,
+                       std::string *value)
+{
+    value->clear();
+    while (query.empty() == false)
+    {
+        size_t end = query.find('&');
+        std::string_view pair = query.substr(0, end);
+        query.remove_prefix(end == std::string_view::npos ? query.size() : end + 1);
+        if (pair.size() <= name.size() || pair.substr(0, name.size()) != name ||
+            pair[name.size()] != '=')
+            continue;
+        value->clear();
+        for (size_t i = name.size() + 1; i < pair.size(); i++)
+        {
+            if (pair[i] == '+') value->push_back(' ');
+            else if (pair[i] != '%') value->push_back(pair[i]);
+            else if (i + 2 < pair.size() && hex_value(pair[i + 1]) >= 0 &&
+                     hex_value(pair[i + 2]) >= 0)
+            {
+                value->push_back(static_cast<char>(hex_value(pair[i + 1]) * 16 +
+                                                   hex_value(pair[i + 2])));
+                i += 2;
+            }
+            else
+            {
+                value->clear();
+                return EINVAL;
+            }
+        }
+        return 0;
+    }
+    return ENOENT;
+}
+
+/**
+ * Maps a request to a route. Returns 0, 400 for a /split view that is badly
+ * encoded or not an Output_projection spec, or 404 or 405 to answer with,
+ * in which case
+ * *allow holds the Allow header for the target.
+ */
+static int route_request(std::string_view method, std::string_view target,
+                         bool sessions, Http_route *route,
+                         std::string_view *session, std::string *view,
+                         const char **allow)
+{
+    const std::string_view SESSIONS = "/sessions";
+    size_t query = target.find('?');
+    if (target.substr(0, query) == "/split")
+    {
+        *route = Http_route::split;
+        *allow = "Allow: POST\r\n";
+        if (method != "POST") return 405;
+        if (query == std::string_view::npos) return 0;
+        int err = query_value(target.substr(query + 1), "view", view);
+        if (err == ENOENT) return 0;
+        Output_projection projection;
+        if (err != 0 || Output_projection::parse(*view, &projection) == false)
+            return 400;
+        return 0;
+    }
+    if (sessions == false || target.substr(0, SESSIONS.size()) != SESSIONS)
+        return 404;
+    target.remove_prefix(SESSIONS.size());
+    if (target.empty())
+    {
+        *route = Http_route::create_session;
+        *allow = "Allow: POST\r\n";
+        return method == "POST" ? 0 : 405;
+    }
+    if (target.size() < 2 || target[0] != '/' ||
+        target.find('/', 1) != std::string_view::npos)
+        return 404;
+
+    *session = target.substr(1);
+    *allow = "Allow: GET, POST, PATCH, DELETE\r\n";
+    if (method == "POST") *route = Http_route::edit_session;
+    else if (method == "PATCH") *route = Http_route::patch_session;
+    else if (method == "GET") *route = Http_route::get_session;
+    else if (method == "DELETE") *route = Http_route::delete_session;
+    else return 405;
+    return 0;
+}
+
+static std::string_view trim(std::string_view text)
+{
+    while (text.empty() == false && (text.front() == ' ' || text.front() == '\t'))
+        text.remove_prefix(1);
+    while (text.empty() == false && (text.back() == ' ' || text.back() == '\t'))
+        text.remove_suffix(1);
+    return text;
+}
+
+/**
+ * One epoll loop serving the connections it accepted. Requests are parsed
+ * here, /split bodies go to the server's workers and come back through
+ * complete(), which wakes the loop through an eventfd.
+ */
+class Http_io_thread
+{
+    public:
+        Http_io_thread(Http_server *server, size_t index, int listen_fd,
+                       const Http_server_options &options) :
+            server(server), index(index), listen_fd(listen_fd),
+            options(options) {}
+
+        ~Http_io_thread()
+        {
+            for (auto &entry : connections) close(entry.second->fd);
+            if (wake_fd >= 0) close(wake_fd);
+            if (epoll_fd >= 0) close(epoll_fd);
+        }
+
+        int init()
+        {
+            epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            if (epoll_fd < 0) return errno;
+            wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (wake_fd < 0) return errno;
+
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.u64 = WAKE_KEY;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) != 0)
+                return errno;
+            //Every loop waits on the listener, only one is woken per connection
+            event.events = EPOLLIN | EPOLLEXCLUSIVE;
+            event.data.u64 = LISTEN_KEY;
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) != 0)
+                return errno;
+            return 0;
+        }
+
+        void run()
+        {
+            epoll_event events[MAX_EVENTS];
+            while (stopping.load(std::memory_order_acquire) == false)
+            {
+                int count = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+                if (count < 0 && errno == EINTR) continue;
+                if (count < 0) return;
+                for (int i = 0; i < count; i++)
+                {
+                    unsigned long long key = events[i].data.u64;
+                    if (key == LISTEN_KEY) accept_connections();
+                    else if (key == WAKE_KEY) deliver_completions();
+                    else handle_event(key, events[i].events);
+                }
+            }
+        }
+
+        void stop()
+        {
+            stopping.store(true, std::memory_order_release);
+            wake();
+        }
+
+        //Called from worker threads with a finished response
+        void complete(unsigned long long connection, unsigned long long sequence,
+                      std::string &&response)
+        {
+            {
+                std::lock_guard<std::mutex> lock(completion_mutex);
+                completions.push_back(Completion{connection, sequence,
+                                                 std::move(response)});
+            }
+            wake();
+        }
+
+    private:
+        struct Completion
+        {
+            unsigned long long connection;
+            unsigned long long sequence;
+            std::string response;
+        };
+
+        struct Connection
+        {
+            int fd;
+            unsigned long long id;
+            //Bytes read but not yet parsed start at in_offset
+            std::string in;
+            size_t in_offset = 0;
+            //Sequence numbers given to parsed requests and next one to write
+            unsigned long long next_sequence = 0;
+            unsigned long long write_sequence = 0;
+            //Responses finished out of order, waiting for earlier ones
+            std::map<unsigned long long, std::string> ready;
+            std::string out;
+            size_t out_offset = 0;
+            //No more requests are parsed, close once every answer is sent
+            bool closing = false;
+            //A session request is in flight, the ones after it wait
+            bool session_pending = false;
+            unsigned long long session_sequence = 0;
+            //Client finished sending, buffered requests are still answered
+            bool read_closed = false;
+            uint32_t events = 0;
+        };
+
+        void wake()
+        {
+            uint64_t one = 1;
+            ssize_t written = write(wake_fd, &one, sizeof(one));
+            (void)written;
+        }
+
+        void accept_connections()
+        {
+            for (;;)
+            {
+                int fd = accept4(listen_fd, nullptr, nullptr,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0) return;
+                int one = 1;
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+                std::unique_ptr<Connection> connection(new Connection());
+                connection->fd = fd;
+                connection->id = next_connection_id++;
+                connection->events = EPOLLIN;
+                epoll_event event = {};
+                event.events = EPOLLIN;
+                event.data.u64 = connection->id;
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+                {
+                    close(fd);
+                    continue;
+                }
+                connections.emplace(connection->id, std::move(connection));
+            }
+        }
+
+        void deliver_completions()
+        {
+            uint64_t counter;
+            ssize_t got = read(wake_fd, &counter, sizeof(counter));
+            (void)got;
+
+            std::vector<Completion> batch;
+            {
+                std::lock_guard<std::mutex> lock(completion_mutex);
+                batch.swap(completions);
+            }
+            for (auto &completion : batch)
+            {
+                auto iter = connections.find(completion.connection);
+                //The client went away while its request was being split
+                if (iter == connections.end()) continue;
+                Connection *connection = iter->second.get();
+                queue_response(connection, completion.sequence,
+                               std::move(completion.response));
+                parse_requests(connection);
+                flush(connection);
+            }
+        }
+
+        void handle_event(unsigned long long key, uint32_t events)
+        {
+            auto iter = connections.find(key);
+            if (iter == connections.end()) return;
+            Connection *connection = iter->second.get();
+
+            if (events & (EPOLLERR | EPOLLHUP))
+            {
+                close_connection(connection);
+                return;
+            }
+            if ((events & EPOLLIN) && read_requests(connection) == false) return;
+            flush(connection);
+        }
+
+        //Returns false if the connection was closed
+        bool read_requests(Connection *connection)
+        {
+            for (;;)
+            {
+                size_t old_size = connection->in.size();
+                connection->in.resize(old_size + READ_CHUNK);
+                ssize_t n = recv(connection->fd, &connection->in[old_size],
+                                 READ_CHUNK, 0);
+                connection->in.resize(old_size + (n > 0 ? n : 0));
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                if (n < 0)
+                {
+                    close_connection(connection);
+                    return false;
+                }
+                if (n == 0)
+                {
+                    connection->read_closed = true;
+                    break;
+                }
+                if (buffered(connection) >= read_limit()) break;
+            }
+            parse_requests(connection);
+            return true;
+        }
+
+        size_t buffered(const Connection *connection) const
+        {
+            return connection->in.size() - connection->in_offset;
+        }
+
+        size_t read_limit() const {return options.max_body + MAX_HEADER_BYTES;}
+
+        //Parses every complete request the pipeline limit allows
+        void parse_requests(Connection *connection)
+        {
+            while (connection->closing == false &&
+                   connection->session_pending == false &&
+                   connection->next_sequence - connection->write_sequence <
+                   options.max_pipeline)
+            {
+                if (parse_one(connection) == false) break;
+            }
+
+            if (connection->in_offset == connection->in.size())
+            {
+                connection->in.clear();
+                connection->in_offset = 0;
+            }
+            else if (connection->in_offset >= READ_CHUNK)
+            {
+                connection->in.erase(0, connection->in_offset);
+                connection->in_offset = 0;
+            }
+        }
+
+        //Returns true if a request was consumed
+        bool parse_one(Connection *connection)
+        {
+            std::string_view pending(connection->in.data() + connection->in_offset,
+                                     buffered(connection));
+            size_t header_end = pending.find("\r\n\r\n");
+            if (header_end == std::string_view::npos)
+            {
+                if (pending.size() > MAX_HEADER_BYTES)
+                    reject(connection, 431, "Request Header Fields Too Large");
+                return false;
+            }
+
+            std::string_view head = pending.substr(0, header_end);
+            size_t line_end = head.find("\r\n");
+            std::string_view request_line = head.substr(0, line_end);
+            size_t method_end = request_line.find(' ');
+            size_t target_end = request_line.rfind(' ');
+            if (method_end == std::string_view::npos || target_end <= method_end)
+            {
+                reject(connection, 400, "Bad Request");
+                return false;
+            }
+            std::string_view method = request_line.substr(0, method_end);
+            std::string_view target = request_line.substr(
+                method_end + 1, target_end - method_end - 1);
+            std::string_view version = request_line.substr(target_end + 1);
+            if (version != "HTTP/1.1" && version != "HTTP/1.0")
+            {
+                reject(connection, 505, "HTTP Version Not Supported");
+                return false;
+            }
+
+            bool keep_alive = (version == "HTTP/1.1");
+            size_t content_length = 0;
+            bool chunked = false;
+            size_t pos = (line_end == std::string_view::npos) ? head.size()
+                                                              : line_end + 2;
+            while (pos < head.size())
+            {
+                size_t next = head.find("\r\n", pos);
+                if (next == std::string_view::npos) next = head.size();
+                std::string_view line = head.substr(pos, next - pos);
+                pos = next + 2;
+                size_t colon = line.find(':');
+                if (colon == std::string_view::npos) continue;
+                std::string_view name = line.substr(0, colon);
+                std::string_view value = trim(line.substr(colon + 1));
+
+                if (equals_ignore_case(name, "Content-Length"))
+                {
+                    content_length = 0;
+                    for (char c : value)
+                    {
+                        if (c < '0' || c > '9' ||
+                            content_length > options.max_body)
+                        {
+                            reject(connection, 400, "Bad Request");
+                            return false;
+                        }
+                        content_length = content_length * 10 + (c - '0');
+                    }
+                }
+                else if (equals_ignore_case(name, "Connection"))
+                {
+                    if (equals_ignore_case(value, "close")) keep_alive = false;
+                    else if (equals_ignore_case(value, "keep-alive"))
+                        keep_alive = true;
+                }
+                else if (equals_ignore_case(name, "Transfer-Encoding"))
+                    chunked = true;
+            }
+
+            if (chunked)
+            {
+                reject(connection, 501, "Not Implemented");
+                return false;
+            }
+            if (content_length > options.max_body)
+            {
+                reject(connection, 413, "Payload Too Large");
+                return false;
+            }
+            size_t request_size = header_end + 4 + content_length;
+            if (pending.size() < request_size) return false;
+
+            unsigned long long sequence = connection->next_sequence++;
+            if (keep_alive == false) connection->closing = true;
+
+            Http_route route = Http_route::split;
+            std::string_view session;
+            std::string view;
+            const char *allow = "";
+            int status = route_request(method, target, options.session_memory > 0,
+                                       &route, &session, &view, &allow);
+            if (status == 400)
+                queue_response(connection, sequence,
+                               make_error_response(400, "Bad Request", keep_alive));
+            else if (status == 404)
+                queue_response(connection, sequence,
+                               make_error_response(404, "Not Found", keep_alive));
+            else if (status == 405)
+                queue_response(connection, sequence,
+                               make_error_response(405, "Method Not Allowed",
+                                                   keep_alive, allow));
+            else
+            {
+                Http_work work;
+                work.io_thread = index;
+                work.connection = connection->id;
+                work.sequence = sequence;
+                work.keep_alive = keep_alive;
+                work.route = route;
+                work.session.assign(session);
+                work.view = std::move(view);
+                work.body.assign(pending.data() + header_end + 4, content_length);
+                if (route != Http_route::split)
+                {
+                    connection->session_pending = true;
+                    connection->session_sequence = sequence;
+                }
+                if (server->submit(std::move(work)) == false)
+                    queue_response(connection, sequence,
+                                   make_error_response(503, "Service Unavailable",
+                                                       keep_alive,
+                                                       "Retry-After: 1\r\n"));
+            }
+
+            connection->in_offset += request_size;
+            return true;
+        }
+
+        //Answers a malformed request and stops reading the connection
+        void reject(Connection *connection, int status, const char *reason)
+        {
+            unsigned long long sequence = connection->next_sequence++;
+            connection->closing = true;
+            connection->in_offset = connection->in.size();
+            queue_response(connection, sequence,
+                           make_error_response(status, reason, false));
+        }
+
+        //Stores a response and moves every in-order one to the output
+        void queue_response(Connection *connection, unsigned long long sequence,
+                            std::string &&response)
+        {
+            if (connection->session_pending &&
+                sequence == connection->session_sequence)
+                connection->session_pending = false;
+            if (sequence == connection->write_sequence &&
+                connection->ready.empty())
+            {
+                connection->out.append(response);
+                connection->write_sequence++;
+                return;
+            }
+
+            connection->ready.emplace(sequence, std::move(response));
+            for (auto iter = connection->ready.begin();
+                 iter != connection->ready.end() &&
+                 iter->first == connection->write_sequence;
+                 iter = connection->ready.erase(iter))
+            {
+                connection->out.append(iter->second);
+                connection->write_sequence++;
+            }
+        }
+
+        void flush(Connection *connection)
+        {
+            while (connection->out_offset < connection->out.size())
+            {
+                ssize_t n = send(connection->fd,
+                                 connection->out.data() + connection->out_offset,
+                                 connection->out.size() - connection->out_offset,
+                                 MSG_NOSIGNAL);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+                if (n < 0)
+                {
+                    close_connection(connection);
+                    return;
+                }
+                connection->out_offset += n;
+            }
+            if (connection->out_offset == connection->out.size())
+            {
+                connection->out.clear();
+                connection->out_offset = 0;
+            }
+
+            //Callers parse first, so with nothing in flight no complete
+            //request is left in the buffer
+            bool answered = connection->write_sequence == connection->next_sequence;
+            bool done = connection->closing || connection->read_closed;
+            if (done && answered && connection->out.empty())
+            {
+                close_connection(connection);
+                return;
+            }
+            update_interest(connection);
+        }
+
+        //Stops reading while the connection is closing or has a full backlog
+        void update_interest(Connection *connection)
+        {
+            uint32_t events = 0;
+            if (connection->closing == false && connection->read_closed == false &&
+                buffered(connection) < read_limit())
+                events |= EPOLLIN;
+            if (connection->out.empty() == false) events |= EPOLLOUT;
+            if (events == connection->events) return;
+
+            epoll_event event = {};
+            event.events = events;
+            event.data.u64 = connection->id;
+            epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+            connection->events = events;
+        }
+
+        void close_connection(Connection *connection)
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, nullptr);
+            close(connection->fd);
+            connections.erase(connection->id);
+        }
+
+        Http_server *server;
+        size_t index;
+        int listen_fd;
+        const Http_server_options &options;
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        std::atomic<bool> stopping{false};
+        unsigned long long next_connection_id = 2;
+        std::unordered_map<unsigned long long, std::unique_ptr<Connection>>
+            connections;
+
+        std::mutex completion_mutex;
+        std::vector<Completion> completions;
+};
+
+//Http_server Implementation
+Http_server::Http_server(const Http_server_options &options) :
+    options(options), sessions(options.session_memory)
+{
+    this->options.parse.max_decompressed = options.max_decompressed_body != 0 ?
+        options.max_decompressed_body : options.max_body * MAX_INFLATE_RATIO;
+}
+
+Http_server::~Http_server(){stop();}
+
+int Http_server::get_port() const{return bound_port;}
+size_t Http_server::get_crash_count() const{return crash_count;}
+
+int Http_server::start()
+{
+    if (running) return EALREADY;
+
+    listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) return errno;
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options.port);
+    if (inet_pton(AF_INET, options.address.c_str(), &addr.sin_addr) != 1)
+    {
+        close(listen_fd);
+        listen_fd = -1;
+        return EINVAL;
+    }
+    socklen_t addr_length = sizeof(addr);
+    if (bind(listen_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        listen(listen_fd, SOMAXCONN) != 0 ||
+        getsockname(listen_fd, reinterpret_cast<sockaddr *>(&addr),
+                    &addr_length) != 0)
+    {
+        int err = errno;
+        close(listen_fd);
+        listen_fd = -1;
+        return err;
+    }
+    bound_port = ntohs(addr.sin_port);
+
+    unsigned io_count = options.io_threads ? options.io_threads : 1;
+    for (unsigned i = 0; i < io_count; i++)
+    {
+        io_threads.emplace_back(new Http_io_thread(this, i, listen_fd, options));
+        int err = io_threads.back()->init();
+        if (err != 0)
+        {
+            io_threads.clear();
+            close(listen_fd);
+            listen_fd = -1;
+            return err;
+        }
+    }
+
+    unsigned worker_count = options.workers;
+    if (worker_count == 0) worker_count = std::thread::hardware_concurrency();
+    if (worker_count == 0) worker_count = 1;
+    if (options.processes > 0)
+    {
+        //Forks before any server thread runs, one thread per process
+        worker_count = options.processes;
+        int err = prefork.start(worker_count, options.parse);
+        if (err != 0)
+        {
+            io_threads.clear();
+            close(listen_fd);
+            listen_fd = -1;
+            return err;
+        }
+    }
+
+    stopping = false;
+    running = true;
+    scheduler = Request_scheduler<Http_work>(options.schedule, worker_count);
+    for (unsigned i = 0; i < worker_count; i++)
+        threads.emplace_back(&Http_server::run_worker, this, i);
+    for (auto &io_thread : io_threads)
+        threads.emplace_back(&Http_io_thread::run, io_thread.get());
+    return 0;
+}
+
+void Http_server::stop()
+{
+    if (running == false) return;
+    {
+        std::lock_guard<std::mutex> lock(work_mutex);
+        stopping = true;
+    }
+    has_work.notify_all();
+    for (auto &io_thread : io_threads) io_thread->stop();
+    for (auto &thread : threads) thread.join();
+    threads.clear();
+    io_threads.clear();
+    scheduler.clear();
+    close(listen_fd);
+    listen_fd = -1;
+    prefork.stop();
+    running = false;
+}
+
+bool Http_server::submit(Http_work &&work)
+{
+    double units = estimate_split_units(work.body.data(), work.body.size());
+    uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    {
+        std::lock_guard<std::mutex> lock(work_mutex);
+        work.request = next_request;
+        if (scheduler.push(std::move(work), units, now) == false) return false;
+        next_request++;
+    }
+    has_work.notify_one();
+    return true;
+}
+
+void Http_server::run_worker(unsigned index)
+{
+    rapidjson::StringBuffer sb;
+    std::string body;
+    //Estimate and duration of the previous request, reported to the
+    //scheduler once the lock is taken again
+    double units = 0.0;
+    double duration_ns = 0.0;
+    for (;;)
+    {
+        Http_work work;
+        {
+            std::unique_lock<std::mutex> lock(work_mutex);
+            scheduler.record(units, duration_ns);
+            has_work.wait(lock, [this]{
+                return stopping || scheduler.empty() == false;});
+            if (stopping) return;
+            work = scheduler.pop(&units);
+        }
+
+        Trace_cart_scope cart(work.request);
+        auto start = std::chrono::steady_clock::now();
+        std::string response;
+        if (work.route != Http_route::split)
+            response = serve_session(work);
+        else if (options.processes > 0)
+        {
+            Prefork_result result;
+            int err = prefork.split(index, work.body.data(), work.body.size(),
+                                    &body, &result, work.view);
+            if (result.crashed) report_crash(work, result);
+            if (err != 0 || result.crashed)
+                response = make_error_response(500, "Internal Server Error",
+                                               work.keep_alive);
+            else if (result.ok)
+                response = make_response(200, "OK", body.data(), body.size(),
+                                         work.keep_alive);
+            else if (result.error == Split_error::input_too_large)
+                response = make_response(413, "Payload Too Large", body.data(),
+                                         body.size(), work.keep_alive);
+            else
+                response = make_response(400, "Bad Request", body.data(),
+                                         body.size(), work.keep_alive);
+        }
+        else
+        {
+            sb.Clear();
+            Output_projection projection;
+            Split_status status;
+            bool ok = false;
+            //Views are checked when the request is routed, this only
+            //guards against answering a bad one with the whole document
+            if (Output_projection::parse(work.view.empty() ? "full" : work.view,
+                                         &projection) == false)
+                serialize_error_json("Bad Request", sb);
+            else
+                ok = split_json_pooled(work.body.data(), work.body.size(),
+                                       options.parse, sb, &status, &projection);
+            if (ok)
+                response = make_response(200, "OK", sb.GetString(), sb.GetSize(),
+                                         work.keep_alive);
+            else if (status.code == Split_error::input_too_large)
+                response = make_response(413, "Payload Too Large", sb.GetString(),
+                                         sb.GetSize(), work.keep_alive);
+            else
+                response = make_response(400, "Bad Request", sb.GetString(),
+                                         sb.GetSize(), work.keep_alive);
+        }
+        duration_ns = std::chrono::duration<double, std::nano>(
+            std::chrono::steady_clock::now() - start).count();
+        io_threads[work.io_thread]->complete(work.connection, work.sequence,
+                                             std::move(response));
+    }
+}
+
+/**
+ * Logs a request that killed its worker process to stderr and, when
+ * crash_dir is set, saves the input there as crash-<request>.json.
+ */
+void Http_server::report_crash(const Http_work &work, const Prefork_result &result)
+{
+    crash_count++;
+    std::string how = "exited";
+    if (WIFSIGNALED(result.wait_status))
+        how = std::string("killed by ") + strsignal(WTERMSIG(result.wait_status));
+
+    std::string saved;
+    if (options.crash_dir.empty() == false)
+    {
+        std::string path = options.crash_dir + "/crash-" +
+                           std::to_string(work.request) + ".json";
+        if (write_whole_file(path, work.body) == 0) saved = ", input saved to " + path;
+    }
+    fprintf(stderr, "split_server: worker %d %s on request %llu (%zu bytes)%s\n",
+            static_cast<int>(result.pid), how.c_str(), work.request,
+            work.body.size(), saved.c_str());
+}
+
+//{"session":id,"roommates":[...]} with each roommate's totals, or the error
+static void serialize_session_totals(const std::string &id,
+                                     const Cart_session &session,
+                                     const Split_status &status,
+                                     rapidjson::StringBuffer &sb)
+{
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+    writer.StartObject();
+    writer.Key("session");
+    writer.String(id.c_str(), id.size());
+    if (status.ok() == false)
+    {
+        writer.Key("error");
+        writer.String(status.message().c_str());
+        writer.EndObject();
+        return;
+    }
+    writer.Key("roommates");
+    writer.StartArray();
+    for (auto &rm_pair : session.get_results())
+    {
+        const Roommate &rm = rm_pair.second;
+        writer.StartObject();
+        writer.Key("id");
+        writer.Int(rm.get_id());
+        writer.Key("name");
+        writer.String(rm.get_name().c_str(), rm.get_name().size());
+        writer.Key("total");
+        writer.Double(rm.get_total());
+        writer.Key("tax_share");
+        writer.Double(rm.get_tax_share());
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+}
+
+//The split document of a session, or its error document
+static bool serialize_session(const Cart_session &session,
+                              const Split_status &status,
+                              rapidjson::StringBuffer &sb)
+{
+    if (status.ok() == false)
+    {
+        serialize_error_json(status.message(), sb);
+        return false;
+    }
+    serialize_json(session.get_cart(), session.get_results(), sb);
+    return true;
+}
+
+/**
+ * Runs a /sessions request. Sessions stay in this process even when /split
+ * uses worker processes, their edits are too cheap to be worth a crash
+ * boundary. Bodies of the wrong shape are refused by the JSON readers and
+ * answered with 400. An edit that leaves the session over the whole budget on its
+ * own, or that raced with its eviction, is answered with 507.
+ */
+std::string Http_server::serve_session(const Http_work &work)
+{
+    rapidjson::StringBuffer sb;
+    if (work.route == Http_route::create_session)
+    {
+        Cart cart = Cart();
+        std::map<int, Roommate> roommates = {};
+        if (parse_json_buffer(&cart, &roommates, work.body.data(), work.body.size(),
+                              options.parse) == false)
+        {
+            serialize_error_json("Invalid input JSON", sb);
+            return make_response(400, "Bad Request", sb.GetString(), sb.GetSize(),
+                                 work.keep_alive);
+        }
+        Session_store::Entry_ptr entry =
+            sessions.add(Cart_session(std::move(cart), std::move(roommates)));
+        if (entry == nullptr)
+            return make_error_response(507, "Insufficient Storage", work.keep_alive);
+
+        std::lock_guard<std::mutex> lock(entry->mutex);
+        Split_status status = entry->session.update(true);
+        rapidjson::StringBuffer result;
+        if (serialize_session(entry->session, status, result))
+            entry->session.clear_changes();
+        rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+        writer.StartObject();
+        writer.Key("session");
+        writer.String(entry->id.c_str(), entry->id.size());
+        writer.Key("result");
+        writer.RawValue(result.GetString(), result.GetSize(), rapidjson::kObjectType);
+        writer.EndObject();
+        std::string location = "Location: /sessions/" + entry->id + "\r\n";
+        return make_response(201, "Created", sb.GetString(), sb.GetSize(),
+                             work.keep_alive, location.c_str());
+    }
+
+    Session_store::Entry_ptr entry = sessions.find(work.session);
+    if (entry == nullptr)
+        return make_error_response(404, "Not Found", work.keep_alive);
+    if (work.route == Http_route::delete_session)
+    {
+        sessions.remove(work.session);
+        return make_response(204, "No Content", "", 0, work.keep_alive);
+    }
+
+    std::lock_guard<std::mutex> lock(entry->mutex);
+    if (work.route == Http_route::get_session)
+    {
+        //The document costs time in the cart's size anyway, so it is exact
+        bool ok = serialize_session(entry->session, entry->session.update(true),
+                                    sb);
+        if (ok) entry->session.clear_changes();
+        return make_response(ok ? 200 : 400, ok ? "OK" : "Bad Request",
+                             sb.GetString(), sb.GetSize(), work.keep_alive);
+    }
+
+    if (work.route == Http_route::patch_session)
+        return serve_patch(work, entry);
+
+    if (apply_session_edits(work.body.data(), work.body.size(), options.parse,
+                            &entry->session) == false)
+    {
+        serialize_error_json("Invalid edit JSON", sb);
+        return make_response(400, "Bad Request", sb.GetString(), sb.GetSize(),
+                             work.keep_alive);
+    }
+    Split_status status = entry->session.update();
+    if (sessions.charge(entry) == false)
+        return make_error_response(507, "Insufficient Storage", work.keep_alive);
+    serialize_session_totals(entry->id, entry->session, status, sb);
+    return make_response(status.ok() ? 200 : 400,
+                         status.ok() ? "OK" : "Bad Request",
+                         sb.GetString(), sb.GetSize(), work.keep_alive);
+}
+
+/**
+ * Runs a PATCH /sessions/<id> request with the entry's mutex held. The
+ * reply patches the split document last sent for the session, a client
+ * that sent none gets the full document instead.
+ */
+std::string Http_server::serve_patch(const Http_work &work,
+                                     const Session_store::Entry_ptr &entry)
+{
+    rapidjson::StringBuffer sb;
+    int err = entry->session.apply_patch(work.body.data(), work.body.size(),
+                                         options.parse);
+    if (err == EINVAL)
+    {
+        serialize_error_json("Invalid patch JSON", sb);
+        return make_response(400, "Bad Request", sb.GetString(), sb.GetSize(),
+                             work.keep_alive);
+    }
+    if (err != 0)
+    {
+        serialize_error_json("Patch does not apply", sb);
+        return make_response(409, "Conflict", sb.GetString(), sb.GetSize(),
+                             work.keep_alive);
+    }
+
+    Split_status status = entry->session.update();
+    if (sessions.charge(entry) == false)
+        return make_error_response(507, "Insufficient Storage", work.keep_alive);
+    if (status.ok() == false)
+    {
+        serialize_session_totals(entry->id, entry->session, status, sb);
+        return make_response(400, "Bad Request", sb.GetString(), sb.GetSize(),
+                             work.keep_alive);
+    }
+    //The full document is exact, like the one GET answers with
+    bool changes = entry->session.serialize_changes(sb);
+    if (changes == false)
+        serialize_session(entry->session, entry->session.update(true), sb);
+    entry->session.clear_changes();
+    return make_response(200, "OK", sb.GetString(), sb.GetSize(), work.keep_alive,
+                         "", changes ? "application/json-patch+json" :
+                                       "application/json");
+}
@@ -0,0 +1,395 @@
+#include "include/id_set.h"
+
+#include <algorithm>
+#include <cstring>
+
+//Id_set::const_iterator Implementation
+Id_set::const_iterator::const_iterator(const Id_set *set, size_t pos) :
+    set(set), pos(pos), value(0)
+{
+    load();
+}
+
+void Id_set::const_iterator::load()
+{
+    if (set->mode == bitset_mode) value = static_cast<int>(pos);
+    else if (pos < set->member_count) value = set->array_data()[pos];
+}
+
+Id_set::const_iterator &Id_set::const_iterator::operator++()
+{
+    if (set->mode == bitset_mode) pos = set->next_bit(pos + 1);
+    else pos++;
+    load();
+    return *this;
+}
+
+Id_set::const_iterator Id_set::const_iterator::operator++(int)
+{
+    const_iterator prev = *this;
+    ++(*this);
+    return prev;
+}
+
+//Id_set Implementation
+Id_set::Id_set(){}
+Id_set::Id_set(std::initializer_list<int> ids){for (int id : ids) insert(id);}
+Id_set::Id_set(const std::set<int> &ids){for (int id : ids) insert(id);}
+Id_set::Id_set(const Id_set &other){*this = other;}
+Id_set::Id_set(Id_set &&other) noexcept {*this = std::move(other);}
+Id_set::~Id_set(){release();}
+
+Id_set &Id_set::operator=(const Id_set &other)
+{
+    if (this == &other) return *this;
+    release();
+    if (other.mode != bitset_mode && other.member_count <= INLINE_CAPACITY)
+    {
+        //Cleared sets can be in sorted mode with few members
+        std::memcpy(inline_ids, other.array_data(),
+                    other.member_count * sizeof(int));
+        member_count = other.member_count;
+        return *this;
+    }
+    if (other.mode == sorted_mode)
+    {
+        sorted.capacity = other.member_count;
+        sorted.ids = new int[sorted.capacity];
+        std::memcpy(sorted.ids, other.sorted.ids,
+                    other.member_count * sizeof(int));
+    }
+    else
+    {
+        bits.word_count = other.bits.word_count;
+        bits.words = new uint64_t[bits.word_count];
+        std::memcpy(bits.words, other.bits.words,
+                    bits.word_count * sizeof(uint64_t));
+    }
+    mode = other.mode;
+    member_count = other.member_count;
+    return *this;
+}
+
+Id_set &Id_set::operator=(Id_set &&other) noexcept
+{
+    if (this == &other) return *this;
+    release();
+    if (other.mode == inline_mode)
+        std::memcpy(inline_ids, other.inline_ids,
+                    other.member_count * sizeof(int));
+    else if (other.mode == sorted_mode)
+        sorted = other.sorted;
+    else
+        bits = other.bits;
+    mode = other.mode;
+    member_count = other.member_count;
+    other.mode = inline_mode;
+    other.member_count = 0;
+    return *this;
+}
+
+bool Id_set::insert(int id)
+{
+    if (mode == bitset_mode)
+    {
+        int64_t limit = static_cast<int64_t>(BITSET_DENSITY) * (member_count + 1);
+        if (id >= 0 && static_cast<uint64_t>(id) < bits.word_count * 64ULL)
+        {
+            uint64_t mask = 1ULL << (id % 64);
+            if (bits.words[id / 64] & mask) return false;
+            bits.words[id / 64] |= mask;
+            member_count++;
+            return true;
+        }
+        if (id >= 0 && id <= limit)
+        {
+            reserve_words(static_cast<uint32_t>(id / 64 + 1));
+            bits.words[id / 64] |= 1ULL << (id % 64);
+            member_count++;
+            return true;
+        }
+        to_sorted(member_count * 2);
+    }
+
+    int *data = array_data();
+    int *pos = std::lower_bound(data, data + member_count, id);
+    if (pos != data + member_count && *pos == id) return false;
+
+    uint32_t capacity = (mode == inline_mode) ? INLINE_CAPACITY : sorted.capacity;
+    if (member_count == capacity)
+    {
+        int min_id = member_count ? std::min(data[0], id) : id;
+        int max_id = member_count ? std::max(data[member_count - 1], id) : id;
+        if (min_id >= 0 &&
+            max_id <= static_cast<int64_t>(BITSET_DENSITY) * (member_count + 1))
+        {
+            to_bitset(max_id);
+            bits.words[id / 64] |= 1ULL << (id % 64);
+            member_count++;
+            return true;
+        }
+        size_t offset = pos - data;
+        to_sorted(capacity * 2);
+        data = array_data();
+        pos = data + offset;
+    }
+
+    std::memmove(pos + 1, pos, (data + member_count - pos) * sizeof(int));
+    *pos = id;
+    member_count++;
+    return true;
+}
+
+size_t Id_set::erase(int id)
+{
+    if (mode == bitset_mode)
+    {
+        if (count(id) == 0) return 0;
+        bits.words[id / 64] &= ~(1ULL << (id % 64));
+        member_count--;
+        return 1;
+    }
+
+    int *data = array_data();
+    int *pos = std::lower_bound(data, data + member_count, id);
+    if (pos == data + member_count || *pos != id) return 0;
+    std::memmove(pos, pos + 1, (data + member_count - pos - 1) * sizeof(int));
+    member_count--;
+    return 1;
+}
+
+size_t Id_set::count(int id) const
+{
+    if (mode == bitset_mode)
+    {
+        if (id < 0 || static_cast<uint64_t>(id) >= bits.word_count * 64ULL)
+            return 0;
+        return (bits.words[id / 64] >> (id % 64)) & 1;
+    }
+    const int *data = array_data();
+    return std::binary_search(data, data + member_count, id) ? 1 : 0;
+}
+
+size_t Id_set::rank(int id) const
+{
+    if (mode == bitset_mode)
+    {
+        if (id <= 0) return 0;
+        uint64_t limit = std::min<uint64_t>(id, bits.word_count * 64ULL);
+        size_t below = 0;
+        for (uint64_t word = 0; word < limit / 64; word++)
+            below += __builtin_popcountll(bits.words[word]);
+        if (limit % 64)
+            below += __builtin_popcountll(bits.words[limit / 64] &
+                                          ((1ULL << (limit % 64)) - 1));
+        return below;
+    }
+    const int *data = array_data();
+    return std::lower_bound(data, data + member_count, id) - data;
+}
+
+//Keeps a heap array or bitset for the next members, so a recycled set
+//refills without allocating
+void Id_set::clear()
+{
+    if (mode == bitset_mode)
+        std::memset(bits.words, 0, bits.word_count * sizeof(uint64_t));
+    member_count = 0;
+}
+
+Id_set::const_iterator Id_set::begin() const
+{
+    if (mode == bitset_mode) return const_iterator(this, next_bit(0));
+    return const_iterator(this, 0);
+}
+
+Id_set::const_iterator Id_set::end() const
+{
+    if (mode == bitset_mode)
+        return const_iterator(this, static_cast<size_t>(bits.word_count) * 64);
+    return const_iterator(this, member_count);
+}
+
+bool Id_set::get_mask(uint64_t *mask) const
+{
+    if (mode == bitset_mode)
+    {
+        for (uint32_t i = 1; i < bits.word_count; i++)
+        {
+            if (bits.words[i] != 0) return false;
+        }
+        *mask = bits.word_count > 0 ? bits.words[0] : 0;
+        return true;
+    }
+    const int *data = array_data();
+    uint64_t result = 0;
+    for (uint32_t i = 0; i < member_count; i++)
+    {
+        if (data[i] < 0 || data[i] >= 64) return false;
+        result |= 1ULL << data[i];
+    }
+    *mask = result;
+    return true;
+}
+
+Id_set &Id_set::operator|=(const Id_set &other)
+{
+    if (mode == bitset_mode && other.mode == bitset_mode)
+    {
+        reserve_words(other.bits.word_count);
+        for (uint32_t i = 0; i < other.bits.word_count; i++)
+            bits.words[i] |= other.bits.words[i];
+        recount();
+        return *this;
+    }
+    for (int id : other) insert(id);
+    return *this;
+}
+
+Id_set &Id_set::operator&=(const Id_set &other)
+{
+    if (mode == bitset_mode && other.mode == bitset_mode)
+    {
+        for (uint32_t i = 0; i < bits.word_count; i++)
+        {
+            if (i < other.bits.word_count) bits.words[i] &= other.bits.words[i];
+            else bits.words[i] = 0;
+        }
+        recount();
+        return *this;
+    }
+    Id_set result;
+    for (int id : *this)
+    {
+        if (other.count(id)) result.insert(id);
+    }
+    *this = std::move(result);
+    return *this;
+}
+
+Id_set &Id_set::operator-=(const Id_set &other)
+{
+    if (mode == bitset_mode && other.mode == bitset_mode)
+    {
+        uint32_t words = std::min(bits.word_count, other.bits.word_count);
+        for (uint32_t i = 0; i < words; i++)
+            bits.words[i] &= ~other.bits.words[i];
+        recount();
+        return *this;
+    }
+    if (&other == this)
+    {
+        clear();
+        return *this;
+    }
+    for (int id : other) erase(id);
+    return *this;
+}
+
+bool Id_set::operator==(const Id_set &other) const
+{
+    if (member_count != other.member_count) return false;
+    return std::equal(begin(), end(), other.begin());
+}
+
+Id_set::operator std::set<int>() const
+{
+    return std::set<int>(begin(), end());
+}
+
+const int *Id_set::array_data() const
+{
+    return (mode == inline_mode) ? inline_ids : sorted.ids;
+}
+
+int *Id_set::array_data()
+{
+    return (mode == inline_mode) ? inline_ids : sorted.ids;
+}
+
+size_t Id_set::next_bit(size_t from) const
+{
+    size_t end_pos = static_cast<size_t>(bits.word_count) * 64;
+    if (from >= end_pos) return end_pos;
+
+    size_t word = from / 64;
+    uint64_t current = bits.words[word] & (~0ULL << (from % 64));
+    while (current == 0)
+    {
+        if (++word == bits.word_count) return end_pos;
+        current = bits.words[word];
+    }
+    return word * 64 + __builtin_ctzll(current);
+}
+
+//Moves array members into a zeroed bitset covering ids 0..max_id
+void Id_set::to_bitset(int max_id)
+{
+    uint32_t word_count = static_cast<uint32_t>(max_id / 64 + 1);
+    uint64_t *words = new uint64_t[word_count]();
+    const int *data = array_data();
+    for (uint32_t i = 0; i < member_count; i++)
+        words[data[i] / 64] |= 1ULL << (data[i] % 64);
+
+    if (mode == sorted_mode) delete[] sorted.ids;
+    bits.words = words;
+    bits.word_count = word_count;
+    mode = bitset_mode;
+}
+
+//Moves the members into a heap array with room for capacity ids
+void Id_set::to_sorted(uint32_t capacity)
+{
+    capacity = std::max(capacity, member_count + 1);
+    int *ids = new int[capacity];
+    uint32_t n = 0;
+    for (int id : *this) ids[n++] = id;
+
+    if (mode == sorted_mode) delete[] sorted.ids;
+    else if (mode == bitset_mode) delete[] bits.words;
+    sorted.ids = ids;
+    sorted.capacity = capacity;
+    mode = sorted_mode;
+}
+
+void Id_set::reserve_words(uint32_t words)
+{
+    if (words <= bits.word_count) return;
+    uint32_t new_count = std::max(words, bits.word_count * 2);
+    uint64_t *new_words = new uint64_t[new_count]();
+    std::memcpy(new_words, bits.words, bits.word_count * sizeof(uint64_t));
+    delete[] bits.words;
+    bits.words = new_words;
+    bits.word_count = new_count;
+}
+
+void Id_set::release()
+{
+    if (mode == sorted_mode) delete[] sorted.ids;
+    else if (mode == bitset_mode) delete[] bits.words;
+    mode = inline_mode;
+    member_count = 0;
+}
+
+void Id_set::recount()
+{
+    member_count = 0;
+    for (uint32_t i = 0; i < bits.word_count; i++)
+        member_count += __builtin_popcountll(bits.words[i]);
+}
+
+Id_set operator|(Id_set lhs, const Id_set &rhs)
+{
+    lhs |= rhs;
+    return lhs;
+}
+Id_set operator&(Id_set lhs, const Id_set &rhs)
+{
+    lhs &= rhs;
+    return lhs;
+}
+Id_set operator-(Id_set lhs, const Id_set &rhs)
+{
+    lhs -= rhs;
+    return lhs;
+}
@@ -0,0 +1,121 @@
+#ifndef ALLOC_TRACKER_H_INCLUDED
+#define ALLOC_TRACKER_H_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+#include <ostream>
+#include "rapidjson/document.h"
+
+/**
+ * Opt-in heap allocation accounting for the calling thread. While an
+ * Alloc_tracker lives, allocations are counted per request and per stage.
+ * The stage is the innermost open Trace_span, so the numbers line up with
+ * the trace timeline: parse, validate, calculate, serialize. Allocations
+ * outside any span count under "none".
+ *
+ * Two hooks feed it. Including alloc_tracker_new.h in one translation unit
+ * of a program routes operator new and delete through the tracker, which
+ * covers std::map and std::set nodes, std::string and vector storage.
+ * Tracking_allocator does the same for rapidjson value chunks and parse
+ * stacks, which rapidjson takes from malloc directly. Untracked threads pay
+ * one relaxed load per allocation.
+ */
+
+//Threads with a tracker running, the hooks skip the rest while it is 0
+extern std::atomic<int> alloc_trackers_running;
+
+inline bool alloc_tracking(){return alloc_trackers_running.load(std::memory_order_relaxed) != 0;}
+
+enum class Alloc_source {heap, rapidjson};
+
+//Hooks, ptr must come from malloc so its usable size is known
+void alloc_record(void *ptr, Alloc_source source);
+void alloc_release(void *ptr);
+
+struct Alloc_stats
+{
+    size_t count = 0;
+    size_t bytes = 0;
+    //Part of count and bytes that came through Tracking_allocator
+    size_t rapidjson_count = 0;
+    size_t rapidjson_bytes = 0;
+    size_t frees = 0;
+    //Most bytes live at once above those live when it began
+    size_t peak = 0;
+};
+
+struct Alloc_stage
+{
+    const char *name = nullptr;
+    Alloc_stats stats;
+    //Live bytes when the stage was last entered
+    long long entry_live = 0;
+};
+
+class Alloc_tracker
+{
+    public:
+        //Stages kept apart, later ones share the last slot
+        static const size_t MAX_STAGES = 16;
+
+        //One tracker per thread at a time, it tracks the thread creating it
+        Alloc_tracker();
+        ~Alloc_tracker();
+
+        //Ends the current request, its stats become get_last_request()
+        void end_request();
+        const Alloc_stats &get_request() const {return request;}
+        const Alloc_stats &get_last_request() const {return last_request;}
+        //Everything since the tracker started
+        const Alloc_stats &get_total() const {return total;}
+        size_t get_stage_count() const {return stage_count;}
+        const Alloc_stage &get_stage(size_t i) const {return stages[i];}
+        //Stats of the named stage, zero if it was not entered
+        Alloc_stats get_stage(const char *name) const;
+        //Stage table with counts, bytes and peaks divided by ops
+        void report(std::ostream &out, size_t ops = 1) const;
+
+        //Called by Trace_span, returns the stage to restore on leave
+        static int enter_stage(const char *name);
+        static void leave_stage(int previous);
+
+    private:
+        friend void alloc_record(void *ptr, Alloc_source source);
+        friend void alloc_release(void *ptr);
+
+        Alloc_tracker(const Alloc_tracker &);
+        Alloc_tracker &operator=(const Alloc_tracker &);
+
+        void record(size_t bytes, Alloc_source source);
+        void release(size_t bytes);
+        int find_stage(const char *name);
+
+        Alloc_stats total;
+        Alloc_stats request;
+        Alloc_stats last_request;
+        long long live = 0;
+        long long request_live = 0;
+        Alloc_stage stages[MAX_STAGES];
+        size_t stage_count = 0;
+        int current_stage = -1;
+};
+
+/**
+ * rapidjson Allocator over malloc whose blocks are recorded as rapidjson
+ * allocations while the thread is tracked.
+ */
+class Tracking_allocator
+{
+    public:
+        static const bool kNeedFree = true;
+        void *Malloc(size_t size);
+        void *Realloc(void *original, size_t original_size, size_t new_size);
+        static void Free(void *ptr);
+};
+
+typedef rapidjson::MemoryPoolAllocator<Tracking_allocator> Tracked_pool_allocator;
+typedef rapidjson::GenericValue<rapidjson::UTF8<>, Tracked_pool_allocator> Tracked_value;
+typedef rapidjson::GenericDocument<rapidjson::UTF8<>, Tracked_pool_allocator,
+                                   Tracking_allocator> Tracked_document;
+
+#endif // ALLOC_TRACKER_H_INCLUDED
@@ -0,0 +1,55 @@
+#ifndef ALLOC_TRACKER_NEW_H_INCLUDED
+#define ALLOC_TRACKER_NEW_H_INCLUDED
+
+#include <cstdlib>
+#include <new>
+#include "alloc_tracker.h"
+
+/**
+ * Replacement global operator new and delete reporting to Alloc_tracker.
+ * These are definitions, include this header in exactly one translation
+ * unit of a program that wants its allocations tracked, such as a test
+ * runner or a benchmark. They are kept out of line so the compiler does
+ * not pair inlined new and free calls away.
+ */
+
+__attribute__((noinline)) void *operator new(size_t size)
+{
+    void *ptr = std::malloc(size ? size : 1);
+    if (ptr == nullptr) throw std::bad_alloc();
+    if (alloc_tracking()) alloc_record(ptr, Alloc_source::heap);
+    return ptr;
+}
+__attribute__((noinline)) void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+__attribute__((noinline)) void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    void *ptr = std::malloc(size ? size : 1);
+    if (ptr != nullptr && alloc_tracking()) alloc_record(ptr, Alloc_source::heap);
+    return ptr;
+}
+__attribute__((noinline)) void *operator new[](size_t size, const std::nothrow_t &tag) noexcept
+{
+    return operator new(size, tag);
+}
+__attribute__((noinline)) void operator delete(void *ptr) noexcept
+{
+    if (alloc_tracking()) alloc_release(ptr);
+    std::free(ptr);
+}
+__attribute__((noinline)) void operator delete[](void *ptr) noexcept
+{
+    operator delete(ptr);
+}
+__attribute__((noinline)) void operator delete(void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+__attribute__((noinline)) void operator delete[](void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+#endif // ALLOC_TRACKER_NEW_H_INCLUDED
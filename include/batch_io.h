@@ -0,0 +1,93 @@
+#ifndef BATCH_IO_H_INCLUDED
+#define BATCH_IO_H_INCLUDED
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include "roommate_split.h"
+#include "output_projection.h"
+#include "table_export.h"
+
+//One receipt to split: the input JSON and where its result is written
+struct Batch_job
+{
+    std::string input_path;
+    std::string output_path;
+    //Input file name without its postfix, the cart column of exported tables
+    std::string name;
+};
+
+//Options for run_batch
+struct Batch_options
+{
+    //Split worker threads, 0 uses std::thread::hardware_concurrency
+    unsigned workers = 0;
+    //Jobs kept between read submission and write completion at once
+    unsigned queue_depth = 64;
+    //Use the thread pool I/O backend even when io_uring is available
+    bool force_thread_pool = false;
+    Parse_options parse;
+    //Part of each split result written to its output file
+    Output_projection projection;
+    //Also appends every split result to these tables when set
+    Table_export *tables = nullptr;
+};
+
+//Counters returned by run_batch
+struct Batch_stats
+{
+    //Jobs whose split result was written
+    size_t succeeded = 0;
+    //Jobs that failed parsing or validation, an error JSON was written
+    size_t failed = 0;
+    //Unreadable inputs plus outputs that could not be written, a failed
+    //write is also counted in succeeded or failed
+    size_t io_errors = 0;
+    //Name of the I/O backend that ran the batch
+    std::string backend;
+};
+
+//A finished read or write, data holds the file contents for reads
+struct Io_completion
+{
+    size_t tag = 0;
+    bool write = false;
+    //0 on success, otherwise an errno value
+    int error = 0;
+    std::string data;
+};
+
+/**
+ * Asynchronous whole-file reads and writes. submit_write may be called from
+ * any thread, submit_read and wait only from the thread driving the batch.
+ */
+class Batch_file_io
+{
+    public:
+        virtual ~Batch_file_io() {}
+        virtual const char *name() const = 0;
+        virtual void submit_read(size_t tag, const std::string &path) = 0;
+        virtual void submit_write(size_t tag, const std::string &path,
+                                  std::string &&data) = 0;
+        //Blocks until at least one completion is available and appends them.
+        //Returns 0, or an errno value when the backend itself failed and no
+        //further completions will come
+        virtual int wait(std::vector<Io_completion> &completions) = 0;
+};
+
+//Blocking whole-file helpers, return 0 or an errno value
+int read_whole_file(const std::string &path, std::string *data);
+int write_whole_file(const std::string &path, const std::string &data);
+
+//io_uring on Linux when the kernel supports it, otherwise a thread pool
+std::unique_ptr<Batch_file_io> make_batch_file_io(const Batch_options &options);
+
+//Pairs every <name>_input.json (or <name>.json) in input_dir with
+//output_dir/<name>_output.json
+std::vector<Batch_job> list_batch_jobs(const std::string &input_dir,
+                                       const std::string &output_dir);
+Batch_stats run_batch(const std::vector<Batch_job> &jobs,
+                      const Batch_options &options);
+
+#endif // BATCH_IO_H_INCLUDED
@@ -0,0 +1,216 @@
+#ifndef CART_SESSION_H_INCLUDED
+#define CART_SESSION_H_INCLUDED
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include "roommate_split.h"
+#include "rapidjson/document.h"
+
+/**
+ * A parsed cart kept between requests, so an edit costs what it changes
+ * rather than a parse and split of the whole receipt. Next to the input
+ * cart and roommates it keeps the sums a split is made of: each roommate's
+ * pre-tax total and the sums of item costs and shares. Line item edits take
+ * the item's old contribution out of those sums and add the new one, and
+ * update() finishes the split in time proportional to the roommates.
+ *
+ * Sums adjusted this way can differ from a fresh split in the last bits.
+ * They are rebuilt in the order try_calculate_shares adds them after
+ * roommate edits, every REBUILD_EDITS edits, whenever a total check fails
+ * and when exact results are asked for. Every error reported, and the
+ * results after a rebuild, match a split of the current input from scratch.
+ *
+ * The input can also be edited with RFC 6902 JSON Patch documents through
+ * apply_patch(), and the results answered the same way: changes made to
+ * them since clear_changes() are written as a patch by serialize_changes().
+ *
+ * Not thread safe.
+ */
+class Cart_session
+{
+    public:
+        //Line item edits between two rebuilds of the sums
+        static const unsigned REBUILD_EDITS = 256;
+
+        Cart_session(Cart &&cart, std::map<int, Roommate> &&roommates);
+
+        //Adds the item or replaces the one with its id
+        void set_line_item(Line_item &&item);
+        //False if there is no item with that id
+        bool remove_line_item(int id);
+        void set_cart_totals(double total, double tax);
+        void set_cart_totals(Money_units total, Money_units tax);
+        //Adds the roommate or replaces the one with its id
+        void set_roommate(Roommate &&roommate);
+        bool remove_roommate(int id);
+
+        /**
+         * Applies a JSON Patch to the input document, {"roommates":[...],
+         * "cart":{...}} as serialize_json writes the input. It is kept in
+         * the session from the first patch on, and only items a patch
+         * touches are read back from it. Roommate ids are positions in the
+         * "roommates" array, as in a fresh input, so patching roommates
+         * renumbers any that the edits above left out of order.
+         *
+         * Returns 0, EINVAL if data is not a patch document, or ECANCELED if
+         * an operation does not apply or the patched document is not a
+         * valid input. The session is unchanged on errors.
+         */
+        int apply_patch(const char *data, size_t length,
+                        const Parse_options &options);
+
+        //Finishes the split after edits, results are valid when it is ok.
+        //With exact they are also bit identical to a fresh split, which
+        //costs a rebuild when items were edited since the last one
+        Split_status update(bool exact = false);
+        const Cart &get_cart() const {return cart;}
+        const std::map<int, Roommate> &get_results() const {return results;}
+        //Estimated bytes held by the session
+        size_t get_memory() const;
+        size_t get_rebuild_count() const {return rebuild_count;}
+
+        //Takes the current results as the ones a client holds, called after
+        //answering with them when update() was ok
+        void clear_changes();
+        //A patch from the results at clear_changes() to the current ones,
+        //over "/roommates" of the split document. False, with nothing
+        //written, if there were no such results
+        bool serialize_changes(rapidjson::StringBuffer &sb) const;
+
+    private:
+        void rebuild();
+        void add_contribution(const Line_item &item);
+        void remove_contribution(const Line_item &item);
+        Split_status finish();
+        Split_status finish_exact();
+        //Leaves the sums to the next rebuild when the totals are no longer
+        //exact amounts of money_scale, or newly are
+        void check_money_scale();
+        //The edits above, without dropping the input document
+        void put_line_item(Line_item &&item);
+        bool erase_line_item(int id);
+        void put_roommates(std::map<int, Roommate> &&replacement);
+        void materialize(const Parse_options &options);
+        void track_item(int rm_id, int item_id, int change);
+
+        Cart cart;
+        //Roommates as they were given, results adds the split to them
+        std::map<int, Roommate> roommates;
+        std::map<int, Roommate> results;
+        std::map<int, double> pre_tax;
+        double cost_sum = 0.0;
+        double share_sum = 0.0;
+        //The same sums in integer units when the amounts are all exact with
+        //one scale (exact_money_scale), which is -1 otherwise
+        int money_scale = -1;
+        std::map<int, long long> pre_tax_units;
+        long long cost_units_sum = 0;
+        long long share_units_sum = 0;
+        //Items failing try_validate_line_item, and items split with a
+        //roommate that does not exist. Neither adds to the sums
+        std::map<int, Split_status> invalid_items;
+        std::set<int> unknown_items;
+        //Roommate edits leave the sums to the next rebuild
+        bool stale = true;
+        unsigned edits = 0;
+        size_t memory = 0;
+        size_t rebuild_count = 0;
+
+        //Input document for patches, dropped by the other edits and when
+        //values patches replaced hold half its allocator
+        std::unique_ptr<rapidjson::Document> document;
+        size_t document_capacity = 0;
+        //Changes since clear_changes(): net (roommate id, item id) changes
+        //to the results' items, whether roommates were edited, and the
+        //totals and tax shares then. Rebuilds do not track items: the ones
+        //after item edits find what the edits tracked, the others follow
+        //roommate edits, which are reported whole
+        bool tracking = false;
+        std::map<std::pair<int, int>, int> item_changes;
+        bool roommates_changed = false;
+        bool reported = false;
+        std::map<int, std::pair<double, double>> reported_totals;
+};
+
+/**
+ * Applies an edit document to a session, without updating it. The document
+ * is {"edits":[...]} and each edit one of
+ *   {"op":"set_item","item":<line item as in the input>}
+ *   {"op":"remove_item","id":<id>}
+ *   {"op":"set_cart","total":<total>,"tax":<tax>}
+ *   {"op":"set_roommate","id":<id>,"roommate":<roommate as in the input>}
+ *   {"op":"remove_roommate","id":<id>}
+ * Returns false and leaves the session untouched if any edit is malformed.
+ */
+bool apply_session_edits(const char *data, size_t length,
+                         const Parse_options &options, Cart_session *session);
+
+/**
+ * Cart sessions under random ids, held within a memory budget. Each
+ * session is charged its estimated memory, and the least recently used
+ * sessions are evicted when the sum would exceed the budget.
+ *
+ * The store is thread safe. A session found in it is used under its
+ * entry's mutex, and stays valid for a holder of the pointer even if it
+ * is evicted meanwhile.
+ */
+class Session_store
+{
+    public:
+        struct Entry
+        {
+            Entry(const std::string &id, Cart_session &&session) :
+                id(id), session(std::move(session)) {}
+
+            const std::string id;
+            std::mutex mutex;
+            Cart_session session;
+        };
+        typedef std::shared_ptr<Entry> Entry_ptr;
+
+        explicit Session_store(size_t memory_budget);
+
+        //Stores a new session under an id of 32 random hex digits, nullptr
+        //if it alone exceeds the budget or no random id could be read
+        Entry_ptr add(Cart_session &&session);
+        //Marks the session most recently used, nullptr if unknown or evicted
+        Entry_ptr find(const std::string &id);
+        //Charges the session's memory after edits, with its mutex held.
+        //False if it had been evicted or alone exceeds the budget now, it
+        //is then no longer stored
+        bool charge(const Entry_ptr &entry);
+        bool remove(const std::string &id);
+
+        size_t size() const;
+        size_t get_memory() const;
+        size_t get_eviction_count() const;
+
+    private:
+        struct Slot
+        {
+            Entry_ptr entry;
+            std::list<std::string>::iterator recent;
+            size_t charged;
+        };
+
+        //Evicts least recently used sessions until memory fits the budget
+        void evict();
+        void erase(std::unordered_map<std::string, Slot>::iterator slot);
+
+        size_t memory_budget;
+        mutable std::mutex mutex;
+        std::unordered_map<std::string, Slot> sessions;
+        //Most recently used first
+        std::list<std::string> recent;
+        size_t memory = 0;
+        size_t eviction_count = 0;
+};
+
+#endif // CART_SESSION_H_INCLUDED
@@ -0,0 +1,158 @@
+#ifndef COMPRESSED_STREAM_H_INCLUDED
+#define COMPRESSED_STREAM_H_INCLUDED
+
+#include <cstddef>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Streaming gzip and zstd adapters for rapidjson's stream concepts, so
+ * inputs are parsed and results written straight over compressed files,
+ * in constant memory and without temporary files. gzip uses zlib. zstd is
+ * built in when ROOMMATE_HAVE_ZSTD is defined, which also needs -lzstd.
+ *
+ * Functions returning int give 0 or an errno value.
+ */
+enum class Compression {none, gzip, zstd};
+
+//From a .gz or .zst extension, none for any other path
+Compression compression_for_path(const std::string &path);
+//From the magic bytes at the start of data
+Compression detect_compression(const char *data, size_t length);
+//False for zstd in builds without ROOMMATE_HAVE_ZSTD
+bool compression_supported(Compression compression);
+
+/**
+ * rapidjson input stream over a file or a buffer in memory, decompressing
+ * as the parser takes characters. The format is detected from the magic
+ * bytes, and plain JSON passes through. Concatenated gzip members, as
+ * written by appending to a .gz file, are read as one stream.
+ *
+ * Like rapidjson::FileReadStream, '\0' is returned past the end, and on a
+ * read or decompression error, which get_error() then reports. A limit on
+ * the decompressed size keeps a small compressed input from inflating to
+ * an unbounded document.
+ */
+class Decompressing_read_stream
+{
+    public:
+        typedef char Ch;
+        static const size_t BUFFER_SIZE = 64 * 1024;
+
+        //fp stays owned by the caller. max_output is the most bytes
+        //compressed input may decompress to, 0 for no limit, plain input
+        //is not limited
+        explicit Decompressing_read_stream(FILE *fp, size_t max_output = 0);
+        Decompressing_read_stream(const char *data, size_t length,
+                                  size_t max_output = 0);
+        ~Decompressing_read_stream();
+
+        Ch Peek() const {return *current;}
+        Ch Take()
+        {
+            Ch c = *current;
+            if (current + 1 < end) current++;
+            else if (at_end == false) fill();
+            return c;
+        }
+        size_t Tell() const {return consumed + (current - out_start);}
+
+        //Not an output stream
+        Ch *PutBegin() {return nullptr;}
+        void Put(Ch) {}
+        void Flush() {}
+        size_t PutEnd(Ch *) {return 0;}
+
+        Compression get_compression() const {return compression;}
+        //EIO for a read error, EINVAL for corrupt, truncated or unsupported
+        //data, EFBIG past max_output
+        int get_error() const {return error;}
+
+    private:
+        struct Codec;
+
+        Decompressing_read_stream(const Decompressing_read_stream &);
+        Decompressing_read_stream &operator=(const Decompressing_read_stream &);
+
+        void start();
+        //Makes the next decompressed bytes current, or the final '\0'
+        void fill();
+        //More compressed input, false at the end of the source
+        bool read_input();
+        void finish(int err);
+
+        FILE *fp = nullptr;
+        Compression compression = Compression::none;
+        std::unique_ptr<Codec> codec;
+        //Compressed input, from the file or the caller's buffer
+        std::vector<char> in_buffer;
+        const char *in_next = nullptr;
+        const char *in_end = nullptr;
+        bool source_done = false;
+        //Decompressed bytes handed to the parser
+        std::vector<char> out_buffer;
+        const char *out_start = nullptr;
+        const char *current = nullptr;
+        const char *end = nullptr;
+        size_t consumed = 0;
+        size_t max_output = 0;
+        bool at_end = false;
+        int error = 0;
+        char eof_char = '\0';
+};
+
+/**
+ * rapidjson output stream compressing into a file as characters are put.
+ * finish() writes the end of the compressed stream and must be called
+ * once everything is put, the destructor does not.
+ */
+class Compressing_write_stream
+{
+    public:
+        typedef char Ch;
+        static const size_t BUFFER_SIZE = 64 * 1024;
+
+        //fp stays owned by the caller. level 0 picks the codec's default
+        Compressing_write_stream(FILE *fp, Compression compression, int level = 0);
+        ~Compressing_write_stream();
+
+        void Put(Ch c)
+        {
+            if (current == in_buffer.data() + in_buffer.size()) drain(false);
+            *current++ = c;
+        }
+        void Flush() {drain(false);}
+        //Characters put so far, before compression
+        size_t Tell() const {return drained + (current - in_buffer.data());}
+        int finish();
+        //First error met, EIO for a write error
+        int get_error() const {return error;}
+
+    private:
+        struct Codec;
+
+        Compressing_write_stream(const Compressing_write_stream &);
+        Compressing_write_stream &operator=(const Compressing_write_stream &);
+
+        //Compresses the buffered characters, ending the stream when last
+        void drain(bool last);
+        void write_out(const char *data, size_t length);
+
+        FILE *fp;
+        Compression compression;
+        std::unique_ptr<Codec> codec;
+        std::vector<char> in_buffer;
+        std::vector<char> out_buffer;
+        char *current;
+        size_t drained = 0;
+        bool finished = false;
+        int error = 0;
+};
+
+//Compresses a whole buffer in memory into *out
+int compress_buffer(const char *data, size_t length, Compression compression,
+                    std::string *out);
+
+#endif // COMPRESSED_STREAM_H_INCLUDED
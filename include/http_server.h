@@ -0,0 +1,157 @@
+#ifndef HTTP_SERVER_H_INCLUDED
+#define HTTP_SERVER_H_INCLUDED
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "roommate_split.h"
+#include "output_projection.h"
+#include "request_scheduler.h"
+#include "prefork_pool.h"
+#include "cart_session.h"
+
+//Default ratio of Http_server_options::max_decompressed_body to max_body
+const size_t MAX_INFLATE_RATIO = 16;
+
+//Options for Http_server
+struct Http_server_options
+{
+    std::string address = "127.0.0.1";
+    //0 picks a free port, see Http_server::get_port
+    int port = 8080;
+    //Epoll threads accepting and serving connections
+    unsigned io_threads = 1;
+    //Split worker threads, 0 uses std::thread::hardware_concurrency
+    unsigned workers = 0;
+    //Requests a connection may have parsed but not yet answered
+    unsigned max_pipeline = 64;
+    //Larger request bodies are answered with 413 and the connection closed
+    size_t max_body = 1 << 20;
+    //gzip and zstd /split bodies decompressing past this many bytes are
+    //answered with 413, 0 for MAX_INFLATE_RATIO times max_body. It replaces
+    //parse.max_decompressed
+    size_t max_decompressed_body = 0;
+    Parse_options parse;
+    //Order of queued requests and load shedding, shed requests get 503
+    Scheduler_options schedule;
+    //Split in this many worker processes instead of in-process, so a crash
+    //costs one request a 500. workers is then ignored. /sessions requests
+    //still run in-process, as their carts live in this process. They rely
+    //on the iterative parse and on the json_read_* readers refusing input
+    //of the wrong shape rather than on isolation
+    unsigned processes = 0;
+    //Inputs that crashed a worker process are saved here when set
+    std::string crash_dir;
+    //Memory budget of the carts kept by /sessions, 0 turns sessions off
+    size_t session_memory = 64 << 20;
+};
+
+//What a queued request asks the workers for
+enum class Http_route {split, create_session, edit_session, patch_session,
+                       get_session, delete_session};
+
+//A parsed request body waiting for a split worker
+struct Http_work
+{
+    size_t io_thread;
+    unsigned long long connection;
+    unsigned long long sequence;
+    //Server wide request number, the cart id of trace events
+    unsigned long long request;
+    bool keep_alive;
+    Http_route route = Http_route::split;
+    //Session id of the /sessions/<id> routes
+    std::string session;
+    //Output_projection spec of a /split?view= request, empty for the whole
+    //result
+    std::string view;
+    std::string body;
+};
+
+class Http_io_thread;
+
+/**
+ * Minimal HTTP/1.1 server exposing POST /split. The body is the input JSON
+ * of parse_json_data and the response is the document write_json or
+ * write_error_json would produce, with status 200 or 400 respectively.
+ * POST /split?view=<spec> answers with that Output_projection of the
+ * result instead, a spec that does not parse gets 400.
+ *
+ * Connections are kept alive unless the client asks otherwise, and
+ * pipelined requests are split in parallel by a fixed worker pool while
+ * their responses are still written back in request order. Waiting
+ * requests are ordered by a Request_scheduler, small carts first unless
+ * the options ask for arrival order.
+ *
+ * /sessions keeps carts parsed in the server so a client can edit one
+ * without sending it again, see Cart_session:
+ *   POST /sessions         input JSON, 201 {"session":id,"result":document}
+ *   POST /sessions/<id>    edits for apply_session_edits, answered with
+ *                          {"session":id,"roommates":[totals]} or 400
+ *                          {"session":id,"error":message}
+ *   PATCH /sessions/<id>   a JSON Patch of the input document, answered
+ *                          with an application/json-patch+json patch of
+ *                          the split document since the last one, or the
+ *                          full document if there was none. 409 if the
+ *                          patch does not apply
+ *   GET /sessions/<id>     the full split document, like /split
+ *   DELETE /sessions/<id>  204
+ * Unknown or evicted sessions get 404. A connection's requests after a
+ * session request are only read once it is answered, so edits pipelined
+ * on one connection apply in order.
+ */
+class Http_server
+{
+    public:
+        explicit Http_server(const Http_server_options &options);
+        ~Http_server();
+
+        //Binds, listens and starts all threads, returns 0 or an errno value
+        int start();
+        //Port actually bound, useful when the options asked for port 0
+        int get_port() const;
+        //Requests that crashed a worker process
+        size_t get_crash_count() const;
+        //Stops accepting, closes connections and joins every thread
+        void stop();
+
+    private:
+        friend class Http_io_thread;
+        Http_server(const Http_server &);
+        Http_server &operator=(const Http_server &);
+
+        //Called by I/O threads to queue a request for the workers, false if
+        //the scheduler shed it
+        bool submit(Http_work &&work);
+        void run_worker(unsigned index);
+        void report_crash(const Http_work &work, const Prefork_result &result);
+        //Runs a /sessions request, always in process
+        std::string serve_session(const Http_work &work);
+        std::string serve_patch(const Http_work &work,
+                                const Session_store::Entry_ptr &entry);
+
+        Http_server_options options;
+        int listen_fd = -1;
+        int bound_port = 0;
+        bool running = false;
+
+        std::vector<std::unique_ptr<Http_io_thread>> io_threads;
+        std::vector<std::thread> threads;
+
+        std::mutex work_mutex;
+        std::condition_variable has_work;
+        Request_scheduler<Http_work> scheduler;
+        unsigned long long next_request = 0;
+        bool stopping = false;
+
+        Session_store sessions;
+        Prefork_pool prefork;
+        std::atomic<size_t> crash_count{0};
+};
+
+#endif // HTTP_SERVER_H_INCLUDED
@@ -0,0 +1,128 @@
+#ifndef ID_SET_H_INCLUDED
+#define ID_SET_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <iterator>
+#include <set>
+
+/**
+ * Ordered set of roommate or line item ids. Up to INLINE_CAPACITY ids are
+ * stored inside the object with no heap allocation. Larger sets switch to a
+ * sorted array, or to a bitset when the ids are dense enough that one bit
+ * per possible id is cheaper than one int per member. Sets keep their
+ * storage when cleared, copies get storage fitting the members.
+ * Iteration is always in ascending id order, like std::set<int>.
+ */
+class Id_set
+{
+    public:
+        static const uint32_t INLINE_CAPACITY = 8;
+
+        class const_iterator
+        {
+            public:
+                typedef std::forward_iterator_tag iterator_category;
+                typedef int value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef const int *pointer;
+                typedef const int &reference;
+
+                const_iterator() : set(nullptr), pos(0), value(0) {}
+                const int &operator*() const {return value;}
+                const_iterator &operator++();
+                const_iterator operator++(int);
+                bool operator==(const const_iterator &other) const
+                {
+                    return pos == other.pos;
+                }
+                bool operator!=(const const_iterator &other) const
+                {
+                    return pos != other.pos;
+                }
+
+            private:
+                friend class Id_set;
+                const_iterator(const Id_set *set, size_t pos);
+                void load();
+
+                const Id_set *set;
+                size_t pos;
+                //Current member, bitset mode has no stored int to point at
+                int value;
+        };
+        typedef const_iterator iterator;
+
+        Id_set();
+        Id_set(std::initializer_list<int> ids);
+        Id_set(const std::set<int> &ids);
+        Id_set(const Id_set &other);
+        Id_set(Id_set &&other) noexcept;
+        Id_set &operator=(const Id_set &other);
+        Id_set &operator=(Id_set &&other) noexcept;
+        ~Id_set();
+
+        bool insert(int id);
+        size_t erase(int id);
+        size_t count(int id) const;
+        //Members smaller than id, the index id has or would have in order
+        size_t rank(int id) const;
+        size_t size() const {return member_count;}
+        bool empty() const {return member_count == 0;}
+        //Empties the set, keeping any heap storage it has
+        void clear();
+        const_iterator begin() const;
+        const_iterator end() const;
+        //Members as bits of *mask, false if any member is outside [0, 64)
+        bool get_mask(uint64_t *mask) const;
+
+        //Set algebra, bitset members combine a word at a time
+        Id_set &operator|=(const Id_set &other);
+        Id_set &operator&=(const Id_set &other);
+        Id_set &operator-=(const Id_set &other);
+        bool operator==(const Id_set &other) const;
+        bool operator!=(const Id_set &other) const {return !(*this == other);}
+
+        operator std::set<int>() const;
+
+    private:
+        enum Mode : uint8_t {inline_mode, sorted_mode, bitset_mode};
+        struct Sorted_ids
+        {
+            int *ids;
+            uint32_t capacity;
+        };
+        struct Bit_words
+        {
+            uint64_t *words;
+            uint32_t word_count;
+        };
+
+        //Bitset mode is chosen when max id <= BITSET_DENSITY * size
+        static const int BITSET_DENSITY = 32;
+
+        const int *array_data() const;
+        int *array_data();
+        size_t next_bit(size_t from) const;
+        void to_bitset(int max_id);
+        void to_sorted(uint32_t capacity);
+        void reserve_words(uint32_t words);
+        void release();
+        void recount();
+
+        uint32_t member_count = 0;
+        Mode mode = inline_mode;
+        union
+        {
+            int inline_ids[INLINE_CAPACITY];
+            Sorted_ids sorted;
+            Bit_words bits;
+        };
+};
+
+Id_set operator|(Id_set lhs, const Id_set &rhs);
+Id_set operator&(Id_set lhs, const Id_set &rhs);
+Id_set operator-(Id_set lhs, const Id_set &rhs);
+
+#endif // ID_SET_H_INCLUDED
@@ -0,0 +1,101 @@
+#ifndef JSON_FRAGMENT_WRITER_H_INCLUDED
+#define JSON_FRAGMENT_WRITER_H_INCLUDED
+
+#include <cstddef>
+#include "rapidjson/stream.h"
+#include "rapidjson/internal/dtoa.h"
+#include "rapidjson/internal/ieee754.h"
+#include "rapidjson/internal/itoa.h"
+
+/**
+ * Writes JSON text into a rapidjson output stream (e.g. StringBuffer) from
+ * pre-encoded fragments. Keys, quotes, colons and commas are passed as string
+ * literals whose length is known at compile time, so only the values are
+ * encoded at run time. Values are formatted exactly like rapidjson::Writer
+ * with default flags, which keeps the output byte compatible with it.
+ */
+template <typename OutputStream>
+class Json_fragment_writer
+{
+    public:
+        explicit Json_fragment_writer(OutputStream &os) : os(os) {}
+
+        //Copies a literal fragment such as ",\"name\":" without escaping
+        template <size_t N>
+        void Raw(const char (&fragment)[N])
+        {
+            write_bytes(fragment, N - 1);
+        }
+
+        void Int(int i)
+        {
+            char buffer[11];
+            char *end = rapidjson::internal::i32toa(i, buffer);
+            write_bytes(buffer, static_cast<size_t>(end - buffer));
+        }
+
+        //NaN and infinity write nothing, matching rapidjson::Writer
+        void Double(double d)
+        {
+            if (rapidjson::internal::Double(d).IsNanOrInf()) return;
+            char buffer[25];
+            char *end = rapidjson::internal::dtoa(d, buffer);
+            write_bytes(buffer, static_cast<size_t>(end - buffer));
+        }
+
+        void String(const char *str, size_t length)
+        {
+            static const char hex_digits[16] = {'0', '1', '2', '3', '4', '5',
+                '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F'};
+
+            rapidjson::PutReserve(os, 2 + length * 6);
+            rapidjson::PutUnsafe(os, '\"');
+            for (size_t i = 0; i < length; i++)
+            {
+                unsigned char c = static_cast<unsigned char>(str[i]);
+                char escape = escape_char(c);
+                if (escape == 0)
+                {
+                    rapidjson::PutUnsafe(os, static_cast<char>(c));
+                    continue;
+                }
+                rapidjson::PutUnsafe(os, '\\');
+                rapidjson::PutUnsafe(os, escape);
+                if (escape == 'u')
+                {
+                    rapidjson::PutUnsafe(os, '0');
+                    rapidjson::PutUnsafe(os, '0');
+                    rapidjson::PutUnsafe(os, hex_digits[c >> 4]);
+                    rapidjson::PutUnsafe(os, hex_digits[c & 0xF]);
+                }
+            }
+            rapidjson::PutUnsafe(os, '\"');
+        }
+
+    private:
+        //Same escaping rules as rapidjson::Writer::WriteString
+        static char escape_char(unsigned char c)
+        {
+            if (c >= 0x20) return (c == '\"' || c == '\\') ? c : 0;
+            switch (c)
+            {
+                case '\b': return 'b';
+                case '\t': return 't';
+                case '\n': return 'n';
+                case '\f': return 'f';
+                case '\r': return 'r';
+                default: return 'u';
+            }
+        }
+
+        void write_bytes(const char *bytes, size_t length)
+        {
+            rapidjson::PutReserve(os, length);
+            for (size_t i = 0; i < length; i++)
+                rapidjson::PutUnsafe(os, bytes[i]);
+        }
+
+        OutputStream &os;
+};
+
+#endif // JSON_FRAGMENT_WRITER_H_INCLUDED
@@ -0,0 +1,57 @@
+#ifndef JSON_PATCH_H_INCLUDED
+#define JSON_PATCH_H_INCLUDED
+
+#include <string>
+#include <vector>
+#include "rapidjson/document.h"
+#include "rapidjson/pointer.h"
+
+/**
+ * Applies RFC 6902 JSON Patch operations to a rapidjson document in place,
+ * addressing values with rapidjson::Pointer. Every operation is undone if
+ * it fails, and rollback() undoes the ones applied before it, so a patch is
+ * applied whole or not at all. Members an undo puts back go to the end of
+ * their object.
+ *
+ * Values a patch adds are copied into the document's allocator, which
+ * does not free replaced or removed values until the document is cleared.
+ */
+class Json_patcher
+{
+    public:
+        explicit Json_patcher(rapidjson::Document *document) :
+            document(document) {}
+
+        //Applies one operation object, false if it is malformed or does not
+        //apply, the document is then as before the call
+        bool apply(const rapidjson::Value &operation);
+        //Undoes every operation applied since construction or commit()
+        void rollback();
+        void commit() {undo.clear();}
+
+    private:
+        struct Undo_step
+        {
+            enum Kind {assign, insert, erase};
+            Kind kind;
+            //JSON Pointer text, the value of insert and assign steps
+            std::string path;
+            rapidjson::Value value;
+        };
+
+        Json_patcher(const Json_patcher &);
+        Json_patcher &operator=(const Json_patcher &);
+
+        //The "add" operation, value is moved into the document
+        bool add(const rapidjson::Pointer &path, rapidjson::Value &value,
+                 bool log);
+        //The "remove" operation, *copy receives the value when not null
+        bool remove(const rapidjson::Pointer &path, rapidjson::Value *copy,
+                    bool log);
+        void undo_to(size_t steps);
+
+        rapidjson::Document *document;
+        std::vector<Undo_step> undo;
+};
+
+#endif // JSON_PATCH_H_INCLUDED
@@ -0,0 +1,74 @@
+#ifndef LEDGER_H_INCLUDED
+#define LEDGER_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <string_view>
+#include "roommate_split.h"
+
+//Running sums for one roommate name across every appended split
+struct Ledger_balance
+{
+    long long total_cents = 0;
+    long long tax_cents = 0;
+    unsigned receipts = 0;
+};
+
+/**
+ * Persistent balances across receipts. Every split result is appended to
+ * <path>.log as one checksummed record of (name, total, tax) entries in
+ * cents, the log is the source of truth. <path>.idx is a memory-mapped open
+ * addressing hash table keyed by roommate name holding the running sums, so
+ * balance queries never read the log.
+ *
+ * The index records how much of the log it reflects. open() replays only the
+ * records after that point, and rebuilds the index from the whole log when
+ * it is missing, damaged or was left mid-update by a crash. A torn record at
+ * the end of the log is cut off.
+ *
+ * One process may hold a ledger open at a time. Functions returning int
+ * give 0 or an errno value.
+ */
+class Ledger
+{
+    public:
+        Ledger();
+        ~Ledger();
+
+        //sync makes append fdatasync the log and msync the index
+        int open(const std::string &path, bool sync = false);
+        void close();
+        int append(const std::map<int, Roommate> &roommates);
+        bool get_balance(std::string_view name, Ledger_balance *balance) const;
+        size_t get_record_count() const;
+        size_t get_name_count() const;
+        //Discards the index and replays the whole log
+        int rebuild_index();
+
+    private:
+        struct Index_header;
+        struct Index_slot;
+
+        Ledger(const Ledger &);
+        Ledger &operator=(const Ledger &);
+
+        int map_index(uint64_t capacity, bool reset);
+        int replay_log(uint64_t offset);
+        int apply_record(const char *payload, uint32_t length, uint32_t count);
+        int add_to_slot(std::string_view name, long long total_cents,
+                        long long tax_cents);
+        const Index_slot *find_slot(std::string_view name, uint64_t hash) const;
+        int grow_index();
+
+        int log_fd = -1;
+        int index_fd = -1;
+        bool sync = false;
+        Index_header *header = nullptr;
+        Index_slot *slots = nullptr;
+        size_t mapped_size = 0;
+        std::string record;
+};
+
+#endif // LEDGER_H_INCLUDED
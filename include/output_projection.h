@@ -0,0 +1,41 @@
+#ifndef OUTPUT_PROJECTION_H_INCLUDED
+#define OUTPUT_PROJECTION_H_INCLUDED
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "roommate_split.h"
+
+/**
+ * The part of a split result document a caller asked for. The serializer
+ * only walks what the projection selects, so the size and the time of the
+ * output follow the projection rather than the cart. Specs are
+ *   full              the whole document, as serialize_json writes it
+ *   totals            {"roommates":[{"id","name","total","tax_share"}]}
+ *   no_cart           {"roommates":[...]}, without echoing the cart
+ *   roommate:<id>     {"roommates":[<that roommate>]}
+ *   /<pointer>,...    {"<pointer>":<value>,...} for each JSON Pointer into
+ *                     the full document, null where it resolves to nothing
+ * Array indexes in pointers are positions, roommates and line items are
+ * in id order.
+ */
+class Output_projection
+{
+    public:
+        enum class View {full, totals, no_cart, roommate, pointers};
+
+        //False if spec is none of the above, *projection is then unchanged
+        static bool parse(std::string_view spec, Output_projection *projection);
+
+        View get_view() const {return view;}
+        void serialize(const Cart &cart, const std::map<int, Roommate> &roommates,
+                       rapidjson::StringBuffer &sb) const;
+
+    private:
+        View view = View::full;
+        int roommate_id = 0;
+        //Pointer text, parsed when serializing
+        std::vector<std::string> pointers;
+};
+
+#endif // OUTPUT_PROJECTION_H_INCLUDED
@@ -0,0 +1,113 @@
+#ifndef PARSE_POOL_H_INCLUDED
+#define PARSE_POOL_H_INCLUDED
+
+#include <map>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "roommate_split.h"
+#include "alloc_tracker.h"
+
+class Output_projection;
+class Table_rows;
+
+/**
+ * Reusable state for turning one request's input JSON into a Cart and its
+ * roommates: the input buffer, the rapidjson value and parse stack memory,
+ * and the map nodes of the previous request. parse() recycles all of it, so
+ * once a context has seen a request of similar size it parses without
+ * touching the heap. What it keeps is capped, so a very large cart only
+ * leaves the capped amount behind.
+ */
+class Parse_context
+{
+    public:
+        Parse_context();
+
+        bool parse(const char *data, size_t length, const Parse_options &options);
+        bool parse_file(const std::string &filename, const Parse_options &options);
+        Cart &get_cart();
+        std::map<int, Roommate> &get_roommates();
+        //Number of parses that outgrew the reused rapidjson buffers
+        size_t get_spill_count() const;
+        //Decompressing_read_stream error of the last parse, 0 for plain input
+        //or when only the JSON was invalid
+        int get_input_error() const;
+        //Moves the current cart and roommates aside for reuse by the next parse
+        void recycle();
+
+    private:
+        //Pool chunks past the reused buffers show up in an Alloc_tracker
+        typedef Tracked_pool_allocator Pool_allocator;
+        typedef rapidjson::GenericDocument<rapidjson::UTF8<>, Pool_allocator,
+                                           Pool_allocator> Pool_document;
+        typedef std::map<int, Roommate>::node_type Roommate_node;
+
+        template <unsigned parse_flags>
+        bool parse_document(const char *data, size_t length,
+                            const Parse_options &options);
+        bool read_document(const Tracked_value &document,
+                           const Parse_options &options);
+        void fit_pool(std::vector<char> &buffer,
+                      std::optional<Pool_allocator> &allocator);
+
+        std::string input;
+        Tracking_allocator base_allocator;
+        std::vector<char> value_buffer;
+        std::vector<char> stack_buffer;
+        std::optional<Pool_allocator> value_allocator;
+        std::optional<Pool_allocator> stack_allocator;
+        size_t spill_count = 0;
+        int input_error = 0;
+
+        Cart cart;
+        std::map<int, Roommate> roommates;
+        std::vector<Cart::Line_item_node> spare_items;
+        //Indexed by roommate id, parsed roommates always get ids 0..n-1
+        std::vector<Roommate_node> spare_roommates;
+};
+
+/**
+ * Per-thread free list of Parse_context objects. A lease hands its context
+ * back to the pool of the thread that destroys it.
+ */
+class Parse_context_pool
+{
+    public:
+        class Lease
+        {
+            public:
+                Lease(Lease &&other) noexcept;
+                ~Lease();
+                Parse_context &operator*() const {return *context;}
+                Parse_context *operator->() const {return context.get();}
+
+            private:
+                friend class Parse_context_pool;
+                explicit Lease(std::unique_ptr<Parse_context> context);
+                Lease(const Lease &);
+                Lease &operator=(const Lease &);
+
+                std::unique_ptr<Parse_context> context;
+        };
+
+        static Lease acquire();
+        //Idle contexts held by the calling thread
+        static size_t idle_count();
+
+    private:
+        static std::vector<std::unique_ptr<Parse_context>> &local();
+};
+
+bool split_json_pooled(const char *data, size_t length,
+                       const Parse_options &options, rapidjson::StringBuffer &sb);
+bool split_json_pooled(const char *data, size_t length,
+                       const Parse_options &options, rapidjson::StringBuffer &sb,
+                       Split_status *status,
+                       const Output_projection *projection = nullptr,
+                       Table_rows *rows = nullptr,
+                       std::string_view cart_name = std::string_view());
+
+#endif // PARSE_POOL_H_INCLUDED
@@ -0,0 +1,80 @@
+#ifndef PREFORK_POOL_H_INCLUDED
+#define PREFORK_POOL_H_INCLUDED
+
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "roommate_split.h"
+
+//Outcome of one Prefork_pool::split call
+struct Prefork_result
+{
+    //Return value of split_json_pooled, the response holds its document
+    bool ok = false;
+    //Its Split_status code when not ok
+    Split_error error = Split_error::none;
+    //The worker process died on this input, wait_status is its waitpid status
+    bool crashed = false;
+    int wait_status = 0;
+    pid_t pid = 0;
+};
+
+//Called in the worker with every request body before it is split, null by
+//default. Tests point it at a function crashing on chosen input, since no
+//input is meant to crash the engine itself. Workers are forked with the
+//value it has when the pool starts
+extern void (*prefork_request_hook)(const char *data, size_t length);
+
+/**
+ * Worker processes running split_json_pooled, so input that crashes the
+ * split engine only takes down one process. start() forks a small helper
+ * process while the caller is still single threaded, and every worker is
+ * forked from that helper, never from the threaded caller.
+ *
+ * Each worker is a slot talking to the caller over a unix socket pair with
+ * length-prefixed messages. One thread at a time may use a slot. A worker
+ * that dies is restarted, and its death is reported when it held a request.
+ *
+ * Functions returning int give 0 or an errno value.
+ */
+class Prefork_pool
+{
+    public:
+        Prefork_pool();
+        ~Prefork_pool();
+
+        int start(unsigned workers, const Parse_options &options);
+        void stop();
+        //view is an Output_projection spec, empty for the whole result
+        int split(unsigned slot, const char *data, size_t length,
+                  std::string *response, Prefork_result *result,
+                  const std::string &view = "");
+        pid_t get_worker_pid(unsigned slot) const;
+        //Workers started again after dying
+        size_t get_restart_count() const;
+
+    private:
+        struct Worker
+        {
+            int fd = -1;
+            pid_t pid = 0;
+        };
+
+        Prefork_pool(const Prefork_pool &);
+        Prefork_pool &operator=(const Prefork_pool &);
+
+        int spawn(Worker *worker);
+        //Closes the worker's socket and returns its waitpid status
+        int reap(Worker *worker);
+
+        int control_fd = -1;
+        pid_t helper_pid = 0;
+        std::vector<Worker> workers;
+        //Guards control_fd and restart_count
+        mutable std::mutex control_mutex;
+        size_t restart_count = 0;
+};
+
+#endif // PREFORK_POOL_H_INCLUDED
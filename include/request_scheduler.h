@@ -0,0 +1,163 @@
+#ifndef REQUEST_SCHEDULER_H_INCLUDED
+#define REQUEST_SCHEDULER_H_INCLUDED
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+//Options for Request_scheduler
+struct Scheduler_options
+{
+    //Serve the request with the smallest estimated cost first, false keeps
+    //arrival order
+    bool shortest_first = true;
+    //Nanoseconds of estimated cost a queued request is forgiven per
+    //nanosecond it waits. Smaller requests stop overtaking a queued one
+    //once it has waited 1 / aging times the difference in cost
+    double aging = 0.1;
+    //Requests that would wait longer than this are shed, 0 never sheds
+    double latency_budget_ms = 0.0;
+};
+
+/**
+ * Cheap cost signal of an input JSON read without parsing it: its bytes
+ * plus a weight per object, which is one per roommate and line item.
+ * Splitting arrays are already paid for by their bytes.
+ */
+inline double estimate_split_units(const char *data, size_t length)
+{
+    const double OBJECT_WEIGHT = 32.0;
+    size_t objects = 0;
+    const char *end = data + length;
+    for (const char *p = data;
+         (p = static_cast<const char *>(memchr(p, '{', end - p))) != nullptr; p++)
+        objects++;
+    return static_cast<double>(length) + OBJECT_WEIGHT * objects;
+}
+
+/**
+ * Priority queue in front of the split workers. Each request carries an
+ * estimated cost in units (see estimate_split_units), converted to
+ * nanoseconds with a rate learned from the durations workers report back
+ * through record().
+ *
+ * With shortest_first a request's priority is its estimated cost minus
+ * aging times the time it has waited. As every queued request ages at the
+ * same rate that order never changes, so it is kept as a static key of
+ * cost + aging * arrival in a binary heap.
+ *
+ * push() sheds a request when the estimated work queued ahead of it, spread
+ * over the workers, exceeds the latency budget. Only the queueing delay
+ * counts, a single request larger than the budget is still admitted.
+ *
+ * Not thread safe, callers serialize access.
+ */
+template <typename Work>
+class Request_scheduler
+{
+    public:
+        explicit Request_scheduler(const Scheduler_options &options =
+                                   Scheduler_options(), unsigned workers = 1) :
+            options(options), workers(std::max(1u, workers)) {}
+
+        //Queues work, returns false and leaves work untouched when shed
+        bool push(Work &&work, double units, uint64_t now_ns)
+        {
+            double cost_ns = units * ns_per_unit;
+            double key = options.shortest_first ?
+                cost_ns + options.aging * static_cast<double>(now_ns) :
+                static_cast<double>(arrivals);
+
+            if (options.latency_budget_ms > 0.0)
+            {
+                double budget_ns = options.latency_budget_ms * 1e6 * workers;
+                //The exact wait needs a scan, only done once the whole
+                //backlog could exceed the budget
+                if (queued_units * ns_per_unit > budget_ns &&
+                    units_ahead(key) * ns_per_unit > budget_ns)
+                {
+                    shed_count++;
+                    return false;
+                }
+            }
+
+            heap.push_back(Entry{key, arrivals++, units, std::move(work)});
+            std::push_heap(heap.begin(), heap.end(), later);
+            queued_units += units;
+            return true;
+        }
+
+        bool empty() const {return heap.empty();}
+        size_t size() const {return heap.size();}
+
+        //Removes the next request to serve, *units receives its estimate
+        Work pop(double *units)
+        {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            Entry entry = std::move(heap.back());
+            heap.pop_back();
+            queued_units = heap.empty() ? 0.0 : queued_units - entry.units;
+            *units = entry.units;
+            return std::move(entry.work);
+        }
+
+        //Feeds the measured duration of a served request into the estimates
+        void record(double units, double duration_ns)
+        {
+            if (units <= 0.0) return;
+            ns_per_unit += (duration_ns / units - ns_per_unit) * RATE_SMOOTHING;
+        }
+
+        void clear()
+        {
+            heap.clear();
+            queued_units = 0.0;
+        }
+
+        //Estimated time for the workers to drain the queue
+        double get_backlog_ns() const {return queued_units * ns_per_unit / workers;}
+        double get_ns_per_unit() const {return ns_per_unit;}
+        size_t get_shed_count() const {return shed_count;}
+
+    private:
+        struct Entry
+        {
+            double key;
+            unsigned long long order;
+            double units;
+            Work work;
+        };
+
+        //Weight of each new duration in the learned rate
+        static constexpr double RATE_SMOOTHING = 1.0 / 16;
+
+        static bool later(const Entry &a, const Entry &b)
+        {
+            if (a.key != b.key) return a.key > b.key;
+            return a.order > b.order;
+        }
+
+        double units_ahead(double key) const
+        {
+            double units = 0.0;
+            for (const Entry &entry : heap)
+            {
+                if (entry.key <= key) units += entry.units;
+            }
+            return units;
+        }
+
+        Scheduler_options options;
+        unsigned workers;
+        std::vector<Entry> heap;
+        unsigned long long arrivals = 0;
+        double queued_units = 0.0;
+        //Starting guess, replaced as soon as durations are recorded
+        double ns_per_unit = 20.0;
+        size_t shed_count = 0;
+};
+
+#endif // REQUEST_SCHEDULER_H_INCLUDED
@@ -4,9 +4,15 @@
 #include <iostream>
 #include <map>
 #include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
+#include "id_set.h"
+#include "json_fragment_writer.h"
 
 #define TEST_FILE_PREFIX "Tests/Input/"
 #define TEST_FILE_POSTFIX "_input.json"
@@ -16,24 +22,50 @@
 //Forward declaration of Line_item required for Roommate declaration
 class Line_item;
 
+/**
+ * A money amount as an exact count of 10^-scale units, as parse_json_data
+ * reads it with Parse_options::exact_decimal. Splits of such amounts are
+ * made in integer units, so their parts add up exactly. scale is -1 for an
+ * amount only known as a double.
+ */
+struct Money_units
+{
+    long long units = 0;
+    int scale = -1;
+
+    bool is_exact() const {return scale >= 0;}
+    //The nearest double, for output and for code reading doubles
+    double to_double() const;
+};
+
 //Roommate declaration, implementation in roommate_split.cpp
 class Roommate
 {
     public:
-        Roommate(const int id, std::string name);
-        const int get_id();
-        std::string get_name();
-        void set_name(std::string new_name);
+        Roommate(int id, std::string name);
+        int get_id() const;
+        const std::string &get_name() const;
+        void set_name(std::string_view new_name);
         void add_line_item(const Line_item &new_item);
         void add_line_item(int item_id);
-        void add_line_item(std::set<int> item_ids);
-        void remove_line_item(Line_item &new_item);
+        void add_line_item(const std::set<int> &item_ids);
+        void add_line_item(const Id_set &item_ids);
+        void remove_line_item(const Line_item &new_item);
         void remove_line_item(int item_id);
-        const std::set<int> &get_items();
+        const Id_set &get_items() const;
+        //Setting a double drops the exact amount, setting an exact amount
+        //sets the double to it
         void add_to_total(double val);
-        double get_total();
+        void set_total(double val);
+        void set_total(Money_units val);
+        double get_total() const;
+        Money_units get_total_units() const;
         void set_tax_share(double val);
-        double get_tax_share();
+        void set_tax_share(Money_units val);
+        double get_tax_share() const;
+        Money_units get_tax_share_units() const;
+        //Drops items and totals, keeping id and name
+        void reset();
         friend std::ostream & operator << (std::ostream &out, const Roommate &r);
 
         template <typename Writer>
@@ -57,12 +89,34 @@ class Roommate
             writer.EndObject();
         }
 
+        //Pre-encoded key specialization, byte compatible with the above
+        template <typename OutputStream>
+        void json_serialize(Json_fragment_writer<OutputStream>& writer) const {
+            writer.Raw("{\"id\":");
+            writer.Int(id);
+            writer.Raw(",\"name\":");
+            writer.String(name.c_str(), name.size());
+            writer.Raw(",\"items\":[");
+            for (auto iter = items.begin(); iter != items.end(); iter++)
+            {
+                if (iter != items.begin()) writer.Raw(",");
+                writer.Int(*iter);
+            }
+            writer.Raw("],\"total\":");
+            writer.Double(total);
+            writer.Raw(",\"tax_share\":");
+            writer.Double(tax_share);
+            writer.Raw("}");
+        }
+
     private:
         const int id;
         std::string name;
-        std::set<int> items = {};
+        Id_set items = {};
         double total = 0.0;
         double tax_share = 0.0;
+        Money_units total_units;
+        Money_units tax_share_units;
 
 };
 
@@ -71,22 +125,36 @@ class Line_item
 {
     public:
         Line_item(int id, std::string name, double item_cost,
-                  double share_cost, std::set<int> splitting);
+                  double share_cost, Id_set splitting);
         Line_item();
 
         void set_id(int new_id);
         int get_id() const;
-        int get_id();
-        void set_name(std::string new_name);
-        std::string get_name() const;
+        void set_name(std::string_view new_name);
+        const std::string &get_name() const;
+        //Money setters work like the ones of Roommate
         void set_cost(double new_cost);
+        void set_cost(Money_units new_cost);
         double get_cost() const;
+        Money_units get_cost_units() const;
         void set_share_cost(double new_cost);
+        void set_share_cost(Money_units new_cost);
         double get_share_cost() const;
-        void add_splitting(Roommate &new_rm);
+        Money_units get_share_cost_units() const;
+        void add_splitting(const Roommate &new_rm);
         void add_splitting(int rm_id);
-        void add_splitting(std::set<int> rm_ids);
-        const std::set<int> &get_splitting() const;
+        void add_splitting(const std::set<int> &rm_ids);
+        void add_splitting(const Id_set &rm_ids);
+        //Adds a roommate whose share is weighted, unweighted roommates count 1
+        void add_splitting(int rm_id, int weight);
+        const Id_set &get_splitting() const;
+        int get_weight(int rm_id) const;
+        bool is_weighted() const;
+        //Number of units the cost covers, weights then split those units
+        void set_quantity(int new_quantity);
+        int get_quantity() const;
+        //Drops the splitting, weights and quantity
+        void clear_splitting();
 
         template <typename Writer>
         void json_serialize(Writer& writer) const {
@@ -106,15 +174,71 @@ class Line_item
                 writer.Int(rm);
             }
             writer.EndArray();
+            if (quantity != 1)
+            {
+                writer.String("quantity");
+                writer.Int(quantity);
+            }
+            if (weights.empty() == false)
+            {
+                writer.String("weights");
+                writer.StartArray();
+                for (auto &rm : splitting)
+                {
+                    writer.Int(get_weight(rm));
+                }
+                writer.EndArray();
+            }
             writer.EndObject();
         }
 
+        //Pre-encoded key specialization, byte compatible with the above
+        template <typename OutputStream>
+        void json_serialize(Json_fragment_writer<OutputStream>& writer) const {
+            writer.Raw("{\"id\":");
+            writer.Int(id);
+            writer.Raw(",\"item_name\":");
+            writer.String(name.c_str(), name.size());
+            writer.Raw(",\"cost\":");
+            writer.Double(cost);
+            writer.Raw(",\"share_cost\":");
+            writer.Double(share_cost);
+            writer.Raw(",\"splitting\":[");
+            for (auto iter = splitting.begin(); iter != splitting.end(); iter++)
+            {
+                if (iter != splitting.begin()) writer.Raw(",");
+                writer.Int(*iter);
+            }
+            writer.Raw("]");
+            if (quantity != 1)
+            {
+                writer.Raw(",\"quantity\":");
+                writer.Int(quantity);
+            }
+            if (weights.empty() == false)
+            {
+                writer.Raw(",\"weights\":[");
+                for (auto iter = splitting.begin(); iter != splitting.end(); iter++)
+                {
+                    if (iter != splitting.begin()) writer.Raw(",");
+                    writer.Int(get_weight(*iter));
+                }
+                writer.Raw("]");
+            }
+            writer.Raw("}");
+        }
+
     private:
         int id;
         std::string name;
         double cost;
         double share_cost;
-        std::set<int> splitting = {};
+        Money_units cost_units;
+        Money_units share_cost_units;
+        Id_set splitting = {};
+        int quantity = 1;
+        //(roommate id, weight) sorted by id, only for explicitly weighted ids
+        std::vector<std::pair<int, int>> weights;
 
 };
 
@@ -122,14 +246,32 @@ class Line_item
 class Cart
 {
     public:
-        Cart(double total, double tax, const std::map<int, Line_item> items);
+        Cart(double total, double tax, std::map<int, Line_item> items);
         Cart();
+        //Money setters work like the ones of Roommate
         void set_total(double new_val);
+        void set_total(Money_units new_val);
         double get_total() const;
+        Money_units get_total_units() const;
         void set_tax(double new_val);
+        void set_tax(Money_units new_val);
         double get_tax() const;
-        void add_line_item(Line_item &new_item);
-        void remove_line_item(Line_item &new_item);
+        Money_units get_tax_units() const;
+        typedef std::map<int, Line_item>::node_type Line_item_node;
+
+        void add_line_item(const Line_item &new_item);
+        void add_line_item(Line_item &&new_item);
+        void add_line_item(Line_item_node &&node);
+        //Constructs the item in place from Line_item constructor arguments,
+        //an existing item with the same id is kept, like add_line_item
+        template <typename... Args>
+        Line_item &emplace_line_item(int id, Args&&... args) {
+            return items.try_emplace(id, id, std::forward<Args>(args)...)
+                   .first->second;
+        }
+        void remove_line_item(const Line_item &new_item);
+        //Moves every line item out as a map node so its memory can be reused
+        void release_line_items(std::vector<Line_item_node> *nodes);
         const std::map<int, Line_item> &get_line_items() const;
         friend std::ostream & operator << (std::ostream &out, const Cart &c);
 
@@ -150,22 +292,138 @@ class Cart
             writer.EndObject();
         }
 
+        //Pre-encoded key specialization, byte compatible with the above
+        template <typename OutputStream>
+        void json_serialize(Json_fragment_writer<OutputStream>& writer) const {
+            writer.Raw("{\"total\":");
+            writer.Double(total);
+            writer.Raw(",\"tax\":");
+            writer.Double(tax);
+            writer.Raw(",\"line_items\":[");
+            for (auto iter = items.begin(); iter != items.end(); iter++)
+            {
+                if (iter != items.begin()) writer.Raw(",");
+                iter->second.json_serialize(writer);
+            }
+            writer.Raw("]}");
+        }
+
     private:
         double total;
         double tax;
+        Money_units total_units;
+        Money_units tax_units;
         std::map<int, Line_item> items = {};
 
 };
 
+//Options controlling how parse_json_data reads numeric fields
+struct Parse_options
+{
+    //Read money fields (total, tax, cost, share_cost) as decimal text and
+    //convert them straight to scaled integers instead of using strtod. The
+    //split is then made in those units, see Money_units
+    bool exact_decimal = false;
+    //Number of fractional digits allowed in money fields when exact_decimal
+    //is set, amounts with more precision are rejected
+    int decimal_scale = 2;
+    //Most bytes a gzip or zstd input may decompress to, 0 for no limit
+    size_t max_decompressed = 0;
+};
+
+//rapidjson flags for every parse of request bodies and input files. The
+//iterative parser keeps its nesting on the heap, so a body of nested
+//brackets can not overflow the call stack the way the recursive one does
+const unsigned INPUT_PARSE_FLAGS = rapidjson::kParseIterativeFlag;
+//INPUT_PARSE_FLAGS for options.exact_decimal, money stays decimal text
+const unsigned INPUT_DECIMAL_PARSE_FLAGS =
+    INPUT_PARSE_FLAGS | rapidjson::kParseNumbersAsStringsFlag;
+
+//Failure codes for the non-throwing validation and calculation path
+enum class Split_error
+{
+    none,
+    no_line_items,
+    non_positive_total,
+    negative_tax,
+    negative_item_cost,
+    cost_mismatch,
+    invalid_quantity,
+    invalid_weight,
+    unknown_roommate,
+    total_mismatch,
+    //Compressed input decompressing past Parse_options::max_decompressed
+    input_too_large
+};
+
+//Compact result of try_validate_input/try_calculate_shares, the message text
+//is only formatted when message() is called
+struct Split_status
+{
+    Split_error code = Split_error::none;
+    //Offending line item id for item level errors, -1 otherwise
+    int item_id = -1;
+
+    bool ok() const {return code == Split_error::none;}
+    std::string message() const;
+};
+
 //Roommate Split functions
 void validate_input(Cart *cart, std::map<int, Roommate> *roommates);
+Split_status try_validate_input(const Cart *cart,
+                                const std::map<int, Roommate> *roommates) noexcept;
+//The per item checks of try_validate_input
+Split_status try_validate_line_item(const Line_item &item) noexcept;
 void write_json(Cart &cart, std::map<int, Roommate> &roommates,
                 std::string filename);
+void serialize_json(const Cart &cart, const std::map<int, Roommate> &roommates,
+                    rapidjson::StringBuffer &sb);
 void write_error_json(std::string filename, std::string error_text);
+void write_error_json(std::string filename, const Split_status &status);
+void serialize_error_json(const std::string &error_text,
+                          rapidjson::StringBuffer &sb);
 bool json_has_parent_fields(rapidjson::Document *doc);
 bool parse_json_data(Cart *cart, std::map<int, Roommate> *roommates,
                      std::string filename);
+bool parse_json_data(Cart *cart, std::map<int, Roommate> *roommates,
+                     std::string filename, const Parse_options &options);
+bool parse_json_buffer(Cart *cart, std::map<int, Roommate> *roommates,
+                       const char *data, size_t length,
+                       const Parse_options &options);
+//Instantiated for rapidjson::Value and Tracked_value (alloc_tracker.h). The
+//readers check the shape of what they read and return false for a missing
+//field or one of the wrong type, so any parsed document is safe to pass
+template <typename Json_value>
+bool json_input_arrays(const Json_value &document, const Json_value **json_roommates,
+                       const Json_value **json_items);
+template <typename Json_value>
+bool json_read_roommate(const Json_value &json_rm,
+                        const Parse_options &options, Roommate *rm);
+template <typename Json_value>
+bool json_read_line_item(const Json_value &json_li,
+                         const Parse_options &options, Line_item *li);
+template <typename Json_value>
+bool json_read_cart_totals(const Json_value &json_cart,
+                           const Parse_options &options, Cart *cart);
+bool split_json_buffer(const char *data, size_t length,
+                       const Parse_options &options, rapidjson::StringBuffer &sb);
+bool parse_decimal_units(const char *text, size_t length, int scale,
+                         long long *units);
+//Splits amount into count parts in proportion to weights, adding up to it
+//exactly. Parts are rounded down and the units left go one each to the
+//largest remainders, the earlier part first on ties. False for a negative
+//amount or weight, or a non-zero amount over weights summing to zero
+bool apportion_units(long long amount, const long long *weights, size_t count,
+                     long long *parts);
+//Scale shared by the cart totals, item costs and roommate totals the split
+//starts from, -1 unless they are all exact amounts of one scale
+int exact_money_scale(const Cart &cart, const std::map<int, Roommate> &roommates);
 void calculate_shares(Cart *cart, std::map<int, Roommate> *roommates);
+Split_status try_calculate_shares(Cart *cart,
+                                  std::map<int, Roommate> *roommates);
+//try_calculate_shares without the small group kernels, for tests and benchmarks
+Split_status try_calculate_shares_generic(Cart *cart,
+                                          std::map<int, Roommate> *roommates);
 bool approximately_equal(double a, double b, double epsilon);
 std::ostream& operator << (std::ostream &out, const Roommate &r);
 std::ostream& operator << (std::ostream &out, const Cart &c);
@@ -0,0 +1,51 @@
+#ifndef SETTLEMENT_H_INCLUDED
+#define SETTLEMENT_H_INCLUDED
+
+#include <map>
+#include <utility>
+#include <vector>
+#include "roommate_split.h"
+
+//One payment that settles part of the bill, amount in integer cents
+struct Transfer
+{
+    int from;
+    int to;
+    long long cents;
+};
+
+//Options for settle_balances and settle_shares
+struct Settlement_options
+{
+    //Search for the fewest possible transfers when at most exact_limit
+    //roommates have a non-zero balance, larger groups use the greedy pass
+    bool exact = true;
+    int exact_limit = 16;
+};
+
+/**
+ * Turns (roommate id, balance in cents) pairs into transfers. A positive
+ * balance is owed to the roommate, a negative one is owed by them, and the
+ * balances must sum to zero. The greedy pass always pairs the largest
+ * debtor with the largest creditor, O(R log R) with at most R - 1 transfers.
+ */
+std::vector<Transfer> settle_balances(
+    const std::vector<std::pair<int, long long>> &balances,
+    const Settlement_options &options);
+
+/**
+ * Settles a calculated split: payments maps the roommates who paid at the
+ * register to the amount they paid, the roommates' totals are what they owe.
+ * Amounts are rounded to cents and rounding leftovers are spread one cent at
+ * a time in id order. Fails if the payments do not cover the totals.
+ */
+bool settle_shares(const std::map<int, double> &payments,
+                   const std::map<int, Roommate> &roommates,
+                   const Settlement_options &options,
+                   std::vector<Transfer> *transfers);
+
+//Writes {"transfers":[{"from":..,"to":..,"amount":..}]}
+void serialize_settlement_json(const std::vector<Transfer> &transfers,
+                               rapidjson::StringBuffer &sb);
+
+#endif // SETTLEMENT_H_INCLUDED
@@ -0,0 +1,90 @@
+#ifndef SHARD_COORDINATOR_H_INCLUDED
+#define SHARD_COORDINATOR_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/**
+ * Consistent hash ring of nodes, each placed at virtual_nodes points. A key
+ * belongs to the first point at or after its hash, so removing a node only
+ * moves the keys it owned.
+ */
+class Hash_ring
+{
+    public:
+        explicit Hash_ring(unsigned virtual_nodes = 64);
+
+        //Nodes are numbered in the order they are added
+        void add(std::string_view node);
+        size_t size() const {return node_count;}
+        //Owner of key among the nodes not marked in down, -1 if all are
+        int lookup(std::string_view key, const std::vector<bool> &down = {}) const;
+
+    private:
+        unsigned virtual_nodes;
+        size_t node_count = 0;
+        //(hash, node) sorted by hash
+        std::vector<std::pair<uint64_t, int>> points;
+};
+
+//Options for run_sharded_batch
+struct Shard_options
+{
+    //split_server endpoints as host:port, host being an IPv4 address
+    std::vector<std::string> workers;
+    //Progress of every shard is recorded here when set, and receipts it
+    //lists are skipped by the next run
+    std::string checkpoint_dir;
+    //Failed connections in a row before a worker's shard moves to the
+    //remaining workers
+    unsigned attempts = 3;
+    //Requests in flight per worker connection
+    unsigned pipeline = 16;
+    //Answers taking longer than this count as a failed connection
+    unsigned timeout_ms = 30000;
+    unsigned virtual_nodes = 64;
+};
+
+//Counters returned by run_sharded_batch
+struct Shard_stats
+{
+    //Receipts answered 200
+    size_t succeeded = 0;
+    //Receipts answered with an error document
+    size_t failed = 0;
+    //Receipts that could not be read
+    size_t io_errors = 0;
+    //Receipts already done according to the checkpoints
+    size_t skipped = 0;
+    //Requests sent again after a connection failed or the worker shed them
+    size_t retried = 0;
+    //Workers given up on
+    size_t lost_workers = 0;
+};
+
+//Non-empty lines of a manifest file that do not start with '#', returns 0
+//or an errno value
+int read_manifest(const std::string &path, std::vector<std::string> *inputs);
+
+/**
+ * Splits every receipt in inputs on the workers. Receipts are sharded by
+ * consistent hashing of their path, and each worker gets one pipelined
+ * keep-alive connection. Results are merged into out as JSON lines
+ * {"index":i,"input":path,"status":code,"result":document}, in completion
+ * order. Unreadable receipts get an "error" member instead of a status.
+ *
+ * A result is written and flushed before its path is appended to the
+ * shard's checkpoint, so after a crash a receipt may be written twice but
+ * never lost. Returns 0, or EHOSTUNREACH when every worker was lost with
+ * receipts left.
+ */
+int run_sharded_batch(const std::vector<std::string> &inputs,
+                      const Shard_options &options, std::ostream &out,
+                      Shard_stats *stats);
+
+#endif // SHARD_COORDINATOR_H_INCLUDED
@@ -0,0 +1,152 @@
+#ifndef SHM_RING_H_INCLUDED
+#define SHM_RING_H_INCLUDED
+
+/*
+ * Shared-memory request/response interface of the split engine, usable from
+ * C and C++. A server (Shm_split_server in shm_server.h) creates a POSIX
+ * shared memory object holding a header, a submission queue and a fixed
+ * number of slots. A caller claims a free slot, writes its request into the
+ * slot, queues the slot index and sleeps on a futex; the server writes the
+ * result back into the same slot and wakes it.
+ *
+ * Requests are either the usual input JSON (the response is the write_json
+ * or write_error_json document) or a packed binary cart described below.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RS_RING_MAGIC 0x52534d52u
+#define RS_RING_VERSION 1u
+
+/* Request formats */
+#define RS_FORMAT_JSON 0u
+#define RS_FORMAT_PACKED 1u
+
+/* Slot status values besides Split_error codes */
+#define RS_STATUS_TOO_LARGE (-1)
+#define RS_STATUS_INVALID_INPUT (-2)
+#define RS_STATUS_SHUTDOWN (-3)
+
+/* Slot states */
+#define RS_SLOT_FREE 0u
+#define RS_SLOT_CLAIMED 1u
+#define RS_SLOT_SUBMITTED 2u
+#define RS_SLOT_SERVING 3u
+#define RS_SLOT_DONE 4u
+
+/*
+ * Packed request: one rs_packed_cart, then item_count items, each an
+ * rs_packed_item followed by split_count int32_t roommate indexes and
+ * padding up to a multiple of 8 bytes. Roommates are 0..roommate_count-1.
+ * Packed response: roommate_count rs_packed_share entries in roommate order,
+ * written only when the status is 0.
+ */
+typedef struct rs_packed_cart
+{
+    uint32_t roommate_count;
+    uint32_t item_count;
+    double total;
+    double tax;
+} rs_packed_cart;
+
+typedef struct rs_packed_item
+{
+    int32_t id;
+    uint32_t split_count;
+    double cost;
+} rs_packed_item;
+
+typedef struct rs_packed_share
+{
+    double total;
+    double tax_share;
+} rs_packed_share;
+
+/* Bytes one packed item with split_count roommates takes */
+#define RS_PACKED_ITEM_SIZE(split_count) \
+    (sizeof(rs_packed_item) + (((split_count) * 4u + 7u) & ~7u))
+
+/* Shared layout, every field shared between processes is only touched with
+ * atomic builtins */
+typedef struct rs_ring_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_capacity;
+    /* Bumped on every submission, servers sleep on it */
+    uint32_t submit_futex;
+    uint32_t server_sleepers;
+    /* Bumped on every slot release, callers without a slot sleep on it */
+    uint32_t release_futex;
+    uint32_t release_sleepers;
+    uint32_t stopping;
+    /* Process id of the server, callers waiting on a ring whose server
+     * exited without stopping give up; 0 when unknown */
+    uint32_t server_pid;
+    uint32_t reserved[2];
+    /* Bounded multi-producer multi-consumer queue of slot indexes */
+    uint64_t queue_head;
+    uint64_t queue_tail;
+} rs_ring_header;
+
+typedef struct rs_queue_cell
+{
+    uint64_t sequence;
+    uint64_t slot;
+} rs_queue_cell;
+
+typedef struct rs_slot
+{
+    uint32_t state;
+    /* Set while the caller sleeps on state */
+    uint32_t waiting;
+    uint32_t format;
+    /* Split_error code of the result or one of the RS_STATUS values */
+    int32_t status;
+    uint64_t length;
+    uint64_t reserved[5];
+    /* slot_capacity data bytes follow, the response overwrites the request */
+} rs_slot;
+
+/* Byte offsets inside the shared object */
+#define RS_QUEUE_OFFSET sizeof(rs_ring_header)
+#define RS_SLOTS_OFFSET(slot_count) \
+    (RS_QUEUE_OFFSET + (size_t)(slot_count) * sizeof(rs_queue_cell))
+#define RS_SLOT_STRIDE(slot_capacity) \
+    ((sizeof(rs_slot) + (size_t)(slot_capacity) + 63u) & ~(size_t)63u)
+#define RS_RING_SIZE(slot_count, slot_capacity) \
+    (RS_SLOTS_OFFSET(slot_count) + \
+     (size_t)(slot_count) * RS_SLOT_STRIDE(slot_capacity))
+
+typedef struct rs_client rs_client;
+
+/* Maps the ring a server created under name, NULL with errno set on failure */
+rs_client *rs_client_open(const char *name);
+void rs_client_close(rs_client *client);
+
+/*
+ * Sends one request and waits for its response. Returns 0 or an errno
+ * value: E2BIG if the request does not fit a slot, ENOBUFS if the response
+ * did not fit the slot or capacity (response_length then holds the size
+ * needed when known) and ESHUTDOWN if the server stopped or its process
+ * exited, the latter noticed within a sleep period. status receives 0,
+ * the Split_error code of a rejected cart or RS_STATUS_INVALID_INPUT for a
+ * request that could not be parsed; JSON requests still get an error
+ * document in those cases.
+ */
+int rs_client_split(rs_client *client, uint32_t format,
+                    const void *request, size_t request_length,
+                    void *response, size_t capacity,
+                    size_t *response_length, int32_t *status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHM_RING_H_INCLUDED */
@@ -0,0 +1,65 @@
+#ifndef SHM_SERVER_H_INCLUDED
+#define SHM_SERVER_H_INCLUDED
+
+#include <cstddef>
+#include <string>
+#include <thread>
+#include <vector>
+#include "roommate_split.h"
+#include "shm_ring.h"
+
+//Options for Shm_split_server
+struct Shm_server_options
+{
+    //POSIX shared memory object name, starting with a slash
+    std::string name = "/roommate_split";
+    //Requests in flight at once, rounded up to a power of two
+    unsigned slots = 64;
+    //Bytes per slot, requests and responses must both fit
+    size_t slot_capacity = 64 * 1024;
+    //Threads taking requests off the queue
+    unsigned workers = 1;
+    Parse_options parse;
+};
+
+/**
+ * Serves split requests placed in shared memory by rs_client_split callers,
+ * see shm_ring.h for the layout. Results are written back into the
+ * request's slot, so neither side copies through a socket.
+ */
+class Shm_split_server
+{
+    public:
+        explicit Shm_split_server(const Shm_server_options &options);
+        ~Shm_split_server();
+
+        //Creates the shared memory object and starts the workers, returns 0
+        //or an errno value
+        int start();
+        //Wakes every caller with ESHUTDOWN, joins the workers and unlinks
+        //the shared memory object
+        void stop();
+
+    private:
+        Shm_split_server(const Shm_split_server &);
+        Shm_split_server &operator=(const Shm_split_server &);
+
+        void run_worker();
+        void serve(rs_slot *slot);
+
+        Shm_server_options options;
+        void *memory = nullptr;
+        size_t mapped_size = 0;
+        std::vector<std::thread> workers;
+};
+
+/**
+ * Splits a packed binary cart (see rs_packed_cart) and writes one
+ * rs_packed_share per roommate to response. Returns 0, a Split_error code,
+ * RS_STATUS_INVALID_INPUT or RS_STATUS_TOO_LARGE; response_length receives
+ * the bytes written or needed.
+ */
+int split_packed_cart(const void *request, size_t request_length,
+                      void *response, size_t capacity, size_t *response_length);
+
+#endif // SHM_SERVER_H_INCLUDED
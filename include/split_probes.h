@@ -0,0 +1,59 @@
+#ifndef SPLIT_PROBES_H_INCLUDED
+#define SPLIT_PROBES_H_INCLUDED
+
+/**
+ * USDT probes at the start and end of the split stages, for perf and
+ * bpftrace to attach to without depending on inlining or symbol names.
+ * Each stage fires <stage>_start and <stage>_done under the provider
+ * roommate_split, with the arguments
+ *   arg0  cart id of the enclosing Trace_cart_scope, -1 outside one
+ *   arg1  bytes parsed or serialized so far, 0 for validate and calculate
+ *   arg2  line items in the cart
+ *   arg3  roommates
+ * The stages are parse, validate, calculate and serialize. Probes compile
+ * to a nop and a note in the binary when sys/sdt.h (systemtap-sdt-dev) is
+ * installed, and to nothing without it or with ROOMMATE_NO_PROBES. See
+ * tools/bpftrace for scripts using them.
+ */
+
+#if !defined(ROOMMATE_NO_PROBES) && __has_include(<sys/sdt.h>)
+#define ROOMMATE_HAVE_SDT 1
+#include <sys/sdt.h>
+#include "trace.h"
+#endif
+
+#ifdef ROOMMATE_HAVE_SDT
+
+//Runs a callable when the scope it is declared in ends
+template <typename F>
+class Split_probe_exit
+{
+    public:
+        explicit Split_probe_exit(F f) : f(f) {}
+        ~Split_probe_exit(){f();}
+
+    private:
+        F f;
+};
+
+#define SPLIT_PROBE(name, bytes, items, roommates) \
+    DTRACE_PROBE4(roommate_split, name, trace_cart_id(), \
+                  static_cast<unsigned long long>(bytes), \
+                  static_cast<unsigned long long>(items), \
+                  static_cast<unsigned long long>(roommates))
+
+//Fires <stage>_start now and <stage>_done on every return from the scope,
+//the arguments are evaluated again then
+#define SPLIT_PROBE_STAGE(stage, bytes, items, roommates) \
+    SPLIT_PROBE(stage##_start, bytes, items, roommates); \
+    auto split_probe_done = [&]{SPLIT_PROBE(stage##_done, bytes, items, roommates);}; \
+    Split_probe_exit<decltype(split_probe_done)> split_probe_exit(split_probe_done)
+
+#else
+
+#define SPLIT_PROBE(name, bytes, items, roommates) do {} while (0)
+#define SPLIT_PROBE_STAGE(stage, bytes, items, roommates) do {} while (0)
+
+#endif
+
+#endif // SPLIT_PROBES_H_INCLUDED
@@ -0,0 +1,81 @@
+#ifndef TABLE_EXPORT_H_INCLUDED
+#define TABLE_EXPORT_H_INCLUDED
+
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include "roommate_split.h"
+
+/**
+ * Columnar export of split results for analytics, two flat tables instead
+ * of one nested document per cart:
+ *   roommates.csv   cart,roommate_id,name,total,tax_share
+ *   line_items.csv  cart,item_id,item_name,cost,share_cost,share_count
+ * with cart the receipt name. CSV quotes text fields holding a separator,
+ * quote or line break. TSV (.tsv files) escapes tab, line breaks and
+ * backslash with a backslash instead.
+ */
+enum class Table_format {csv, tsv};
+
+/**
+ * Rows of the carts one thread split, formatted into reused buffers so
+ * adding a cart allocates nothing once they have grown.
+ */
+class Table_rows
+{
+    public:
+        //Buffered rows are handed to the export past this many bytes
+        static const size_t FLUSH_SIZE = 256 * 1024;
+
+        explicit Table_rows(Table_format format);
+
+        void add(std::string_view cart_name, const Cart &cart,
+                 const std::map<int, Roommate> &roommates);
+        size_t size() const {return roommate_rows.size() + item_rows.size();}
+        void clear();
+
+    private:
+        friend class Table_export;
+
+        void put_text(std::string &out, std::string_view text);
+        void put_int(std::string &out, int value);
+        void put_double(std::string &out, double value);
+
+        Table_format format;
+        char separator;
+        std::string roommate_rows;
+        std::string item_rows;
+};
+
+//The two table files of a batch run, shared by its split workers
+class Table_export
+{
+    public:
+        Table_export();
+        ~Table_export();
+
+        //Creates both tables in dir and writes their header rows
+        int open(const std::string &dir, Table_format format);
+        bool is_open() const {return roommate_file != nullptr;}
+        Table_format get_format() const {return format;}
+        //Appends the buffered rows and clears them, safe from any thread
+        void append(Table_rows &rows);
+        //Returns the first write error, 0 if every row was written
+        int close();
+
+    private:
+        Table_export(const Table_export &);
+        Table_export &operator=(const Table_export &);
+
+        void write(FILE *fp, const std::string &data);
+
+        std::mutex mutex;
+        Table_format format = Table_format::csv;
+        FILE *roommate_file = nullptr;
+        FILE *item_file = nullptr;
+        int error = 0;
+};
+
+#endif // TABLE_EXPORT_H_INCLUDED
@@ -0,0 +1,82 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "alloc_tracker.h"
+
+/**
+ * Optional timeline of the split stages as Chrome trace-event JSON, which
+ * chrome://tracing and Perfetto display per thread. While tracing is off a
+ * span costs one relaxed load. While it is on every thread appends complete
+ * events to a buffer of its own without locking, and trace_stop writes all
+ * buffers out at the end.
+ *
+ * Spans are named after the stage they time: parse, validate, calculate,
+ * serialize, read_file and write_file. Their args carry the cart id set by
+ * the enclosing Trace_cart_scope and the item count when known.
+ */
+
+extern std::atomic<bool> trace_active;
+
+inline bool trace_enabled(){return trace_active.load(std::memory_order_relaxed);}
+
+//Starts a new trace, events recorded before are dropped
+void trace_start();
+//Stops tracing and writes the trace to path, returns 0 or an errno value.
+//Call it once traced threads are idle, spans still open are left out
+int trace_stop(const std::string &path);
+
+//Times the enclosing scope as one event while tracing is on, and is the
+//stage an Alloc_tracker on the thread counts allocations under
+class Trace_span
+{
+    public:
+        explicit Trace_span(const char *name) : name(name)
+        {
+            if (trace_enabled()) begin();
+            if (alloc_tracking()) alloc_stage = Alloc_tracker::enter_stage(name);
+        }
+        ~Trace_span()
+        {
+            if (start_ns != 0) end();
+            if (alloc_stage != NO_ALLOC_STAGE) Alloc_tracker::leave_stage(alloc_stage);
+        }
+        void set_items(size_t count){items = static_cast<long long>(count);}
+
+    private:
+        Trace_span(const Trace_span &);
+        Trace_span &operator=(const Trace_span &);
+
+        void begin();
+        void end();
+
+        static const int NO_ALLOC_STAGE = -2;
+
+        const char *name;
+        uint64_t start_ns = 0;
+        long long items = -1;
+        //Stage to restore when leaving, NO_ALLOC_STAGE if none was entered
+        int alloc_stage = NO_ALLOC_STAGE;
+};
+
+//Cart id of the innermost Trace_cart_scope on the calling thread, -1 if none
+long long trace_cart_id();
+
+//Cart id recorded by the spans of the calling thread while in scope
+class Trace_cart_scope
+{
+    public:
+        explicit Trace_cart_scope(long long cart);
+        ~Trace_cart_scope();
+
+    private:
+        Trace_cart_scope(const Trace_cart_scope &);
+        Trace_cart_scope &operator=(const Trace_cart_scope &);
+
+        long long previous;
+};
+
+#endif // TRACE_H_INCLUDED
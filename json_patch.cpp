@@ -0,0 +1,252 @@
+#include "include/json_patch.h"
+
+#include <cstring>
+
+#include "include/rapidjson/stringbuffer.h"
+
+typedef rapidjson::Pointer::Token Pointer_token;
+
+//Pointer text of parent followed by one more token, as "~" and "/" escaped
+static std::string child_path(const rapidjson::Pointer &parent,
+                              const char *name, size_t length)
+{
+    rapidjson::StringBuffer sb;
+    parent.Stringify(sb);
+    std::string path(sb.GetString(), sb.GetSize());
+    path.push_back('/');
+    for (size_t i = 0; i < length; i++)
+    {
+        if (name[i] == '~') path.append("~0");
+        else if (name[i] == '/') path.append("~1");
+        else path.push_back(name[i]);
+    }
+    return path;
+}
+
+static std::string child_path(const rapidjson::Pointer &parent,
+                              rapidjson::SizeType index)
+{
+    std::string name = std::to_string(index);
+    return child_path(parent, name.data(), name.size());
+}
+
+static bool read_member(const rapidjson::Value &object, const char *name,
+                        const rapidjson::Value **member)
+{
+    auto iter = object.FindMember(name);
+    if (iter == object.MemberEnd()) return false;
+    *member = &iter->value;
+    return true;
+}
+
+//from is a proper prefix of path, moving a value into itself is refused
+static bool is_proper_prefix(const rapidjson::Pointer &from,
+                             const rapidjson::Pointer &path)
+{
+    if (from.GetTokenCount() >= path.GetTokenCount()) return false;
+    for (size_t i = 0; i < from.GetTokenCount(); i++)
+    {
+        const Pointer_token &a = from.GetTokens()[i];
+        const Pointer_token &b = path.GetTokens()[i];
+        if (a.length != b.length || memcmp(a.name, b.name, a.length) != 0)
+            return false;
+    }
+    return true;
+}
+
+//Json_patcher Implementation
+bool Json_patcher::apply(const rapidjson::Value &operation)
+{
+    const rapidjson::Value *op = nullptr;
+    const rapidjson::Value *path_text = nullptr;
+    if (operation.IsObject() == false || read_member(operation, "op", &op) == false ||
+        op->IsString() == false || read_member(operation, "path", &path_text) == false ||
+        path_text->IsString() == false)
+        return false;
+    rapidjson::Pointer path(path_text->GetString(), path_text->GetStringLength());
+    if (path.IsValid() == false) return false;
+
+    const rapidjson::Value *value = nullptr;
+    bool has_value = read_member(operation, "value", &value);
+    const rapidjson::Value *from_text = nullptr;
+    rapidjson::Pointer from;
+    if (read_member(operation, "from", &from_text))
+    {
+        if (from_text->IsString() == false) return false;
+        from = rapidjson::Pointer(from_text->GetString(),
+                                  from_text->GetStringLength());
+        if (from.IsValid() == false) return false;
+    }
+
+    auto &allocator = document->GetAllocator();
+    std::string name(op->GetString(), op->GetStringLength());
+    size_t mark = undo.size();
+    bool ok = false;
+    if (name == "add" && has_value)
+    {
+        rapidjson::Value copy(*value, allocator);
+        ok = add(path, copy, true);
+    }
+    else if (name == "remove")
+        ok = remove(path, nullptr, true);
+    else if (name == "replace" && has_value)
+    {
+        rapidjson::Value *target = path.Get(*document);
+        if (target != nullptr)
+        {
+            rapidjson::StringBuffer sb;
+            path.Stringify(sb);
+            undo.push_back(Undo_step{Undo_step::assign, sb.GetString(),
+                                     rapidjson::Value()});
+            undo.back().value = *target;
+            *target = rapidjson::Value(*value, allocator);
+            ok = true;
+        }
+    }
+    else if (name == "move" && from_text != nullptr)
+    {
+        rapidjson::Value moved;
+        if (from == path) ok = path.Get(*document) != nullptr;
+        else if (is_proper_prefix(from, path) == false)
+            ok = remove(from, &moved, true) && add(path, moved, true);
+    }
+    else if (name == "copy" && from_text != nullptr)
+    {
+        const rapidjson::Value *source = from.Get(*document);
+        if (source != nullptr)
+        {
+            rapidjson::Value copy(*source, allocator);
+            ok = add(path, copy, true);
+        }
+    }
+    else if (name == "test" && has_value)
+    {
+        const rapidjson::Value *target = path.Get(*document);
+        ok = target != nullptr && *target == *value;
+    }
+
+    if (ok == false) undo_to(mark);
+    return ok;
+}
+
+void Json_patcher::rollback(){undo_to(0);}
+
+bool Json_patcher::add(const rapidjson::Pointer &path, rapidjson::Value &value,
+                       bool log)
+{
+    auto &allocator = document->GetAllocator();
+    size_t count = path.GetTokenCount();
+    if (count == 0)
+    {
+        if (log) undo.push_back(Undo_step{Undo_step::assign, "", rapidjson::Value()});
+        if (log) undo.back().value = static_cast<rapidjson::Value &>(*document);
+        static_cast<rapidjson::Value &>(*document) = value;
+        return true;
+    }
+
+    const Pointer_token &last = path.GetTokens()[count - 1];
+    rapidjson::Pointer parent_path(path.GetTokens(), count - 1);
+    rapidjson::Value *parent = parent_path.Get(*document);
+    if (parent == nullptr) return false;
+
+    if (parent->IsObject())
+    {
+        auto member = parent->FindMember(rapidjson::Value(rapidjson::StringRef(
+            last.name, last.length)));
+        if (member != parent->MemberEnd())
+        {
+            if (log)
+            {
+                undo.push_back(Undo_step{Undo_step::assign,
+                                         child_path(parent_path, last.name,
+                                                    last.length),
+                                         rapidjson::Value()});
+                undo.back().value = member->value;
+            }
+            member->value = value;
+            return true;
+        }
+        if (log)
+            undo.push_back(Undo_step{Undo_step::erase,
+                                     child_path(parent_path, last.name, last.length),
+                                     rapidjson::Value()});
+        parent->AddMember(rapidjson::Value(last.name, last.length, allocator),
+                          value, allocator);
+        return true;
+    }
+    if (parent->IsArray() == false) return false;
+
+    rapidjson::SizeType index = last.index;
+    if (last.length == 1 && last.name[0] == '-') index = parent->Size();
+    else if (index == rapidjson::kPointerInvalidIndex || index > parent->Size())
+        return false;
+    parent->PushBack(value, allocator);
+    for (rapidjson::SizeType i = parent->Size() - 1; i > index; i--)
+        (*parent)[i].Swap((*parent)[i - 1]);
+    if (log)
+        undo.push_back(Undo_step{Undo_step::erase, child_path(parent_path, index),
+                                 rapidjson::Value()});
+    return true;
+}
+
+bool Json_patcher::remove(const rapidjson::Pointer &path, rapidjson::Value *copy,
+                          bool log)
+{
+    size_t count = path.GetTokenCount();
+    if (count == 0) return false;
+    const Pointer_token &last = path.GetTokens()[count - 1];
+    rapidjson::Pointer parent_path(path.GetTokens(), count - 1);
+    rapidjson::Value *parent = parent_path.Get(*document);
+    if (parent == nullptr) return false;
+
+    rapidjson::Value removed;
+    std::string removed_path;
+    if (parent->IsObject())
+    {
+        auto member = parent->FindMember(rapidjson::Value(rapidjson::StringRef(
+            last.name, last.length)));
+        if (member == parent->MemberEnd()) return false;
+        removed = member->value;
+        parent->EraseMember(member);
+        if (log) removed_path = child_path(parent_path, last.name, last.length);
+    }
+    else if (parent->IsArray())
+    {
+        if (last.index == rapidjson::kPointerInvalidIndex ||
+            last.index >= parent->Size())
+            return false;
+        removed = (*parent)[last.index];
+        parent->Erase(parent->Begin() + last.index);
+        if (log) removed_path = child_path(parent_path, last.index);
+    }
+    else
+        return false;
+
+    if (copy != nullptr) copy->CopyFrom(removed, document->GetAllocator());
+    if (log)
+    {
+        undo.push_back(Undo_step{Undo_step::insert, removed_path, rapidjson::Value()});
+        undo.back().value = removed;
+    }
+    return true;
+}
+
+//Steps are logged with concrete indexes, so each one reverts exactly
+void Json_patcher::undo_to(size_t steps)
+{
+    while (undo.size() > steps)
+    {
+        Undo_step &step = undo.back();
+        rapidjson::Pointer path(step.path.data(), step.path.size());
+        if (step.kind == Undo_step::assign)
+        {
+            rapidjson::Value *target = path.Get(*document);
+            if (target != nullptr) *target = step.value;
+        }
+        else if (step.kind == Undo_step::insert)
+            add(path, step.value, false);
+        else
+            remove(path, nullptr, false);
+        undo.pop_back();
+    }
+}
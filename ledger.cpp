@@ -0,0 +1,412 @@
+#include "include/ledger.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char INDEX_MAGIC[8] = {'R', 'M', 'L', 'G', 'I', 'D', 'X', '1'};
+static const uint32_t RECORD_MAGIC = 0x314c4d52;
+static const uint64_t INITIAL_INDEX_CAPACITY = 1024;
+//Name bytes kept in a slot, longer names are matched by this prefix plus
+//their length and 64-bit hash
+static const size_t SLOT_NAME_BYTES = 33;
+static const uint8_t SLOT_USED = 1;
+
+//Log record layout: header, then per entry a u16 name length, the name and
+//two int64 amounts in cents. crc covers count and the payload.
+struct Record_header
+{
+    uint32_t magic;
+    uint32_t length;
+    uint32_t crc;
+    uint32_t count;
+};
+
+struct Ledger::Index_header
+{
+    char magic[8];
+    uint64_t capacity;
+    uint64_t used;
+    //Log bytes and records reflected in the slots
+    uint64_t log_offset;
+    uint64_t records;
+    //Set while slots are ahead of log_offset
+    uint32_t dirty;
+    uint32_t reserved[5];
+};
+
+struct Ledger::Index_slot
+{
+    uint64_t hash;
+    int64_t total_cents;
+    int64_t tax_cents;
+    uint32_t receipts;
+    uint16_t name_length;
+    uint8_t state;
+    char name[SLOT_NAME_BYTES];
+};
+
+static uint32_t crc32_update(uint32_t crc, const char *data, size_t length)
+{
+    static uint32_t table[256];
+    static bool table_ready = [](){
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        return true;
+    }();
+    (void)table_ready;
+
+    crc = ~crc;
+    for (size_t i = 0; i < length; i++)
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t record_crc(const Record_header &rec, const char *payload)
+{
+    uint32_t crc = crc32_update(0, reinterpret_cast<const char *>(&rec.count),
+                                sizeof(rec.count));
+    return crc32_update(crc, payload, rec.length);
+}
+
+//FNV-1a
+static uint64_t hash_name(std::string_view name)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : name)
+    {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static int write_fully(int fd, const char *data, size_t length)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = write(fd, data + done, length - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno;
+        done += n;
+    }
+    return 0;
+}
+
+//Ledger Implementation
+Ledger::Ledger() {}
+Ledger::~Ledger(){close();}
+
+int Ledger::open(const std::string &path, bool sync)
+{
+    static_assert(sizeof(Index_header) == 64, "index header layout");
+    static_assert(sizeof(Index_slot) == 64, "index slot layout");
+    close();
+    this->sync = sync;
+    log_fd = ::open((path + ".log").c_str(),
+                    O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0) return errno;
+    //One writer per ledger, the index is updated in place
+    if (flock(log_fd, LOCK_EX | LOCK_NB) != 0)
+    {
+        int err = errno;
+        close();
+        return err;
+    }
+    index_fd = ::open((path + ".idx").c_str(), O_RDWR | O_CREAT | O_CLOEXEC,
+                      0644);
+    if (index_fd < 0)
+    {
+        int err = errno;
+        close();
+        return err;
+    }
+
+    struct stat log_st, index_st;
+    if (fstat(log_fd, &log_st) != 0 || fstat(index_fd, &index_st) != 0)
+    {
+        int err = errno;
+        close();
+        return err;
+    }
+
+    //Trust the index only if it is complete and not ahead of the log
+    Index_header existing;
+    bool usable = false;
+    if (static_cast<size_t>(index_st.st_size) >= sizeof(existing) &&
+        pread(index_fd, &existing, sizeof(existing), 0) ==
+            static_cast<ssize_t>(sizeof(existing)))
+    {
+        usable = memcmp(existing.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0 &&
+                 existing.dirty == 0 && existing.capacity != 0 &&
+                 (existing.capacity & (existing.capacity - 1)) == 0 &&
+                 static_cast<uint64_t>(index_st.st_size) ==
+                     sizeof(Index_header) + existing.capacity * sizeof(Index_slot) &&
+                 existing.log_offset <= static_cast<uint64_t>(log_st.st_size);
+    }
+
+    int err = usable ? map_index(existing.capacity, false)
+                     : map_index(INITIAL_INDEX_CAPACITY, true);
+    if (err == 0) err = replay_log(header->log_offset);
+    if (err != 0) close();
+    return err;
+}
+
+void Ledger::close()
+{
+    if (header != nullptr)
+    {
+        if (sync) msync(header, mapped_size, MS_SYNC);
+        munmap(header, mapped_size);
+    }
+    header = nullptr;
+    slots = nullptr;
+    mapped_size = 0;
+    if (log_fd >= 0) ::close(log_fd);
+    if (index_fd >= 0) ::close(index_fd);
+    log_fd = -1;
+    index_fd = -1;
+}
+
+//Maps the index file at capacity slots, reset starts an empty table
+int Ledger::map_index(uint64_t capacity, bool reset)
+{
+    if (header != nullptr) munmap(header, mapped_size);
+    header = nullptr;
+    slots = nullptr;
+
+    size_t size = sizeof(Index_header) + capacity * sizeof(Index_slot);
+    if (reset && ftruncate(index_fd, 0) != 0) return errno;
+    if (ftruncate(index_fd, size) != 0) return errno;
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        index_fd, 0);
+    if (memory == MAP_FAILED) return errno;
+
+    mapped_size = size;
+    header = static_cast<Index_header *>(memory);
+    slots = reinterpret_cast<Index_slot *>(header + 1);
+    if (reset)
+    {
+        memset(header, 0, sizeof(Index_header));
+        memcpy(header->magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+        header->capacity = capacity;
+    }
+    return 0;
+}
+
+int Ledger::rebuild_index()
+{
+    if (log_fd < 0) return EBADF;
+    int err = map_index(INITIAL_INDEX_CAPACITY, true);
+    if (err != 0) return err;
+    return replay_log(0);
+}
+
+//Applies the log records from offset on and cuts off a torn tail
+int Ledger::replay_log(uint64_t offset)
+{
+    struct stat st;
+    if (fstat(log_fd, &st) != 0) return errno;
+    uint64_t log_size = st.st_size;
+    if (offset >= log_size) return 0;
+
+    void *memory = mmap(nullptr, log_size, PROT_READ, MAP_PRIVATE, log_fd, 0);
+    if (memory == MAP_FAILED) return errno;
+    const char *log = static_cast<const char *>(memory);
+
+    header->dirty = 1;
+    while (offset + sizeof(Record_header) <= log_size)
+    {
+        Record_header rec;
+        memcpy(&rec, log + offset, sizeof(rec));
+        const char *payload = log + offset + sizeof(rec);
+        if (rec.magic != RECORD_MAGIC ||
+            rec.length > log_size - offset - sizeof(rec) ||
+            record_crc(rec, payload) != rec.crc)
+            break;
+
+        int err = apply_record(payload, rec.length, rec.count);
+        if (err != 0)
+        {
+            munmap(memory, log_size);
+            return err;
+        }
+        offset += sizeof(rec) + rec.length;
+        header->log_offset = offset;
+        header->records++;
+    }
+    header->dirty = 0;
+    munmap(memory, log_size);
+
+    if (offset < log_size && ftruncate(log_fd, offset) != 0) return errno;
+    return 0;
+}
+
+int Ledger::apply_record(const char *payload, uint32_t length, uint32_t count)
+{
+    const char *end = payload + length;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint16_t name_length;
+        int64_t amounts[2];
+        if (static_cast<size_t>(end - payload) < sizeof(name_length))
+            return EINVAL;
+        memcpy(&name_length, payload, sizeof(name_length));
+        payload += sizeof(name_length);
+        if (static_cast<size_t>(end - payload) < name_length + sizeof(amounts))
+            return EINVAL;
+        std::string_view name(payload, name_length);
+        payload += name_length;
+        memcpy(amounts, payload, sizeof(amounts));
+        payload += sizeof(amounts);
+        int err = add_to_slot(name, amounts[0], amounts[1]);
+        if (err != 0) return err;
+    }
+    return 0;
+}
+
+const Ledger::Index_slot *Ledger::find_slot(std::string_view name,
+                                            uint64_t hash) const
+{
+    uint64_t mask = header->capacity - 1;
+    size_t stored = std::min(name.size(), SLOT_NAME_BYTES);
+    for (uint64_t pos = hash & mask;; pos = (pos + 1) & mask)
+    {
+        const Index_slot &slot = slots[pos];
+        if (slot.state != SLOT_USED) return &slot;
+        if (slot.hash == hash && slot.name_length == name.size() &&
+            memcmp(slot.name, name.data(), stored) == 0)
+            return &slot;
+    }
+}
+
+int Ledger::add_to_slot(std::string_view name, long long total_cents,
+                        long long tax_cents)
+{
+    //Stay under 3/4 full so probes stay short
+    if ((header->used + 1) * 4 > header->capacity * 3)
+    {
+        int err = grow_index();
+        if (err != 0) return err;
+    }
+
+    uint64_t hash = hash_name(name);
+    Index_slot *slot = const_cast<Index_slot *>(find_slot(name, hash));
+    if (slot->state != SLOT_USED)
+    {
+        slot->hash = hash;
+        slot->name_length = name.size();
+        memcpy(slot->name, name.data(), std::min(name.size(), SLOT_NAME_BYTES));
+        slot->state = SLOT_USED;
+        header->used++;
+    }
+    slot->total_cents += total_cents;
+    slot->tax_cents += tax_cents;
+    slot->receipts++;
+    return 0;
+}
+
+//Doubles the table in place, slots keep their sums and are reinserted
+int Ledger::grow_index()
+{
+    std::vector<Index_slot> live;
+    live.reserve(header->used);
+    for (uint64_t i = 0; i < header->capacity; i++)
+    {
+        if (slots[i].state == SLOT_USED) live.push_back(slots[i]);
+    }
+    Index_header saved = *header;
+
+    int err = map_index(saved.capacity * 2, false);
+    if (err != 0) return err;
+    *header = saved;
+    header->capacity = saved.capacity * 2;
+    memset(static_cast<void *>(slots), 0, header->capacity * sizeof(Index_slot));
+
+    uint64_t mask = header->capacity - 1;
+    for (const Index_slot &slot : live)
+    {
+        uint64_t pos = slot.hash & mask;
+        while (slots[pos].state == SLOT_USED) pos = (pos + 1) & mask;
+        slots[pos] = slot;
+    }
+    return 0;
+}
+
+int Ledger::append(const std::map<int, Roommate> &roommates)
+{
+    if (log_fd < 0) return EBADF;
+
+    record.resize(sizeof(Record_header));
+    for (auto &rm_pair : roommates)
+    {
+        const Roommate &rm = rm_pair.second;
+        if (rm.get_name().size() > UINT16_MAX) return ENAMETOOLONG;
+        uint16_t name_length = rm.get_name().size();
+        int64_t amounts[2] = {std::llround(rm.get_total() * 100.0),
+                              std::llround(rm.get_tax_share() * 100.0)};
+        record.append(reinterpret_cast<const char *>(&name_length),
+                      sizeof(name_length));
+        record.append(rm.get_name());
+        record.append(reinterpret_cast<const char *>(amounts), sizeof(amounts));
+    }
+
+    Record_header rec;
+    rec.magic = RECORD_MAGIC;
+    rec.length = record.size() - sizeof(rec);
+    rec.count = roommates.size();
+    rec.crc = record_crc(rec, record.data() + sizeof(rec));
+    memcpy(&record[0], &rec, sizeof(rec));
+
+    int err = write_fully(log_fd, record.data(), record.size());
+    if (err == 0 && sync && fdatasync(log_fd) != 0) err = errno;
+    if (err != 0)
+    {
+        //Later records must not land behind a partial one
+        if (ftruncate(log_fd, header->log_offset) != 0) return errno;
+        return err;
+    }
+
+    header->dirty = 1;
+    err = apply_record(record.data() + sizeof(rec), rec.length, rec.count);
+    if (err != 0) return err;
+    header->log_offset += record.size();
+    header->records++;
+    header->dirty = 0;
+    if (sync && msync(header, mapped_size, MS_SYNC) != 0) return errno;
+    return 0;
+}
+
+bool Ledger::get_balance(std::string_view name, Ledger_balance *balance) const
+{
+    if (header == nullptr) return false;
+    const Index_slot *slot = find_slot(name, hash_name(name));
+    if (slot->state != SLOT_USED) return false;
+    balance->total_cents = slot->total_cents;
+    balance->tax_cents = slot->tax_cents;
+    balance->receipts = slot->receipts;
+    return true;
+}
+
+size_t Ledger::get_record_count() const
+{
+    return header == nullptr ? 0 : header->records;
+}
+
+size_t Ledger::get_name_count() const
+{
+    return header == nullptr ? 0 : header->used;
+}
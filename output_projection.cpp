@@ -0,0 +1,286 @@
+#include "include/output_projection.h"
+#include "include/split_probes.h"
+#include "include/trace.h"
+
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+#include "include/rapidjson/document.h"
+#include "include/rapidjson/pointer.h"
+
+typedef rapidjson::Pointer::Token Pointer_token;
+typedef Json_fragment_writer<rapidjson::StringBuffer> Fragment_writer;
+
+static bool token_is(const Pointer_token &token, const char *name)
+{
+    return token.length == strlen(name) && memcmp(token.name, name, token.length) == 0;
+}
+
+//Writes an id array of a roommate or line item, or with one more token the
+//id at that position, null past its end
+template <typename Value>
+static void write_array(const Id_set &ids, Value value, const Pointer_token *tokens,
+                        size_t count, Fragment_writer &writer)
+{
+    if (count == 0)
+    {
+        writer.Raw("[");
+        for (auto iter = ids.begin(); iter != ids.end(); iter++)
+        {
+            if (iter != ids.begin()) writer.Raw(",");
+            writer.Int(value(*iter));
+        }
+        writer.Raw("]");
+        return;
+    }
+    if (count > 1 || tokens[0].index == rapidjson::kPointerInvalidIndex ||
+        tokens[0].index >= ids.size())
+    {
+        writer.Raw("null");
+        return;
+    }
+    writer.Int(value(*std::next(ids.begin(), tokens[0].index)));
+}
+
+//Scalar members are written straight from the object, false for the others
+static bool write_member(const Roommate &rm, const Pointer_token &token,
+                         Fragment_writer &writer)
+{
+    if (token_is(token, "id")) writer.Int(rm.get_id());
+    else if (token_is(token, "name"))
+        writer.String(rm.get_name().data(), rm.get_name().size());
+    else if (token_is(token, "total")) writer.Double(rm.get_total());
+    else if (token_is(token, "tax_share")) writer.Double(rm.get_tax_share());
+    else return false;
+    return true;
+}
+
+static bool write_member(const Line_item &item, const Pointer_token &token,
+                         Fragment_writer &writer)
+{
+    if (token_is(token, "id")) writer.Int(item.get_id());
+    else if (token_is(token, "item_name"))
+        writer.String(item.get_name().data(), item.get_name().size());
+    else if (token_is(token, "cost")) writer.Double(item.get_cost());
+    else if (token_is(token, "share_cost")) writer.Double(item.get_share_cost());
+    else return false;
+    return true;
+}
+
+/**
+ * Writes the value the tokens address inside a roommate or line item, null
+ * if there is none, as found in its json_serialize output. Fields are read
+ * from the object, nothing is serialized or parsed to find them.
+ */
+static void write_within(const Roommate &rm, const Pointer_token *tokens,
+                         size_t count, Fragment_writer &writer)
+{
+    if (count == 1 && write_member(rm, tokens[0], writer)) return;
+    if (token_is(tokens[0], "items"))
+        write_array(rm.get_items(), [](int id){return id;}, tokens + 1, count - 1,
+                    writer);
+    else
+        writer.Raw("null");
+}
+
+static void write_within(const Line_item &item, const Pointer_token *tokens,
+                         size_t count, Fragment_writer &writer)
+{
+    if (count == 1 && write_member(item, tokens[0], writer)) return;
+    if (token_is(tokens[0], "splitting"))
+        write_array(item.get_splitting(), [](int id){return id;}, tokens + 1,
+                    count - 1, writer);
+    else if (token_is(tokens[0], "weights") && item.is_weighted())
+        write_array(item.get_splitting(),
+                    [&item](int id){return item.get_weight(id);}, tokens + 1,
+                    count - 1, writer);
+    else if (token_is(tokens[0], "quantity") && count == 1 &&
+             item.get_quantity() != 1)
+        writer.Int(item.get_quantity());
+    else
+        writer.Raw("null");
+}
+
+/**
+ * Writes the i-th element of an id ordered map, or what tokens address in
+ * it. Pointers index the serialized array by position. When the ids are
+ * exactly 0..n-1, as for parsed roommates, position and id agree and the
+ * element is found by id, otherwise reaching it walks i map nodes.
+ */
+template <typename T>
+static void write_element(const std::map<int, T> &elements,
+                          const Pointer_token *tokens, size_t count,
+                          rapidjson::StringBuffer &sb)
+{
+    Fragment_writer writer(sb);
+    if (tokens[0].index == rapidjson::kPointerInvalidIndex ||
+        tokens[0].index >= elements.size())
+    {
+        writer.Raw("null");
+        return;
+    }
+    bool dense = elements.begin()->first == 0 &&
+                 static_cast<size_t>(elements.rbegin()->first) == elements.size() - 1;
+    const T &element = dense ?
+        elements.find(static_cast<int>(tokens[0].index))->second :
+        std::next(elements.begin(), tokens[0].index)->second;
+    if (count == 1) element.json_serialize(writer);
+    else write_within(element, tokens + 1, count - 1, writer);
+}
+
+//Writes the value one pointer addresses in the split document
+static void write_pointer(const Cart &cart, const std::map<int, Roommate> &roommates,
+                          const std::string &text, rapidjson::StringBuffer &sb)
+{
+    rapidjson::Pointer pointer(text.data(), text.size());
+    const Pointer_token *tokens = pointer.GetTokens();
+    size_t count = pointer.GetTokenCount();
+    Fragment_writer writer(sb);
+    if (count == 0)
+    {
+        serialize_json(cart, roommates, sb);
+        return;
+    }
+
+    if (token_is(tokens[0], "roommates"))
+    {
+        if (count > 1)
+        {
+            write_element(roommates, tokens + 1, count - 1, sb);
+            return;
+        }
+        writer.Raw("[");
+        for (auto iter = roommates.begin(); iter != roommates.end(); iter++)
+        {
+            if (iter != roommates.begin()) writer.Raw(",");
+            iter->second.json_serialize(writer);
+        }
+        writer.Raw("]");
+        return;
+    }
+    if (token_is(tokens[0], "cart") == false)
+        writer.Raw("null");
+    else if (count == 1)
+        cart.json_serialize(writer);
+    else if (token_is(tokens[1], "total") && count == 2)
+        writer.Double(cart.get_total());
+    else if (token_is(tokens[1], "tax") && count == 2)
+        writer.Double(cart.get_tax());
+    else if (token_is(tokens[1], "line_items") && count > 2)
+        write_element(cart.get_line_items(), tokens + 2, count - 2, sb);
+    else if (token_is(tokens[1], "line_items"))
+    {
+        writer.Raw("[");
+        const std::map<int, Line_item> &items = cart.get_line_items();
+        for (auto iter = items.begin(); iter != items.end(); iter++)
+        {
+            if (iter != items.begin()) writer.Raw(",");
+            iter->second.json_serialize(writer);
+        }
+        writer.Raw("]");
+    }
+    else
+        writer.Raw("null");
+}
+
+//Output_projection Implementation
+bool Output_projection::parse(std::string_view spec, Output_projection *projection)
+{
+    const std::string_view ROOMMATE = "roommate:";
+    Output_projection parsed;
+    if (spec == "full")
+        parsed.view = View::full;
+    else if (spec == "totals")
+        parsed.view = View::totals;
+    else if (spec == "no_cart")
+        parsed.view = View::no_cart;
+    else if (spec.substr(0, ROOMMATE.size()) == ROOMMATE)
+    {
+        std::string id(spec.substr(ROOMMATE.size()));
+        char *end = nullptr;
+        long value = strtol(id.c_str(), &end, 10);
+        if (id.empty() || *end != '\0' || value < INT_MIN || value > INT_MAX)
+            return false;
+        parsed.view = View::roommate;
+        parsed.roommate_id = static_cast<int>(value);
+    }
+    else
+    {
+        parsed.view = View::pointers;
+        size_t start = 0;
+        for (;;)
+        {
+            size_t comma = spec.find(',', start);
+            std::string_view text = spec.substr(start, comma == std::string_view::npos ?
+                                                       comma : comma - start);
+            if (text.empty() || text[0] != '/' ||
+                rapidjson::Pointer(text.data(), text.size()).IsValid() == false)
+                return false;
+            parsed.pointers.emplace_back(text);
+            if (comma == std::string_view::npos) break;
+            start = comma + 1;
+        }
+    }
+    *projection = std::move(parsed);
+    return true;
+}
+
+void Output_projection::serialize(const Cart &cart,
+                                  const std::map<int, Roommate> &roommates,
+                                  rapidjson::StringBuffer &sb) const
+{
+    if (view == View::full)
+    {
+        serialize_json(cart, roommates, sb);
+        return;
+    }
+
+    Trace_span span("serialize");
+    [[maybe_unused]] size_t start_size = sb.GetSize();
+    SPLIT_PROBE_STAGE(serialize, sb.GetSize() - start_size, cart.get_line_items().size(),
+                      roommates.size());
+    Fragment_writer writer(sb);
+    if (view == View::pointers)
+    {
+        writer.Raw("{");
+        for (size_t i = 0; i < pointers.size(); i++)
+        {
+            if (i > 0) writer.Raw(",");
+            writer.String(pointers[i].data(), pointers[i].size());
+            writer.Raw(":");
+            write_pointer(cart, roommates, pointers[i], sb);
+        }
+        writer.Raw("}");
+        return;
+    }
+
+    writer.Raw("{\"roommates\":[");
+    if (view == View::roommate)
+    {
+        auto rm = roommates.find(roommate_id);
+        if (rm != roommates.end()) rm->second.json_serialize(writer);
+    }
+    for (auto iter = roommates.begin();
+         view != View::roommate && iter != roommates.end(); iter++)
+    {
+        if (iter != roommates.begin()) writer.Raw(",");
+        const Roommate &rm = iter->second;
+        if (view == View::no_cart)
+        {
+            rm.json_serialize(writer);
+            continue;
+        }
+        writer.Raw("{\"id\":");
+        writer.Int(rm.get_id());
+        writer.Raw(",\"name\":");
+        writer.String(rm.get_name().data(), rm.get_name().size());
+        writer.Raw(",\"total\":");
+        writer.Double(rm.get_total());
+        writer.Raw(",\"tax_share\":");
+        writer.Double(rm.get_tax_share());
+        writer.Raw("}");
+    }
+    writer.Raw("]}");
+}
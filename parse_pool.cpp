@@ -0,0 +1,295 @@
+#include "include/parse_pool.h"
+#include "include/batch_io.h"
+#include "include/compressed_stream.h"
+#include "include/split_probes.h"
+#include "include/output_projection.h"
+#include "include/table_export.h"
+#include "include/trace.h"
+
+#include <algorithm>
+#include <cerrno>
+
+//Starting sizes of the reused rapidjson buffers, grown to fit on demand
+static const size_t INITIAL_VALUE_BUFFER = 16 * 1024;
+static const size_t INITIAL_STACK_BUFFER = 4 * 1024;
+static const size_t PARSE_STACK_CAPACITY = 1024;
+//Heap chunk size once a parse outgrows the reused buffer
+static const size_t POOL_CHUNK_CAPACITY = 64 * 1024;
+//Most memory a context keeps between requests, so one huge cart does not
+//pin its nodes and buffers for the life of the thread. Larger requests
+//allocate the excess and free it when they are recycled
+static const size_t MAX_REUSED_BUFFER = 8 * 1024 * 1024;
+static const size_t MAX_REUSED_INPUT = 8 * 1024 * 1024;
+static const size_t MAX_SPARE_ITEMS = 16 * 1024;
+static const size_t MAX_SPARE_ROOMMATES = 1024;
+
+static size_t next_power_of_two(size_t n)
+{
+    size_t size = 1;
+    while (size < n) size <<= 1;
+    return size;
+}
+
+//Parse_context Implementation
+Parse_context::Parse_context() :
+    value_buffer(INITIAL_VALUE_BUFFER), stack_buffer(INITIAL_STACK_BUFFER)
+{
+    value_allocator.emplace(value_buffer.data(), value_buffer.size(),
+                            POOL_CHUNK_CAPACITY, &base_allocator);
+    stack_allocator.emplace(stack_buffer.data(), stack_buffer.size(),
+                            POOL_CHUNK_CAPACITY, &base_allocator);
+}
+
+Cart &Parse_context::get_cart(){return cart;}
+std::map<int, Roommate> &Parse_context::get_roommates(){return roommates;}
+size_t Parse_context::get_spill_count() const{return spill_count;}
+int Parse_context::get_input_error() const{return input_error;}
+
+void Parse_context::recycle()
+{
+    cart.release_line_items(&spare_items);
+    if (spare_items.size() > MAX_SPARE_ITEMS)
+    {
+        spare_items.resize(MAX_SPARE_ITEMS);
+        spare_items.shrink_to_fit();
+    }
+    cart.set_total(0.0);
+    cart.set_tax(0.0);
+
+    size_t bound = std::min(roommates.size(), MAX_SPARE_ROOMMATES);
+    while (roommates.empty() == false)
+    {
+        Roommate_node node = roommates.extract(roommates.begin());
+        int id = node.key();
+        if (id < 0 || static_cast<size_t>(id) >= bound) continue;
+        if (spare_roommates.size() <= static_cast<size_t>(id))
+            spare_roommates.resize(bound);
+        spare_roommates[id] = std::move(node);
+    }
+}
+
+bool Parse_context::parse(const char *data, size_t length,
+                          const Parse_options &options)
+{
+    Trace_span span("parse");
+    recycle();
+    input_error = 0;
+    SPLIT_PROBE_STAGE(parse, length, cart.get_line_items().size(), roommates.size());
+    bool ok;
+    if (options.exact_decimal)
+        ok = parse_document<INPUT_DECIMAL_PARSE_FLAGS>(data, length, options);
+    else
+        ok = parse_document<INPUT_PARSE_FLAGS>(data, length, options);
+
+    fit_pool(value_buffer, value_allocator);
+    fit_pool(stack_buffer, stack_allocator);
+    span.set_items(cart.get_line_items().size());
+    return ok;
+}
+
+bool Parse_context::parse_file(const std::string &filename,
+                               const Parse_options &options)
+{
+    if (read_whole_file(filename, &input) != 0)
+    {
+        recycle();
+        input_error = 0;
+        return false;
+    }
+    bool ok = parse(input.data(), input.size(), options);
+    if (input.capacity() > MAX_REUSED_INPUT)
+    {
+        input.clear();
+        input.shrink_to_fit();
+    }
+    return ok;
+}
+
+template <unsigned parse_flags>
+bool Parse_context::parse_document(const char *data, size_t length,
+                                   const Parse_options &options)
+{
+    Pool_document document(&*value_allocator, PARSE_STACK_CAPACITY,
+                           &*stack_allocator);
+    if (detect_compression(data, length) == Compression::none)
+        document.Parse<parse_flags>(data, length);
+    else
+    {
+        //Compressed bodies and files are inflated as the parser reads them
+        Decompressing_read_stream is(data, length, options.max_decompressed);
+        document.ParseStream<parse_flags>(is);
+        input_error = is.get_error();
+        if (input_error != 0) return false;
+    }
+    if (document.HasParseError()) return false;
+    return read_document(document, options);
+}
+
+//Same walk as parse_json_data, but every map node comes from the spares
+bool Parse_context::read_document(const Tracked_value &document,
+                                  const Parse_options &options)
+{
+    const Tracked_value *json_roommates;
+    const Tracked_value *json_items;
+    if (json_input_arrays(document, &json_roommates, &json_items) == false)
+        return false;
+
+    int index = 0;
+    for (auto &json_rm : json_roommates->GetArray())
+    {
+        Roommate_node node;
+        if (static_cast<size_t>(index) < spare_roommates.size() &&
+            spare_roommates[index].empty() == false)
+        {
+            node = std::move(spare_roommates[index]);
+            node.mapped().reset();
+        }
+        else
+        {
+            std::map<int, Roommate> fresh;
+            fresh.emplace(index, Roommate(index, ""));
+            node = fresh.extract(fresh.begin());
+        }
+
+        auto inserted = roommates.insert(std::move(node));
+        if (json_read_roommate(json_rm, options, &inserted.position->second) == false)
+            return false;
+        index++;
+    }
+
+    if (json_read_cart_totals(document["cart"], options, &cart) == false)
+        return false;
+    for (auto &json_li : json_items->GetArray())
+    {
+        Cart::Line_item_node node;
+        if (spare_items.empty() == false)
+        {
+            node = std::move(spare_items.back());
+            spare_items.pop_back();
+            node.mapped().clear_splitting();
+        }
+        else
+        {
+            std::map<int, Line_item> fresh;
+            fresh.emplace(0, Line_item());
+            node = fresh.extract(fresh.begin());
+        }
+
+        bool ok = json_read_line_item(json_li, options, &node.mapped());
+        node.key() = node.mapped().get_id();
+        cart.add_line_item(std::move(node));
+        if (ok == false) return false;
+    }
+
+    return true;
+}
+
+//Clears the pool, growing its buffer first if this parse spilled into heap
+//chunks, so the next request of the same size fits in reused memory. The
+//buffer stops growing at MAX_REUSED_BUFFER, chunks past it are freed
+void Parse_context::fit_pool(std::vector<char> &buffer,
+                             std::optional<Pool_allocator> &allocator)
+{
+    //Only the user buffer is in the pool, its capacity excludes a header
+    if (allocator->Capacity() <= buffer.size())
+    {
+        allocator->Clear();
+        return;
+    }
+
+    spill_count++;
+    size_t needed = std::min(next_power_of_two(allocator->Capacity() * 2),
+                             MAX_REUSED_BUFFER);
+    if (needed <= buffer.size())
+    {
+        allocator->Clear();
+        return;
+    }
+    allocator.reset();
+    buffer.resize(needed);
+    allocator.emplace(buffer.data(), buffer.size(),
+                      POOL_CHUNK_CAPACITY, &base_allocator);
+}
+
+/**
+ * split_json_buffer on a context leased from the calling thread's pool, so
+ * steady-state requests reuse the parse memory of earlier ones.
+ */
+bool split_json_pooled(const char *data, size_t length,
+                       const Parse_options &options, rapidjson::StringBuffer &sb)
+{
+    Split_status status;
+    return split_json_pooled(data, length, options, sb, &status);
+}
+
+//As above, status receives the validation or calculation failure. When the
+//input JSON could not be parsed it stays ok(), unless compressed input grew
+//past options.max_decompressed, which gives input_too_large. A projection, when given,
+//selects the part of the result written, and rows receive the table rows
+//of a successful split under cart_name
+bool split_json_pooled(const char *data, size_t length,
+                       const Parse_options &options, rapidjson::StringBuffer &sb,
+                       Split_status *status, const Output_projection *projection,
+                       Table_rows *rows, std::string_view cart_name)
+{
+    *status = Split_status();
+    Parse_context_pool::Lease context = Parse_context_pool::acquire();
+    if (context->parse(data, length, options) == false)
+    {
+        if (context->get_input_error() == EFBIG)
+        {
+            status->code = Split_error::input_too_large;
+            serialize_error_json(status->message(), sb);
+        }
+        else
+            serialize_error_json("Invalid input JSON", sb);
+        return false;
+    }
+
+    *status = try_validate_input(&context->get_cart(), &context->get_roommates());
+    if (status->ok())
+        *status = try_calculate_shares(&context->get_cart(),
+                                       &context->get_roommates());
+    if (status->ok() == false)
+    {
+        serialize_error_json(status->message(), sb);
+        return false;
+    }
+
+    if (rows != nullptr)
+        rows->add(cart_name, context->get_cart(), context->get_roommates());
+    if (projection != nullptr)
+        projection->serialize(context->get_cart(), context->get_roommates(), sb);
+    else
+        serialize_json(context->get_cart(), context->get_roommates(), sb);
+    return true;
+}
+
+//Parse_context_pool Implementation
+Parse_context_pool::Lease::Lease(std::unique_ptr<Parse_context> context) :
+    context(std::move(context)) {}
+Parse_context_pool::Lease::Lease(Lease &&other) noexcept :
+    context(std::move(other.context)) {}
+Parse_context_pool::Lease::~Lease()
+{
+    if (context) local().push_back(std::move(context));
+}
+
+Parse_context_pool::Lease Parse_context_pool::acquire()
+{
+    std::vector<std::unique_ptr<Parse_context>> &pool = local();
+    if (pool.empty())
+        return Lease(std::unique_ptr<Parse_context>(new Parse_context()));
+
+    std::unique_ptr<Parse_context> context = std::move(pool.back());
+    pool.pop_back();
+    return Lease(std::move(context));
+}
+
+size_t Parse_context_pool::idle_count(){return local().size();}
+
+std::vector<std::unique_ptr<Parse_context>> &Parse_context_pool::local()
+{
+    static thread_local std::vector<std::unique_ptr<Parse_context>> pool;
+    return pool;
+}
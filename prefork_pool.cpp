@@ -0,0 +1,354 @@
+#include "include/prefork_pool.h"
+#include "include/output_projection.h"
+#include "include/parse_pool.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+//Commands the pool sends to the helper process
+static const char SPAWN_COMMAND = 's';
+static const char WAIT_COMMAND = 'w';
+
+void (*prefork_request_hook)(const char *data, size_t length) = nullptr;
+
+//Precedes every request and response between a slot and its worker
+struct Prefork_header
+{
+    uint32_t length;
+    uint32_t ok;
+    //Split_error of a failed split
+    uint32_t error;
+    //Bytes of Output_projection spec sent ahead of a request
+    uint32_t view_length;
+};
+
+static int send_fully(int fd, const void *data, size_t length)
+{
+    const char *bytes = static_cast<const char *>(data);
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = send(fd, bytes + done, length - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno;
+        done += n;
+    }
+    return 0;
+}
+
+//EPIPE when the peer closed the socket before length bytes arrived
+static int recv_fully(int fd, void *data, size_t length)
+{
+    char *bytes = static_cast<char *>(data);
+    size_t done = 0;
+    while (done < length)
+    {
+        ssize_t n = recv(fd, bytes + done, length - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno;
+        if (n == 0) return EPIPE;
+        done += n;
+    }
+    return 0;
+}
+
+//Passes a worker's socket and pid to the pool, pid holds -errno when the
+//fork failed and there is no socket
+static int send_worker(int control_fd, int fd, pid_t pid)
+{
+    iovec iov = {&pid, sizeof(pid)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (fd >= 0)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    while (sendmsg(control_fd, &msg, MSG_NOSIGNAL) < 0)
+    {
+        if (errno != EINTR) return errno;
+    }
+    return 0;
+}
+
+static int receive_worker(int control_fd, int *fd, pid_t *pid)
+{
+    iovec iov = {pid, sizeof(*pid)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    while ((n = recvmsg(control_fd, &msg, MSG_CMSG_CLOEXEC)) < 0)
+    {
+        if (errno != EINTR) return errno;
+    }
+    if (n != sizeof(*pid)) return EPIPE;
+    if (*pid <= 0) return -*pid;
+
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_type != SCM_RIGHTS) return EPROTO;
+    memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+    return 0;
+}
+
+//Answers split requests until the pool closes the socket
+static void run_worker_process(int fd, const Parse_options &options)
+{
+    std::string request;
+    rapidjson::StringBuffer sb;
+    for (;;)
+    {
+        Prefork_header header;
+        if (recv_fully(fd, &header, sizeof(header)) != 0) return;
+        request.resize(header.view_length + header.length);
+        if (recv_fully(fd, &request[0], request.size()) != 0) return;
+
+        Output_projection projection;
+        bool view_ok = header.view_length == 0 ||
+            Output_projection::parse(std::string_view(request.data(),
+                                                      header.view_length),
+                                     &projection);
+        if (prefork_request_hook != nullptr)
+            prefork_request_hook(request.data() + header.view_length, header.length);
+        sb.Clear();
+        Split_status status;
+        if (view_ok)
+            header.ok = split_json_pooled(request.data() + header.view_length,
+                                          header.length, options, sb, &status,
+                                          &projection);
+        else
+        {
+            serialize_error_json("Bad Request", sb);
+            header.ok = 0;
+        }
+        header.error = static_cast<uint32_t>(status.code);
+        header.length = sb.GetSize();
+        header.view_length = 0;
+        if (send_fully(fd, &header, sizeof(header)) != 0 ||
+            send_fully(fd, sb.GetString(), sb.GetSize()) != 0)
+            return;
+    }
+}
+
+/**
+ * Body of the helper process. It forks a worker per spawn command and
+ * collects the exit status of dead workers, then waits for the remaining
+ * ones once the pool closes the control socket.
+ */
+static void run_helper(int control_fd, const Parse_options &options)
+{
+    //A crash must end the worker, not run handlers the parent installed
+    for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT})
+        signal(sig, SIG_DFL);
+    //Nor may workers hold the parent's sockets and files open
+    if (control_fd > 3) close_range(3, control_fd - 1, 0);
+    close_range(control_fd + 1, ~0U, 0);
+
+    for (;;)
+    {
+        char command;
+        if (recv_fully(control_fd, &command, 1) != 0) break;
+
+        if (command == SPAWN_COMMAND)
+        {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+            {
+                send_worker(control_fd, -1, -errno);
+                continue;
+            }
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                close(control_fd);
+                close(fds[0]);
+                run_worker_process(fds[1], options);
+                _exit(0);
+            }
+            int err = errno;
+            close(fds[1]);
+            if (pid < 0) send_worker(control_fd, -1, -err);
+            else send_worker(control_fd, fds[0], pid);
+            close(fds[0]);
+        }
+        else if (command == WAIT_COMMAND)
+        {
+            pid_t pid;
+            if (recv_fully(control_fd, &pid, sizeof(pid)) != 0) break;
+            int status = 0;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+            send_fully(control_fd, &status, sizeof(status));
+        }
+    }
+
+    while (waitpid(-1, nullptr, 0) > 0 || errno == EINTR) {}
+}
+
+//Prefork_pool Implementation
+Prefork_pool::Prefork_pool() {}
+Prefork_pool::~Prefork_pool(){stop();}
+
+int Prefork_pool::start(unsigned count, const Parse_options &options)
+{
+    stop();
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) return errno;
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        int err = errno;
+        close(fds[0]);
+        close(fds[1]);
+        return err;
+    }
+    if (pid == 0)
+    {
+        close(fds[0]);
+        run_helper(fds[1], options);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    control_fd = fds[0];
+    helper_pid = pid;
+    workers.assign(count ? count : 1, Worker());
+    for (auto &worker : workers)
+    {
+        int err = spawn(&worker);
+        if (err != 0)
+        {
+            stop();
+            return err;
+        }
+    }
+    return 0;
+}
+
+//Closing the sockets ends the workers, then the helper
+void Prefork_pool::stop()
+{
+    for (auto &worker : workers)
+    {
+        if (worker.fd >= 0) close(worker.fd);
+    }
+    workers.clear();
+    if (control_fd >= 0) close(control_fd);
+    control_fd = -1;
+    if (helper_pid > 0)
+    {
+        while (waitpid(helper_pid, nullptr, 0) < 0 && errno == EINTR) {}
+    }
+    helper_pid = 0;
+}
+
+/**
+ * Runs split_json_pooled on the slot's worker. When the worker dies after
+ * taking the request, result->crashed is set, the response is empty and a
+ * new worker takes the slot. A worker found dead before it got the request
+ * is replaced and the request sent again once.
+ */
+int Prefork_pool::split(unsigned slot, const char *data, size_t length,
+                        std::string *response, Prefork_result *result,
+                        const std::string &view)
+{
+    *result = Prefork_result();
+    response->clear();
+    if (slot >= workers.size()) return EINVAL;
+    if (length > UINT32_MAX || view.size() > UINT32_MAX) return E2BIG;
+
+    Worker &worker = workers[slot];
+    Prefork_header header = {static_cast<uint32_t>(length), 0, 0,
+                             static_cast<uint32_t>(view.size())};
+    for (int attempt = 0; ; attempt++)
+    {
+        if (worker.fd < 0)
+        {
+            int err = spawn(&worker);
+            if (err != 0) return err;
+        }
+        int err = send_fully(worker.fd, &header, sizeof(header));
+        if (err == 0) err = send_fully(worker.fd, view.data(), view.size());
+        if (err == 0) err = send_fully(worker.fd, data, length);
+        if (err == 0) break;
+        reap(&worker);
+        if (attempt > 0) return err;
+    }
+
+    result->pid = worker.pid;
+    int err = recv_fully(worker.fd, &header, sizeof(header));
+    if (err == 0)
+    {
+        response->resize(header.length);
+        err = recv_fully(worker.fd, &(*response)[0], response->size());
+    }
+    if (err != 0)
+    {
+        response->clear();
+        result->crashed = true;
+        result->wait_status = reap(&worker);
+        //A failed restart is retried by the next split on this slot
+        spawn(&worker);
+        return 0;
+    }
+    result->ok = header.ok != 0;
+    result->error = static_cast<Split_error>(header.error);
+    return 0;
+}
+
+pid_t Prefork_pool::get_worker_pid(unsigned slot) const
+{
+    return slot < workers.size() ? workers[slot].pid : 0;
+}
+
+size_t Prefork_pool::get_restart_count() const
+{
+    std::lock_guard<std::mutex> lock(control_mutex);
+    return restart_count;
+}
+
+int Prefork_pool::spawn(Worker *worker)
+{
+    std::lock_guard<std::mutex> lock(control_mutex);
+    if (control_fd < 0) return ESHUTDOWN;
+    int fd = -1;
+    pid_t pid = 0;
+    int err = send_fully(control_fd, &SPAWN_COMMAND, 1);
+    if (err == 0) err = receive_worker(control_fd, &fd, &pid);
+    if (err != 0) return err;
+    worker->fd = fd;
+    worker->pid = pid;
+    return 0;
+}
+
+int Prefork_pool::reap(Worker *worker)
+{
+    close(worker->fd);
+    worker->fd = -1;
+
+    std::lock_guard<std::mutex> lock(control_mutex);
+    restart_count++;
+    char command[1 + sizeof(pid_t)];
+    command[0] = WAIT_COMMAND;
+    memcpy(command + 1, &worker->pid, sizeof(pid_t));
+    int status = 0;
+    if (control_fd < 0 || send_fully(control_fd, command, sizeof(command)) != 0 ||
+        recv_fully(control_fd, &status, sizeof(status)) != 0)
+        return 0;
+    return status;
+}
@@ -1,106 +1,785 @@
 #include "include/roommate_split.h"
+#include "include/alloc_tracker.h"
+#include "include/compressed_stream.h"
+#include "include/split_probes.h"
+#include "include/trace.h"
 
-#include <fstream>
+#include <algorithm>
+#include <climits>
 #include <cmath>
+#include <cstdio>
 #include <stdexcept>
 #include <limits>
 
 #include "include/rapidjson/document.h"
-#include "include/rapidjson/istreamwrapper.h"
 
-void write_json(Cart &cart, std::map<int, Roommate> &roommates,
-                std::string filename)
+//Same document as a rapidjson::Writer walk, but keys are emitted pre-encoded
+template <typename OutputStream>
+static void serialize_document(const Cart &cart, const std::map<int, Roommate> &roommates,
+                               OutputStream &os)
 {
-    rapidjson::StringBuffer sb;
-    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+    Json_fragment_writer<OutputStream> writer(os);
 
-    writer.StartObject();
-    writer.String("roommates");
-    writer.StartArray();
-    for (auto &rm : roommates)
+    writer.Raw("{\"roommates\":[");
+    for (auto iter = roommates.begin(); iter != roommates.end(); iter++)
     {
-        rm.second.json_serialize(writer);
+        if (iter != roommates.begin()) writer.Raw(",");
+        iter->second.json_serialize(writer);
     }
-    writer.EndArray();
-    writer.String("cart");
+    writer.Raw("],\"cart\":");
     cart.json_serialize(writer);
-    writer.EndObject();
+    writer.Raw("}");
+}
+
+//Opens filename for a compressed or plain stream, by its extension
+static FILE *open_output(const std::string &filename, Compression *compression)
+{
+    *compression = compression_for_path(filename);
+    if (compression_supported(*compression) == false) return nullptr;
+    return fopen(filename.c_str(), "wb");
+}
+
+static void close_output(FILE *fp, Compressing_write_stream &os)
+{
+    os.finish();
+    fclose(fp);
+}
+
+void write_json(Cart &cart, std::map<int, Roommate> &roommates,
+                std::string filename)
+{
+    Trace_span span("serialize");
+    span.set_items(cart.get_line_items().size());
+    Compression compression;
+    FILE *fp = open_output(filename, &compression);
+    if (fp == nullptr) return;
+    //Serialized straight into the file, compressed for .gz and .zst names
+    Compressing_write_stream os(fp, compression);
+    SPLIT_PROBE_STAGE(serialize, os.Tell(), cart.get_line_items().size(), roommates.size());
+    serialize_document(cart, roommates, os);
+    close_output(fp, os);
+}
 
-    std::ofstream json_output;
-    json_output.open(filename);
-    json_output << sb.GetString();
-    json_output.close();
+void serialize_json(const Cart &cart, const std::map<int, Roommate> &roommates,
+                    rapidjson::StringBuffer &sb)
+{
+    Trace_span span("serialize");
+    span.set_items(cart.get_line_items().size());
+    [[maybe_unused]] size_t start_size = sb.GetSize();
+    SPLIT_PROBE_STAGE(serialize, sb.GetSize() - start_size, cart.get_line_items().size(),
+                      roommates.size());
+    serialize_document(cart, roommates, sb);
 }
 
 void write_error_json(std::string filename, std::string error_text)
 {
     rapidjson::StringBuffer sb;
+    serialize_error_json(error_text, sb);
+
+    Trace_span span("write_file");
+    Compression compression;
+    FILE *fp = open_output(filename, &compression);
+    if (fp == nullptr) return;
+    Compressing_write_stream os(fp, compression);
+    for (size_t i = 0; i < sb.GetSize(); i++) os.Put(sb.GetString()[i]);
+    close_output(fp, os);
+}
+
+void serialize_error_json(const std::string &error_text,
+                          rapidjson::StringBuffer &sb)
+{
     rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
 
     writer.StartObject();
     writer.String("error");
     writer.String(error_text.c_str());
     writer.EndObject();
+}
 
-    std::ofstream json_output;
-    json_output.open(filename);
-    json_output << sb.GetString();
-    json_output.close();
+void write_error_json(std::string filename, const Split_status &status)
+{
+    write_error_json(filename, status.message());
 }
 
 bool json_has_parent_fields(rapidjson::Document *doc)
 {
+    if (doc->IsObject() == false) return false;
     if (doc->HasMember("cart") == 0) return false;
     if (doc->HasMember("roommates") == 0) return false;
     return true;
 }
 
+//Largest scaled amount that still converts to a double without rounding
+static const unsigned long long MAX_EXACT_UNITS = 9007199254740992ULL;
+//Powers of ten that are exactly representable as doubles
+static const int MAX_DECIMAL_SCALE = 15;
+static const double decimal_scales[MAX_DECIMAL_SCALE + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+    1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+
+static bool push_decimal_digit(unsigned long long *value, int digit)
+{
+    if (*value > (MAX_EXACT_UNITS - digit) / 10) return false;
+    *value = *value * 10 + digit;
+    return true;
+}
+
+/**
+ * Converts a JSON number literal to an integer count of 10^-scale units
+ * without going through floating point. Fails if the literal has non-zero
+ * digits below the scale or does not fit in 53 bits.
+ */
+bool parse_decimal_units(const char *text, size_t length, int scale,
+                         long long *units)
+{
+    if (scale < 0 || scale > MAX_DECIMAL_SCALE) return false;
+
+    size_t pos = 0;
+    bool negative = false;
+    if (pos < length && text[pos] == '-')
+    {
+        negative = true;
+        pos++;
+    }
+    if (pos == length || text[pos] < '0' || text[pos] > '9') return false;
+
+    unsigned long long value = 0;
+    int frac_digits = 0;
+    for (; pos < length && text[pos] >= '0' && text[pos] <= '9'; pos++)
+    {
+        if (push_decimal_digit(&value, text[pos] - '0') == false) return false;
+    }
+
+    if (pos < length && text[pos] == '.')
+    {
+        //Zeros are only pushed once a later non-zero digit makes them count
+        int pending_zeros = 0;
+        for (pos++; pos < length && text[pos] >= '0' && text[pos] <= '9'; pos++)
+        {
+            if (text[pos] == '0')
+            {
+                pending_zeros++;
+                continue;
+            }
+            for (; pending_zeros > 0; pending_zeros--, frac_digits++)
+            {
+                if (push_decimal_digit(&value, 0) == false) return false;
+            }
+            if (push_decimal_digit(&value, text[pos] - '0') == false)
+                return false;
+            frac_digits++;
+        }
+    }
+
+    int exponent = 0;
+    if (pos < length && (text[pos] == 'e' || text[pos] == 'E'))
+    {
+        bool negative_exp = false;
+        pos++;
+        if (pos < length && (text[pos] == '+' || text[pos] == '-'))
+        {
+            negative_exp = (text[pos] == '-');
+            pos++;
+        }
+        if (pos == length) return false;
+        for (; pos < length && text[pos] >= '0' && text[pos] <= '9'; pos++)
+        {
+            if (exponent < 10000) exponent = exponent * 10 + (text[pos] - '0');
+        }
+        if (negative_exp) exponent = -exponent;
+    }
+    if (pos != length) return false;
+
+    if (value != 0)
+    {
+        int digits_below_point = frac_digits - exponent;
+        while (digits_below_point > scale && value % 10 == 0)
+        {
+            value /= 10;
+            digits_below_point--;
+        }
+        if (digits_below_point > scale) return false;
+        for (; digits_below_point < scale; digits_below_point++)
+        {
+            if (push_decimal_digit(&value, 0) == false) return false;
+        }
+    }
+
+    *units = negative ? -static_cast<long long>(value)
+                      : static_cast<long long>(value);
+    return true;
+}
+
+double Money_units::to_double() const
+{
+    if (scale < 0 || scale > MAX_DECIMAL_SCALE) return static_cast<double>(units);
+    return static_cast<double>(units) / decimal_scales[scale];
+}
+
+//Member of an object, null when val is not an object or has no such member.
+//The readers below look every field up through it, so input of the wrong
+//shape is refused instead of tripping a rapidjson assert
+template <typename Json_value>
+static const Json_value *find_member(const Json_value &val, const char *name)
+{
+    if (val.IsObject() == false) return nullptr;
+    auto member = val.FindMember(name);
+    return member == val.MemberEnd() ? nullptr : &member->value;
+}
+
+/**
+ * Reads a money field and passes it to set, false if it is missing or not a
+ * number. In exact mode the decimal text is converted straight to scaled
+ * integer units, which set gets as the exact amount, without the strtod
+ * slow paths.
+ */
+template <typename Json_value, typename Setter>
+static bool read_money(const Json_value *val, const Parse_options &options,
+                       Setter set)
+{
+    if (val == nullptr) return false;
+    if (options.exact_decimal == false)
+    {
+        if (val->IsNumber() == false) return false;
+        set(val->GetDouble());
+        return true;
+    }
+
+    Money_units money;
+    money.scale = options.decimal_scale;
+    if (val->IsString() == false) return false;
+    if (parse_decimal_units(val->GetString(), val->GetStringLength(),
+                            options.decimal_scale, &money.units) == false)
+        return false;
+    set(money);
+    return true;
+}
+
+//Reads an id field, numbers arrive as text when exact mode is on
+template <typename Json_value>
+static bool read_int(const Json_value *val,
+                     const Parse_options &options, int *out)
+{
+    if (val == nullptr) return false;
+    if (options.exact_decimal == false)
+    {
+        if (val->IsInt() == false) return false;
+        *out = val->GetInt();
+        return true;
+    }
+
+    long long value = 0;
+    if (val->IsString() == false) return false;
+    if (parse_decimal_units(val->GetString(), val->GetStringLength(), 0,
+                            &value) == false)
+        return false;
+    if (value < std::numeric_limits<int>::min() ||
+        value > std::numeric_limits<int>::max())
+        return false;
+    *out = static_cast<int>(value);
+    return true;
+}
+
+template <typename Json_value>
+static bool read_json_data(const Json_value &document, Cart *cart,
+                           std::map<int, Roommate> *roommates,
+                           const Parse_options &options);
+
 bool parse_json_data(Cart *cart, std::map<int, Roommate> *roommates,
                      std::string filename)
 {
-    bool ret = true;
-    std::ifstream ifs(filename);
-    rapidjson::IStreamWrapper isw(ifs);
+    return parse_json_data(cart, roommates, filename, Parse_options());
+}
+
+bool parse_json_data(Cart *cart, std::map<int, Roommate> *roommates,
+                     std::string filename, const Parse_options &options)
+{
+    Trace_span span("parse");
+    FILE *fp = fopen(filename.c_str(), "rb");
+    if (fp == nullptr) return false;
+    //gzip and zstd input is recognized by its magic bytes, not the name
+    Decompressing_read_stream is(fp, options.max_decompressed);
+    SPLIT_PROBE_STAGE(parse, is.Tell(), cart->get_line_items().size(), roommates->size());
+
+    Tracked_document document;
+    if (options.exact_decimal)
+        document.ParseStream<INPUT_DECIMAL_PARSE_FLAGS>(is);
+    else
+        document.ParseStream<INPUT_PARSE_FLAGS>(is);
+    int error = is.get_error();
+    fclose(fp);
+    if (document.HasParseError() || error != 0) return false;
+    bool ok = read_json_data(document, cart, roommates, options);
+    span.set_items(cart->get_line_items().size());
+    return ok;
+}
+
+bool parse_json_buffer(Cart *cart, std::map<int, Roommate> *roommates,
+                       const char *data, size_t length,
+                       const Parse_options &options)
+{
+    Trace_span span("parse");
+    SPLIT_PROBE_STAGE(parse, length, cart->get_line_items().size(), roommates->size());
+    Tracked_document document;
+    if (options.exact_decimal)
+        document.Parse<INPUT_DECIMAL_PARSE_FLAGS>(data, length);
+    else
+        document.Parse<INPUT_PARSE_FLAGS>(data, length);
+    if (document.HasParseError()) return false;
+    bool ok = read_json_data(document, cart, roommates, options);
+    span.set_items(cart->get_line_items().size());
+    return ok;
+}
 
-    rapidjson::Document document;
-    document.ParseStream(isw);
-    if (json_has_parent_fields(&document) == false) return false;
+//Fills a roommate from one element of the input "roommates" array, false
+//if it is not an object with a string name, money totals and an id array
+template <typename Json_value>
+bool json_read_roommate(const Json_value &json_rm,
+                        const Parse_options &options, Roommate *rm)
+{
+    int int_value = 0;
+    const Json_value *json_name = find_member(json_rm, "name");
+    const Json_value *json_items = find_member(json_rm, "items");
+    if (json_name == nullptr || json_name->IsString() == false ||
+        json_items == nullptr || json_items->IsArray() == false)
+        return false;
+    rm->set_name(std::string_view(json_name->GetString(),
+                                  json_name->GetStringLength()));
+    if (read_money(find_member(json_rm, "total"), options,
+                   [rm](auto value) {rm->set_total(value);}) == false)
+        return false;
+    if (read_money(find_member(json_rm, "tax_share"), options,
+                   [rm](auto value) {rm->set_tax_share(value);}) == false)
+        return false;
 
-    for (auto &json_rm : document["roommates"].GetArray())
+    for (auto &json_item : json_items->GetArray())
     {
-        Roommate *new_rm = new Roommate((*roommates).size(), "");
-        new_rm->set_name(json_rm["name"].GetString());
-        new_rm->add_to_total(json_rm["total"].GetDouble());
-        new_rm->set_tax_share(json_rm["tax_share"].GetDouble());
+        if (read_int(&json_item, options, &int_value) == false) return false;
+        rm->add_line_item(int_value);
+    }
+    return true;
+}
+
+//Fills a line item from one element of the input "line_items" array, false
+//for a missing field or one of the wrong type
+template <typename Json_value>
+bool json_read_line_item(const Json_value &json_li,
+                         const Parse_options &options, Line_item *li)
+{
+    int int_value = 0;
+    if (read_int(find_member(json_li, "id"), options, &int_value) == false)
+        return false;
+    li->set_id(int_value);
+    const Json_value *json_name = find_member(json_li, "item_name");
+    if (json_name == nullptr || json_name->IsString() == false) return false;
+    li->set_name(std::string_view(json_name->GetString(),
+                                  json_name->GetStringLength()));
+    if (read_money(find_member(json_li, "cost"), options,
+                   [li](auto value) {li->set_cost(value);}) == false)
+        return false;
+    if (read_money(find_member(json_li, "share_cost"), options,
+                   [li](auto value) {li->set_share_cost(value);}) == false)
+        return false;
 
-        for (auto &json_item : json_rm["items"].GetArray())
+    const Json_value *json_quantity = find_member(json_li, "quantity");
+    if (json_quantity != nullptr)
+    {
+        if (read_int(json_quantity, options, &int_value) == false)
+            return false;
+        li->set_quantity(int_value);
+    }
+
+    //Optional weights run parallel to the splitting array
+    const Json_value *json_splitting = find_member(json_li, "splitting");
+    if (json_splitting == nullptr || json_splitting->IsArray() == false)
+        return false;
+    const Json_value *json_weights = find_member(json_li, "weights");
+    if (json_weights != nullptr &&
+        (json_weights->IsArray() == false ||
+         json_weights->Size() != json_splitting->Size()))
+        return false;
+    for (rapidjson::SizeType i = 0; i < json_splitting->Size(); i++)
+    {
+        if (read_int(&(*json_splitting)[i], options, &int_value) == false)
+            return false;
+        if (json_weights == nullptr)
         {
-            new_rm->add_line_item(json_item.GetInt());
+            li->add_splitting(int_value);
+            continue;
         }
+        int weight = 0;
+        if (read_int(&(*json_weights)[i], options, &weight) == false)
+            return false;
+        li->add_splitting(int_value, weight);
+    }
+    return true;
+}
+
+//Reads total and tax from the input "cart" object, false unless both are
+//money fields
+template <typename Json_value>
+bool json_read_cart_totals(const Json_value &json_cart,
+                           const Parse_options &options, Cart *cart)
+{
+    if (read_money(find_member(json_cart, "total"), options,
+                   [cart](auto value) {cart->set_total(value);}) == false)
+        return false;
+    if (read_money(find_member(json_cart, "tax"), options,
+                   [cart](auto value) {cart->set_tax(value);}) == false)
+        return false;
+    return true;
+}
+
+//The "roommates" array and the cart's "line_items" array of an input
+//document, false if either is missing or not an array
+template <typename Json_value>
+bool json_input_arrays(const Json_value &document, const Json_value **json_roommates,
+                       const Json_value **json_items)
+{
+    *json_roommates = find_member(document, "roommates");
+    const Json_value *json_cart = find_member(document, "cart");
+    *json_items = json_cart != nullptr ? find_member(*json_cart, "line_items")
+                                       : nullptr;
+    return *json_roommates != nullptr && (*json_roommates)->IsArray() &&
+           *json_items != nullptr && (*json_items)->IsArray();
+}
+
+//Fills cart and roommates from an already parsed input document
+template <typename Json_value>
+static bool read_json_data(const Json_value &document, Cart *cart,
+                           std::map<int, Roommate> *roommates,
+                           const Parse_options &options)
+{
+    //Documents are read as their root value
+    typedef typename Json_value::ValueType Value;
+    const Value &root = document;
+    const Value *json_roommates;
+    const Value *json_items;
+    if (json_input_arrays(root, &json_roommates, &json_items) == false)
+        return false;
 
-        roommates->insert(std::pair<int, Roommate>(new_rm->get_id(), *new_rm));
+    for (auto &json_rm : json_roommates->GetArray())
+    {
+        Roommate new_rm((*roommates).size(), "");
+        if (json_read_roommate(json_rm, options, &new_rm) == false) return false;
+        roommates->insert(std::pair<int, Roommate>(new_rm.get_id(), new_rm));
     }
 
-    (*cart).set_total(document["cart"]["total"].GetDouble());
-    (*cart).set_tax(document["cart"]["tax"].GetDouble());
-    for (auto &json_li : document["cart"]["line_items"].GetArray())
+    if (json_read_cart_totals(root["cart"], options, cart) == false)
+        return false;
+    for (auto &json_li : json_items->GetArray())
     {
-        Line_item *new_li = new Line_item();
-        new_li->set_id(json_li["id"].GetInt());
-        new_li->set_name(json_li["item_name"].GetString());
-        new_li->set_cost(json_li["cost"].GetDouble());
-        new_li->set_share_cost(json_li["share_cost"].GetDouble());
-        for (auto &json_int : json_li["splitting"].GetArray())
+        Line_item new_li;
+        if (json_read_line_item(json_li, options, &new_li) == false) return false;
+        cart->add_line_item(new_li);
+    }
+
+    return true;
+}
+
+//The readers take values of plain documents and of tracked ones
+template bool json_read_roommate(const rapidjson::Value &, const Parse_options &,
+                                 Roommate *);
+template bool json_read_roommate(const Tracked_value &, const Parse_options &,
+                                 Roommate *);
+template bool json_read_line_item(const rapidjson::Value &, const Parse_options &,
+                                  Line_item *);
+template bool json_read_line_item(const Tracked_value &, const Parse_options &,
+                                  Line_item *);
+template bool json_read_cart_totals(const rapidjson::Value &, const Parse_options &,
+                                    Cart *);
+template bool json_read_cart_totals(const Tracked_value &, const Parse_options &,
+                                    Cart *);
+template bool json_input_arrays(const rapidjson::Value &, const rapidjson::Value **,
+                                const rapidjson::Value **);
+template bool json_input_arrays(const Tracked_value &, const Tracked_value **,
+                                const Tracked_value **);
+
+/**
+ * Runs parse, validation and share calculation on one input document held
+ * in memory. The split result, or an error document, is written to sb.
+ */
+bool split_json_buffer(const char *data, size_t length,
+                       const Parse_options &options, rapidjson::StringBuffer &sb)
+{
+    std::map<int, Roommate> roommates = {};
+    Cart cart = Cart();
+    if (parse_json_buffer(&cart, &roommates, data, length, options) == false)
+    {
+        serialize_error_json("Invalid input JSON", sb);
+        return false;
+    }
+
+    Split_status status = try_validate_input(&cart, &roommates);
+    if (status.ok()) status = try_calculate_shares(&cart, &roommates);
+    if (status.ok() == false)
+    {
+        serialize_error_json(status.message(), sb);
+        return false;
+    }
+
+    serialize_json(cart, roommates, sb);
+    return true;
+}
+
+void calculate_shares(Cart *cart, std::map<int, Roommate> *roommates)
+{
+    Split_status status = try_calculate_shares(cart, roommates);
+    if (status.code == Split_error::unknown_roommate)
+        throw std::invalid_argument(status.message());
+    if (status.ok() == false) throw std::logic_error(status.message());
+}
+
+bool apportion_units(long long amount, const long long *weights, size_t count,
+                     long long *parts)
+{
+    if (amount < 0) return false;
+    long long weight_sum = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (weights[i] < 0) return false;
+        weight_sum += weights[i];
+    }
+    if (weight_sum == 0)
+    {
+        std::fill(parts, parts + count, 0LL);
+        return amount == 0;
+    }
+
+    //(remainder, part) pairs, reused so a warm thread does not allocate
+    static thread_local std::vector<std::pair<long long, size_t>> remainders;
+    remainders.clear();
+    long long left = amount;
+    for (size_t i = 0; i < count; i++)
+    {
+        __int128 scaled = static_cast<__int128>(amount) * weights[i];
+        parts[i] = static_cast<long long>(scaled / weight_sum);
+        left -= parts[i];
+        remainders.emplace_back(static_cast<long long>(scaled % weight_sum), i);
+    }
+    if (left == 0) return true;
+
+    //Fewer units are left than there are parts
+    std::sort(remainders.begin(), remainders.end(),
+              [](const std::pair<long long, size_t> &a,
+                 const std::pair<long long, size_t> &b) {
+                  return a.first != b.first ? a.first > b.first : a.second < b.second;
+              });
+    for (long long i = 0; i < left; i++) parts[remainders[i].second]++;
+    return true;
+}
+
+int exact_money_scale(const Cart &cart, const std::map<int, Roommate> &roommates)
+{
+    int scale = cart.get_total_units().scale;
+    if (scale < 0 || cart.get_tax_units().scale != scale) return -1;
+    for (auto &item : cart.get_line_items())
+    {
+        if (item.second.get_cost_units().scale != scale) return -1;
+    }
+    for (auto &rm : roommates)
+    {
+        if (rm.second.get_total_units().scale != scale) return -1;
+    }
+    return scale;
+}
+
+/**
+ * Splits one weighted item in a single pass: each roommate pays
+ * cost * weight / (sum of weights), so "2 of 3" or "70/30" needs no
+ * duplicated items. Weights and splitting are both sorted by roommate id.
+ */
+static Split_status add_weighted_shares(const Line_item &lm,
+                                        std::map<int, Roommate> *roommates,
+                                        double *total_check)
+{
+    long long weight_sum = 0;
+    for (int rm_id : lm.get_splitting()) weight_sum += lm.get_weight(rm_id);
+
+    for (int rm_id : lm.get_splitting())
+    {
+        auto rm_iter = roommates->find(rm_id);
+        if (rm_iter == roommates->end())
+            return Split_status{Split_error::unknown_roommate, lm.get_id()};
+        double share_cost = lm.get_cost() * lm.get_weight(rm_id) / weight_sum;
+        Roommate *rm = &(rm_iter->second);
+        rm->add_line_item(lm);
+        rm->add_to_total(share_cost);
+        *total_check += share_cost;
+    }
+    return Split_status();
+}
+
+//Largest group handled by a fixed size kernel
+static const int MAX_KERNEL_ROOMMATES = 8;
+
+/**
+ * try_calculate_shares for exactly N roommates with ids 0..N-1. Splittings
+ * become bitmasks and subtotals live in a fixed array indexed by id, so no
+ * roommate lookups are needed. Each item walks only the set bits of its
+ * mask, finding the next roommate with ctz, and the tax pass runs over the
+ * N subtotals. Every sum is formed in the same order as the generic path,
+ * so results are bit identical. Returns false without touching anything if
+ * an item is weighted or names an unknown roommate, the caller then runs
+ * the generic path.
+ */
+template <int N>
+static bool calculate_shares_fixed(Cart *cart, std::map<int, Roommate> *roommates,
+                                   Split_status *status)
+{
+    //Splitting mask of every item, roommates are only touched once the
+    //whole cart is known to fit the kernel
+    static thread_local std::vector<uint64_t> masks;
+    masks.clear();
+    for (auto &item : cart->get_line_items())
+    {
+        const Line_item &lm = item.second;
+        uint64_t mask;
+        if (lm.is_weighted() || lm.get_splitting().get_mask(&mask) == false ||
+            (mask >> N) != 0)
+            return false;
+        masks.push_back(mask);
+    }
+
+    Roommate *rms[N];
+    double totals[N];
+    auto rm_iter = roommates->begin();
+    for (int i = 0; i < N; i++, rm_iter++)
+    {
+        rms[i] = &rm_iter->second;
+        totals[i] = rms[i]->get_total();
+    }
+
+    double total_check = 0.0;
+    const uint64_t *mask_iter = masks.data();
+    for (auto &item : cart->get_line_items())
+    {
+        uint64_t mask = *mask_iter++;
+        double share_cost = item.second.get_cost() /
+                            item.second.get_splitting().size();
+        for (uint64_t bits = mask; bits != 0; bits &= bits - 1)
         {
-            new_li->add_splitting(json_int.GetInt());
+            int i = __builtin_ctzll(bits);
+            rms[i]->add_line_item(item.first);
+            totals[i] += share_cost;
+            total_check += share_cost;
         }
-        cart->add_line_item(*new_li);
     }
 
-    return ret;
+    double pre_tax_total = cart->get_total() - cart->get_tax();
+    for (int i = 0; i < N; i++)
+    {
+        double tax_share = (totals[i] / pre_tax_total) * cart->get_tax();
+        rms[i]->set_tax_share(tax_share);
+        totals[i] += tax_share;
+        total_check += tax_share;
+        rms[i]->set_total(totals[i]);
+    }
+
+    if (approximately_equal(total_check, cart->get_total(),
+                           std::numeric_limits<double>::epsilon()) == false)
+        *status = Split_status{Split_error::total_mismatch};
+    else
+        *status = Split_status();
+    return true;
 }
 
-void calculate_shares(Cart *cart, std::map<int, Roommate> *roommates)
+//Runs the kernel for the roommate count when ids are exactly 0..N-1
+static bool dispatch_fixed_kernel(Cart *cart, std::map<int, Roommate> *roommates,
+                                  Split_status *status)
+{
+    int count = roommates->size();
+    if (count == 0 || count > MAX_KERNEL_ROOMMATES) return false;
+    if (roommates->begin()->first != 0 || roommates->rbegin()->first != count - 1)
+        return false;
+
+    switch (count)
+    {
+        case 1: return calculate_shares_fixed<1>(cart, roommates, status);
+        case 2: return calculate_shares_fixed<2>(cart, roommates, status);
+        case 3: return calculate_shares_fixed<3>(cart, roommates, status);
+        case 4: return calculate_shares_fixed<4>(cart, roommates, status);
+        case 5: return calculate_shares_fixed<5>(cart, roommates, status);
+        case 6: return calculate_shares_fixed<6>(cart, roommates, status);
+        case 7: return calculate_shares_fixed<7>(cart, roommates, status);
+        case 8: return calculate_shares_fixed<8>(cart, roommates, status);
+    }
+    return false;
+}
+
+/**
+ * try_calculate_shares for amounts that are all exact in units of 10^-scale.
+ * Each item's cost is apportioned to its roommates by weight, then the tax
+ * by pre-tax totals, so every share is a whole unit and the shares add up
+ * to the cart total exactly. The doubles are only set from the results.
+ */
+static Split_status calculate_shares_exact(Cart *cart,
+                                           std::map<int, Roommate> *roommates,
+                                           int scale)
+{
+    //Reused so a warm thread does not allocate
+    static thread_local std::vector<long long> weights;
+    static thread_local std::vector<long long> parts;
+    long long total_check = 0;
+
+    for (auto &item : cart->get_line_items())
+    {
+        const Line_item &lm = item.second;
+        weights.clear();
+        for (int rm_id : lm.get_splitting()) weights.push_back(lm.get_weight(rm_id));
+        parts.resize(weights.size());
+        if (apportion_units(lm.get_cost_units().units, weights.data(), weights.size(),
+                            parts.data()) == false)
+            return Split_status{Split_error::total_mismatch};
+
+        const long long *part = parts.data();
+        for (int rm_id : lm.get_splitting())
+        {
+            auto rm_iter = roommates->find(rm_id);
+            if (rm_iter == roommates->end())
+                return Split_status{Split_error::unknown_roommate, lm.get_id()};
+            Roommate *rm = &(rm_iter->second);
+            rm->add_line_item(lm);
+            rm->set_total(Money_units{rm->get_total_units().units + *part, scale});
+            total_check += *part++;
+        }
+    }
+
+    weights.clear();
+    for (auto &rm_pair : *roommates) weights.push_back(rm_pair.second.get_total_units().units);
+    parts.resize(weights.size());
+    if (apportion_units(cart->get_tax_units().units, weights.data(), weights.size(),
+                        parts.data()) == false)
+        return Split_status{Split_error::total_mismatch};
+    const long long *part = parts.data();
+    for (auto &rm_pair : *roommates)
+    {
+        Roommate *rm = &(rm_pair.second);
+        rm->set_tax_share(Money_units{*part, scale});
+        rm->set_total(Money_units{rm->get_total_units().units + *part, scale});
+        total_check += *part++;
+    }
+
+    if (total_check != cart->get_total_units().units)
+        return Split_status{Split_error::total_mismatch};
+    return Split_status();
+}
+
+Split_status try_calculate_shares(Cart *cart,
+                                  std::map<int, Roommate> *roommates)
+{
+    Trace_span span("calculate");
+    span.set_items(cart->get_line_items().size());
+    SPLIT_PROBE_STAGE(calculate, 0, cart->get_line_items().size(), roommates->size());
+    int scale = exact_money_scale(*cart, *roommates);
+    if (scale >= 0) return calculate_shares_exact(cart, roommates, scale);
+    Split_status status;
+    if (dispatch_fixed_kernel(cart, roommates, &status)) return status;
+    return try_calculate_shares_generic(cart, roommates);
+}
+
+Split_status try_calculate_shares_generic(Cart *cart,
+                                          std::map<int, Roommate> *roommates)
 {
     double total_check = 0.0;
 
@@ -108,10 +787,20 @@ void calculate_shares(Cart *cart, std::map<int, Roommate> *roommates)
     for (auto &item : cart->get_line_items())
     {
         const Line_item *lm = &(item.second);
+        if (lm->is_weighted())
+        {
+            Split_status status = add_weighted_shares(*lm, roommates,
+                                                      &total_check);
+            if (status.ok() == false) return status;
+            continue;
+        }
         double share_cost = (*lm).get_cost() / (*lm).get_splitting().size();
         for (int rm_id : lm->get_splitting())
         {
-            Roommate *rm = &((*(roommates->find(rm_id))).second);
+            auto rm_iter = roommates->find(rm_id);
+            if (rm_iter == roommates->end())
+                return Split_status{Split_error::unknown_roommate, lm->get_id()};
+            Roommate *rm = &(rm_iter->second);
             rm->add_line_item(*lm);
             rm->add_to_total(share_cost);
             total_check += share_cost;
@@ -130,34 +819,113 @@ void calculate_shares(Cart *cart, std::map<int, Roommate> *roommates)
 
     if (approximately_equal(total_check, cart->get_total(),
                            std::numeric_limits<double>::epsilon()) == false)
-        throw std::logic_error(std::string("Cart total does not match") +
-                               std::string("roommate split total"));
+        return Split_status{Split_error::total_mismatch};
+    return Split_status();
 }
 
 void validate_input(Cart *cart, std::map<int, Roommate> *roommates)
 {
+    Split_status status = try_validate_input(cart, roommates);
+    if (status.ok() == false) throw std::invalid_argument(status.message());
+}
+
+Split_status try_validate_input(const Cart *cart,
+                                const std::map<int, Roommate> *roommates) noexcept
+{
+    Trace_span span("validate");
+    span.set_items(cart->get_line_items().size());
+    SPLIT_PROBE_STAGE(validate, 0, cart->get_line_items().size(), roommates->size());
     double temp_total = 0.0;
     if (cart->get_line_items().size() == 0)
-        throw std::invalid_argument("Invalid cart items");
+        return Split_status{Split_error::no_line_items};
     if (cart->get_total() <= 0.0)
-        throw std::invalid_argument("Invalid cart total, must be positive");
+        return Split_status{Split_error::non_positive_total};
     if (cart->get_tax() < 0)
-        throw std::invalid_argument("Invalid cart tax, cannot be negative");
+        return Split_status{Split_error::negative_tax};
 
+    //Exact amounts of one scale are checked without rounding
+    int scale = cart->get_total_units().scale;
+    bool exact = scale >= 0 && cart->get_tax_units().scale == scale;
+    long long units_total = cart->get_tax_units().units;
     for (auto &item : cart->get_line_items())
     {
-        const Line_item *lm = &(item.second);
-        if (lm->get_cost() < 0)
-            throw std::invalid_argument("Item cost is negative id:" +
-                                        std::to_string(lm->get_id()));
-        temp_total += lm->get_cost();
+        Split_status status = try_validate_line_item(item.second);
+        if (status.ok() == false) return status;
+        temp_total += item.second.get_cost();
+        exact = exact && item.second.get_cost_units().scale == scale;
+        units_total += item.second.get_cost_units().units;
     }
     temp_total += cart->get_tax();
 
+    if (exact)
+    {
+        if (units_total != cart->get_total_units().units)
+            return Split_status{Split_error::cost_mismatch};
+        return Split_status();
+    }
     if (approximately_equal(temp_total, cart->get_total(),
                            std::numeric_limits<double>::epsilon()) == false)
-        throw std::invalid_argument(std::string("Cart cost doesn't equal") +
-                                    std::string("sum of all items plus tax"));
+        return Split_status{Split_error::cost_mismatch};
+    return Split_status();
+}
+
+Split_status try_validate_line_item(const Line_item &item) noexcept
+{
+    if (item.get_cost() < 0)
+        return Split_status{Split_error::negative_item_cost, item.get_id()};
+    if (item.get_quantity() < 1)
+        return Split_status{Split_error::invalid_quantity, item.get_id()};
+    if (item.is_weighted())
+    {
+        //Weighted units must add up to the quantity when one is given
+        long long weight_sum = 0;
+        for (int rm_id : item.get_splitting())
+        {
+            int weight = item.get_weight(rm_id);
+            if (weight < 1)
+                return Split_status{Split_error::invalid_weight, item.get_id()};
+            weight_sum += weight;
+        }
+        if (item.get_quantity() > 1 && weight_sum != item.get_quantity())
+            return Split_status{Split_error::invalid_weight, item.get_id()};
+    }
+    return Split_status();
+}
+
+//Messages are only built here, so failing fast on bad input stays cheap
+std::string Split_status::message() const
+{
+    switch (code)
+    {
+        case Split_error::none:
+            return std::string();
+        case Split_error::no_line_items:
+            return "Invalid cart items";
+        case Split_error::non_positive_total:
+            return "Invalid cart total, must be positive";
+        case Split_error::negative_tax:
+            return "Invalid cart tax, cannot be negative";
+        case Split_error::negative_item_cost:
+            return "Item cost is negative id:" + std::to_string(item_id);
+        case Split_error::cost_mismatch:
+            return std::string("Cart cost doesn't equal") +
+                   std::string("sum of all items plus tax");
+        case Split_error::invalid_quantity:
+            return "Item quantity must be positive id:" +
+                   std::to_string(item_id);
+        case Split_error::invalid_weight:
+            return "Item weights must be positive and sum to its quantity id:" +
+                   std::to_string(item_id);
+        case Split_error::unknown_roommate:
+            return "Item split with unknown roommate id:" +
+                   std::to_string(item_id);
+        case Split_error::total_mismatch:
+            return std::string("Cart total does not match") +
+                   std::string("roommate split total");
+        case Split_error::input_too_large:
+            return "Input too large once decompressed";
+    }
+    return std::string();
 }
 
 //Credit to The art of computer programming by Knuth
@@ -167,22 +935,38 @@ bool approximately_equal(double a, double b, double epsilon)
 }
 
 //Roommate Implementation
-Roommate::Roommate(const int id, std::string name) : id(id), name(name){}
-const int Roommate::get_id(){return id;}
-std::string Roommate::get_name(){return name;}
-void Roommate::set_name(std::string new_name){name = new_name;}
+Roommate::Roommate(int id, std::string name) : id(id), name(std::move(name)){}
+int Roommate::get_id() const{return id;}
+const std::string &Roommate::get_name() const{return name;}
+void Roommate::set_name(std::string_view new_name){name.assign(new_name);}
 void Roommate::add_line_item(const Line_item &new_item){items.insert(new_item.get_id());}
 void Roommate::add_line_item(int item_id){items.insert(item_id);}
-void Roommate::add_line_item(std::set<int> item_ids){
+void Roommate::add_line_item(const std::set<int> &item_ids){
     for (int item_id : item_ids) items.insert(item_id);
 }
-void Roommate::remove_line_item(Line_item &new_item){items.erase(new_item.get_id());}
+void Roommate::add_line_item(const Id_set &item_ids){items |= item_ids;}
+void Roommate::remove_line_item(const Line_item &new_item){items.erase(new_item.get_id());}
 void Roommate::remove_line_item(int item_id){items.erase(item_id);}
-const std::set<int> &Roommate::get_items(){return items;}
-void Roommate::add_to_total(double val){total += val;}
-double Roommate::get_total(){return total;}
-void Roommate::set_tax_share(double val){tax_share = val;}
-double Roommate::get_tax_share() {return tax_share;}
+const Id_set &Roommate::get_items() const{return items;}
+void Roommate::add_to_total(double val){total += val; total_units = Money_units();}
+void Roommate::set_total(double val){total = val; total_units = Money_units();}
+void Roommate::set_total(Money_units val){total = val.to_double(); total_units = val;}
+double Roommate::get_total() const{return total;}
+Money_units Roommate::get_total_units() const{return total_units;}
+void Roommate::set_tax_share(double val){tax_share = val; tax_share_units = Money_units();}
+void Roommate::set_tax_share(Money_units val){
+    tax_share = val.to_double();
+    tax_share_units = val;
+}
+double Roommate::get_tax_share() const{return tax_share;}
+Money_units Roommate::get_tax_share_units() const{return tax_share_units;}
+void Roommate::reset(){
+    items.clear();
+    total = 0.0;
+    tax_share = 0.0;
+    total_units = Money_units();
+    tax_share_units = Money_units();
+}
 
 std::ostream& operator << (std::ostream &out, const Roommate &r)
 {
@@ -203,27 +987,64 @@ std::ostream& operator << (std::ostream &out, const Roommate &r)
 
 //Line_item Implementation
 Line_item::Line_item(int id, std::string name, double item_cost,
-          double share_cost, std::set<int> splitting) : id(id),
-          name(name), cost(item_cost),
-          share_cost(share_cost), splitting(splitting) {}
+          double share_cost, Id_set splitting) : id(id),
+          name(std::move(name)), cost(item_cost),
+          share_cost(share_cost), splitting(std::move(splitting)) {}
 Line_item::Line_item(){}
 void Line_item::set_id(int new_id){id = new_id;}
 int Line_item::get_id() const{return id;}
-int Line_item::get_id(){return id;}
-void Line_item::set_name(std::string new_name){name = new_name;}
-std::string Line_item::get_name() const{return name;}
-void Line_item::set_cost(double new_cost){cost = new_cost;}
+void Line_item::set_name(std::string_view new_name){name.assign(new_name);}
+const std::string &Line_item::get_name() const{return name;}
+void Line_item::set_cost(double new_cost){cost = new_cost; cost_units = Money_units();}
+void Line_item::set_cost(Money_units new_cost){
+    cost = new_cost.to_double();
+    cost_units = new_cost;
+}
 double Line_item::get_cost() const{return cost;}
-void Line_item::set_share_cost(double new_cost){share_cost = new_cost;}
+Money_units Line_item::get_cost_units() const{return cost_units;}
+void Line_item::set_share_cost(double new_cost){
+    share_cost = new_cost;
+    share_cost_units = Money_units();
+}
+void Line_item::set_share_cost(Money_units new_cost){
+    share_cost = new_cost.to_double();
+    share_cost_units = new_cost;
+}
 double Line_item::get_share_cost() const{return share_cost;}
-void Line_item::add_splitting(Roommate &new_rm){
+Money_units Line_item::get_share_cost_units() const{return share_cost_units;}
+void Line_item::add_splitting(const Roommate &new_rm){
     splitting.insert(new_rm.get_id());
 }
 void Line_item::add_splitting(int rm_id){splitting.insert(rm_id);}
-void Line_item::add_splitting(std::set<int> rm_ids){
+void Line_item::add_splitting(const std::set<int> &rm_ids){
     for (int rm_id : rm_ids) splitting.insert(rm_id);
 }
-const std::set<int> &Line_item::get_splitting() const{return splitting;}
+void Line_item::add_splitting(const Id_set &rm_ids){splitting |= rm_ids;}
+void Line_item::add_splitting(int rm_id, int weight)
+{
+    splitting.insert(rm_id);
+    auto iter = std::lower_bound(weights.begin(), weights.end(),
+                                 std::make_pair(rm_id, INT_MIN));
+    if (iter != weights.end() && iter->first == rm_id) iter->second = weight;
+    else weights.insert(iter, std::make_pair(rm_id, weight));
+}
+const Id_set &Line_item::get_splitting() const{return splitting;}
+int Line_item::get_weight(int rm_id) const
+{
+    auto iter = std::lower_bound(weights.begin(), weights.end(),
+                                 std::make_pair(rm_id, INT_MIN));
+    if (iter != weights.end() && iter->first == rm_id) return iter->second;
+    return 1;
+}
+bool Line_item::is_weighted() const{return weights.empty() == false;}
+void Line_item::set_quantity(int new_quantity){quantity = new_quantity;}
+int Line_item::get_quantity() const{return quantity;}
+void Line_item::clear_splitting()
+{
+    splitting.clear();
+    weights.clear();
+    quantity = 1;
+}
 
 std::ostream& operator << (std::ostream &out,const Line_item &l)
 {
@@ -243,16 +1064,28 @@ std::ostream& operator << (std::ostream &out,const Line_item &l)
 
 //Cart Implementation
 Cart::Cart(){total = 0.0; tax = 0.0;}
-Cart::Cart(double total, double tax, const std::map<int, Line_item> items):
-     total(total), tax(tax), items(items) {}
-void Cart::set_total(double new_val){total = new_val;}
+Cart::Cart(double total, double tax, std::map<int, Line_item> items):
+     total(total), tax(tax), items(std::move(items)) {}
+void Cart::set_total(double new_val){total = new_val; total_units = Money_units();}
+void Cart::set_total(Money_units new_val){total = new_val.to_double(); total_units = new_val;}
 double Cart::get_total() const{return total;}
-void Cart::set_tax(double new_val){tax = new_val;}
+Money_units Cart::get_total_units() const{return total_units;}
+void Cart::set_tax(double new_val){tax = new_val; tax_units = Money_units();}
+void Cart::set_tax(Money_units new_val){tax = new_val.to_double(); tax_units = new_val;}
 double Cart::get_tax() const{return tax;}
-void Cart::add_line_item(Line_item &new_item){
-    items.insert(std::pair<int, Line_item>(new_item.get_id(), new_item));
+Money_units Cart::get_tax_units() const{return tax_units;}
+void Cart::add_line_item(const Line_item &new_item){
+    items.try_emplace(new_item.get_id(), new_item);
+}
+void Cart::add_line_item(Line_item &&new_item){
+    int id = new_item.get_id();
+    items.try_emplace(id, std::move(new_item));
+}
+void Cart::add_line_item(Line_item_node &&node){items.insert(std::move(node));}
+void Cart::remove_line_item(const Line_item &new_item){items.erase(new_item.get_id());}
+void Cart::release_line_items(std::vector<Line_item_node> *nodes){
+    while (items.empty() == false) nodes->push_back(items.extract(items.begin()));
 }
-void Cart::remove_line_item(Line_item &new_item){items.erase(new_item.get_id());}
 const std::map<int, Line_item> &Cart::get_line_items()const {return items;}
 
 std::ostream& operator << (std::ostream &out, const Cart &c)
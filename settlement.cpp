@@ -0,0 +1,176 @@
+#include "include/settlement.h"
+
+#include <cmath>
+#include <cstdint>
+#include <queue>
+
+//Subset search state is 2^n entries, this bounds it to a few megabytes
+static const int MAX_EXACT_BALANCES = 20;
+
+typedef std::pair<long long, int> Heap_entry;
+
+//Greedy pass over balances that sum to zero, appends to transfers
+static void settle_greedy(const std::vector<std::pair<int, long long>> &balances,
+                          std::vector<Transfer> *transfers)
+{
+    std::vector<Heap_entry> creditor_entries;
+    std::vector<Heap_entry> debtor_entries;
+    for (auto &balance : balances)
+    {
+        if (balance.second > 0)
+            creditor_entries.emplace_back(balance.second, balance.first);
+        else if (balance.second < 0)
+            debtor_entries.emplace_back(-balance.second, balance.first);
+    }
+    std::priority_queue<Heap_entry> creditors(std::less<Heap_entry>(),
+                                              std::move(creditor_entries));
+    std::priority_queue<Heap_entry> debtors(std::less<Heap_entry>(),
+                                            std::move(debtor_entries));
+
+    while (creditors.empty() == false && debtors.empty() == false)
+    {
+        Heap_entry creditor = creditors.top();
+        Heap_entry debtor = debtors.top();
+        creditors.pop();
+        debtors.pop();
+
+        long long cents = std::min(creditor.first, debtor.first);
+        transfers->push_back(Transfer{debtor.second, creditor.second, cents});
+        if (creditor.first > cents)
+            creditors.emplace(creditor.first - cents, creditor.second);
+        if (debtor.first > cents)
+            debtors.emplace(debtor.first - cents, debtor.second);
+    }
+}
+
+/**
+ * Fewest transfers for n non-zero balances is n minus the largest number of
+ * disjoint zero-sum groups they split into. dp[mask] is the most zero-sum
+ * groups an ordering of mask passes through, O(2^n * n). Each group found
+ * is then settled greedily with (group size - 1) transfers.
+ */
+static void settle_exact(const std::vector<std::pair<int, long long>> &balances,
+                         std::vector<Transfer> *transfers)
+{
+    int n = balances.size();
+    uint32_t full = (1u << n) - 1;
+    std::vector<long long> sums(full + 1, 0);
+    std::vector<uint8_t> dp(full + 1, 0);
+    for (uint32_t mask = 1; mask <= full; mask++)
+    {
+        int low = __builtin_ctz(mask);
+        sums[mask] = sums[mask & (mask - 1)] + balances[low].second;
+        uint8_t best = 0;
+        for (uint32_t rest = mask; rest != 0; rest &= rest - 1)
+        {
+            uint8_t without = dp[mask & ~(rest & -rest)];
+            if (without > best) best = without;
+        }
+        dp[mask] = best + (sums[mask] == 0 ? 1 : 0);
+    }
+
+    //Walk back to an ordering, removed last means added first
+    std::vector<int> order;
+    for (uint32_t mask = full; mask != 0;)
+    {
+        uint8_t target = dp[mask] - (sums[mask] == 0 ? 1 : 0);
+        for (uint32_t rest = mask; rest != 0; rest &= rest - 1)
+        {
+            uint32_t bit = rest & -rest;
+            if (dp[mask & ~bit] != target) continue;
+            order.push_back(__builtin_ctz(bit));
+            mask &= ~bit;
+            break;
+        }
+    }
+
+    std::vector<std::pair<int, long long>> group;
+    long long running = 0;
+    for (auto iter = order.rbegin(); iter != order.rend(); iter++)
+    {
+        group.push_back(balances[*iter]);
+        running += balances[*iter].second;
+        if (running != 0) continue;
+        settle_greedy(group, transfers);
+        group.clear();
+    }
+}
+
+std::vector<Transfer> settle_balances(
+    const std::vector<std::pair<int, long long>> &balances,
+    const Settlement_options &options)
+{
+    std::vector<std::pair<int, long long>> open;
+    for (auto &balance : balances)
+    {
+        if (balance.second != 0) open.push_back(balance);
+    }
+
+    std::vector<Transfer> transfers;
+    int limit = std::min(options.exact_limit, MAX_EXACT_BALANCES);
+    if (options.exact && static_cast<int>(open.size()) <= limit)
+        settle_exact(open, &transfers);
+    else
+        settle_greedy(open, &transfers);
+    return transfers;
+}
+
+bool settle_shares(const std::map<int, double> &payments,
+                   const std::map<int, Roommate> &roommates,
+                   const Settlement_options &options,
+                   std::vector<Transfer> *transfers)
+{
+    std::map<int, long long> cents;
+    long long residual = 0;
+    for (auto &rm_pair : roommates)
+    {
+        long long owed = std::llround(rm_pair.second.get_total() * 100.0);
+        cents[rm_pair.first] -= owed;
+        residual -= owed;
+    }
+    for (auto &payment : payments)
+    {
+        if (roommates.count(payment.first) == 0) return false;
+        long long paid = std::llround(payment.second * 100.0);
+        cents[payment.first] += paid;
+        residual += paid;
+    }
+
+    //Per roommate rounding leaves at most one cent each
+    if (roommates.empty() ||
+        std::llabs(residual) > static_cast<long long>(roommates.size()))
+        return false;
+    for (auto iter = cents.begin(); residual != 0; iter++)
+    {
+        long long step = residual > 0 ? 1 : -1;
+        iter->second -= step;
+        residual -= step;
+    }
+
+    std::vector<std::pair<int, long long>> balances(cents.begin(), cents.end());
+    *transfers = settle_balances(balances, options);
+    return true;
+}
+
+void serialize_settlement_json(const std::vector<Transfer> &transfers,
+                               rapidjson::StringBuffer &sb)
+{
+    rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+
+    writer.StartObject();
+    writer.String("transfers");
+    writer.StartArray();
+    for (auto &transfer : transfers)
+    {
+        writer.StartObject();
+        writer.String("from");
+        writer.Int(transfer.from);
+        writer.String("to");
+        writer.Int(transfer.to);
+        writer.String("amount");
+        writer.Double(transfer.cents / 100.0);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+}
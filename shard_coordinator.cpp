@@ -0,0 +1,483 @@
+#include "include/shard_coordinator.h"
+#include "include/batch_io.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "include/rapidjson/stringbuffer.h"
+#include "include/rapidjson/writer.h"
+
+//Pause after the n-th failed connection in a row is n times this
+static const int RETRY_BACKOFF_MS = 100;
+
+//FNV-1a followed by a mixing step, so similar names spread over the ring
+static uint64_t hash_key(std::string_view key)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : key)
+    {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 1099511628211ull;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+//Hash_ring Implementation
+Hash_ring::Hash_ring(unsigned virtual_nodes) :
+    virtual_nodes(std::max(1u, virtual_nodes)) {}
+
+void Hash_ring::add(std::string_view node)
+{
+    int index = static_cast<int>(node_count++);
+    std::string point(node);
+    point.push_back('#');
+    for (unsigned i = 0; i < virtual_nodes; i++)
+        points.emplace_back(hash_key(point + std::to_string(i)), index);
+    std::sort(points.begin(), points.end());
+}
+
+int Hash_ring::lookup(std::string_view key, const std::vector<bool> &down) const
+{
+    if (points.empty()) return -1;
+    auto start = std::lower_bound(points.begin(), points.end(),
+                                  std::make_pair(hash_key(key), -1));
+    size_t first = start - points.begin();
+    for (size_t i = 0; i < points.size(); i++)
+    {
+        int node = points[(first + i) % points.size()].second;
+        if (static_cast<size_t>(node) >= down.size() || down[node] == false)
+            return node;
+    }
+    return -1;
+}
+
+int read_manifest(const std::string &path, std::vector<std::string> *inputs)
+{
+    std::ifstream manifest(path);
+    if (manifest.is_open() == false) return errno ? errno : ENOENT;
+    std::string line;
+    while (std::getline(manifest, line))
+    {
+        if (line.empty() == false && line.back() == '\r') line.pop_back();
+        if (line.empty() || line[0] == '#') continue;
+        inputs->push_back(line);
+    }
+    return 0;
+}
+
+static int connect_worker(const sockaddr_in &addr, unsigned timeout_ms)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    timeval timeout = {static_cast<time_t>(timeout_ms / 1000),
+                       static_cast<suseconds_t>((timeout_ms % 1000) * 1000)};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static bool send_request(int fd, const std::string &body)
+{
+    std::string head = "POST /split HTTP/1.1\r\nContent-Type: application/json"
+                       "\r\nContent-Length: " + std::to_string(body.size()) +
+                       "\r\n\r\n";
+    iovec parts[2] = {{&head[0], head.size()},
+                      {const_cast<char *>(body.data()), body.size()}};
+    msghdr msg = {};
+    msg.msg_iov = parts;
+    msg.msg_iovlen = 2;
+    while (msg.msg_iovlen > 0)
+    {
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        while (msg.msg_iovlen > 0 && static_cast<size_t>(n) >= msg.msg_iov->iov_len)
+        {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = static_cast<char *>(msg.msg_iov->iov_base) + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+//Value of a header in a response head, matched without regard to case
+static std::string_view find_header(std::string_view head, std::string_view name)
+{
+    size_t pos = head.find("\r\n");
+    while (pos != std::string_view::npos && pos + 2 < head.size())
+    {
+        size_t line_start = pos + 2;
+        size_t line_end = head.find("\r\n", line_start);
+        std::string_view line = head.substr(line_start, line_end - line_start);
+        if (line.size() > name.size() && line[name.size()] == ':' &&
+            std::equal(name.begin(), name.end(), line.begin(), [](char a, char b){
+                return tolower(static_cast<unsigned char>(a)) ==
+                       tolower(static_cast<unsigned char>(b));}))
+        {
+            std::string_view value = line.substr(name.size() + 1);
+            while (value.empty() == false && value.front() == ' ')
+                value.remove_prefix(1);
+            return value;
+        }
+        pos = line_end;
+    }
+    return std::string_view();
+}
+
+//Reads one response, false if the connection failed or sent garbage
+static bool read_response(int fd, std::string &buffer, int *status,
+                          std::string *body, bool *closing)
+{
+    char chunk[16 * 1024];
+    for (;;)
+    {
+        size_t header_end = buffer.find("\r\n\r\n");
+        if (header_end != std::string::npos)
+        {
+            std::string_view head(buffer.data(), header_end + 2);
+            std::string_view length = find_header(head, "Content-Length");
+            if (head.size() < 12 || length.empty()) return false;
+            size_t body_length = std::strtoul(std::string(length).c_str(),
+                                              nullptr, 10);
+            size_t total = header_end + 4 + body_length;
+            if (buffer.size() >= total)
+            {
+                *status = std::atoi(buffer.c_str() + 9);
+                *closing = find_header(head, "Connection") == "close";
+                body->assign(buffer, header_end + 4, body_length);
+                buffer.erase(0, total);
+                return true;
+            }
+        }
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buffer.append(chunk, n);
+    }
+}
+
+/**
+ * State shared by the per-worker threads of one run_sharded_batch call.
+ * Everything but the inputs and options is guarded by mutex.
+ */
+class Shard_run
+{
+    public:
+        Shard_run(const std::vector<std::string> &inputs,
+                  const Shard_options &options, std::ostream &out,
+                  Shard_stats *stats) :
+            inputs(inputs), options(options), ring(options.virtual_nodes),
+            out(out), stats(stats) {}
+
+        ~Shard_run()
+        {
+            for (auto &shard : shards)
+            {
+                if (shard.checkpoint_fd >= 0) close(shard.checkpoint_fd);
+            }
+        }
+
+        int run()
+        {
+            for (auto &worker : options.workers)
+            {
+                Shard shard;
+                size_t colon = worker.rfind(':');
+                shard.addr.sin_family = AF_INET;
+                if (colon == std::string::npos ||
+                    inet_pton(AF_INET, worker.substr(0, colon).c_str(),
+                              &shard.addr.sin_addr) != 1)
+                    return EINVAL;
+                shard.addr.sin_port = htons(std::atoi(worker.c_str() + colon + 1));
+                shards.push_back(shard);
+                ring.add(worker);
+            }
+            if (shards.empty()) return EINVAL;
+            down.assign(shards.size(), false);
+            failures.assign(shards.size(), 0);
+
+            std::unordered_set<std::string> done;
+            int err = load_checkpoints(&done);
+            if (err != 0) return err;
+            for (size_t i = 0; i < inputs.size(); i++)
+            {
+                if (done.count(inputs[i]))
+                {
+                    stats->skipped++;
+                    continue;
+                }
+                shards[ring.lookup(inputs[i])].queue.push_back(i);
+                remaining++;
+            }
+
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < shards.size(); i++)
+                threads.emplace_back(&Shard_run::run_shard, this, i);
+            for (auto &thread : threads) thread.join();
+            out.flush();
+            return lost ? EHOSTUNREACH : 0;
+        }
+
+    private:
+        struct Shard
+        {
+            sockaddr_in addr = {};
+            std::deque<size_t> queue;
+            int checkpoint_fd = -1;
+        };
+
+        int load_checkpoints(std::unordered_set<std::string> *done)
+        {
+            if (options.checkpoint_dir.empty()) return 0;
+            std::error_code error;
+            std::filesystem::create_directories(options.checkpoint_dir, error);
+            if (error) return error.value();
+
+            for (auto &entry :
+                 std::filesystem::directory_iterator(options.checkpoint_dir, error))
+            {
+                if (entry.path().extension() != ".done") continue;
+                std::ifstream checkpoint(entry.path());
+                std::string line;
+                while (std::getline(checkpoint, line)) done->insert(line);
+            }
+            if (error) return error.value();
+
+            for (size_t i = 0; i < shards.size(); i++)
+            {
+                std::string path = options.checkpoint_dir + "/shard-" +
+                                   std::to_string(i) + ".done";
+                shards[i].checkpoint_fd = open(path.c_str(), O_WRONLY | O_CREAT |
+                                               O_APPEND | O_CLOEXEC, 0644);
+                if (shards[i].checkpoint_fd < 0) return errno;
+            }
+            return 0;
+        }
+
+        //Writes the result line and the checkpoint entry, caller holds mutex
+        void finish(size_t shard, size_t index, int status, int err,
+                    const std::string &body)
+        {
+            rapidjson::StringBuffer sb;
+            rapidjson::Writer<rapidjson::StringBuffer> writer(sb);
+            writer.StartObject();
+            writer.Key("index");
+            writer.Uint64(index);
+            writer.Key("input");
+            writer.String(inputs[index].c_str(), inputs[index].size());
+            if (err != 0)
+            {
+                writer.Key("error");
+                writer.String(strerror(err));
+                stats->io_errors++;
+            }
+            else
+            {
+                writer.Key("status");
+                writer.Int(status);
+                writer.Key("result");
+                if (body.empty()) writer.Null();
+                else writer.RawValue(body.data(), body.size(), rapidjson::kObjectType);
+                if (status == 200) stats->succeeded++;
+                else stats->failed++;
+            }
+            writer.EndObject();
+            out.write(sb.GetString(), sb.GetSize());
+            out.put('\n');
+
+            int fd = shards[shard].checkpoint_fd;
+            if (fd >= 0)
+            {
+                out.flush();
+                std::string line = inputs[index] + "\n";
+                if (write(fd, line.data(), line.size()) < 0) {}
+            }
+            if (--remaining == 0) ready.notify_all();
+        }
+
+        //Puts unanswered receipts back in order, true if the shard gave up
+        bool requeue(size_t shard, std::deque<size_t> &in_flight, bool failed)
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::deque<size_t> &queue = shards[shard].queue;
+            stats->retried += in_flight.size();
+            queue.insert(queue.begin(), in_flight.begin(), in_flight.end());
+            in_flight.clear();
+            if (failed == false) return false;
+            if (++failures[shard] < options.attempts) return false;
+
+            //Consistent hashing sends each receipt to the next live worker
+            down[shard] = true;
+            stats->lost_workers++;
+            for (size_t index : queue)
+            {
+                int next = ring.lookup(inputs[index], down);
+                if (next < 0)
+                {
+                    lost++;
+                    if (--remaining == 0) ready.notify_all();
+                    continue;
+                }
+                shards[next].queue.push_back(index);
+            }
+            queue.clear();
+            ready.notify_all();
+            return true;
+        }
+
+        void run_shard(size_t shard)
+        {
+            std::deque<size_t> in_flight;
+            std::vector<size_t> to_send;
+            std::string buffer, body, response;
+            int fd = -1;
+            for (;;)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    std::deque<size_t> &queue = shards[shard].queue;
+                    ready.wait(lock, [&]{
+                        return queue.empty() == false || in_flight.empty() == false ||
+                               remaining == 0;});
+                    if (in_flight.empty() && queue.empty()) break;
+                    while (queue.empty() == false &&
+                           in_flight.size() + to_send.size() < options.pipeline)
+                    {
+                        to_send.push_back(queue.front());
+                        queue.pop_front();
+                    }
+                }
+
+                if (fd < 0 && (fd = connect_worker(shards[shard].addr,
+                                                   options.timeout_ms)) < 0)
+                {
+                    in_flight.insert(in_flight.end(), to_send.begin(), to_send.end());
+                    to_send.clear();
+                    if (back_off(shard, in_flight)) return;
+                    continue;
+                }
+
+                bool sent = true;
+                for (size_t index : to_send)
+                {
+                    int err = read_whole_file(inputs[index], &body);
+                    if (err != 0)
+                    {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        finish(shard, index, 0, err, body);
+                        continue;
+                    }
+                    in_flight.push_back(index);
+                    if (sent) sent = send_request(fd, body);
+                }
+                to_send.clear();
+                if (in_flight.empty()) continue;
+
+                int status = 0;
+                bool closing = false;
+                if (sent == false ||
+                    read_response(fd, buffer, &status, &response, &closing) == false)
+                {
+                    close(fd);
+                    fd = -1;
+                    buffer.clear();
+                    if (back_off(shard, in_flight)) return;
+                    continue;
+                }
+
+                size_t index = in_flight.front();
+                in_flight.pop_front();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    failures[shard] = 0;
+                    if (status == 503)
+                    {
+                        //Shed by the worker, try again after the others
+                        shards[shard].queue.push_back(index);
+                        stats->retried++;
+                    }
+                    else
+                        finish(shard, index, status, 0, response);
+                }
+                if (closing)
+                {
+                    close(fd);
+                    fd = -1;
+                    buffer.clear();
+                    requeue(shard, in_flight, false);
+                }
+            }
+            if (fd >= 0) close(fd);
+        }
+
+        //Requeues after a failed connection and waits before the next try,
+        //true if the shard gave up
+        bool back_off(size_t shard, std::deque<size_t> &in_flight)
+        {
+            if (requeue(shard, in_flight, true)) return true;
+            unsigned count;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                count = failures[shard];
+            }
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(RETRY_BACKOFF_MS * count));
+            return false;
+        }
+
+        const std::vector<std::string> &inputs;
+        const Shard_options &options;
+        Hash_ring ring;
+        std::ostream &out;
+        Shard_stats *stats;
+
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::vector<Shard> shards;
+        std::vector<bool> down;
+        std::vector<unsigned> failures;
+        size_t remaining = 0;
+        size_t lost = 0;
+};
+
+int run_sharded_batch(const std::vector<std::string> &inputs,
+                      const Shard_options &options, std::ostream &out,
+                      Shard_stats *stats)
+{
+    *stats = Shard_stats();
+    Shard_run run(inputs, options, out, stats);
+    return run.run();
+}
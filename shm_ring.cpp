@@ -0,0 +1,471 @@
+#include "include/shm_server.h"
+#include "include/parse_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <functional>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+//Polls of the slot state before a caller sleeps on its futex
+static const int CALLER_SPINS = 2000;
+//Sleeps are bounded so a caller notices a server that stopped while it
+//was submitting, or whose process died
+static const long SLEEP_TIMEOUT_NS = 100 * 1000 * 1000;
+
+static_assert(sizeof(rs_ring_header) == 64, "ring header layout");
+static_assert(sizeof(rs_slot) == 64, "slot header layout");
+
+template <typename T>
+static T load_acquire(const T *ptr){return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);}
+template <typename T>
+static void store_release(T *ptr, T value){__atomic_store_n(ptr, value, __ATOMIC_RELEASE);}
+
+//Shared (not process private) futex calls, the words live in shared memory
+static void futex_wait(uint32_t *word, uint32_t expected, long timeout_ns)
+{
+    timespec timeout = {0, timeout_ns};
+    syscall(SYS_futex, word, FUTEX_WAIT, expected,
+            timeout_ns > 0 ? &timeout : nullptr, nullptr, 0);
+}
+
+static void futex_wake(uint32_t *word, int count)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE, count, nullptr, nullptr, 0);
+}
+
+static rs_queue_cell *queue_cells(rs_ring_header *header)
+{
+    return reinterpret_cast<rs_queue_cell *>(
+        reinterpret_cast<char *>(header) + RS_QUEUE_OFFSET);
+}
+
+static rs_slot *slot_at(rs_ring_header *header, uint64_t index)
+{
+    return reinterpret_cast<rs_slot *>(
+        reinterpret_cast<char *>(header) + RS_SLOTS_OFFSET(header->slot_count) +
+        index * RS_SLOT_STRIDE(header->slot_capacity));
+}
+
+static char *slot_data(rs_slot *slot){return reinterpret_cast<char *>(slot + 1);}
+
+//False once the process that serves the ring has exited, a server killed
+//before stop() never fails the requests it holds
+static bool server_alive(const rs_ring_header *header)
+{
+    pid_t pid = static_cast<pid_t>(load_acquire(&header->server_pid));
+    return pid == 0 || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+/**
+ * Bounded MPMC queue, every cell carries a sequence number telling producers
+ * and consumers whose turn it is (Vyukov). It holds slot indexes and has one
+ * cell per slot, so a push never finds it full.
+ */
+static void queue_push(rs_ring_header *header, uint64_t slot)
+{
+    rs_queue_cell *cells = queue_cells(header);
+    uint64_t mask = header->slot_count - 1;
+    uint64_t pos = __atomic_load_n(&header->queue_tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        rs_queue_cell *cell = &cells[pos & mask];
+        int64_t diff = static_cast<int64_t>(load_acquire(&cell->sequence) - pos);
+        if (diff == 0 &&
+            __atomic_compare_exchange_n(&header->queue_tail, &pos, pos + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            cell->slot = slot;
+            store_release(&cell->sequence, pos + 1);
+            return;
+        }
+        if (diff != 0)
+            pos = __atomic_load_n(&header->queue_tail, __ATOMIC_RELAXED);
+    }
+}
+
+static bool queue_pop(rs_ring_header *header, uint64_t *slot)
+{
+    rs_queue_cell *cells = queue_cells(header);
+    uint64_t mask = header->slot_count - 1;
+    uint64_t pos = __atomic_load_n(&header->queue_head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        rs_queue_cell *cell = &cells[pos & mask];
+        int64_t diff = static_cast<int64_t>(load_acquire(&cell->sequence) -
+                                            (pos + 1));
+        if (diff < 0) return false;
+        if (diff == 0 &&
+            __atomic_compare_exchange_n(&header->queue_head, &pos, pos + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            *slot = cell->slot;
+            store_release(&cell->sequence, pos + mask + 1);
+            return true;
+        }
+        if (diff > 0)
+            pos = __atomic_load_n(&header->queue_head, __ATOMIC_RELAXED);
+    }
+}
+
+//Client Implementation
+struct rs_client
+{
+    rs_ring_header *header;
+    size_t mapped_size;
+};
+
+extern "C" rs_client *rs_client_open(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return nullptr;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        static_cast<size_t>(st.st_size) < sizeof(rs_ring_header))
+    {
+        int err = errno ? errno : EINVAL;
+        close(fd);
+        errno = err;
+        return nullptr;
+    }
+    void *memory = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) return nullptr;
+
+    rs_ring_header *header = static_cast<rs_ring_header *>(memory);
+    if (load_acquire(&header->magic) != RS_RING_MAGIC ||
+        header->version != RS_RING_VERSION ||
+        static_cast<size_t>(st.st_size) <
+            RS_RING_SIZE(header->slot_count, header->slot_capacity))
+    {
+        munmap(memory, st.st_size);
+        errno = EPROTO;
+        return nullptr;
+    }
+
+    rs_client *client = new rs_client;
+    client->header = header;
+    client->mapped_size = st.st_size;
+    return client;
+}
+
+extern "C" void rs_client_close(rs_client *client)
+{
+    if (client == nullptr) return;
+    munmap(client->header, client->mapped_size);
+    delete client;
+}
+
+//Claims a free slot, sleeping while every slot is in use
+static rs_slot *claim_slot(rs_ring_header *header)
+{
+    //Start callers on different threads at different slots
+    uint64_t start = std::hash<std::thread::id>()(std::this_thread::get_id());
+    for (;;)
+    {
+        if (load_acquire(&header->stopping)) return nullptr;
+        uint32_t seen = load_acquire(&header->release_futex);
+        for (uint64_t i = 0; i < header->slot_count; i++)
+        {
+            rs_slot *slot = slot_at(header, (start + i) % header->slot_count);
+            uint32_t expected = RS_SLOT_FREE;
+            if (__atomic_compare_exchange_n(&slot->state, &expected,
+                                            RS_SLOT_CLAIMED, false,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return slot;
+        }
+        if (server_alive(header) == false) return nullptr;
+        __atomic_fetch_add(&header->release_sleepers, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&header->release_futex, seen, SLEEP_TIMEOUT_NS);
+        __atomic_fetch_sub(&header->release_sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void release_slot(rs_ring_header *header, rs_slot *slot)
+{
+    store_release(&slot->state, RS_SLOT_FREE);
+    __atomic_fetch_add(&header->release_futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->release_sleepers, __ATOMIC_SEQ_CST) != 0)
+        futex_wake(&header->release_futex, 1);
+}
+
+extern "C" int rs_client_split(rs_client *client, uint32_t format,
+                               const void *request, size_t request_length,
+                               void *response, size_t capacity,
+                               size_t *response_length, int32_t *status)
+{
+    rs_ring_header *header = client->header;
+    if (request_length > header->slot_capacity) return E2BIG;
+    rs_slot *slot = claim_slot(header);
+    if (slot == nullptr) return ESHUTDOWN;
+
+    memcpy(slot_data(slot), request, request_length);
+    slot->format = format;
+    slot->length = request_length;
+    slot->status = 0;
+    store_release(&slot->state, RS_SLOT_SUBMITTED);
+    queue_push(header, (reinterpret_cast<char *>(slot) -
+                        reinterpret_cast<char *>(slot_at(header, 0))) /
+                       RS_SLOT_STRIDE(header->slot_capacity));
+    __atomic_fetch_add(&header->submit_futex, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->server_sleepers, __ATOMIC_SEQ_CST) != 0)
+        futex_wake(&header->submit_futex, 1);
+
+    //Short requests finish within the spin, longer ones sleep on the state
+    for (int spin = 0;; spin++)
+    {
+        uint32_t state = load_acquire(&slot->state);
+        if (state == RS_SLOT_DONE) break;
+        if (spin < CALLER_SPINS) continue;
+        if (state == RS_SLOT_SUBMITTED && load_acquire(&header->stopping))
+        {
+            //A server that stopped before taking the request never will
+            if (__atomic_compare_exchange_n(&slot->state, &state, RS_SLOT_FREE,
+                                            false, __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE))
+                return ESHUTDOWN;
+            continue;
+        }
+        //The slot is left as it is, nobody serves this ring any more
+        if (server_alive(header) == false) return ESHUTDOWN;
+        __atomic_store_n(&slot->waiting, 1, __ATOMIC_SEQ_CST);
+        futex_wait(&slot->state, state, SLEEP_TIMEOUT_NS);
+        __atomic_store_n(&slot->waiting, 0, __ATOMIC_RELAXED);
+    }
+
+    int err = 0;
+    *status = slot->status;
+    *response_length = slot->length;
+    if (slot->status == RS_STATUS_SHUTDOWN) err = ESHUTDOWN;
+    else if (slot->status == RS_STATUS_TOO_LARGE || slot->length > capacity)
+        err = ENOBUFS;
+    else memcpy(response, slot_data(slot), slot->length);
+    release_slot(header, slot);
+    return err;
+}
+
+//Shm_split_server Implementation
+Shm_split_server::Shm_split_server(const Shm_server_options &options) :
+    options(options) {}
+
+Shm_split_server::~Shm_split_server(){stop();}
+
+int Shm_split_server::start()
+{
+    if (memory != nullptr) return EALREADY;
+
+    uint32_t slot_count = 1;
+    while (slot_count < options.slots) slot_count <<= 1;
+    if (options.slot_capacity > UINT32_MAX) return EINVAL;
+    size_t size = RS_RING_SIZE(slot_count, options.slot_capacity);
+
+    //A stale object from a crashed server is replaced
+    shm_unlink(options.name.c_str());
+    int fd = shm_open(options.name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) return errno;
+    if (ftruncate(fd, size) != 0)
+    {
+        int err = errno;
+        close(fd);
+        shm_unlink(options.name.c_str());
+        return err;
+    }
+    void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int err = errno;
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        shm_unlink(options.name.c_str());
+        return err;
+    }
+    memory = mapped;
+    mapped_size = size;
+
+    //ftruncate zero filled everything, so all slots start free
+    rs_ring_header *header = static_cast<rs_ring_header *>(memory);
+    header->version = RS_RING_VERSION;
+    header->slot_count = slot_count;
+    header->slot_capacity = options.slot_capacity;
+    header->server_pid = static_cast<uint32_t>(getpid());
+    rs_queue_cell *cells = queue_cells(header);
+    for (uint32_t i = 0; i < slot_count; i++) cells[i].sequence = i;
+    //Callers check the magic last
+    store_release(&header->magic, RS_RING_MAGIC);
+
+    unsigned worker_count = options.workers ? options.workers : 1;
+    for (unsigned i = 0; i < worker_count; i++)
+        workers.emplace_back(&Shm_split_server::run_worker, this);
+    return 0;
+}
+
+void Shm_split_server::stop()
+{
+    if (memory == nullptr) return;
+    rs_ring_header *header = static_cast<rs_ring_header *>(memory);
+    __atomic_store_n(&header->stopping, 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&header->submit_futex, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&header->submit_futex, INT_MAX);
+    for (auto &worker : workers) worker.join();
+    workers.clear();
+
+    //Requests nobody will serve are failed, waking their callers. The slot
+    //is taken like serve() takes it before its status is written, as the
+    //caller may be freeing it at the same time
+    for (uint64_t i = 0; i < header->slot_count; i++)
+    {
+        rs_slot *slot = slot_at(header, i);
+        uint32_t expected = RS_SLOT_SUBMITTED;
+        if (__atomic_compare_exchange_n(&slot->state, &expected, RS_SLOT_SERVING,
+                                        false, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED) == false)
+            continue;
+        slot->status = RS_STATUS_SHUTDOWN;
+        slot->length = 0;
+        store_release(&slot->state, RS_SLOT_DONE);
+        futex_wake(&slot->state, INT_MAX);
+    }
+    __atomic_fetch_add(&header->release_futex, 1, __ATOMIC_SEQ_CST);
+    futex_wake(&header->release_futex, INT_MAX);
+
+    munmap(memory, mapped_size);
+    shm_unlink(options.name.c_str());
+    memory = nullptr;
+    mapped_size = 0;
+}
+
+void Shm_split_server::run_worker()
+{
+    rs_ring_header *header = static_cast<rs_ring_header *>(memory);
+    for (;;)
+    {
+        uint64_t index;
+        if (queue_pop(header, &index))
+        {
+            serve(slot_at(header, index));
+            continue;
+        }
+        if (__atomic_load_n(&header->stopping, __ATOMIC_SEQ_CST)) return;
+
+        //Sleep unless a submission raced with the empty check
+        uint32_t seen = __atomic_load_n(&header->submit_futex, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&header->server_sleepers, 1, __ATOMIC_SEQ_CST);
+        if (queue_pop(header, &index))
+        {
+            __atomic_fetch_sub(&header->server_sleepers, 1, __ATOMIC_SEQ_CST);
+            serve(slot_at(header, index));
+            continue;
+        }
+        futex_wait(&header->submit_futex, seen, 0);
+        __atomic_fetch_sub(&header->server_sleepers, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+//Splits the request in slot and writes the response over it
+void Shm_split_server::serve(rs_slot *slot)
+{
+    rs_ring_header *header = static_cast<rs_ring_header *>(memory);
+    //The caller may have given up on a stopping server
+    uint32_t expected = RS_SLOT_SUBMITTED;
+    if (__atomic_compare_exchange_n(&slot->state, &expected, RS_SLOT_SERVING,
+                                    false, __ATOMIC_ACQUIRE,
+                                    __ATOMIC_RELAXED) == false)
+        return;
+    size_t length = std::min<uint64_t>(slot->length, header->slot_capacity);
+
+    if (slot->format == RS_FORMAT_PACKED)
+    {
+        size_t written = 0;
+        slot->status = split_packed_cart(slot_data(slot), length, slot_data(slot),
+                                         header->slot_capacity, &written);
+        slot->length = written;
+    }
+    else
+    {
+        static thread_local rapidjson::StringBuffer sb;
+        sb.Clear();
+        Split_status status;
+        bool ok = split_json_pooled(slot_data(slot), length, options.parse, sb,
+                                    &status);
+        if (ok) slot->status = 0;
+        else if (status.ok()) slot->status = RS_STATUS_INVALID_INPUT;
+        else slot->status = static_cast<int32_t>(status.code);
+
+        slot->length = sb.GetSize();
+        if (sb.GetSize() > header->slot_capacity)
+            slot->status = RS_STATUS_TOO_LARGE;
+        else memcpy(slot_data(slot), sb.GetString(), sb.GetSize());
+    }
+
+    store_release(&slot->state, RS_SLOT_DONE);
+    if (__atomic_load_n(&slot->waiting, __ATOMIC_SEQ_CST) != 0)
+        futex_wake(&slot->state, 1);
+}
+
+int split_packed_cart(const void *request, size_t request_length,
+                      void *response, size_t capacity, size_t *response_length)
+{
+    const char *data = static_cast<const char *>(request);
+    const char *end = data + request_length;
+    *response_length = 0;
+
+    rs_packed_cart packed_cart;
+    if (request_length < sizeof(packed_cart)) return RS_STATUS_INVALID_INPUT;
+    memcpy(&packed_cart, data, sizeof(packed_cart));
+    data += sizeof(packed_cart);
+    size_t needed = packed_cart.roommate_count * sizeof(rs_packed_share);
+    if (packed_cart.roommate_count > request_length) return RS_STATUS_INVALID_INPUT;
+
+    //The request is read completely before the response overwrites it
+    std::map<int, Roommate> roommates;
+    for (uint32_t i = 0; i < packed_cart.roommate_count; i++)
+        roommates.emplace_hint(roommates.end(), i, Roommate(i, ""));
+    Cart cart(packed_cart.total, packed_cart.tax, {});
+    for (uint32_t i = 0; i < packed_cart.item_count; i++)
+    {
+        rs_packed_item item;
+        if (static_cast<size_t>(end - data) < sizeof(item))
+            return RS_STATUS_INVALID_INPUT;
+        memcpy(&item, data, sizeof(item));
+        if (static_cast<size_t>(end - data) <
+            RS_PACKED_ITEM_SIZE(static_cast<uint64_t>(item.split_count)))
+            return RS_STATUS_INVALID_INPUT;
+
+        Line_item &line_item = cart.emplace_line_item(item.id, "", item.cost,
+                                                      0.0, Id_set());
+        const char *ids = data + sizeof(item);
+        for (uint32_t k = 0; k < item.split_count; k++)
+        {
+            int32_t rm_id;
+            memcpy(&rm_id, ids + k * sizeof(rm_id), sizeof(rm_id));
+            line_item.add_splitting(rm_id);
+        }
+        data += RS_PACKED_ITEM_SIZE(static_cast<uint64_t>(item.split_count));
+    }
+
+    Split_status status = try_validate_input(&cart, &roommates);
+    if (status.ok()) status = try_calculate_shares(&cart, &roommates);
+    if (status.ok() == false) return static_cast<int>(status.code);
+
+    *response_length = needed;
+    if (needed > capacity) return RS_STATUS_TOO_LARGE;
+    char *out = static_cast<char *>(response);
+    for (auto &rm_pair : roommates)
+    {
+        rs_packed_share share = {rm_pair.second.get_total(),
+                                 rm_pair.second.get_tax_share()};
+        memcpy(out, &share, sizeof(share));
+        out += sizeof(share);
+    }
+    return 0;
+}
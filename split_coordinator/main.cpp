@@ -0,0 +1,109 @@
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "../include/shard_coordinator.h"
+
+static void usage()
+{
+    std::cout << "usage: split_coordinator <manifest> --worker HOST:PORT"
+              << " [--worker HOST:PORT ...] [options]" << std::endl;
+    std::cout << "  --worker HOST:PORT  split_server to shard receipts to"
+              << std::endl;
+    std::cout << "  --output FILE       merged JSON lines (default: stdout)"
+              << std::endl;
+    std::cout << "  --checkpoint DIR    record progress in DIR and skip receipts"
+              << " already done" << std::endl;
+    std::cout << "  --attempts N        failed connections before a worker is"
+              << " dropped (default: 3)" << std::endl;
+    std::cout << "  --pipeline N        requests in flight per worker (default: 16)"
+              << std::endl;
+}
+
+/**
+ * Splits every receipt listed in <manifest>, one path per line, on a set of
+ * split_server workers and merges the results into one JSON lines stream.
+ * With --checkpoint an interrupted run can be started again and appends
+ * only the receipts still missing to --output.
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    Shard_options options;
+    std::string output_path;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--worker") == 0 && i + 1 < argc)
+            options.workers.push_back(argv[++i]);
+        else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+            output_path = argv[++i];
+        else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+            options.checkpoint_dir = argv[++i];
+        else if (strcmp(argv[i], "--attempts") == 0 && i + 1 < argc)
+            options.attempts = std::stoi(argv[++i]);
+        else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc)
+            options.pipeline = std::stoi(argv[++i]);
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.workers.empty())
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> inputs;
+    int err = read_manifest(argv[1], &inputs);
+    if (err != 0)
+    {
+        std::cerr << "split_coordinator: " << argv[1] << ": " << strerror(err)
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    std::ofstream output_file;
+    if (output_path.empty() == false)
+    {
+        //A resumed run adds to the results of the interrupted one
+        output_file.open(output_path, options.checkpoint_dir.empty() ?
+                         std::ios::out | std::ios::trunc :
+                         std::ios::out | std::ios::app);
+        if (output_file.is_open() == false)
+        {
+            std::cerr << "split_coordinator: cannot open " << output_path
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    std::ostream &out = output_path.empty() ? std::cout : output_file;
+
+    Shard_stats stats;
+    auto start = std::chrono::steady_clock::now();
+    err = run_sharded_batch(inputs, options, out, &stats);
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::cerr << "receipts: " << inputs.size() << " in " << seconds << " s"
+              << std::endl;
+    std::cerr << "succeeded: " << stats.succeeded << " failed: " << stats.failed
+              << " io errors: " << stats.io_errors << " skipped: "
+              << stats.skipped << std::endl;
+    std::cerr << "retried: " << stats.retried << " lost workers: "
+              << stats.lost_workers << std::endl;
+    if (err != 0)
+    {
+        std::cerr << "split_coordinator: " << strerror(err) << std::endl;
+        return EXIT_FAILURE;
+    }
+    return (stats.failed == 0 && stats.io_errors == 0) ? 0 : EXIT_FAILURE;
+}
@@ -0,0 +1,107 @@
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include "../include/http_server.h"
+#include "../include/trace.h"
+
+static void usage()
+{
+    std::cout << "usage: split_server [options]" << std::endl;
+    std::cout << "  --address A     listen address (default: 127.0.0.1)"
+              << std::endl;
+    std::cout << "  --port N        listen port (default: 8080)" << std::endl;
+    std::cout << "  --io-threads N  epoll threads (default: 1)" << std::endl;
+    std::cout << "  --workers N     split worker threads (default: all cores)"
+              << std::endl;
+    std::cout << "  --exact         exact decimal parsing of money fields"
+              << std::endl;
+    std::cout << "  --processes N   split in N worker processes, a crashing input"
+              << " only fails its request" << std::endl;
+    std::cout << "  --crash-dir D   save inputs that crashed a worker to D"
+              << std::endl;
+    std::cout << "  --fifo          serve requests in arrival order instead of"
+              << " smallest first" << std::endl;
+    std::cout << "  --aging X       ns of priority gained per ns waited (default: 0.1)"
+              << std::endl;
+    std::cout << "  --latency-budget MS  answer 503 when a request would wait"
+              << " longer" << std::endl;
+    std::cout << "  --session-memory MB  memory for carts kept by /sessions, 0 turns"
+              << " them off (default: 64)" << std::endl;
+    std::cout << "  --trace FILE    write a Chrome trace-event timeline to FILE"
+              << std::endl;
+    std::cout << "                  on exit" << std::endl;
+}
+
+/**
+ * Serves POST /split until SIGINT or SIGTERM, the request body is a receipt
+ * JSON and the response its split result or error document. /sessions
+ * keeps carts for editing, see Http_server.
+ */
+int main(int argc, char **argv)
+{
+    Http_server_options options;
+    std::string trace_path;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--address") == 0 && i + 1 < argc)
+            options.address = argv[++i];
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+            options.port = std::stoi(argv[++i]);
+        else if (strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc)
+            options.io_threads = std::stoi(argv[++i]);
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+            options.workers = std::stoi(argv[++i]);
+        else if (strcmp(argv[i], "--exact") == 0)
+            options.parse.exact_decimal = true;
+        else if (strcmp(argv[i], "--processes") == 0 && i + 1 < argc)
+            options.processes = std::stoi(argv[++i]);
+        else if (strcmp(argv[i], "--crash-dir") == 0 && i + 1 < argc)
+            options.crash_dir = argv[++i];
+        else if (strcmp(argv[i], "--fifo") == 0)
+            options.schedule.shortest_first = false;
+        else if (strcmp(argv[i], "--aging") == 0 && i + 1 < argc)
+            options.schedule.aging = std::stod(argv[++i]);
+        else if (strcmp(argv[i], "--latency-budget") == 0 && i + 1 < argc)
+            options.schedule.latency_budget_ms = std::stod(argv[++i]);
+        else if (strcmp(argv[i], "--session-memory") == 0 && i + 1 < argc)
+            options.session_memory = std::stoul(argv[++i]) << 20;
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            trace_path = argv[++i];
+        else
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    //Block the stop signals so every server thread inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    if (trace_path.empty() == false) trace_start();
+    Http_server server(options);
+    int err = server.start();
+    if (err != 0)
+    {
+        std::cerr << "split_server: " << strerror(err) << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "listening on " << options.address << ":" << server.get_port()
+              << std::endl;
+
+    int received = 0;
+    sigwait(&signals, &received);
+    server.stop();
+    if (trace_path.empty() == false)
+    {
+        err = trace_stop(trace_path);
+        if (err != 0)
+            std::cerr << "split_server: " << trace_path << ": " << strerror(err)
+                      << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include "include/table_export.h"
+
+#include <cerrno>
+#include <filesystem>
+
+#include "include/rapidjson/internal/dtoa.h"
+#include "include/rapidjson/internal/itoa.h"
+
+//Large stdio buffers, rows arrive in chunks of up to Table_rows::FLUSH_SIZE
+static const size_t FILE_BUFFER_SIZE = 1024 * 1024;
+
+static FILE *open_table(const std::string &path, const char *header)
+{
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr) return nullptr;
+    setvbuf(fp, nullptr, _IOFBF, FILE_BUFFER_SIZE);
+    fputs(header, fp);
+    return fp;
+}
+
+//Table_rows Implementation
+Table_rows::Table_rows(Table_format format) :
+    format(format), separator(format == Table_format::csv ? ',' : '\t') {}
+
+void Table_rows::clear()
+{
+    roommate_rows.clear();
+    item_rows.clear();
+}
+
+void Table_rows::put_text(std::string &out, std::string_view text)
+{
+    if (format == Table_format::tsv)
+    {
+        for (char c : text)
+        {
+            if (c == '\t') out.append("\\t");
+            else if (c == '\n') out.append("\\n");
+            else if (c == '\r') out.append("\\r");
+            else if (c == '\\') out.append("\\\\");
+            else out.push_back(c);
+        }
+        return;
+    }
+
+    if (text.find_first_of(",\"\r\n") == std::string_view::npos)
+    {
+        out.append(text.data(), text.size());
+        return;
+    }
+    out.push_back('"');
+    for (char c : text)
+    {
+        if (c == '"') out.push_back('"');
+        out.push_back(c);
+    }
+    out.push_back('"');
+}
+
+void Table_rows::put_int(std::string &out, int value)
+{
+    char buffer[16];
+    char *end = rapidjson::internal::i32toa(value, buffer);
+    out.append(buffer, end - buffer);
+}
+
+//Shortest text reading back as the same double, as the JSON output has it
+void Table_rows::put_double(std::string &out, double value)
+{
+    char buffer[32];
+    char *end = rapidjson::internal::dtoa(value, buffer);
+    out.append(buffer, end - buffer);
+}
+
+void Table_rows::add(std::string_view cart_name, const Cart &cart,
+                     const std::map<int, Roommate> &roommates)
+{
+    for (auto &entry : roommates)
+    {
+        const Roommate &rm = entry.second;
+        put_text(roommate_rows, cart_name);
+        roommate_rows.push_back(separator);
+        put_int(roommate_rows, rm.get_id());
+        roommate_rows.push_back(separator);
+        put_text(roommate_rows, rm.get_name());
+        roommate_rows.push_back(separator);
+        put_double(roommate_rows, rm.get_total());
+        roommate_rows.push_back(separator);
+        put_double(roommate_rows, rm.get_tax_share());
+        roommate_rows.push_back('\n');
+    }
+
+    for (auto &entry : cart.get_line_items())
+    {
+        const Line_item &item = entry.second;
+        put_text(item_rows, cart_name);
+        item_rows.push_back(separator);
+        put_int(item_rows, item.get_id());
+        item_rows.push_back(separator);
+        put_text(item_rows, item.get_name());
+        item_rows.push_back(separator);
+        put_double(item_rows, item.get_cost());
+        item_rows.push_back(separator);
+        put_double(item_rows, item.get_share_cost());
+        item_rows.push_back(separator);
+        put_int(item_rows, static_cast<int>(item.get_splitting().size()));
+        item_rows.push_back('\n');
+    }
+}
+
+//Table_export Implementation
+Table_export::Table_export() {}
+
+Table_export::~Table_export()
+{
+    close();
+}
+
+int Table_export::open(const std::string &dir, Table_format format)
+{
+    close();
+    error = 0;
+    this->format = format;
+    const char *extension = format == Table_format::csv ? ".csv" : ".tsv";
+    std::string roommate_header = "cart,roommate_id,name,total,tax_share\n";
+    std::string item_header = "cart,item_id,item_name,cost,share_cost,share_count\n";
+    if (format == Table_format::tsv)
+    {
+        for (char &c : roommate_header) if (c == ',') c = '\t';
+        for (char &c : item_header) if (c == ',') c = '\t';
+    }
+
+    std::filesystem::path path(dir);
+    roommate_file = open_table((path / "roommates").string() + extension,
+                               roommate_header.c_str());
+    if (roommate_file == nullptr) return errno;
+    item_file = open_table((path / "line_items").string() + extension,
+                           item_header.c_str());
+    if (item_file == nullptr)
+    {
+        int err = errno;
+        fclose(roommate_file);
+        roommate_file = nullptr;
+        return err;
+    }
+    return 0;
+}
+
+void Table_export::write(FILE *fp, const std::string &data)
+{
+    if (data.empty() == false && fwrite(data.data(), 1, data.size(), fp) != data.size() &&
+        error == 0)
+        error = errno != 0 ? errno : EIO;
+}
+
+void Table_export::append(Table_rows &rows)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (roommate_file != nullptr)
+        {
+            write(roommate_file, rows.roommate_rows);
+            write(item_file, rows.item_rows);
+        }
+    }
+    rows.clear();
+}
+
+int Table_export::close()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (roommate_file == nullptr) return error;
+    if (fclose(roommate_file) != 0 && error == 0) error = errno;
+    if (fclose(item_file) != 0 && error == 0) error = errno;
+    roommate_file = nullptr;
+    item_file = nullptr;
+    return error;
+}
@@ -0,0 +1,180 @@
+#include "include/trace.h"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+std::atomic<bool> trace_active(false);
+
+struct Trace_event
+{
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    long long cart;
+    long long items;
+};
+
+//Events are only appended by the owning thread and published through
+//count, a full chunk is followed by the next through next
+struct Trace_chunk
+{
+    static const size_t CAPACITY = 4096;
+    Trace_event events[CAPACITY];
+    std::atomic<size_t> count{0};
+    std::atomic<Trace_chunk *> next{nullptr};
+};
+
+struct Trace_buffer
+{
+    long tid = 0;
+    //Written by the owning thread only
+    Trace_chunk *tail = nullptr;
+    //Next event to read, touched only under registry_mutex
+    Trace_chunk *read_chunk = nullptr;
+    size_t read_index = 0;
+};
+
+//Buffers outlive their threads so a trace still holds the events of
+//workers that were joined before trace_stop
+static std::mutex registry_mutex;
+static std::vector<std::unique_ptr<Trace_buffer>> registry;
+static uint64_t trace_origin_ns = 0;
+
+static thread_local Trace_buffer *local_buffer = nullptr;
+static thread_local long long local_cart = -1;
+
+static uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static Trace_buffer *get_local_buffer()
+{
+    if (local_buffer) return local_buffer;
+
+    std::unique_ptr<Trace_buffer> buffer(new Trace_buffer());
+    buffer->tid = syscall(SYS_gettid);
+    buffer->tail = new Trace_chunk();
+    buffer->read_chunk = buffer->tail;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    local_buffer = buffer.get();
+    registry.push_back(std::move(buffer));
+    return local_buffer;
+}
+
+/**
+ * Calls emit for every event published since the last read and frees
+ * the chunks left behind. The chunk being filled is never freed, so the
+ * owning thread can keep appending meanwhile.
+ */
+template <typename Emit>
+static void drain(Trace_buffer *buffer, Emit emit)
+{
+    Trace_chunk *chunk = buffer->read_chunk;
+    for (;;)
+    {
+        size_t count = chunk->count.load(std::memory_order_acquire);
+        for (size_t i = buffer->read_index; i < count; i++)
+            emit(chunk->events[i]);
+        buffer->read_index = count;
+        if (count < Trace_chunk::CAPACITY) break;
+
+        Trace_chunk *next = chunk->next.load(std::memory_order_acquire);
+        if (next == nullptr) break;
+        delete chunk;
+        chunk = next;
+        buffer->read_chunk = chunk;
+        buffer->read_index = 0;
+    }
+}
+
+void trace_start()
+{
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto &buffer : registry) drain(buffer.get(), [](const Trace_event &){});
+    trace_origin_ns = now_ns();
+    trace_active.store(true, std::memory_order_relaxed);
+}
+
+int trace_stop(const std::string &path)
+{
+    trace_active.store(false, std::memory_order_relaxed);
+
+    FILE *file = fopen(path.c_str(), "we");
+    if (file == nullptr) return errno;
+
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    long pid = getpid();
+    bool first = true;
+    fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+    for (auto &buffer : registry)
+    {
+        long tid = buffer->tid;
+        drain(buffer.get(), [&](const Trace_event &event){
+            //Spans that began before trace_start are not part of this trace
+            if (event.start_ns < trace_origin_ns) return;
+            uint64_t ts = event.start_ns - trace_origin_ns;
+            fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"split\",\"ph\":\"X\","
+                    "\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,"
+                    "\"pid\":%ld,\"tid\":%ld,\"args\":{",
+                    first ? "" : ",", event.name,
+                    ts / 1000, static_cast<unsigned>(ts % 1000),
+                    event.duration_ns / 1000,
+                    static_cast<unsigned>(event.duration_ns % 1000), pid, tid);
+            if (event.cart >= 0) fprintf(file, "\"cart\":%lld", event.cart);
+            if (event.items >= 0)
+                fprintf(file, "%s\"items\":%lld", event.cart >= 0 ? "," : "",
+                        event.items);
+            fputs("}}", file);
+            first = false;
+        });
+    }
+    fputs("\n]}\n", file);
+
+    int err = ferror(file) ? EIO : 0;
+    if (fclose(file) != 0 && err == 0) err = errno;
+    return err;
+}
+
+//Trace_span Implementation
+void Trace_span::begin(){start_ns = now_ns();}
+
+void Trace_span::end()
+{
+    uint64_t end_ns = now_ns();
+    Trace_buffer *buffer = get_local_buffer();
+    Trace_chunk *chunk = buffer->tail;
+    size_t count = chunk->count.load(std::memory_order_relaxed);
+    if (count == Trace_chunk::CAPACITY)
+    {
+        Trace_chunk *next = new Trace_chunk();
+        chunk->next.store(next, std::memory_order_release);
+        buffer->tail = chunk = next;
+        count = 0;
+    }
+
+    chunk->events[count] = Trace_event{name, start_ns, end_ns - start_ns,
+                                       local_cart, items};
+    chunk->count.store(count + 1, std::memory_order_release);
+}
+
+//Trace_cart_scope Implementation
+long long trace_cart_id(){return local_cart;}
+
+Trace_cart_scope::Trace_cart_scope(long long cart) : previous(local_cart)
+{
+    local_cart = cart;
+}
+
+Trace_cart_scope::~Trace_cart_scope(){local_cart = previous;}